@@ -0,0 +1,25 @@
+#!/bin/sh
+# Compare the epoll and io_uring server backends on loopback: system
+# calls made by the server per request, and request latency. Run from
+# the repository root after `make bench`.
+#
+# usage: bench/backends.sh [loadgen options...]
+
+SERVER=build/bin/server
+LOADGEN=build/bin/loadgen
+LOG=$(mktemp)
+
+for backend in epoll uring; do
+  $SERVER -b $backend > $LOG &
+  pid=$!
+  sleep 0.5
+  printf "backend=%s " $backend
+  $LOADGEN -t 4 -c 4 -g 95 "$@"
+  # The server prints per-worker counts on SIGUSR1
+  kill -USR1 $pid
+  sleep 0.5
+  grep "^worker" $LOG
+  kill $pid
+  wait $pid 2> /dev/null
+done
+rm -f $LOG
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Compare MGET/MPUT batches with the equivalent pipelined single-key
+# GETs and PUTs, for several batch sizes. Run from the repository root
+# after `make bench`.
+#
+# usage: bench/batch.sh [loadgen options...]
+
+SERVER=build/bin/server
+LOADGEN=build/bin/loadgen
+
+$SERVER > /dev/null &
+pid=$!
+sleep 0.5
+for batch in 1 10 50 200; do
+  printf "mode=batch "
+  $LOADGEN -t 4 -c 4 -g 95 -b $batch "$@"
+  printf "mode=pipelined "
+  $LOADGEN -t 4 -c 4 -g 95 -b $batch -s "$@"
+done
+kill $pid
+wait $pid 2> /dev/null
@@ -0,0 +1,169 @@
+/*
+ * Key hash microbenchmark, comparing hash_bytes with djb2 (the
+ * original key hash) on several realistic key sets. For each, prints
+ * the hashing throughput and how the keys spread: over a power of two
+ * bucket count at load factor up to one, as ENGINE_CHAINED tables
+ * index them by the low bits, and over shards, as chosen from the high
+ * bits (djb2 with the multiply it used to need, see shard_index).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include "../lib/hash.h"
+
+#define KEY_MAX 64
+#define SHARDS 16
+/* Throughput is measured over this many keys, so that they stay in
+   cache and the hash rather than memory is timed */
+#define SAMPLE_KEYS 8192
+
+typedef struct KeySet {
+  const char *name;
+  unsigned int count;
+  uint8_t *bufs;                /* KEY_MAX bytes per key */
+  uint8_t *lens;
+} KeySet;
+
+typedef uint64_t (*HashFn)(const uint8_t *buf, size_t len);
+
+void usage(void) {
+  fprintf(stderr, "usage: hashbench [-k keys] [-r rounds]\n");
+  exit(1);
+}
+
+uint64_t seeded_hash(const uint8_t *buf, size_t len) {
+  return hash_bytes(buf, len, hash_seed);
+}
+
+unsigned int djb2_shard(uint64_t h) {
+  return ((h * 0x9e3779b97f4a7c15ULL) >> 32) % SHARDS;
+}
+
+unsigned int seeded_shard(uint64_t h) {
+  return ((h >> 32) * SHARDS) >> 32;
+}
+
+/* xorshift64*, as rand_r's low bits repeat too soon for random keys */
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Fill in key N of KS for a key set named as in main() */
+void make_key(KeySet *ks, unsigned int n, uint64_t *state) {
+  char *buf = (char *)ks->bufs + (size_t)n * KEY_MAX;
+  int len;
+  if (!strcmp(ks->name, "int")) {
+    /* Binary integers, as the tests use */
+    memcpy(buf, &n, sizeof n);
+    len = sizeof n;
+  } else if (!strcmp(ks->name, "key"))
+    len = snprintf(buf, KEY_MAX, "key:%u", n);
+  else if (!strcmp(ks->name, "user"))
+    len = snprintf(buf, KEY_MAX, "user:%08u:profile", n);
+  else if (!strcmp(ks->name, "url"))
+    len = snprintf(buf, KEY_MAX, "/api/v1/catalog/items/%u?fields=name,price", n);
+  else {
+    len = 0;
+    for (int i = 0; i < 36; i++)
+      buf[len++] = i == 8 || i == 13 || i == 18 || i == 23
+        ? '-' : "0123456789abcdef"[next_random(state) >> 60];
+  }
+  ks->lens[n] = len;
+}
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(KeySet *ks, const char *hash_name, HashFn fn, unsigned int (*shard)(uint64_t),
+         unsigned int rounds) {
+  uint64_t *hashes = malloc(ks->count * sizeof(uint64_t));
+  unsigned int sample = ks->count < SAMPLE_KEYS ? ks->count : SAMPLE_KEYS;
+  unsigned long repeats = (unsigned long)rounds * ks->count / sample;
+  size_t bytes = 0;
+  for (unsigned int i = 0; i < sample; i++)
+    bytes += ks->lens[i];
+
+  volatile uint64_t sink = 0;
+  double start = now_sec();
+  for (unsigned long r = 0; r < repeats; r++) {
+    uint64_t acc = 0;
+    for (unsigned int i = 0; i < sample; i++)
+      acc += fn(ks->bufs + (size_t)i * KEY_MAX, ks->lens[i]);
+    sink += acc;
+  }
+  double secs = now_sec() - start;
+  for (unsigned int i = 0; i < ks->count; i++)
+    hashes[i] = fn(ks->bufs + (size_t)i * KEY_MAX, ks->lens[i]);
+
+  unsigned int buckets = 1;
+  while (buckets < ks->count)
+    buckets *= 2;
+  unsigned int *chains = calloc(buckets, sizeof(unsigned int));
+  unsigned int shards[SHARDS] = {0};
+  for (unsigned int i = 0; i < ks->count; i++) {
+    ++chains[hashes[i] & (buckets - 1)];
+    ++shards[shard(hashes[i])];
+  }
+  unsigned int empty = 0, max_chain = 0, max_shard = 0;
+  double probes = 0;
+  for (unsigned int i = 0; i < buckets; i++) {
+    empty += !chains[i];
+    if (chains[i] > max_chain)
+      max_chain = chains[i];
+    /* A hit on the jth entry of a chain compares j keys */
+    probes += (double)chains[i] * (chains[i] + 1) / 2;
+  }
+  for (unsigned int i = 0; i < SHARDS; i++)
+    if (shards[i] > max_shard)
+      max_shard = shards[i];
+
+  double n = (double)sample * repeats;
+  printf("keys=%s hash=%s n=%u ns_per_key=%.2f mb_per_sec=%.0f buckets=%u empty_pct=%.1f"
+         " max_chain=%u avg_probes=%.3f shard_skew=%.3f\n",
+         ks->name, hash_name, ks->count, secs * 1e9 / n, bytes * (double)repeats / secs / 1e6,
+         buckets, 100.0 * empty / buckets, max_chain, probes / ks->count,
+         (double)max_shard * SHARDS / ks->count);
+  free(chains);
+  free(hashes);
+}
+
+int main(int argc, char *argv[]) {
+  const char *names[] = { "int", "key", "user", "url", "uuid" };
+  unsigned int count = 1000000;
+  unsigned int rounds = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "k:r:")) != -1) {
+    switch (opt) {
+    case 'k': count = strtoul(optarg, NULL, 10); break;
+    case 'r': rounds = strtoul(optarg, NULL, 10); break;
+    default: usage();
+    }
+  }
+  if (!count || !rounds)
+    usage();
+  hash_seed_random();
+
+  for (size_t s = 0; s < sizeof names / sizeof names[0]; s++) {
+    KeySet ks = { .name = names[s], .count = count };
+    uint64_t state = 1;
+    ks.bufs = malloc((size_t)count * KEY_MAX);
+    ks.lens = malloc(count);
+    for (unsigned int i = 0; i < count; i++)
+      make_key(&ks, i, &state);
+    run(&ks, "djb2", djb2_hash, djb2_shard, rounds);
+    run(&ks, "seeded", seeded_hash, seeded_shard, rounds);
+    free(ks.bufs);
+    free(ks.lens);
+  }
+  return 0;
+}
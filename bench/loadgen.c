@@ -0,0 +1,532 @@
+/*
+ * Load generator for the cache server. Each thread drives several
+ * connections, keeping up to a pipeline depth of requests outstanding
+ * on each, and the throughput and latency percentiles of the requests
+ * completed after the warm-up are reported at the end of the run.
+ *
+ * With a batch size above one, each request covers that many keys,
+ * sent as one MGET or MPUT, or with -s as the equivalent pipelined
+ * GETs or PUTs. Operations are then counted per key, and latency per
+ * batch.
+ *
+ * Keys are chosen uniformly, or with -z from a Zipfian distribution,
+ * key:0 being the most popular. Latency is measured from when a
+ * request is queued to when its last response arrives, so includes
+ * the time spent behind earlier requests in the pipeline, and is
+ * recorded in a log-linear histogram, as HdrHistogram does: exact to
+ * the nanosecond below HIST_SUB, then within 1/HIST_SUB of the true
+ * value up to the largest a run can take.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "../lib/message.h"
+#include "../lib/conn.h"
+
+#define RECV_BUF_SIZE (64 * 1024)
+#define PRELOAD_DEPTH 256       /* PUTs in flight while preloading */
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        /* 2^40ns, about 18 minutes */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Zipfian ranks, generated as in YCSB (after Gray et al., "Quickly
+   Generating Billion-Record Synthetic Databases") */
+typedef struct Zipf {
+  unsigned int n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+  double half_pow_theta;
+} Zipf;
+
+typedef struct Options {
+  const char *host;
+  const char *port;
+  unsigned int threads;
+  unsigned int conns;           /* Per thread */
+  unsigned int duration;        /* Seconds, after the warm-up */
+  unsigned int warmup;          /* Seconds */
+  unsigned int keys;
+  unsigned int get_percent;
+  ValSize val_size;
+  BatchCount batch;             /* Keys per request */
+  bool singles;                 /* Pipeline single-key requests instead */
+  unsigned int depth;           /* Requests (or batches) in flight per connection */
+  Zipf *zipf;                   /* Or NULL for uniform keys */
+} Options;
+
+typedef struct Histogram {
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long total;
+  uint64_t max;                 /* Exact, in nanoseconds */
+} Histogram;
+
+/* A request (or batch) in flight */
+typedef struct InFlight {
+  uint64_t sent;                /* When queued, in nanoseconds */
+  unsigned int awaiting;        /* Responses still to come */
+} InFlight;
+
+typedef struct LoadConn {
+  Conn conn;                    /* Requests queued for sending */
+  uint8_t *buf;                 /* Received, not yet parsed, from the start */
+  size_t buf_size;
+  size_t len;
+  InFlight *in_flight;          /* Ring of depth, in the order sent */
+  unsigned int head;
+  unsigned int count;
+} LoadConn;
+
+typedef struct LoadThread {
+  pthread_t thread;
+  Options *opts;
+  uint64_t rng;
+  unsigned long ops;
+  Histogram *hist;
+} LoadThread;
+
+volatile bool running = true;
+volatile bool measuring = false;
+
+void usage(void) {
+  fprintf(stderr, "usage: loadgen [-h host] [-p port] [-t threads] [-c conns_per_thread]\n"
+          "               [-d seconds] [-w warmup_seconds] [-k keys] [-z theta]\n"
+          "               [-g get_percent] [-v val_size] [-b batch] [-s] [-P depth]\n");
+  exit(1);
+}
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, which is plenty for choosing keys and much cheaper than
+   sharing a generator between threads */
+uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Return a uniform double in [0, 1) */
+double next_uniform(uint64_t *state) {
+  return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+/* Set up ZIPF for ranks below N, with skew THETA in (0, 1). Computing
+   zeta(N) takes a pass over every rank, so is only done once. */
+void init_zipf(Zipf *zipf, unsigned int n, double theta) {
+  double zeta2 = 1 + pow(0.5, theta);
+  zipf->n = n;
+  zipf->theta = theta;
+  zipf->alpha = 1 / (1 - theta);
+  zipf->zetan = 0;
+  for (unsigned int i = 1; i <= n; i++)
+    zipf->zetan += 1 / pow(i, theta);
+  zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf->zetan);
+  zipf->half_pow_theta = pow(0.5, theta);
+}
+
+unsigned int next_zipf(Zipf *zipf, uint64_t *state) {
+  double u = next_uniform(state);
+  double uz = u * zipf->zetan;
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + zipf->half_pow_theta)
+    return 1;
+  unsigned int rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+  return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+/* Return the index of the bucket counting VALUE */
+unsigned int hist_index(uint64_t value) {
+  if (value < HIST_SUB)
+    return value;
+  int bits = 63 - __builtin_clzll(value);
+  if (bits >= HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  /* The top HIST_SUB_BITS + 1 bits pick the bucket within its power
+     of two */
+  int shift = bits - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (unsigned int)((value >> shift) - HIST_SUB);
+}
+
+/* Return the highest value counted by bucket INDEX */
+uint64_t hist_value(unsigned int index) {
+  if (index < 2 * HIST_SUB)
+    return index;
+  int shift = index / HIST_SUB - 1;
+  return ((uint64_t)(index % HIST_SUB + HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(Histogram *hist, uint64_t ns) {
+  ++hist->counts[hist_index(ns)];
+  ++hist->total;
+  if (ns > hist->max)
+    hist->max = ns;
+}
+
+void hist_add(Histogram *to, Histogram *from) {
+  for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    to->counts[i] += from->counts[i];
+  to->total += from->total;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+/* Return the latency in microseconds within which FRACTION of the
+   requests counted in HIST completed */
+double hist_percentile(Histogram *hist, double fraction) {
+  unsigned long rank = ceil(hist->total * fraction), seen = 0;
+  if (!rank)
+    rank = 1;
+  for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      uint64_t ns = hist_value(i);
+      return (ns < hist->max ? ns : hist->max) / 1000.0;
+    }
+  }
+  return hist->max / 1000.0;
+}
+
+int connect_to(Options *opts) {
+  struct addrinfo hints, *servinfo, *p;
+  int sockfd = -1, rv;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(opts->host, opts->port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    exit(1);
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+      continue;
+    if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+      close(sockfd);
+      continue;
+    }
+    break;
+  }
+  if (p == NULL) {
+    fprintf(stderr, "loadgen: failed to connect\n");
+    exit(2);
+  }
+  freeaddrinfo(servinfo);
+  return sockfd;
+}
+
+/* Connect LC, which never blocks, so that neither end can stall
+   sending while the other is too */
+void open_load_conn(Options *opts, LoadConn *lc) {
+  init_conn(&lc->conn);
+  lc->conn.fd = connect_to(opts);
+  fcntl(lc->conn.fd, F_SETFL, fcntl(lc->conn.fd, F_GETFL) | O_NONBLOCK);
+  lc->buf_size = RECV_BUF_SIZE;
+  lc->buf = malloc(lc->buf_size);
+  lc->len = 0;
+  lc->in_flight = calloc(opts->depth, sizeof(InFlight));
+  lc->head = lc->count = 0;
+}
+
+void close_load_conn(LoadConn *lc) {
+  close(lc->conn.fd);
+  free(lc->conn.out_buf);
+  free(lc->buf);
+  free(lc->in_flight);
+}
+
+/* Send what LC has queued, as far as the socket takes it */
+void send_queued(LoadConn *lc) {
+  if (conn_send(&lc->conn) == -1) {
+    perror("loadgen: send");
+    exit(1);
+  }
+}
+
+/* Receive what has arrived on LC, returning how many responses were
+   completed. Only the framing and format of responses are checked. */
+unsigned int recv_responses(LoadConn *lc) {
+  ssize_t nbytes = recv(lc->conn.fd, lc->buf + lc->len, lc->buf_size - lc->len, 0);
+  if (nbytes == -1 && errno == EAGAIN)
+    return 0;
+  if (nbytes <= 0) {
+    fprintf(stderr, "loadgen: connection lost\n");
+    exit(1);
+  }
+  lc->len += nbytes;
+  unsigned int done = 0;
+  size_t pos = 0;
+  Message msg;
+  Val val;
+  while (lc->len - pos >= sizeof(MessageSize)) {
+    MessageSize size = read_u32(lc->buf + pos);
+    if (lc->len - pos - sizeof(MessageSize) < size)
+      break;
+    if (!parse_response(lc->buf + pos + sizeof(MessageSize), size, &msg, &val)) {
+      fprintf(stderr, "loadgen: malformed response\n");
+      exit(1);
+    }
+    free_message_views(&msg);
+    pos += sizeof(MessageSize) + size;
+    ++done;
+  }
+  lc->len -= pos;
+  memmove(lc->buf, lc->buf + pos, lc->len);
+  if (lc->len >= sizeof(MessageSize)) {
+    size_t total = sizeof(MessageSize) + read_u32(lc->buf);
+    if (total > lc->buf_size) {
+      lc->buf = realloc(lc->buf, total);
+      lc->buf_size = total;
+    }
+  }
+  return done;
+}
+
+/* Fill KEY_BUF with the name of key N, returning its length */
+KeySize key_name(uint8_t *key_buf, unsigned int n) {
+  return snprintf((char *)key_buf, UINT8_MAX, "key:%u", n);
+}
+
+/* Fill in PUT for a random key, naming it in KEY_BUF */
+void random_put(LoadThread *lt, MessagePut *put, uint8_t *key_buf, uint8_t *val_buf) {
+  Options *opts = lt->opts;
+  unsigned int n = opts->zipf ? next_zipf(opts->zipf, &lt->rng)
+    : next_random(&lt->rng) % opts->keys;
+  put->key.key = key_buf;
+  put->key.key_size = key_name(key_buf, n);
+  put->val.val_size = opts->val_size;
+  put->val.val = val_buf;
+  put->ttl = 0;
+}
+
+/* Queue a random request (or batch of them) on LC */
+void queue_request(LoadThread *lt, LoadConn *lc, uint8_t *val_buf) {
+  Options *opts = lt->opts;
+  uint8_t key_bufs[opts->batch][UINT8_MAX];
+  MessagePut puts[opts->batch];
+  Key keys[opts->batch];
+  bool is_get = next_random(&lt->rng) % 100 < opts->get_percent;
+  for (BatchCount i = 0; i < opts->batch; i++) {
+    random_put(lt, &puts[i], key_bufs[i], val_buf);
+    keys[i] = puts[i].key;
+  }
+
+  Message msgs[opts->batch];
+  unsigned int count = opts->batch;
+  if (count > 1 && !opts->singles) {
+    msgs[0].type = is_get ? MGET : MPUT;
+    if (is_get) {
+      msgs[0].message.mget.count = count;
+      msgs[0].message.mget.keys = keys;
+    } else {
+      msgs[0].message.mput.count = count;
+      msgs[0].message.mput.puts = puts;
+    }
+    count = 1;
+  } else {
+    for (unsigned int i = 0; i < count; i++) {
+      msgs[i].type = is_get ? GET : PUT;
+      if (is_get)
+        msgs[i].message.get.key = keys[i];
+      else
+        msgs[i].message.put = puts[i];
+    }
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    conn_queue_msg(&lc->conn, &msgs[i]);
+  InFlight *req = &lc->in_flight[(lc->head + lc->count++) % opts->depth];
+  req->awaiting = count;
+  req->sent = now_ns();
+}
+
+/* Account for DONE more responses on LC, completing the requests they
+   finish */
+void complete_requests(LoadThread *lt, LoadConn *lc, unsigned int done) {
+  Options *opts = lt->opts;
+  uint64_t now = done ? now_ns() : 0;
+  while (done) {
+    InFlight *req = &lc->in_flight[lc->head];
+    unsigned int n = done < req->awaiting ? done : req->awaiting;
+    req->awaiting -= n;
+    done -= n;
+    if (req->awaiting)
+      break;
+    if (measuring) {
+      hist_record(lt->hist, now - req->sent);
+      lt->ops += opts->batch;
+    }
+    lc->head = (lc->head + 1) % opts->depth;
+    --lc->count;
+  }
+}
+
+void *run_load_thread(void *arg) {
+  LoadThread *lt = arg;
+  Options *opts = lt->opts;
+  LoadConn *lcs = malloc(sizeof(LoadConn) * opts->conns);
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * opts->conns);
+  uint8_t *val_buf = calloc(opts->val_size + 1, 1);
+  for (unsigned int i = 0; i < opts->conns; i++) {
+    open_load_conn(opts, &lcs[i]);
+    pfds[i].fd = lcs[i].conn.fd;
+  }
+  while (running) {
+    for (unsigned int i = 0; i < opts->conns; i++) {
+      LoadConn *lc = &lcs[i];
+      while (lc->count < opts->depth)
+        queue_request(lt, lc, val_buf);
+      if (conn_pending(&lc->conn))
+        send_queued(lc);
+      pfds[i].events = POLLIN | (conn_pending(&lc->conn) ? POLLOUT : 0);
+    }
+    if (poll(pfds, opts->conns, 100) == -1) {
+      perror("poll");
+      exit(1);
+    }
+    for (unsigned int i = 0; i < opts->conns; i++) {
+      if (pfds[i].revents & POLLOUT)
+        send_queued(&lcs[i]);
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        complete_requests(lt, &lcs[i], recv_responses(&lcs[i]));
+    }
+  }
+  for (unsigned int i = 0; i < opts->conns; i++)
+    close_load_conn(&lcs[i]);
+  free(lcs);
+  free(pfds);
+  free(val_buf);
+  return NULL;
+}
+
+/* PUT every key once so that GETs hit, PRELOAD_DEPTH at a time */
+void preload(Options *opts) {
+  LoadConn lc;
+  uint8_t key_buf[UINT8_MAX];
+  uint8_t *val_buf = calloc(opts->val_size + 1, 1);
+  open_load_conn(opts, &lc);
+  struct pollfd pfd = { .fd = lc.conn.fd };
+  unsigned int sent = 0, done = 0;
+  while (done < opts->keys) {
+    for (; sent < opts->keys && sent - done < PRELOAD_DEPTH; sent++) {
+      Message msg = { .type = PUT };
+      msg.message.put.key.key = key_buf;
+      msg.message.put.key.key_size = key_name(key_buf, sent);
+      msg.message.put.val.val = val_buf;
+      msg.message.put.val.val_size = opts->val_size;
+      msg.message.put.ttl = 0;
+      conn_queue_msg(&lc.conn, &msg);
+    }
+    send_queued(&lc);
+    pfd.events = POLLIN | (conn_pending(&lc.conn) ? POLLOUT : 0);
+    if (poll(&pfd, 1, -1) == -1) {
+      perror("poll");
+      exit(1);
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+      done += recv_responses(&lc);
+  }
+  close_load_conn(&lc);
+  free(val_buf);
+}
+
+int main(int argc, char *argv[]) {
+  Options opts = {
+    .host = "127.0.0.1", .port = "9034", .threads = 4, .conns = 4,
+    .duration = 10, .warmup = 1, .keys = 100000, .get_percent = 90,
+    .val_size = 32, .batch = 1, .singles = false, .depth = 1, .zipf = NULL
+  };
+  double theta = 0;
+  unsigned long val_size = opts.val_size, batch = opts.batch;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:t:c:d:w:k:z:g:v:b:sP:")) != -1) {
+    switch (opt) {
+    case 'h': opts.host = optarg; break;
+    case 'p': opts.port = optarg; break;
+    case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+    case 'c': opts.conns = strtoul(optarg, NULL, 10); break;
+    case 'd': opts.duration = strtoul(optarg, NULL, 10); break;
+    case 'w': opts.warmup = strtoul(optarg, NULL, 10); break;
+    case 'k': opts.keys = strtoul(optarg, NULL, 10); break;
+    case 'z': theta = strtod(optarg, NULL); break;
+    case 'g': opts.get_percent = strtoul(optarg, NULL, 10); break;
+    case 'v': val_size = strtoul(optarg, NULL, 10); break;
+    case 'b': batch = strtoul(optarg, NULL, 10); break;
+    case 's': opts.singles = true; break;
+    case 'P': opts.depth = strtoul(optarg, NULL, 10); break;
+    default: usage();
+    }
+  }
+  if (!opts.threads || !opts.conns || !opts.duration || !opts.keys
+      || opts.get_percent > 100 || !batch || batch > UINT16_MAX
+      || val_size > UINT16_MAX || !opts.depth || theta < 0 || theta >= 1)
+    usage();
+  opts.val_size = val_size;
+  opts.batch = batch;
+
+  Zipf zipf;
+  if (theta > 0) {
+    init_zipf(&zipf, opts.keys, theta);
+    opts.zipf = &zipf;
+  }
+
+  preload(&opts);
+
+  LoadThread *threads = calloc(opts.threads, sizeof(LoadThread));
+  for (unsigned int i = 0; i < opts.threads; i++) {
+    threads[i].opts = &opts;
+    threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    threads[i].hist = calloc(1, sizeof(Histogram));
+    pthread_create(&threads[i].thread, NULL, run_load_thread, &threads[i]);
+  }
+  sleep(opts.warmup);
+  measuring = true;
+  uint64_t start = now_ns();
+  sleep(opts.duration);
+  measuring = false;
+  double elapsed = (now_ns() - start) / 1e9;
+  running = false;
+  unsigned long ops = 0;
+  Histogram *hist = calloc(1, sizeof(Histogram));
+  for (unsigned int i = 0; i < opts.threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    ops += threads[i].ops;
+    hist_add(hist, threads[i].hist);
+    free(threads[i].hist);
+  }
+  char dist[32] = "uniform";
+  if (opts.zipf)
+    snprintf(dist, sizeof dist, "zipf:%g", theta);
+  printf("threads=%u conns=%u depth=%u batch=%u keys=%s ops=%lu ops/sec=%.0f"
+         " p50_us=%.1f p99_us=%.1f p999_us=%.1f p9999_us=%.1f max_us=%.1f\n",
+         opts.threads, opts.threads * opts.conns, opts.depth, opts.batch, dist, ops,
+         ops / elapsed, hist_percentile(hist, 0.5), hist_percentile(hist, 0.99),
+         hist_percentile(hist, 0.999), hist_percentile(hist, 0.9999),
+         hist->max / 1000.0);
+  free(hist);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * In-process microbenchmarks of the hash table and message
+ * serialisation, for catching regressions in lib/hash_table.c,
+ * lib/open_table.c and lib/message.c without a server.
+ *
+ * Table benchmarks time hash_table_put into an empty table (so
+ * including its growth), hash_table_get of present keys (hit) and of
+ * absent ones (miss), and hash_table_delete of every key, in a
+ * shuffled order, for each engine, table size, key size and value
+ * size. Message benchmarks time out_serialise_message and
+ * out_deserialise_message of a PUT and a GET_RESP, for each key and
+ * value size.
+ *
+ * Each result is the median, over several repetitions after some
+ * discarded warm-up ones, of the time per operation, where a
+ * repetition times at least -m operations (repeating passes over
+ * small tables). Results are printed as CSV or JSON, optionally
+ * labelled (say with the commit), and with -b are compared with a
+ * baseline CSV from an earlier run, listing the benchmarks slower by
+ * more than a threshold and exiting with status 3 if there are any.
+ * The hash seed is left at its default, and keys are shuffled with a
+ * fixed seed, so that every run lays tables out alike.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include "../lib/hash_table.h"
+#include "../lib/message.h"
+
+#define MAX_SWEEP 16
+#define MAX_BASELINE 4096
+#define INITIAL_TABLE_SIZE 128  /* As each shard's table starts */
+#define NAME_MAX_LEN 32
+
+typedef struct Options {
+  HashTableEngine engines[MAX_SWEEP];
+  unsigned int engine_count;
+  unsigned int table_sizes[MAX_SWEEP];
+  unsigned int table_size_count;
+  unsigned int key_sizes[MAX_SWEEP];
+  unsigned int key_size_count;
+  unsigned int val_sizes[MAX_SWEEP];
+  unsigned int val_size_count;
+  unsigned int reps;
+  unsigned int warmup;
+  unsigned long min_ops;
+  bool json;
+  const char *label;
+  double threshold;             /* Percent slower to count as a regression */
+} Options;
+
+/* A result from the baseline, see read_baseline */
+typedef struct Baseline {
+  char bench[NAME_MAX_LEN];
+  char engine[NAME_MAX_LEN];
+  unsigned int table_size;
+  unsigned int key_size;
+  unsigned int val_size;
+  double median_ns;
+} Baseline;
+
+typedef struct Result {
+  const char *bench;
+  const char *engine;           /* "-" for message benchmarks */
+  unsigned int table_size;      /* Zero for message benchmarks */
+  unsigned int key_size;
+  unsigned int val_size;
+  unsigned long ops;            /* Per repetition */
+  double median_ns;             /* Per operation */
+  double min_ns;
+  double max_ns;
+} Result;
+
+Baseline baseline[MAX_BASELINE];
+unsigned int baseline_count;
+unsigned int result_count;
+unsigned int regressions;
+volatile uint64_t sink;
+
+void usage(void) {
+  fprintf(stderr, "usage: microbench [-e engines] [-n table_sizes] [-k key_sizes] [-v val_sizes]\n"
+          "                  [-r reps] [-w warmup_reps] [-m min_ops] [-j] [-l label]\n"
+          "                  [-b baseline.csv] [-T threshold_percent]\n"
+          "Sweeps are comma-separated lists.\n");
+  exit(1);
+}
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64*, for shuffling */
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Parse comma-separated positive numbers from ARG into OUT, storing
+   how many in *COUNT */
+void parse_sweep(const char *arg, unsigned int *out, unsigned int *count) {
+  char *end;
+  *count = 0;
+  do {
+    unsigned long n = strtoul(arg, &end, 10);
+    if (end == arg || !n || n > UINT32_MAX || *count == MAX_SWEEP)
+      usage();
+    out[(*count)++] = n;
+    arg = end + 1;
+  } while (*end == ',');
+  if (*end)
+    usage();
+}
+
+void parse_engines(const char *arg, Options *opts) {
+  char buf[256];
+  snprintf(buf, sizeof buf, "%s", arg);
+  opts->engine_count = 0;
+  for (char *name = strtok(buf, ","); name; name = strtok(NULL, ",")) {
+    if (opts->engine_count == MAX_SWEEP
+        || !parse_hash_table_engine(name, &opts->engines[opts->engine_count++]))
+      usage();
+  }
+  if (!opts->engine_count)
+    usage();
+}
+
+const char *engine_name(HashTableEngine engine) {
+  return engine == ENGINE_OPEN ? "open" : "chained";
+}
+
+/* Load the results of an earlier CSV run from PATH. Returns FALSE if
+   it can't be read. */
+bool read_baseline(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  char line[512];
+  while (fgets(line, sizeof line, f) && baseline_count < MAX_BASELINE) {
+    Baseline *b = &baseline[baseline_count];
+    /* The label may be empty, so is skipped by hand */
+    char *rest = strchr(line, ',');
+    if (rest && sscanf(rest + 1, "%31[^,],%31[^,],%u,%u,%u,%*u,%*u,%lf", b->bench, b->engine,
+                       &b->table_size, &b->key_size, &b->val_size, &b->median_ns) == 6)
+      ++baseline_count;
+  }
+  fclose(f);
+  return true;
+}
+
+Baseline *find_baseline(Result *r) {
+  for (unsigned int i = 0; i < baseline_count; i++) {
+    Baseline *b = &baseline[i];
+    if (!strcmp(b->bench, r->bench) && !strcmp(b->engine, r->engine)
+        && b->table_size == r->table_size && b->key_size == r->key_size
+        && b->val_size == r->val_size)
+      return b;
+  }
+  return NULL;
+}
+
+/* Print R, and report it if it is a regression on the baseline */
+void report(Options *opts, Result *r) {
+  if (opts->json)
+    printf("%s  {\"label\": \"%s\", \"bench\": \"%s\", \"engine\": \"%s\", \"table_size\": %u,"
+           " \"key_size\": %u, \"val_size\": %u, \"ops\": %lu, \"reps\": %u,"
+           " \"median_ns\": %.2f, \"min_ns\": %.2f, \"max_ns\": %.2f}",
+           result_count ? ",\n" : "[\n", opts->label, r->bench, r->engine, r->table_size,
+           r->key_size, r->val_size, r->ops, opts->reps, r->median_ns, r->min_ns, r->max_ns);
+  else
+    printf("%s,%s,%s,%u,%u,%u,%lu,%u,%.2f,%.2f,%.2f\n", opts->label, r->bench, r->engine,
+           r->table_size, r->key_size, r->val_size, r->ops, opts->reps, r->median_ns,
+           r->min_ns, r->max_ns);
+  fflush(stdout);
+  ++result_count;
+
+  Baseline *b = find_baseline(r);
+  if (b && r->median_ns > b->median_ns * (1 + opts->threshold / 100)) {
+    fprintf(stderr, "regression: %s engine=%s table_size=%u key_size=%u val_size=%u"
+            " %.2fns -> %.2fns (%+.1f%%)\n", r->bench, r->engine, r->table_size,
+            r->key_size, r->val_size, b->median_ns, r->median_ns,
+            (r->median_ns / b->median_ns - 1) * 100);
+    ++regressions;
+  }
+}
+
+int cmp_doubles(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return da < db ? -1 : da > db;
+}
+
+/* Summarise the REPS times per operation in SAMPLES into R */
+void summarise(Result *r, double *samples, unsigned int reps) {
+  qsort(samples, reps, sizeof(double), cmp_doubles);
+  r->median_ns = reps % 2 ? samples[reps / 2]
+    : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+  r->min_ns = samples[0];
+  r->max_ns = samples[reps - 1];
+}
+
+/* Fill in the COUNT keys of KEY_SIZE bytes from FIRST in BUF, as
+   zero-padded decimal numbers. Returns FALSE if they don't fit. */
+bool make_keys(uint8_t *buf, unsigned int first, unsigned int count, unsigned int key_size) {
+  char tmp[UINT8_MAX + 1];
+  for (unsigned int i = 0; i < count; i++) {
+    if (snprintf(tmp, sizeof tmp, "%0*u", key_size, first + i) != (int)key_size)
+      return false;
+    memcpy(buf + (size_t)i * key_size, tmp, key_size);
+  }
+  return true;
+}
+
+/* Time each table operation on tables of ENGINE holding N keys. Every
+   pass starts from a new table of INITIAL_TABLE_SIZE buckets, made and
+   freed outside the timed region, so puts include the resizes up to N
+   keys however many passes are run. */
+void bench_table(Options *opts, HashTableEngine engine, unsigned int n, unsigned int key_size,
+                 unsigned int val_size) {
+  enum { PUT_OP, HIT_OP, MISS_OP, DELETE_OP, OPS };
+  static const char *names[OPS] = { "put", "get_hit", "get_miss", "delete" };
+  uint8_t *hit_bufs = malloc((size_t)n * key_size);
+  uint8_t *miss_bufs = malloc((size_t)n * key_size);
+  Key *hits = malloc(n * sizeof(Key));
+  Key *misses = malloc(n * sizeof(Key));
+  uint8_t *val_buf = calloc(val_size, 1);
+  Val val = { .val_size = val_size, .val = val_buf };
+  if (!make_keys(hit_bufs, 0, n, key_size) || !make_keys(miss_bufs, n, n, key_size)) {
+    fprintf(stderr, "microbench: %u keys don't fit in %u bytes\n", 2 * n, key_size);
+    exit(1);
+  }
+  /* Shuffled, so that consecutive operations touch unrelated buckets */
+  uint64_t state = 1;
+  for (unsigned int i = 0; i < n; i++) {
+    unsigned int j = next_random(&state) % (i + 1);
+    hits[i] = hits[j];
+    hits[j] = (Key) { .key_size = key_size, .key = hit_bufs + (size_t)i * key_size };
+    misses[i] = (Key) { .key_size = key_size, .key = miss_bufs + (size_t)i * key_size };
+  }
+
+  unsigned long passes = (opts->min_ops + n - 1) / n;
+  double samples[OPS][opts->reps];
+  for (unsigned int rep = 0; rep < opts->warmup + opts->reps; rep++) {
+    double times[OPS] = {0};
+    uint64_t acc = 0;
+    for (unsigned long p = 0; p < passes; p++) {
+      HashTable *ht = create_hash_table_engine(engine, INITIAL_TABLE_SIZE);
+      double start = now_ns();
+      for (unsigned int i = 0; i < n; i++)
+        hash_table_put(ht, &hits[i], &val);
+      double put_done = now_ns();
+      for (unsigned int i = 0; i < n; i++)
+        acc += hash_table_get(ht, &hits[n - 1 - i])->val_size;
+      double hit_done = now_ns();
+      for (unsigned int i = 0; i < n; i++)
+        acc += hash_table_get(ht, &misses[i]) != NULL;
+      double miss_done = now_ns();
+      for (unsigned int i = 0; i < n; i++)
+        acc += hash_table_delete(ht, &hits[i]);
+      double delete_done = now_ns();
+      times[PUT_OP] += put_done - start;
+      times[HIT_OP] += hit_done - put_done;
+      times[MISS_OP] += miss_done - hit_done;
+      times[DELETE_OP] += delete_done - miss_done;
+      free_hash_table(ht);
+    }
+    sink += acc;
+    if (rep >= opts->warmup)
+      for (int op = 0; op < OPS; op++)
+        samples[op][rep - opts->warmup] = times[op] / ((double)passes * n);
+  }
+
+  for (int op = 0; op < OPS; op++) {
+    Result r = {
+      .bench = names[op], .engine = engine_name(engine), .table_size = n,
+      .key_size = key_size, .val_size = val_size, .ops = passes * n
+    };
+    summarise(&r, samples[op], opts->reps);
+    report(opts, &r);
+  }
+  free(hit_bufs);
+  free(miss_bufs);
+  free(hits);
+  free(misses);
+  free(val_buf);
+}
+
+/* Time serialising MSG and deserialising the result */
+void bench_message(Options *opts, Message *msg, const char *serialise_name,
+                   const char *deserialise_name, unsigned int key_size, unsigned int val_size) {
+  double samples[2][opts->reps];
+  size_t buf_size;
+  uint8_t *buf = out_serialise_message(msg, &buf_size);
+  for (unsigned int rep = 0; rep < opts->warmup + opts->reps; rep++) {
+    uint64_t acc = 0;
+    double start = now_ns();
+    for (unsigned long i = 0; i < opts->min_ops; i++) {
+      size_t size;
+      uint8_t *out = out_serialise_message(msg, &size);
+      acc += out[size - 1];
+      free(out);
+    }
+    double serialised = now_ns();
+    for (unsigned long i = 0; i < opts->min_ops; i++) {
+      Message *parsed = out_deserialise_message(buf + sizeof(MessageSize),
+                                                buf_size - sizeof(MessageSize));
+      acc += parsed->type;
+      free_message(parsed);
+    }
+    double deserialised = now_ns();
+    sink += acc;
+    if (rep >= opts->warmup) {
+      samples[0][rep - opts->warmup] = (serialised - start) / opts->min_ops;
+      samples[1][rep - opts->warmup] = (deserialised - serialised) / opts->min_ops;
+    }
+  }
+  free(buf);
+
+  const char *names[2] = { serialise_name, deserialise_name };
+  for (int i = 0; i < 2; i++) {
+    Result r = {
+      .bench = names[i], .engine = "-", .table_size = 0, .key_size = key_size,
+      .val_size = val_size, .ops = opts->min_ops
+    };
+    summarise(&r, samples[i], opts->reps);
+    report(opts, &r);
+  }
+}
+
+void bench_put(Options *opts, unsigned int key_size, unsigned int val_size) {
+  uint8_t *key_buf = calloc(key_size, 1);
+  uint8_t *val_buf = calloc(val_size, 1);
+  Message msg = { .type = PUT };
+  msg.message.put.key = (Key) { .key_size = key_size, .key = key_buf };
+  msg.message.put.val = (Val) { .val_size = val_size, .val = val_buf };
+  msg.message.put.ttl = 0;
+  bench_message(opts, &msg, "serialise_put", "deserialise_put", key_size, val_size);
+  free(key_buf);
+  free(val_buf);
+}
+
+/* GET_RESP has no key, so is reported with a key size of zero */
+void bench_get_resp(Options *opts, unsigned int val_size) {
+  uint8_t *val_buf = calloc(val_size, 1);
+  Val val = { .val_size = val_size, .val = val_buf };
+  Message msg = { .type = GET_RESP };
+  msg.message.get_resp.val = &val;
+  bench_message(opts, &msg, "serialise_get_resp", "deserialise_get_resp", 0, val_size);
+  free(val_buf);
+}
+
+int main(int argc, char *argv[]) {
+  Options opts = {
+    .engine_count = 2, .engines = { ENGINE_CHAINED, ENGINE_OPEN },
+    .table_size_count = 3, .table_sizes = { 1000, 100000, 1000000 },
+    .key_size_count = 3, .key_sizes = { 8, 32, 128 },
+    .val_size_count = 2, .val_sizes = { 16, 256 },
+    .reps = 5, .warmup = 1, .min_ops = 1000000, .json = false, .label = "",
+    .threshold = 10
+  };
+  const char *baseline_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:n:k:v:r:w:m:jl:b:T:")) != -1) {
+    switch (opt) {
+    case 'e': parse_engines(optarg, &opts); break;
+    case 'n': parse_sweep(optarg, opts.table_sizes, &opts.table_size_count); break;
+    case 'k': parse_sweep(optarg, opts.key_sizes, &opts.key_size_count); break;
+    case 'v': parse_sweep(optarg, opts.val_sizes, &opts.val_size_count); break;
+    case 'r': opts.reps = strtoul(optarg, NULL, 10); break;
+    case 'w': opts.warmup = strtoul(optarg, NULL, 10); break;
+    case 'm': opts.min_ops = strtoul(optarg, NULL, 10); break;
+    case 'j': opts.json = true; break;
+    case 'l': opts.label = optarg; break;
+    case 'b': baseline_path = optarg; break;
+    case 'T': opts.threshold = strtod(optarg, NULL); break;
+    default: usage();
+    }
+  }
+  if (!opts.reps || !opts.min_ops || opts.threshold < 0 || strpbrk(opts.label, ",\"\\\n"))
+    usage();
+  for (unsigned int i = 0; i < opts.key_size_count; i++)
+    if (opts.key_sizes[i] > UINT8_MAX)
+      usage();
+  for (unsigned int i = 0; i < opts.val_size_count; i++)
+    if (opts.val_sizes[i] > UINT16_MAX)
+      usage();
+  if (baseline_path && !read_baseline(baseline_path)) {
+    perror(baseline_path);
+    return 1;
+  }
+
+  if (!opts.json)
+    printf("label,bench,engine,table_size,key_size,val_size,ops,reps,median_ns,min_ns,max_ns\n");
+  for (unsigned int e = 0; e < opts.engine_count; e++)
+    for (unsigned int n = 0; n < opts.table_size_count; n++)
+      for (unsigned int k = 0; k < opts.key_size_count; k++)
+        for (unsigned int v = 0; v < opts.val_size_count; v++)
+          bench_table(&opts, opts.engines[e], opts.table_sizes[n], opts.key_sizes[k],
+                      opts.val_sizes[v]);
+  for (unsigned int k = 0; k < opts.key_size_count; k++)
+    for (unsigned int v = 0; v < opts.val_size_count; v++)
+      bench_put(&opts, opts.key_sizes[k], opts.val_sizes[v]);
+  for (unsigned int v = 0; v < opts.val_size_count; v++)
+    bench_get_resp(&opts, opts.val_sizes[v]);
+  if (opts.json)
+    printf("%s]\n", result_count ? "\n" : "[\n");
+  return regressions ? 3 : 0;
+}
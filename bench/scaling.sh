@@ -0,0 +1,18 @@
+#!/bin/sh
+# Measure GET-heavy throughput as the server's worker thread count
+# grows. Run from the repository root after `make bench`.
+#
+# usage: bench/scaling.sh [loadgen options...]
+
+SERVER=build/bin/server
+LOADGEN=build/bin/loadgen
+
+for threads in 1 2 4 8 16; do
+  $SERVER -t $threads > /dev/null &
+  pid=$!
+  sleep 0.5
+  printf "server_threads=%s " $threads
+  $LOADGEN -t 16 -c 4 -g 95 "$@"
+  kill $pid
+  wait $pid 2> /dev/null
+done
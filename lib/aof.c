@@ -0,0 +1,602 @@
+/*
+ * Append-only log (see aof.h). Appends are serialised into a buffer
+ * under the log's lock, which a background thread swaps for a spare
+ * and writes out with the lock released, so that appending only ever
+ * waits for a memcpy. Rewrites run in a forked child, as snapshots do
+ * (see fork_snapshot), while the thread keeps a copy of what is logged
+ * meanwhile to add to the child's file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "hash_table.h"
+#include "hash.h"
+#include "message.h"
+#include "shard.h"
+#include "aof.h"
+
+#define AOF_BUF_SIZE (1 << 20)
+/* Each record starts with its checksums, then the time it was
+   applied, then the request's size */
+#define AOF_RECORD_CHECKS (2 * sizeof(uint32_t))
+#define AOF_RECORD_HEADER (AOF_RECORD_CHECKS + sizeof(uint32_t) + sizeof(MessageSize))
+#define AOF_CHECKSUM_SEED 0x616f66
+
+typedef struct AofWriter {
+  int fd;
+  uint8_t *buf;                 /* AOF_BUF_SIZE bytes */
+  size_t len;
+  uint32_t now;
+} AofWriter;
+
+typedef struct AofReader {
+  int fd;
+  uint8_t *buf;
+  size_t cap;
+  size_t pos;
+  size_t len;
+} AofReader;
+
+/* Write LEN bytes at BUF to FD. Returns -1, setting errno, on
+   failure. */
+int aof_write(int fd, uint8_t *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Make room for SIZE bytes in *BUF, of capacity *CAP */
+void aof_grow(uint8_t **buf, size_t *cap, size_t size) {
+  if (size <= *cap)
+    return;
+  size_t new_cap = *cap ? *cap : AOF_BUF_SIZE;
+  while (new_cap < size)
+    new_cap *= 2;
+  *buf = realloc(*buf, new_cap);
+  assert(*buf != 0);
+  *cap = new_cap;
+}
+
+uint32_t aof_checksum(const uint8_t *buf, size_t len) {
+  return hash_bytes(buf, len, AOF_CHECKSUM_SEED);
+}
+
+/* Fill in the checksums of the SIZE-byte record at REC, whose time and
+   request are in place: one of its header, so that its size can be
+   trusted before the rest is read, and one of the rest */
+void aof_seal_record(uint8_t *rec, size_t size) {
+  put_u32(rec, aof_checksum(rec + AOF_RECORD_CHECKS, AOF_RECORD_HEADER - AOF_RECORD_CHECKS));
+  put_u32(rec + sizeof(uint32_t),
+          aof_checksum(rec + AOF_RECORD_HEADER, size - AOF_RECORD_HEADER));
+}
+
+/* Size of the record of request MSG */
+size_t aof_record_size(Message *msg) {
+  return AOF_RECORD_CHECKS + sizeof(uint32_t) + serialised_message_size(msg);
+}
+
+/* Write the SIZE-byte record of request MSG, applied at time NOW, to
+   REC */
+void write_record(uint8_t *rec, size_t size, Message *msg, uint32_t now) {
+  put_u32(rec + AOF_RECORD_CHECKS, now);
+  serialise_message(msg, rec + AOF_RECORD_CHECKS + sizeof(uint32_t));
+  aof_seal_record(rec, size);
+}
+
+void *run_aof(void *arg);
+
+/*
+ * Open (or create) the log at PATH and start logging the writes made
+ * to ST, which are to be passed to aof_append, syncing every SYNC_MS
+ * milliseconds or SYNC_BYTES, whichever comes first. The log is
+ * rewritten once it reaches REWRITE_MIN bytes and has doubled since it
+ * was opened or last rewritten, or never, if REWRITE_MIN is zero.
+ * Returns NULL, setting errno, on failure. Mapped tables can't be
+ * logged (ENOTSUP), as rewriting one would need a private copy of it.
+ */
+Aof *create_aof(const char *path, ShardedTable *st, unsigned int sync_ms, size_t sync_bytes,
+                size_t rewrite_min) {
+  struct stat sb;
+  if (sharded_table_is_mapped(st)) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &sb) == -1) {
+    close(fd);
+    return NULL;
+  }
+  Aof *aof = calloc(1, sizeof(Aof));
+  assert(aof != 0);
+  pthread_mutex_init(&aof->lock, NULL);
+  pthread_cond_init(&aof->cond, NULL);
+  aof->st = st;
+  aof->path = strdup(path);
+  size_t len = strlen(path) + sizeof(".rewrite");
+  aof->rewrite_path = malloc(len);
+  assert(aof->path != 0 && aof->rewrite_path != 0);
+  snprintf(aof->rewrite_path, len, "%s.rewrite", path);
+  aof->fd = fd;
+  aof->sync_ms = sync_ms;
+  aof->sync_bytes = sync_bytes;
+  aof->rewrite_min = rewrite_min;
+  aof->size = aof->base_size = sb.st_size;
+  int err = pthread_create(&aof->thread, NULL, run_aof, aof);
+  if (err) {
+    close(fd);
+    free(aof->rewrite_path);
+    free(aof->path);
+    free(aof);
+    errno = err;
+    return NULL;
+  }
+  st->aof = aof;
+  return aof;
+}
+
+/*
+ * Append write request MSG, applied at time NOW (as the table's clock
+ * read), to the log. Must be called while holding the locks of the
+ * shards owning MSG's keys, so that each key's writes are logged in the
+ * order they were applied, and so that no write is missed by a rewrite.
+ */
+void aof_append(Aof *aof, Message *msg, uint32_t now) {
+  size_t size = aof_record_size(msg);
+  pthread_mutex_lock(&aof->lock);
+  aof_grow(&aof->buf, &aof->cap, aof->len + size);
+  write_record(aof->buf + aof->len, size, msg, now);
+  aof->len += size;
+  if (aof->len >= aof->sync_bytes)
+    pthread_cond_signal(&aof->cond);
+  pthread_mutex_unlock(&aof->lock);
+}
+
+/* Ask for the log to be rewritten as soon as possible, unless it's
+   being rewritten already */
+void aof_rewrite(Aof *aof) {
+  pthread_mutex_lock(&aof->lock);
+  aof->rewrite_requested = true;
+  pthread_cond_signal(&aof->cond);
+  pthread_mutex_unlock(&aof->lock);
+}
+
+/*
+ * Write out and sync everything appended so far. Called by the log's
+ * thread holding its lock, which is released meanwhile. While a
+ * rewrite runs, what was appended since it forked is also kept, to add
+ * to the new log.
+ */
+void aof_sync(Aof *aof) {
+  uint8_t *out = aof->buf;
+  size_t len = aof->len;
+  size_t cap = aof->cap;
+  if (!len)
+    return;
+  aof->buf = aof->out;
+  aof->cap = aof->out_cap;
+  aof->len = 0;
+  aof->out = out;
+  aof->out_cap = cap;
+  pthread_mutex_unlock(&aof->lock);
+  if (aof_write(aof->fd, out, len) == -1 || fdatasync(aof->fd) == -1)
+    error(0, errno, "%s", aof->path);
+  pthread_mutex_lock(&aof->lock);
+  aof->size += len;
+  ++aof->syncs;
+  if (aof->rewrite_pid) {
+    size_t skip = aof->rewrite_skip;
+    aof_grow(&aof->rewrite_buf, &aof->rewrite_cap, aof->rewrite_len + len - skip);
+    memcpy(aof->rewrite_buf + aof->rewrite_len, out + skip, len - skip);
+    aof->rewrite_len += len - skip;
+    aof->rewrite_skip = 0;
+  }
+}
+
+/* Flush W's buffer. Returns -1, setting errno, on failure. */
+int aof_flush(AofWriter *w) {
+  int ret = aof_write(w->fd, w->buf, w->len);
+  w->len = 0;
+  return ret;
+}
+
+/* Write a PUT record recreating ENTRY, unless it has expired
+   (hash_table_for_each callback) */
+int rewrite_entry(Entry *entry, void *arg) {
+  AofWriter *w = arg;
+  if (entry->expires_at && entry->expires_at <= w->now)
+    return 0;
+  Message msg = { .type = PUT };
+  msg.message.put.key.key_size = entry->key_size;
+  msg.message.put.key.key = entry->data;
+  msg.message.put.val = entry->val;
+  msg.message.put.ttl = entry->expires_at ? entry->expires_at - w->now : 0;
+  size_t size = aof_record_size(&msg);
+  if (w->len + size > AOF_BUF_SIZE && aof_flush(w) == -1)
+    return -1;
+  write_record(w->buf + w->len, size, &msg, w->now);
+  w->len += size;
+  return 0;
+}
+
+/* Write a log recreating every live entry of ST to PATH and sync it.
+   Runs in the rewrite child. Returns -1, setting errno, on failure. */
+int write_rewrite(ShardedTable *st, const char *path) {
+  AofWriter w = { .len = 0 };
+  int ret = -1;
+  w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w.fd == -1)
+    return -1;
+  w.buf = malloc(AOF_BUF_SIZE);
+  if (!w.buf)
+    goto out;
+  for (unsigned int i = 0; i < st->shard_count; i++) {
+    HashTable *ht = st->shards[i].ht;
+    w.now = ht->now;
+    if (hash_table_for_each(ht, rewrite_entry, &w))
+      goto out;
+  }
+  if (aof_flush(&w) == 0 && fsync(w.fd) == 0)
+    ret = 0;
+out:
+  free(w.buf);
+  if (close(w.fd) == -1)
+    ret = -1;
+  return ret;
+}
+
+/*
+ * Fork a child to write the rewritten log from its copy of the table.
+ * Called by the log's thread holding its lock. Every shard is locked
+ * across the fork (before the log's own lock, as writers take them),
+ * so appends made before it are in the child's copy, and those made
+ * after are kept by aof_sync.
+ */
+void start_rewrite(Aof *aof) {
+  ShardedTable *st = aof->st;
+  aof->rewrite_requested = false;
+  pthread_mutex_unlock(&aof->lock);
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_lock(&st->shards[i]);
+  pthread_mutex_lock(&aof->lock);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (write_rewrite(st, aof->rewrite_path) == -1) {
+      perror(aof->rewrite_path);
+      _exit(1);
+    }
+    _exit(0);
+  }
+  if (pid == -1)
+    error(0, errno, "fork");
+  else {
+    aof->rewrite_pid = pid;
+    aof->rewrite_skip = aof->len;
+    aof->rewrite_len = 0;
+  }
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_unlock(&st->shards[i]);
+}
+
+/* Give up on the running rewrite, keeping the current log */
+void abandon_rewrite(Aof *aof) {
+  error(0, 0, "rewrite of %s failed", aof->path);
+  unlink(aof->rewrite_path);
+  aof->rewrite_pid = 0;
+  aof->rewrite_len = 0;
+  /* Wait for the log to double again before retrying */
+  aof->base_size = aof->size;
+}
+
+/*
+ * If the rewrite child has exited (or once it does, with WAIT), add
+ * what was logged since it forked to its file and switch to that as
+ * the log. Called by the log's thread holding its lock. The bulk is
+ * added with the lock released, and only the appends made meanwhile
+ * with it held, as they must not be logged to the old file instead.
+ */
+void finish_rewrite(Aof *aof, bool wait) {
+  int status;
+  pid_t pid = waitpid(aof->rewrite_pid, &status, wait ? 0 : WNOHANG);
+  if (pid == 0 || (pid == -1 && errno == EINTR))
+    return;
+  if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    abandon_rewrite(aof);
+    return;
+  }
+  int fd = open(aof->rewrite_path, O_WRONLY | O_APPEND);
+  pthread_mutex_unlock(&aof->lock);
+  bool ok = fd != -1 && aof_write(fd, aof->rewrite_buf, aof->rewrite_len) == 0;
+  pthread_mutex_lock(&aof->lock);
+  size_t skip = aof->rewrite_skip;
+  struct stat sb;
+  ok = ok && aof_write(fd, aof->buf + skip, aof->len - skip) == 0 && fdatasync(fd) == 0
+    && fstat(fd, &sb) == 0 && rename(aof->rewrite_path, aof->path) == 0;
+  if (!ok) {
+    error(0, errno, "%s", aof->rewrite_path);
+    if (fd != -1)
+      close(fd);
+    abandon_rewrite(aof);
+    return;
+  }
+  close(aof->fd);
+  aof->fd = fd;
+  aof->len = 0;
+  aof->size = aof->base_size = sb.st_size;
+  aof->rewrite_pid = 0;
+  aof->rewrite_len = 0;
+  ++aof->rewrites;
+}
+
+bool should_rewrite(Aof *aof) {
+  return aof->rewrite_requested
+    || (aof->rewrite_min && aof->size >= aof->rewrite_min && aof->size >= 2 * aof->base_size);
+}
+
+/* The log's thread, syncing it every SYNC_MS, or sooner once
+   SYNC_BYTES have been appended, and running rewrites */
+void *run_aof(void *arg) {
+  Aof *aof = arg;
+  struct timespec due;
+  pthread_mutex_lock(&aof->lock);
+  while (!aof->stop) {
+    clock_gettime(CLOCK_REALTIME, &due);
+    due.tv_sec += aof->sync_ms / 1000;
+    due.tv_nsec += (aof->sync_ms % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L) {
+      ++due.tv_sec;
+      due.tv_nsec -= 1000000000L;
+    }
+    while (!aof->stop && aof->len < aof->sync_bytes
+           && !(aof->rewrite_requested && !aof->rewrite_pid)
+           && pthread_cond_timedwait(&aof->cond, &aof->lock, &due) != ETIMEDOUT)
+      ;
+    aof_sync(aof);
+    if (aof->rewrite_pid)
+      finish_rewrite(aof, false);
+    else if (!aof->stop && should_rewrite(aof))
+      start_rewrite(aof);
+  }
+  aof_sync(aof);
+  if (aof->rewrite_pid)
+    finish_rewrite(aof, true);
+  pthread_mutex_unlock(&aof->lock);
+  return NULL;
+}
+
+/* Stop the log's thread, once everything appended has been synced
+   and any running rewrite has finished. Appends are still buffered,
+   for free_aof to sync. Must be called with no shard locked, as a
+   rewrite locks them all. */
+void aof_stop(Aof *aof) {
+  pthread_mutex_lock(&aof->lock);
+  bool running = !aof->stop;
+  aof->stop = true;
+  pthread_cond_signal(&aof->cond);
+  pthread_mutex_unlock(&aof->lock);
+  if (running)
+    pthread_join(aof->thread, NULL);
+}
+
+/* Stop logging, once everything appended has been synced. Must not
+   run alongside writes to the table, nor with any shard locked unless
+   aof_stop has been called first. */
+void free_aof(Aof *take_aof) {
+  aof_stop(take_aof);
+  pthread_mutex_lock(&take_aof->lock);
+  aof_sync(take_aof);
+  pthread_mutex_unlock(&take_aof->lock);
+  if (take_aof->st->aof == take_aof)
+    take_aof->st->aof = NULL;
+  close(take_aof->fd);
+  pthread_cond_destroy(&take_aof->cond);
+  pthread_mutex_destroy(&take_aof->lock);
+  free(take_aof->buf);
+  free(take_aof->out);
+  free(take_aof->rewrite_buf);
+  free(take_aof->rewrite_path);
+  free(take_aof->path);
+  free(take_aof);
+}
+
+/* Make sure at least N bytes are buffered from POS onwards, growing
+   the buffer if need be. Returns FALSE at the end of the file or on
+   failure, setting errno to zero for the former. */
+bool aof_fill(AofReader *r, size_t n) {
+  if (r->len - r->pos >= n)
+    return true;
+  if (r->pos) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  aof_grow(&r->buf, &r->cap, n);
+  while (r->len < n) {
+    ssize_t got = read(r->fd, r->buf + r->len, r->cap - r->len);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (got == 0)
+        errno = 0;
+      return false;
+    }
+    r->len += got;
+  }
+  return true;
+}
+
+/* Apply PUT, logged at time THEN, to ST. It's applied as a delete if
+   it has expired since. */
+void replay_put(ShardedTable *st, MessagePut *put, uint32_t then) {
+  uint64_t h = hash(&put->key);
+  HashTable *ht = sharded_table_shard_hashed(st, h)->ht;
+  uint32_t ttl = put->ttl;
+  if (ttl) {
+    uint64_t expires_at = (uint64_t)then + ttl;
+    if (expires_at <= ht->now) {
+      hash_table_delete_hashed(ht, &put->key, h);
+      return;
+    }
+    ttl = expires_at - ht->now;
+  }
+  hash_table_put_hashed(ht, &put->key, &put->val, ttl, h);
+}
+
+void replay_delete(ShardedTable *st, Key *key) {
+  uint64_t h = hash(key);
+  hash_table_delete_hashed(sharded_table_shard_hashed(st, h)->ht, key, h);
+}
+
+/* Apply logged request MSG, which was applied at time THEN, to ST.
+   Returns FALSE if MSG isn't a write. */
+bool replay_request(ShardedTable *st, Message *msg, uint32_t then) {
+  switch (msg->type) {
+  case PUT:
+    replay_put(st, &msg->message.put, then);
+    return true;
+  case DELETE:
+    replay_delete(st, &msg->message.delete.key);
+    return true;
+  case MPUT:
+    for (BatchCount i = 0; i < msg->message.mput.count; i++)
+      replay_put(st, &msg->message.mput.puts[i], then);
+    return true;
+  case MDELETE:
+    for (BatchCount i = 0; i < msg->message.mdelete.count; i++)
+      replay_delete(st, &msg->message.mdelete.keys[i]);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* After the record header at R's position fails its checksum, with
+   LEFT bytes of the log from there on, return TRUE if a record whose
+   checksums both match starts anywhere after it, or the rest of the
+   log can't be read */
+bool aof_record_follows(AofReader *r, off_t left) {
+  for (r->pos++, left--; left >= (off_t)AOF_RECORD_HEADER; r->pos++, left--) {
+    size_t size = AOF_RECORD_HEADER;
+    if (!aof_fill(r, size))
+      return true;
+    uint8_t *rec = r->buf + r->pos;
+    if (read_u32(rec) != aof_checksum(rec + AOF_RECORD_CHECKS, size - AOF_RECORD_CHECKS))
+      continue;
+    size += read_u32(rec + AOF_RECORD_HEADER - sizeof(MessageSize));
+    if (size > (size_t)left)
+      continue;
+    if (!aof_fill(r, size))
+      return true;
+    rec = r->buf + r->pos;
+    if (read_u32(rec + sizeof(uint32_t))
+        == aof_checksum(rec + AOF_RECORD_HEADER, size - AOF_RECORD_HEADER))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Replay the log at PATH into ST, measuring the TTLs of its PUTs from
+ * when they were logged against each shard's current time. A record
+ * cut short by a crash at the end of the log, with its header intact
+ * or too short to hold one, is truncated away, as is a damaged header
+ * with no intact record after it (such as the zeros a crash can leave
+ * past the last write). Must run before the
+ * log is opened with create_aof, and not alongside other users of ST.
+ * Returns the number of requests replayed, or -1 on failure, setting
+ * errno: ENOENT if there is no log, or EINVAL if a record is
+ * malformed or fails its checksum, in which case those before it have
+ * still been replayed and the log is left as it is.
+ */
+long aof_replay(ShardedTable *st, const char *path) {
+  AofReader r = { .buf = NULL, .cap = 0, .pos = 0, .len = 0 };
+  struct stat sb;
+  long replayed = 0;
+  off_t done = 0;
+  r.fd = open(path, O_RDWR);
+  if (r.fd == -1)
+    return -1;
+  if (fstat(r.fd, &sb) == -1) {
+    replayed = -1;
+    goto out;
+  }
+  posix_fadvise(r.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (;;) {
+    size_t size = AOF_RECORD_HEADER;
+    if (!aof_fill(&r, size))
+      break;
+    uint8_t *rec = r.buf + r.pos;
+    if (read_u32(rec) != aof_checksum(rec + AOF_RECORD_CHECKS, size - AOF_RECORD_CHECKS)) {
+      if (aof_record_follows(&r, sb.st_size - done)) {
+        errno = EINVAL;
+        replayed = -1;
+        goto out;
+      }
+      errno = 0;
+      break;
+    }
+    size += read_u32(rec + AOF_RECORD_HEADER - sizeof(MessageSize));
+    /* With its header intact, a record running past the end can only
+       have been torn */
+    if (size > (size_t)(sb.st_size - done)) {
+      errno = 0;
+      break;
+    }
+    if (!aof_fill(&r, size))
+      break;
+    Message msg;
+    rec = r.buf + r.pos;
+    if (read_u32(rec + sizeof(uint32_t))
+        != aof_checksum(rec + AOF_RECORD_HEADER, size - AOF_RECORD_HEADER)
+        || !parse_request(rec + AOF_RECORD_HEADER, size - AOF_RECORD_HEADER, &msg)) {
+      errno = EINVAL;
+      replayed = -1;
+      goto out;
+    }
+    bool ok = replay_request(st, &msg, read_u32(rec + AOF_RECORD_CHECKS));
+    free_message_views(&msg);
+    if (!ok) {
+      errno = EINVAL;
+      replayed = -1;
+      goto out;
+    }
+    r.pos += size;
+    done += size;
+    ++replayed;
+  }
+  if (errno)
+    replayed = -1;
+  else if (done < sb.st_size && ftruncate(r.fd, done) == -1)
+    replayed = -1;
+out:
+  free(r.buf);
+  close(r.fd);
+  return replayed;
+}
+
+void print_aof_stats(Aof *aof, FILE *out) {
+  pthread_mutex_lock(&aof->lock);
+  fprintf(out, "aof: %s size: %zu unsynced: %zu syncs: %lu rewrites: %lu rewriting: %s\n",
+          aof->path, aof->size, aof->len, aof->syncs, aof->rewrites,
+          aof->rewrite_pid ? "yes" : "no");
+  pthread_mutex_unlock(&aof->lock);
+}
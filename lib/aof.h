@@ -0,0 +1,85 @@
+#ifndef _AOF_H
+#define _AOF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "message.h"
+#include "shard.h"
+
+/*
+ * Append-only log of the write requests (PUT, DELETE, MPUT and
+ * MDELETE) applied to a ShardedTable, replayed on startup to recover
+ * the table after a crash. Each record is the time the request was
+ * applied (seconds, as a big-endian u32, against which its TTLs count)
+ * followed by the request as serialised on the wire, preceded by two
+ * checksums (big-endian u32s): one of the time and the request's size,
+ * and one of the rest of the request. A record whose header checks out
+ * but which runs past the end of the log was torn by a crash, and is
+ * dropped on replay, but any other damage fails the replay.
+ *
+ * Appends only copy the request into a buffer. A background thread
+ * writes the buffer out and fsyncs the file every SYNC_MS
+ * milliseconds, or sooner once SYNC_BYTES are waiting, so one fsync
+ * commits every request appended meanwhile. Requests are answered
+ * without waiting for this, so a crash loses at most that window.
+ *
+ * Once the log has grown to REWRITE_MIN bytes and doubled since it was
+ * last rewritten, it is rewritten in the background: a forked child
+ * writes a PUT for each live entry to a new file, and writes appended
+ * since the fork are added to it before it replaces the log.
+ */
+typedef struct Aof {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  ShardedTable *st;
+  char *path;
+  char *rewrite_path;           /* PATH.rewrite, written by the child */
+  int fd;
+  unsigned int sync_ms;
+  size_t sync_bytes;
+  size_t rewrite_min;           /* Zero to rewrite only on request */
+  uint8_t *buf;                 /* Appended, not yet written */
+  size_t len;
+  size_t cap;
+  uint8_t *out;                 /* Being written by the thread */
+  size_t out_cap;
+  size_t size;                  /* Bytes in the log file */
+  size_t base_size;             /* Size after the last rewrite */
+  bool stop;
+  bool rewrite_requested;
+  pid_t rewrite_pid;            /* Zero unless a rewrite is running */
+  size_t rewrite_skip;          /* Bytes of BUF predating the rewrite */
+  uint8_t *rewrite_buf;         /* Written since the rewrite began */
+  size_t rewrite_len;
+  size_t rewrite_cap;
+  unsigned long rewrites;
+  unsigned long syncs;
+} Aof;
+
+Aof *create_aof(const char *path, ShardedTable *st, unsigned int sync_ms, size_t sync_bytes,
+                size_t rewrite_min);
+
+void aof_seal_record(uint8_t *rec, size_t size);
+
+void aof_append(Aof *aof, Message *msg, uint32_t now);
+
+void aof_rewrite(Aof *aof);
+
+void aof_stop(Aof *aof);
+
+void free_aof(Aof *take_aof);
+
+long aof_replay(ShardedTable *st, const char *path);
+
+void replay_put(ShardedTable *st, MessagePut *put, uint32_t then);
+
+void replay_delete(ShardedTable *st, Key *key);
+
+void print_aof_stats(Aof *aof, FILE *out);
+
+#endif
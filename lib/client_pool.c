@@ -0,0 +1,308 @@
+/*
+ * Pooled non-blocking client (see client_pool.h). Responses arrive in
+ * the order their requests were sent on each connection, so each
+ * connection keeps a ring of the callbacks awaiting them, and the
+ * front of the ring takes the next response parsed.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "hash_table.h"
+#include "message.h"
+#include "conn.h"
+#include "client_pool.h"
+
+/* Open PC's connection to POOL's server, without blocking once open.
+   Returns -1, setting errno, on failure. */
+int open_pool_conn(ClientPool *pool, PoolConn *pc) {
+  struct addrinfo hints, *ai, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(pool->host, pool->port, &hints, &ai) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for (p = ai; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(ai);
+  if (fd == -1)
+    return -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  pc->conn.fd = fd;
+  return 0;
+}
+
+/*
+ * Create a pool of CONN_COUNT connections to the server at HOST and
+ * PORT. Returns NULL, setting errno, if any connection can't be
+ * opened.
+ */
+ClientPool *create_client_pool(const char *host, const char *port, unsigned int conn_count) {
+  ClientPool *pool = calloc(1, sizeof(ClientPool));
+  assert(pool != 0);
+  pool->host = strdup(host);
+  pool->port = strdup(port);
+  pool->conn_count = conn_count;
+  pool->conns = calloc(conn_count, sizeof(PoolConn));
+  assert(pool->host != 0 && pool->port != 0 && pool->conns != 0);
+  for (unsigned int i = 0; i < conn_count; i++)
+    init_conn(&pool->conns[i].conn);
+  for (unsigned int i = 0; i < conn_count; i++)
+    if (open_pool_conn(pool, &pool->conns[i]) == -1) {
+      int err = errno;
+      free_client_pool(pool);
+      errno = err;
+      return NULL;
+    }
+  return pool;
+}
+
+/* Close PC's connection, failing every request awaiting a response
+   on it with ERR */
+void fail_pool_conn(ClientPool *pool, PoolConn *pc, int err) {
+  if (pc->conn.fd != -1)
+    close(pc->conn.fd);
+  pc->conn.fd = -1;
+  pc->conn.out_len = pc->conn.out_sent = 0;
+  pc->recv_len = 0;
+  /* Callbacks may queue requests, reopening the connection, so they
+     are called from a detached copy of the ring */
+  PendingRequest *ring = pc->pending;
+  size_t head = pc->pending_head, count = pc->pending_count, cap = pc->pending_cap;
+  pc->pending = NULL;
+  pc->pending_head = pc->pending_count = pc->pending_cap = 0;
+  pool->in_flight -= count;
+  for (size_t i = 0; i < count; i++) {
+    PendingRequest *req = &ring[(head + i) % cap];
+    errno = err;
+    req->callback(NULL, req->arg);
+  }
+  free(ring);
+}
+
+/* Close every connection, failing requests still awaiting responses
+   with ECONNABORTED. Their callbacks mustn't queue more. */
+void free_client_pool(ClientPool *take_pool) {
+  for (unsigned int i = 0; i < take_pool->conn_count; i++) {
+    PoolConn *pc = &take_pool->conns[i];
+    fail_pool_conn(take_pool, pc, ECONNABORTED);
+    free(pc->conn.out_buf);
+    free(pc->recv_buf);
+    free(pc->pending);
+  }
+  free(take_pool->conns);
+  free(take_pool->host);
+  free(take_pool->port);
+  free(take_pool);
+}
+
+/* Add a request awaiting a response to PC's ring */
+void push_pending(PoolConn *pc, ClientCallback callback, void *arg) {
+  if (pc->pending_count == pc->pending_cap) {
+    size_t cap = pc->pending_cap ? pc->pending_cap * 2 : 64;
+    PendingRequest *ring = malloc(cap * sizeof(PendingRequest));
+    assert(ring != 0);
+    /* Unwrap the ring into the new one */
+    for (size_t i = 0; i < pc->pending_count; i++)
+      ring[i] = pc->pending[(pc->pending_head + i) % pc->pending_cap];
+    free(pc->pending);
+    pc->pending = ring;
+    pc->pending_head = 0;
+    pc->pending_cap = cap;
+  }
+  pc->pending[(pc->pending_head + pc->pending_count++) % pc->pending_cap] =
+    (PendingRequest) { .callback = callback, .arg = arg };
+}
+
+/*
+ * Queue request MSG on the next connection, to be sent as the pool is
+ * driven, and call CALLBACK with its response and ARG. MSG is copied,
+ * so needn't outlive the call. Returns -1, setting errno, if the
+ * connection was closed and can't be reopened, in which case CALLBACK
+ * isn't called.
+ */
+int client_pool_send(ClientPool *pool, Message *msg, ClientCallback callback, void *arg) {
+  PoolConn *pc = &pool->conns[pool->next];
+  pool->next = (pool->next + 1) % pool->conn_count;
+  if (pc->conn.fd == -1 && open_pool_conn(pool, pc) == -1)
+    return -1;
+  conn_queue_msg(&pc->conn, msg);
+  push_pending(pc, callback, arg);
+  ++pool->in_flight;
+  return 0;
+}
+
+/* Queue a GET of KEY, see client_pool_send */
+int client_pool_get(ClientPool *pool, Key *key, ClientCallback callback, void *arg) {
+  Message msg = { .type = GET };
+  msg.message.get.key = *key;
+  return client_pool_send(pool, &msg, callback, arg);
+}
+
+/* Queue a PUT of VAL at KEY, expiring after TTL seconds unless zero,
+   see client_pool_send */
+int client_pool_put(ClientPool *pool, Key *key, Val *val, uint32_t ttl,
+                    ClientCallback callback, void *arg) {
+  Message msg = { .type = PUT };
+  msg.message.put.key = *key;
+  msg.message.put.val = *val;
+  msg.message.put.ttl = ttl;
+  return client_pool_send(pool, &msg, callback, arg);
+}
+
+/* Queue a DELETE of KEY, see client_pool_send */
+int client_pool_delete(ClientPool *pool, Key *key, ClientCallback callback, void *arg) {
+  Message msg = { .type = DELETE };
+  msg.message.delete.key = *key;
+  return client_pool_send(pool, &msg, callback, arg);
+}
+
+/* Fill in a pollfd for each of POOL's connections, in order, waiting
+   to send only while output is queued. Closed connections have a
+   negative FD, which poll() ignores. Returns how many were filled
+   in. */
+unsigned int client_pool_pollfds(ClientPool *pool, struct pollfd *pfds) {
+  for (unsigned int i = 0; i < pool->conn_count; i++) {
+    PoolConn *pc = &pool->conns[i];
+    pfds[i].fd = pc->conn.fd;
+    pfds[i].events = POLLIN | (conn_pending(&pc->conn) ? POLLOUT : 0);
+    pfds[i].revents = 0;
+  }
+  return pool->conn_count;
+}
+
+/* Pass each complete response in PC's receive buffer to the request
+   awaiting it. Returns -1, setting errno, if the server sent
+   something other than a response, or one too large to take. */
+int dispatch_responses(ClientPool *pool, PoolConn *pc) {
+  size_t pos = 0;
+  Message msg;
+  Val val;
+  while (pc->recv_len - pos >= sizeof(MessageSize)) {
+    MessageSize size = read_u32(pc->recv_buf + pos);
+    if (pc->recv_len - pos - sizeof(MessageSize) < size)
+      break;
+    uint8_t *payload = pc->recv_buf + pos + sizeof(MessageSize);
+    if (!pc->pending_count || !parse_response(payload, size, &msg, &val)) {
+      errno = EPROTO;
+      return -1;
+    }
+    pos += sizeof(MessageSize) + size;
+    PendingRequest req = pc->pending[pc->pending_head];
+    pc->pending_head = (pc->pending_head + 1) % pc->pending_cap;
+    --pc->pending_count;
+    --pool->in_flight;
+    req.callback(&msg, req.arg);
+    free_message_views(&msg);
+  }
+  /* Keep the start of the next response at the front */
+  pc->recv_len -= pos;
+  memmove(pc->recv_buf, pc->recv_buf + pos, pc->recv_len);
+  if (pc->recv_len >= sizeof(MessageSize)) {
+    if (read_u32(pc->recv_buf) > pc->conn.max_msg_size) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    size_t total = sizeof(MessageSize) + read_u32(pc->recv_buf);
+    if (total > pc->recv_cap) {
+      pc->recv_buf = realloc(pc->recv_buf, total);
+      assert(pc->recv_buf != 0);
+      pc->recv_cap = total;
+    }
+  }
+  return 0;
+}
+
+/* Receive what has arrived on PC and dispatch its responses. Returns
+   -1, setting errno, if the connection has failed. */
+int receive_responses(ClientPool *pool, PoolConn *pc) {
+  if (!pc->recv_buf) {
+    pc->recv_cap = CLIENT_POOL_RECV_BUF_SIZE;
+    pc->recv_buf = malloc(pc->recv_cap);
+    assert(pc->recv_buf != 0);
+  }
+  for (;;) {
+    ssize_t n = recv(pc->conn.fd, pc->recv_buf + pc->recv_len, pc->recv_cap - pc->recv_len, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0) {
+      if (n == 0)
+        errno = ECONNRESET;
+      return -1;
+    }
+    pc->recv_len += n;
+    if (dispatch_responses(pool, pc) == -1)
+      return -1;
+  }
+}
+
+/* Handle events REVENTS, as reported by poll(), on POOL's connection
+   INDEX: send queued requests and dispatch responses received */
+void client_pool_handle(ClientPool *pool, unsigned int index, short revents) {
+  PoolConn *pc = &pool->conns[index];
+  if (pc->conn.fd == -1 || !revents)
+    return;
+  int err = 0;
+  if ((revents & POLLOUT) && conn_send(&pc->conn) == -1)
+    err = errno;
+  else if ((revents & (POLLIN | POLLHUP | POLLERR)) && receive_responses(pool, pc) == -1)
+    err = errno;
+  if (err)
+    fail_pool_conn(pool, pc, err);
+}
+
+/*
+ * Drive POOL from its own poll(): send what is queued, waiting up to
+ * TIMEOUT_MS milliseconds (or forever if negative) for anything to
+ * happen, and dispatch the responses that have arrived. Returns -1,
+ * setting errno, if poll() fails.
+ */
+int client_pool_run(ClientPool *pool, int timeout_ms) {
+  struct pollfd pfds[pool->conn_count];
+  /* Sending straight away saves waiting for POLLOUT, which an idle
+     socket always reports */
+  for (unsigned int i = 0; i < pool->conn_count; i++) {
+    PoolConn *pc = &pool->conns[i];
+    if (pc->conn.fd != -1 && conn_pending(&pc->conn) && conn_send(&pc->conn) == -1)
+      fail_pool_conn(pool, pc, errno);
+  }
+  unsigned int n = client_pool_pollfds(pool, pfds);
+  int ready = poll(pfds, n, timeout_ms);
+  if (ready == -1)
+    return errno == EINTR ? 0 : -1;
+  for (unsigned int i = 0; i < n && ready; i++)
+    if (pfds[i].revents) {
+      client_pool_handle(pool, i, pfds[i].revents);
+      --ready;
+    }
+  return 0;
+}
+
+/* Drive POOL until every request has been answered (or failed).
+   Returns -1, setting errno, if poll() fails. */
+int client_pool_wait(ClientPool *pool) {
+  while (pool->in_flight)
+    if (client_pool_run(pool, -1) == -1)
+      return -1;
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef _CLIENT_POOL_H
+#define _CLIENT_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <poll.h>
+#include "message.h"
+#include "conn.h"
+
+/*
+ * A non-blocking client of one server, over a pool of persistent
+ * connections, for embedding in a program with its own event loop.
+ *
+ * Requests are queued with a callback, spread round-robin over the
+ * connections, and pipelined: each connection may have any number in
+ * flight, answered in order. Nothing is sent until the pool is driven,
+ * either by the caller's loop (poll the descriptors from
+ * client_pool_pollfds and pass their events to client_pool_handle), or
+ * by client_pool_run. Sockets never block, so one slow connection
+ * doesn't hold up the others.
+ *
+ * Each callback is passed the response parsed in place in its
+ * connection's receive buffer, which is kept and reused for every
+ * response, so a GET costs no allocation. The response is only valid
+ * during the callback. It is NULL, with errno set, if the connection
+ * failed first. A failed connection is reopened on its next request.
+ * Callbacks may queue further requests, but mustn't drive or free the
+ * pool.
+ */
+#define CLIENT_POOL_RECV_BUF_SIZE 65536
+
+typedef void (*ClientCallback)(Message *resp, void *arg);
+
+typedef struct PendingRequest {
+  ClientCallback callback;
+  void *arg;
+} PendingRequest;
+
+typedef struct PoolConn {
+  Conn conn;                    /* Queued requests, and FD, -1 if closed */
+  uint8_t *recv_buf;            /* Received, not yet parsed, from the start */
+  size_t recv_len;
+  size_t recv_cap;
+  PendingRequest *pending;      /* Ring of requests awaiting responses */
+  size_t pending_head;
+  size_t pending_count;
+  size_t pending_cap;
+} PoolConn;
+
+typedef struct ClientPool {
+  char *host;
+  char *port;
+  unsigned int conn_count;
+  PoolConn *conns;
+  unsigned int next;            /* Connection for the next request */
+  size_t in_flight;             /* Requests awaiting responses */
+} ClientPool;
+
+ClientPool *create_client_pool(const char *host, const char *port, unsigned int conn_count);
+
+void free_client_pool(ClientPool *take_pool);
+
+int client_pool_send(ClientPool *pool, Message *msg, ClientCallback callback, void *arg);
+
+int client_pool_get(ClientPool *pool, Key *key, ClientCallback callback, void *arg);
+
+int client_pool_put(ClientPool *pool, Key *key, Val *val, uint32_t ttl,
+                    ClientCallback callback, void *arg);
+
+int client_pool_delete(ClientPool *pool, Key *key, ClientCallback callback, void *arg);
+
+unsigned int client_pool_pollfds(ClientPool *pool, struct pollfd *pfds);
+
+void client_pool_handle(ClientPool *pool, unsigned int index, short revents);
+
+int client_pool_run(ClientPool *pool, int timeout_ms);
+
+int client_pool_wait(ClientPool *pool);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Cluster client (see cluster.h). Requests are blocking: each call
+ * returns once its responses have arrived. A batch is still served in
+ * parallel, as the servers' responses queue in their sockets while the
+ * first ones are read.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "hash_table.h"
+#include "hash.h"
+#include "message.h"
+#include "conn.h"
+#include "cluster.h"
+
+int cmp_ring_points(const void *a, const void *b) {
+  const RingPoint *pa = a, *pb = b;
+  return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+/*
+ * Create a client of the COUNT servers at ADDRS, each given as
+ * host:port. Connections are only opened when first needed, so this
+ * only fails (returning NULL with errno EINVAL) if an address has no
+ * port.
+ */
+Cluster *create_cluster(char **addrs, unsigned int count) {
+  for (unsigned int i = 0; i < count; i++)
+    if (!strrchr(addrs[i], ':')) {
+      errno = EINVAL;
+      return NULL;
+    }
+  Cluster *cluster = malloc(sizeof(Cluster));
+  assert(cluster != 0);
+  cluster->node_count = count;
+  cluster->nodes = calloc(count, sizeof(ClusterNode));
+  cluster->point_count = (size_t)count * CLUSTER_VNODES;
+  cluster->ring = malloc(cluster->point_count * sizeof(RingPoint));
+  assert(cluster->nodes != 0 && cluster->ring != 0);
+  for (unsigned int i = 0; i < count; i++) {
+    ClusterNode *node = &cluster->nodes[i];
+    node->addr = strdup(addrs[i]);
+    assert(node->addr != 0);
+    init_conn(&node->conn);
+    /* A server's points depend only on its address, so they don't
+       move as others join or leave */
+    for (unsigned int v = 0; v < CLUSTER_VNODES; v++) {
+      RingPoint *point = &cluster->ring[(size_t)i * CLUSTER_VNODES + v];
+      point->hash = hash_bytes((uint8_t *)node->addr, strlen(node->addr), CLUSTER_SEED + v);
+      point->node = i;
+    }
+  }
+  qsort(cluster->ring, cluster->point_count, sizeof(RingPoint), cmp_ring_points);
+  return cluster;
+}
+
+/* Close NODE's connection, dropping anything buffered for it. Client
+   connections only use the output and message buffers. */
+void disconnect_node(ClusterNode *node) {
+  if (node->conn.fd == -1)
+    return;
+  close(node->conn.fd);
+  free(node->conn.out_buf);
+  free(node->conn.msg_buf);
+  init_conn(&node->conn);
+  node->recv_pos = node->recv_len = 0;
+}
+
+void free_cluster(Cluster *take_cluster) {
+  for (unsigned int i = 0; i < take_cluster->node_count; i++) {
+    disconnect_node(&take_cluster->nodes[i]);
+    free(take_cluster->nodes[i].addr);
+    free(take_cluster->nodes[i].recv_buf);
+  }
+  free(take_cluster->nodes);
+  free(take_cluster->ring);
+  free(take_cluster);
+}
+
+/* Return the index of the server owning KEY */
+unsigned int cluster_node_index(Cluster *cluster, Key *key) {
+  uint64_t h = hash_bytes(key->key, key->key_size, CLUSTER_SEED);
+  /* Find the first point at or after H, wrapping around the ring */
+  size_t lo = 0, hi = cluster->point_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cluster->ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return cluster->ring[lo == cluster->point_count ? 0 : lo].node;
+}
+
+/* Connect NODE if it isn't already. Returns -1, setting errno, on
+   failure. */
+int connect_node(ClusterNode *node) {
+  if (node->conn.fd != -1)
+    return 0;
+  char *colon = strrchr(node->addr, ':');
+  *colon = '\0';
+  struct addrinfo hints, *ai, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rv = getaddrinfo(node->addr, colon + 1, &hints, &ai);
+  *colon = ':';
+  if (rv != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for (p = ai; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(ai);
+  if (fd == -1)
+    return -1;
+  node->conn.fd = fd;
+  if (!node->recv_buf) {
+    node->recv_buf = malloc(CLUSTER_RECV_BUF_SIZE);
+    assert(node->recv_buf != 0);
+  }
+  return 0;
+}
+
+/* Queue MSG on NODE's connection, connecting first if need be, and
+   send it. Returns -1, setting errno, on failure. */
+int send_to_node(ClusterNode *node, Message *msg) {
+  if (connect_node(node) == -1)
+    return -1;
+  conn_queue_msg(&node->conn, msg);
+  if (conn_flush(&node->conn) == -1) {
+    disconnect_node(node);
+    return -1;
+  }
+  return 0;
+}
+
+/* Receive the next message from NODE, which must be a response of
+   TYPE. Returns NULL, setting errno, on failure, including a response
+   too large to take, after which NODE is disconnected, as its
+   responses can no longer be matched up. */
+Message *out_recv_from_node(ClusterNode *node, MessageType type) {
+  size_t processed;
+  for (;;) {
+    while (node->recv_pos < node->recv_len) {
+      Message *msg = out_recv_msg(&node->conn, node->recv_len - node->recv_pos,
+                                  node->recv_buf + node->recv_pos, &processed);
+      node->recv_pos += processed;
+      if (node->conn.refused) {
+        disconnect_node(node);
+        errno = EMSGSIZE;
+        return NULL;
+      }
+      if (msg && msg->type == type)
+        return msg;
+      if (msg) {
+        free_message(msg);
+        disconnect_node(node);
+        errno = EPROTO;
+        return NULL;
+      }
+    }
+    ssize_t n = recv(node->conn.fd, node->recv_buf, CLUSTER_RECV_BUF_SIZE, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = ECONNRESET;
+      disconnect_node(node);
+      return NULL;
+    }
+    node->recv_pos = 0;
+    node->recv_len = n;
+  }
+}
+
+/* Send single-key request MSG to the server owning KEY and return its
+   response of type TYPE, or NULL setting errno */
+Message *out_request(Cluster *cluster, Key *key, Message *msg, MessageType type) {
+  ClusterNode *node = &cluster->nodes[cluster_node_index(cluster, key)];
+  if (send_to_node(node, msg) == -1)
+    return NULL;
+  return out_recv_from_node(node, type);
+}
+
+/* Get KEY, storing its value, or NULL if not found, in *OUT_VAL.
+   Returns -1, setting errno, on failure. */
+int cluster_get(Cluster *cluster, Key *key, Val **out_val) {
+  Message msg = { .type = GET };
+  msg.message.get.key = *key;
+  Message *resp = out_request(cluster, key, &msg, GET_RESP);
+  if (!resp)
+    return -1;
+  *out_val = resp->message.get_resp.val;
+  free(resp);
+  return 0;
+}
+
+/* Put VAL at KEY, expiring after TTL seconds unless zero. Stores
+   whether KEY already had a value in *IS_UPDATE. Returns -1, setting
+   errno, on failure. */
+int cluster_put(Cluster *cluster, Key *key, Val *val, uint32_t ttl, bool *is_update) {
+  Message msg = { .type = PUT };
+  msg.message.put.key = *key;
+  msg.message.put.val = *val;
+  msg.message.put.ttl = ttl;
+  Message *resp = out_request(cluster, key, &msg, PUT_RESP);
+  if (!resp)
+    return -1;
+  *is_update = resp->message.put_resp.is_update;
+  free_message(resp);
+  return 0;
+}
+
+/* Delete KEY, storing whether it was found in *DELETED. Returns -1,
+   setting errno, on failure. */
+int cluster_delete(Cluster *cluster, Key *key, bool *deleted) {
+  Message msg = { .type = DELETE };
+  msg.message.delete.key = *key;
+  Message *resp = out_request(cluster, key, &msg, DELETE_RESP);
+  if (!resp)
+    return -1;
+  *deleted = resp->message.delete_resp.deleted;
+  free_message(resp);
+  return 0;
+}
+
+/*
+ * Get the COUNT keys at KEYS, storing each value, or NULL if not
+ * found, in OUT_VALS in the same order. Each server is sent one MGET
+ * of its keys, and all are sent before any response is read. Returns
+ * -1, setting errno, if any server fails, in which case no values are
+ * returned.
+ */
+int cluster_mget(Cluster *cluster, BatchCount count, Key *keys, Val **out_vals) {
+  unsigned int nodes = cluster->node_count;
+  unsigned int *owner = malloc(count * sizeof(unsigned int));
+  BatchCount *start = calloc(nodes + 1, sizeof(BatchCount));
+  BatchCount *next = malloc((nodes + 1) * sizeof(BatchCount));
+  Key *split = malloc(count * sizeof(Key));
+  Message **resps = calloc(nodes, sizeof(Message *));
+  assert(owner != 0 && start != 0 && next != 0 && split != 0 && resps != 0);
+
+  /* Group the keys by server, keeping their order within each */
+  for (BatchCount i = 0; i < count; i++)
+    ++start[(owner[i] = cluster_node_index(cluster, &keys[i])) + 1];
+  for (unsigned int n = 0; n < nodes; n++)
+    start[n + 1] += start[n];
+  memcpy(next, start, (nodes + 1) * sizeof(BatchCount));
+  for (BatchCount i = 0; i < count; i++)
+    split[next[owner[i]]++] = keys[i];
+
+  int err = 0;
+  Message msg = { .type = MGET };
+  for (unsigned int n = 0; n < nodes; n++) {
+    msg.message.mget.count = start[n + 1] - start[n];
+    msg.message.mget.keys = split + start[n];
+    if (msg.message.mget.count && send_to_node(&cluster->nodes[n], &msg) == -1 && !err)
+      err = errno;
+  }
+  for (unsigned int n = 0; n < nodes; n++) {
+    if (start[n + 1] == start[n] || cluster->nodes[n].conn.fd == -1)
+      continue;
+    resps[n] = out_recv_from_node(&cluster->nodes[n], MGET_RESP);
+    if (!resps[n] && !err)
+      err = errno;
+    else if (resps[n] && resps[n]->message.mget_resp.count != start[n + 1] - start[n]) {
+      disconnect_node(&cluster->nodes[n]);
+      if (!err)
+        err = EPROTO;
+    }
+  }
+
+  /* Hand each value over to the caller, in the order asked for */
+  if (!err) {
+    memcpy(next, start, (nodes + 1) * sizeof(BatchCount));
+    for (BatchCount i = 0; i < count; i++) {
+      Val **val = &resps[owner[i]]->message.mget_resp.vals[next[owner[i]]++ - start[owner[i]]];
+      out_vals[i] = *val;
+      *val = NULL;
+    }
+  }
+  for (unsigned int n = 0; n < nodes; n++)
+    if (resps[n])
+      free_message(resps[n]);
+  free(owner);
+  free(start);
+  free(next);
+  free(split);
+  free(resps);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "message.h"
+#include "conn.h"
+
+/*
+ * A client of several servers, each holding a share of the keys.
+ *
+ * Keys are mapped to servers by consistent hashing: each server is put
+ * at CLUSTER_VNODES points on a ring of 64-bit hashes, and a key
+ * belongs to the server at the first point at or after the key's hash.
+ * Adding a server then only moves the keys falling just before its
+ * points, about 1/N of them, where hashing modulo N would move nearly
+ * all. Many points per server keep the shares even. Hashes use a fixed
+ * seed, so that every client maps keys alike.
+ *
+ * Each server has one persistent connection, opened on first use and
+ * reopened on the next request after a failure. A batch is split by
+ * server, and every part is sent before any response is awaited, so
+ * the servers work on their parts in parallel.
+ */
+#define CLUSTER_VNODES 160
+#define CLUSTER_SEED 0x636c7573746572ULL
+#define CLUSTER_RECV_BUF_SIZE 65536
+
+typedef struct ClusterNode {
+  char *addr;                   /* As given, host:port */
+  Conn conn;                    /* FD is -1 while disconnected */
+  uint8_t *recv_buf;            /* CLUSTER_RECV_BUF_SIZE bytes, once connected */
+  size_t recv_pos;              /* Received bytes not yet parsed */
+  size_t recv_len;
+} ClusterNode;
+
+typedef struct RingPoint {
+  uint64_t hash;
+  unsigned int node;
+} RingPoint;
+
+typedef struct Cluster {
+  unsigned int node_count;
+  ClusterNode *nodes;
+  size_t point_count;
+  RingPoint *ring;              /* Sorted by hash */
+} Cluster;
+
+Cluster *create_cluster(char **addrs, unsigned int count);
+
+void free_cluster(Cluster *take_cluster);
+
+unsigned int cluster_node_index(Cluster *cluster, Key *key);
+
+int cluster_get(Cluster *cluster, Key *key, Val **out_val);
+
+int cluster_put(Cluster *cluster, Key *key, Val *val, uint32_t ttl, bool *is_update);
+
+int cluster_delete(Cluster *cluster, Key *key, bool *deleted);
+
+int cluster_mget(Cluster *cluster, BatchCount count, Key *keys, Val **out_vals);
+
+#endif
@@ -4,28 +4,265 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <error.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "hash_table.h"
 #include "message.h"
 #include "conn.h"
+#include "shard.h"
+#include "aof.h"
+#include "repl.h"
+
+/* Set up POOL to keep up to MAX free buffers */
+void init_msg_buf_pool(MsgBufPool *pool, size_t max) {
+  pool->bufs = malloc(max * sizeof(uint8_t *));
+  assert(pool->bufs != 0);
+  pool->count = 0;
+  pool->max = max;
+}
+
+void free_msg_buf_pool(MsgBufPool *pool) {
+  for (size_t i = 0; i < pool->count; i++)
+    free(pool->bufs[i]);
+  free(pool->bufs);
+}
 
 void init_conn(Conn *conn) {
+  conn->fd = -1;
   conn->msg_size = 0;
   conn->msg_buf = NULL;
+  conn->msg_cap = 0;
+  conn->pool = NULL;
   conn->bytes_received = 0;
+  conn->out_buf = NULL;
+  conn->out_len = 0;
+  conn->out_cap = 0;
+  conn->out_sent = 0;
+  conn->read_paused = false;
+  conn->write_wait = false;
+  conn->in_buf = NULL;
+  conn->in_len = 0;
+  conn->share_vals = false;
+  conn->segs = NULL;
+  conn->seg_count = 0;
+  conn->seg_cap = 0;
+  conn->seg_head = 0;
+  conn->seg_sent = 0;
+  conn->ref_bytes = 0;
+  conn->max_msg_size = CONN_MAX_MSG_SIZE;
+  conn->refused = false;
+}
+
+/* Allocate state for a connection on socket FD */
+Conn *create_conn(int fd) {
+  Conn *conn = malloc(sizeof(Conn));
+  assert(conn != 0);
+  init_conn(conn);
+  conn->fd = fd;
+  return conn;
+}
+
+/* Drop the table's value referenced by SEG, which has been sent */
+void release_seg(Conn *conn, OutSeg *seg) {
+  shard_lock(seg->shard);
+  hash_table_unref_val(seg->shard->ht, seg->val);
+  shard_unlock(seg->shard);
+  conn->ref_bytes -= seg->len;
+}
+
+/* Free connection state, including any partially received message
+   and unsent output. The socket is not closed. */
+void free_conn(Conn *take_conn) {
+  for (size_t i = take_conn->seg_head; i < take_conn->seg_count; i++)
+    if (take_conn->segs[i].val)
+      release_seg(take_conn, &take_conn->segs[i]);
+  free(take_conn->segs);
+  take_conn->bytes_received = 0;
+  conn_release_msg_buf(take_conn);
+  free(take_conn->out_buf);
+  free(take_conn->in_buf);
+  free(take_conn);
 }
 
-int min(int a, int b) {
+size_t min(size_t a, size_t b) {
   return a < b ? a : b;
 }
 
-/* Handle message, returning response message */
-Message *out_handle_msg(Message *msg, HashTable *ht) {
+bool is_batch(Message *msg) {
+  return msg->type == MGET || msg->type == MPUT || msg->type == MDELETE;
+}
+
+/* Return TRUE if MSG is a request changing the table */
+bool is_write(Message *msg) {
+  return msg->type == PUT || msg->type == DELETE || msg->type == MPUT || msg->type == MDELETE;
+}
+
+BatchCount batch_count(Message *msg) {
+  switch (msg->type) {
+  case MGET:
+    return msg->message.mget.count;
+  case MPUT:
+    return msg->message.mput.count;
+  default:
+    return msg->message.mdelete.count;
+  }
+}
+
+/* Return the Ith key of request MSG (which has one key unless it's a
+   batch), or NULL if it has none */
+Key *request_key(Message *msg, BatchCount i) {
+  switch (msg->type) {
+  case GET:
+    return &msg->message.get.key;
+  case PUT:
+    return &msg->message.put.key;
+  case DELETE:
+    return &msg->message.delete.key;
+  case MGET:
+    return &msg->message.mget.keys[i];
+  case MPUT:
+    return &msg->message.mput.puts[i].key;
+  case MDELETE:
+    return &msg->message.mdelete.keys[i];
+  default:
+    return NULL;
+  }
+}
+
+/*
+ * Hash each key of request MSG once, so that the one hash picks its
+ * shard, its bucket and its fingerprint. A single key's hash is
+ * stored in *ONE, and ONE returned; a batch's hashes are returned in
+ * an array to be freed by release_hashes. Returns NULL if MSG isn't a
+ * request.
+ */
+uint64_t *hash_request_keys(Message *msg, uint64_t *one) {
+  if (!is_batch(msg)) {
+    Key *key = request_key(msg, 0);
+    if (!key)
+      return NULL;
+    *one = hash(key);
+    return one;
+  }
+  BatchCount count = batch_count(msg);
+  uint64_t *hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+  assert(hashes != 0);
+  for (BatchCount i = 0; i < count; i++)
+    hashes[i] = hash(request_key(msg, i));
+  return hashes;
+}
+
+void release_hashes(uint64_t *take_hashes, uint64_t *one) {
+  if (take_hashes != one)
+    free(take_hashes);
+}
+
+/* Return the table holding a key with hash H: HT, or if ST is given,
+   the table of the shard owning the key */
+HashTable *key_table(HashTable *ht, ShardedTable *st, uint64_t h) {
+  return st ? sharded_table_shard_hashed(st, h)->ht : ht;
+}
+
+/*
+ * Handle batch request MSG in one pass over its keys, with hashes
+ * HASHES, filling in RESP with results in the same order. Keys are
+ * looked up in HT, or in the shards of ST, which the caller must hold
+ * locked. Values in the response point into the tables, and its array
+ * is freed with free_message_views. An MGET whose response would
+ * exceed MGET_RESP_MAX_SIZE is answered with no results.
+ */
+void handle_batch(Message *msg, Message *resp, HashTable *ht, ShardedTable *st,
+                  uint64_t *hashes) {
+  BatchCount count = batch_count(msg);
+  Key *key;
+  size_t size;
+  switch (msg->type) {
+  case MGET:
+    resp->type = MGET_RESP;
+    resp->message.mget_resp.count = count;
+    resp->message.mget_resp.vals = malloc(count * sizeof(Val *));
+    size = sizeof(MessageSize) + sizeof(MessageType) + sizeof(BatchCount) + count;
+    for (BatchCount i = 0; i < count; i++) {
+      key = &msg->message.mget.keys[i];
+      Val *val = hash_table_get_hashed(key_table(ht, st, hashes[i]), key, hashes[i]);
+      resp->message.mget_resp.vals[i] = val;
+      if (val && (size += val_size(val)) > MGET_RESP_MAX_SIZE) {
+        resp->message.mget_resp.count = 0;
+        break;
+      }
+    }
+    break;
+  case MPUT:
+    resp->type = MPUT_RESP;
+    resp->message.mput_resp.count = count;
+    resp->message.mput_resp.is_update = malloc(count * sizeof(bool));
+    for (BatchCount i = 0; i < count; i++) {
+      MessagePut *put = &msg->message.mput.puts[i];
+      resp->message.mput_resp.is_update[i] =
+        hash_table_put_hashed(key_table(ht, st, hashes[i]), &put->key, &put->val, put->ttl,
+                              hashes[i]);
+    }
+    break;
+  default:
+    resp->type = MDELETE_RESP;
+    resp->message.mdelete_resp.count = count;
+    resp->message.mdelete_resp.deleted = malloc(count * sizeof(bool));
+    for (BatchCount i = 0; i < count; i++) {
+      key = &msg->message.mdelete.keys[i];
+      resp->message.mdelete_resp.deleted[i] =
+        !hash_table_delete_hashed(key_table(ht, st, hashes[i]), key, hashes[i]);
+    }
+    break;
+  }
+}
+
+/* Lock every shard owning a key of batch request MSG, whose keys have
+   hashes HASHES, in index order so that concurrent batches can't
+   deadlock. Returns which shards were locked, to pass to
+   unlock_batch_shards. */
+bool *lock_batch_shards(ShardedTable *st, Message *msg, uint64_t *hashes) {
+  bool *locked = calloc(st->shard_count, sizeof(bool));
+  assert(locked != 0);
+  for (BatchCount i = 0; i < batch_count(msg); i++)
+    locked[hash_shard_index(st, hashes[i])] = true;
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    if (locked[i])
+      shard_lock(&st->shards[i]);
+  return locked;
+}
+
+void unlock_batch_shards(ShardedTable *st, bool *take_locked) {
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    if (take_locked[i])
+      shard_unlock(&st->shards[i]);
+  free(take_locked);
+}
+
+/* Log request MSG, whose keys have hashes HASHES, if ST has a log and
+   MSG is a write. Called before unlocking its keys' shards, so that
+   the log has each key's writes in the order they were applied. */
+void log_request(ShardedTable *st, Message *msg, uint64_t *hashes) {
+  if ((!st->aof && !st->primary) || !is_write(msg) || (is_batch(msg) && !batch_count(msg)))
+    return;
+  uint32_t now = sharded_table_shard_hashed(st, hashes[0])->ht->now;
+  if (st->aof)
+    aof_append(st->aof, msg, now);
+  if (st->primary)
+    primary_append(st->primary, msg, now);
+}
+
+/* Handle message, whose keys have hashes HASHES, against HT, or the
+   shards of ST which the caller holds locked, returning the response
+   message with its own copies of any values */
+Message *out_handle(Message *msg, HashTable *ht, ShardedTable *st, uint64_t *hashes) {
   Message *resp = malloc(sizeof(Message));
   Val *val;
   bool is_update;
   switch (msg->type) {
   case GET:
-    val = hash_table_get(ht, &msg->message.get.key);
+    val = hash_table_get_hashed(key_table(ht, st, hashes[0]), &msg->message.get.key,
+                                hashes[0]);
     resp->type = GET_RESP;
     if (val != NULL) {
       /* Copy val to resp */
@@ -38,61 +275,499 @@ Message *out_handle_msg(Message *msg, HashTable *ht) {
     }
     break;
   case PUT:
-    is_update = hash_table_put(ht, &msg->message.put.key, &msg->message.put.val);
+    is_update = hash_table_put_hashed(key_table(ht, st, hashes[0]),
+                                      &msg->message.put.key, &msg->message.put.val,
+                                      msg->message.put.ttl, hashes[0]);
     resp->type = PUT_RESP;
     resp->message.put_resp.is_update = is_update;
     break;
+  case DELETE:
+    resp->type = DELETE_RESP;
+    resp->message.delete_resp.deleted =
+      !hash_table_delete_hashed(key_table(ht, st, hashes[0]), &msg->message.delete.key,
+                                hashes[0]);
+    break;
+  case MGET:
+  case MPUT:
+  case MDELETE:
+    handle_batch(msg, resp, ht, st, hashes);
+    if (resp->type == MGET_RESP)
+      for (BatchCount i = 0; i < resp->message.mget_resp.count; i++) {
+        val = resp->message.mget_resp.vals[i];
+        resp->message.mget_resp.vals[i] = val ? create_val(val->val_size, val->val) : NULL;
+      }
+    break;
   default:
     free(resp);
+    resp = NULL;
     error(0, 0, "Unhandled message type %d", msg->type);
   };
   return resp;
 }
 
+/* Handle message, returning response message */
+Message *out_handle_msg(Message *msg, HashTable *ht) {
+  uint64_t one;
+  uint64_t *hashes = hash_request_keys(msg, &one);
+  if (!hashes) {
+    error(0, 0, "Unhandled message type %d", msg->type);
+    return NULL;
+  }
+  Message *resp = out_handle(msg, ht, NULL, hashes);
+  release_hashes(hashes, &one);
+  return resp;
+}
+
+/* Handle message against the shard owning its key, holding the
+   shard's lock (or those of all its keys, for a batch), and log it if
+   it's a write and ST has a log. Returns the response message. */
+Message *out_handle_shared_msg(Message *msg, ShardedTable *st) {
+  uint64_t one;
+  uint64_t *hashes = hash_request_keys(msg, &one);
+  Message *resp;
+  if (!hashes) {
+    error(0, 0, "Unhandled message type %d", msg->type);
+    return NULL;
+  }
+  if (is_batch(msg)) {
+    bool *locked = lock_batch_shards(st, msg, hashes);
+    resp = out_handle(msg, NULL, st, hashes);
+    log_request(st, msg, hashes);
+    unlock_batch_shards(st, locked);
+  } else {
+    Shard *shard = sharded_table_shard_hashed(st, one);
+    shard_lock(shard);
+    resp = out_handle(msg, shard->ht, NULL, hashes);
+    log_request(st, msg, hashes);
+    shard_unlock(shard);
+  }
+  release_hashes(hashes, &one);
+  return resp;
+}
+
+/* Handle batch request MSG against HT or the shards of ST, which the
+   caller holds locked, and queue the response on CONN */
+void handle_conn_batch(Conn *conn, Message *msg, HashTable *ht, ShardedTable *st,
+                       uint64_t *hashes) {
+  Message resp;
+  handle_batch(msg, &resp, ht, st, hashes);
+  conn_queue_msg(conn, &resp);
+  free_message_views(&resp);
+}
+
+/* Handle request MSG, whose keys have hashes HASHES, against HT,
+   belonging to SHARD if not NULL, and queue the response on CONN. A
+   GET's value is serialised straight from the table, or if large and
+   SHARD is given, queued by reference so that it's never copied. */
+void handle_msg(Conn *conn, Message *msg, HashTable *ht, Shard *shard, uint64_t *hashes) {
+  Message resp;
+  Val *val;
+  switch (msg->type) {
+  case GET:
+    val = hash_table_get_hashed(ht, &msg->message.get.key, hashes[0]);
+    if (val && shard && conn->share_vals && val->val_size >= CONN_SHARE_VAL_MIN
+        && hash_table_ref_val(ht, val)) {
+      conn_queue_val(conn, val, shard);
+      return;
+    }
+    resp.type = GET_RESP;
+    resp.message.get_resp.val = val;
+    break;
+  case PUT:
+    resp.type = PUT_RESP;
+    resp.message.put_resp.is_update = hash_table_put_hashed(ht, &msg->message.put.key,
+                                                            &msg->message.put.val,
+                                                            msg->message.put.ttl, hashes[0]);
+    break;
+  case DELETE:
+    resp.type = DELETE_RESP;
+    resp.message.delete_resp.deleted =
+      !hash_table_delete_hashed(ht, &msg->message.delete.key, hashes[0]);
+    break;
+  case MGET:
+  case MPUT:
+  case MDELETE:
+    handle_conn_batch(conn, msg, ht, NULL, hashes);
+    return;
+  default:
+    error(0, 0, "Unhandled message type %d", msg->type);
+    return;
+  }
+  conn_queue_msg(conn, &resp);
+}
+
+/* Handle request MSG, queueing the response on CONN */
+void conn_handle_msg(Conn *conn, Message *msg, HashTable *ht) {
+  uint64_t one;
+  uint64_t *hashes = hash_request_keys(msg, &one);
+  if (!hashes) {
+    error(0, 0, "Unhandled message type %d", msg->type);
+    return;
+  }
+  handle_msg(conn, msg, ht, NULL, hashes);
+  release_hashes(hashes, &one);
+}
+
+/* Handle request MSG against the shard owning its key, holding the
+   shard's lock (or those of all its keys, for a batch), log it if it's
+   a write and ST has a log, and queue the response on CONN */
+void conn_handle_shared_msg(Conn *conn, Message *msg, ShardedTable *st) {
+  uint64_t one;
+  uint64_t *hashes = hash_request_keys(msg, &one);
+  if (!hashes) {
+    error(0, 0, "Unhandled message type %d", msg->type);
+    return;
+  }
+  if (is_batch(msg)) {
+    bool *locked = lock_batch_shards(st, msg, hashes);
+    handle_conn_batch(conn, msg, NULL, st, hashes);
+    log_request(st, msg, hashes);
+    unlock_batch_shards(st, locked);
+  } else {
+    Shard *shard = sharded_table_shard_hashed(st, one);
+    shard_lock(shard);
+    handle_msg(conn, msg, shard->ht, shard, hashes);
+    log_request(st, msg, hashes);
+    shard_unlock(shard);
+  }
+  release_hashes(hashes, &one);
+}
+
+/* Make room for SIZE bytes in the connection's message buffer, taken
+   from its pool if it has one */
+void reserve_msg_buf(Conn *conn, size_t size) {
+  if (size <= conn->msg_cap)
+    return;
+  if (!conn->msg_buf && conn->pool && size <= MESSAGE_MAX_SIZE) {
+    MsgBufPool *pool = conn->pool;
+    conn->msg_buf = pool->count ? pool->bufs[--pool->count] : malloc(MESSAGE_MAX_SIZE);
+    assert(conn->msg_buf != 0);
+    conn->msg_cap = MESSAGE_MAX_SIZE;
+    return;
+  }
+  conn->msg_cap = size;
+  conn->msg_buf = realloc(conn->msg_buf, size);
+  assert(conn->msg_buf != 0);
+}
+
+/* Refuse the connection if a message of SIZE bytes exceeds its
+   limit, dropping the rest of the input from *POS up to END. Returns
+   TRUE if so. */
+bool refuse_msg_size(Conn *conn, MessageSize size, uint8_t **pos, uint8_t *end) {
+  if (size <= conn->max_msg_size)
+    return false;
+  conn->refused = true;
+  conn->bytes_received = 0;
+  conn->msg_size = 0;
+  *pos = end;
+  return true;
+}
+
+/*
+ * Consume bytes from *POS up to END until a message is complete,
+ * pointing *PAYLOAD at it (excluding its size) and storing its size in
+ * *SIZE. A message wholly within the input is returned in place.
+ * Otherwise it straddles reads, and is copied into the connection's
+ * message buffer as it arrives. Returns FALSE if the input runs out
+ * first, or if the message is over the connection's size limit, in
+ * which case the connection is marked refused.
+ */
+bool next_payload(Conn *conn, uint8_t **pos, uint8_t *end, uint8_t **payload,
+                  MessageSize *size) {
+  size_t avail = end - *pos;
+  size_t n;
+  if (conn->refused) {
+    *pos = end;
+    return false;
+  }
+  if (!conn->bytes_received && avail >= sizeof(MessageSize)) {
+    MessageSize msg_size = read_u32(*pos);
+    if (refuse_msg_size(conn, msg_size, pos, end))
+      return false;
+    if (avail - sizeof(MessageSize) >= msg_size) {
+      *payload = *pos + sizeof(MessageSize);
+      *size = msg_size;
+      *pos += sizeof(MessageSize) + msg_size;
+      return true;
+    }
+  }
+
+  if (conn->bytes_received < sizeof(MessageSize)) {
+    /* This logic handles where less than sizeof(MessageSize) bytes is
+       received by storing partial bytes in the buffer. */
+    reserve_msg_buf(conn, sizeof(MessageSize));
+    n = min(avail, sizeof(MessageSize) - conn->bytes_received);
+    memcpy(conn->msg_buf + conn->bytes_received, *pos, n);
+    conn->bytes_received += n;
+    *pos += n;
+    avail -= n;
+    if (conn->bytes_received < sizeof(MessageSize))
+      return false;
+    conn->msg_size = read_u32(conn->msg_buf);
+    if (refuse_msg_size(conn, conn->msg_size, pos, end))
+      return false;
+    reserve_msg_buf(conn, sizeof(MessageSize) + conn->msg_size);
+  }
+  size_t total = sizeof(MessageSize) + conn->msg_size;
+  n = min(avail, total - conn->bytes_received);
+  memcpy(conn->msg_buf + conn->bytes_received, *pos, n);
+  conn->bytes_received += n;
+  *pos += n;
+  if (conn->bytes_received < total)
+    return false;
+  *payload = conn->msg_buf + sizeof(MessageSize);
+  *size = conn->msg_size;
+  conn->bytes_received = 0;
+  conn->msg_size = 0;
+  return true;
+}
+
+/*
+ * Consume bytes from *POS up to END until a request is complete, and
+ * parse it into MSG without copying (see parse_request). MSG is valid
+ * until the next call or until the input is overwritten. Returns FALSE
+ * if the input runs out first, if the request is malformed, in which
+ * case it's skipped, or if it's too large (see next_payload).
+ */
+bool conn_next_msg(Conn *conn, uint8_t **pos, uint8_t *end, Message *msg) {
+  uint8_t *payload;
+  MessageSize size;
+  if (!next_payload(conn, pos, end, &payload, &size))
+    return false;
+  if (!parse_request(payload, size, msg)) {
+    error(0, 0, "Malformed request of type %d", size ? payload[0] : -1);
+    return false;
+  }
+  return true;
+}
+
+/* Return TRUE if a message straddling reads has been received in
+   full, so conn_next_msg() will return it without further input */
+bool conn_has_msg(Conn *conn) {
+  return conn->bytes_received >= sizeof(MessageSize)
+    && conn->bytes_received == sizeof(MessageSize) + conn->msg_size;
+}
+
+/*
+ * If a message is partly received and its size known, return where
+ * the rest of it goes in the message buffer, storing how many bytes
+ * remain in *LEN, and otherwise NULL. Input may be received there
+ * directly, rather than copied by conn_next_msg(), and reported with
+ * conn_msg_received().
+ */
+uint8_t *conn_msg_space(Conn *conn, size_t *len) {
+  if (conn->bytes_received < sizeof(MessageSize))
+    return NULL;
+  *len = sizeof(MessageSize) + conn->msg_size - conn->bytes_received;
+  return conn->msg_buf + conn->bytes_received;
+}
+
+void conn_msg_received(Conn *conn, size_t len) {
+  conn->bytes_received += len;
+}
+
+/* Give up the message buffer, returning it to the pool, unless a
+   message is partly received */
+void conn_release_msg_buf(Conn *conn) {
+  MsgBufPool *pool = conn->pool;
+  if (conn->bytes_received || !conn->msg_buf)
+    return;
+  if (pool && conn->msg_cap == MESSAGE_MAX_SIZE && pool->count < pool->max)
+    pool->bufs[pool->count++] = conn->msg_buf;
+  else
+    free(conn->msg_buf);
+  conn->msg_buf = NULL;
+  conn->msg_cap = 0;
+}
+
 /* Consume bytes from the network and deserialise into message,
-   handling partial input */
-/* TODO: test */
+   handling partial input. Returns NULL until a message is complete,
+   or for good if one is too large (see next_payload). */
 Message *
 out_recv_msg(Conn *conn, size_t buf_size, uint8_t *buf, size_t *bytes_read) {
-  size_t outstanding_bytes;
+  uint8_t *pos = buf;
+  uint8_t *payload;
+  MessageSize size;
   Message *msg = NULL;
-  if (conn->msg_size) {
-    outstanding_bytes = conn->msg_size - conn->bytes_received;
-    *bytes_read = min(buf_size, outstanding_bytes);
-    memcpy(conn->msg_buf + conn->bytes_received, buf, *bytes_read);
-    conn->bytes_received += *bytes_read;
-    assert(conn->bytes_received <= conn->msg_size);
-    if (conn->bytes_received == conn->msg_size) {
-      msg = out_deserialise_message(conn->msg_buf, conn->msg_size);
-      conn->msg_size = 0;
-      free(conn->msg_buf);
-      conn->msg_buf = NULL;
-      conn->bytes_received = 0;
+  if (next_payload(conn, &pos, buf + buf_size, &payload, &size))
+    msg = out_deserialise_message(payload, size);
+  *bytes_read = pos - buf;
+  return msg;
+}
+
+/* Append a segment to the connection's output */
+void push_seg(Conn *conn, size_t len, uint8_t *val, Shard *shard) {
+  if (conn->seg_count == conn->seg_cap && conn->seg_head) {
+    conn->seg_count -= conn->seg_head;
+    memmove(conn->segs, conn->segs + conn->seg_head, conn->seg_count * sizeof(OutSeg));
+    conn->seg_head = 0;
+  }
+  if (conn->seg_count == conn->seg_cap) {
+    conn->seg_cap = conn->seg_cap ? conn->seg_cap * 2 : 16;
+    conn->segs = realloc(conn->segs, conn->seg_cap * sizeof(OutSeg));
+    assert(conn->segs != 0);
+  }
+  OutSeg *seg = &conn->segs[conn->seg_count++];
+  seg->len = len;
+  seg->val = val;
+  seg->shard = shard;
+}
+
+bool has_segs(Conn *conn) {
+  return conn->seg_head < conn->seg_count;
+}
+
+/* Append SIZE bytes to the connection's output buffer, returning
+   where they are to be written */
+uint8_t *queue_bytes(Conn *conn, size_t size) {
+  if (conn->out_sent && conn->out_len + size > conn->out_cap) {
+    /* Reclaim the space already sent before growing */
+    conn->out_len -= conn->out_sent;
+    memmove(conn->out_buf, conn->out_buf + conn->out_sent, conn->out_len);
+    conn->out_sent = 0;
+  }
+  if (conn->out_len + size > conn->out_cap) {
+    conn->out_cap = (conn->out_len + size) * 2;
+    conn->out_buf = realloc(conn->out_buf, conn->out_cap);
+    assert(conn->out_buf != 0);
+  }
+  if (has_segs(conn)) {
+    OutSeg *last = &conn->segs[conn->seg_count - 1];
+    if (last->val)
+      push_seg(conn, size, NULL, NULL);
+    else
+      last->len += size;
+  }
+  uint8_t *buf = conn->out_buf + conn->out_len;
+  conn->out_len += size;
+  return buf;
+}
+
+/* Serialise MSG onto the end of the connection's output, to be sent
+   along with any other queued messages by conn_flush() */
+void conn_queue_msg(Conn *conn, Message *msg) {
+  serialise_message(msg, queue_bytes(conn, serialised_message_size(msg)));
+}
+
+/* Queue a GET_RESP for VAL, a value in SHARD's table referenced with
+   hash_table_ref_val(). The reference is dropped once sent. */
+void conn_queue_val(Conn *conn, Val *val, Shard *shard) {
+  bool had_segs = has_segs(conn);
+  serialise_get_resp_header(val, queue_bytes(conn, GET_RESP_HEADER_SIZE));
+  if (!had_segs) {
+    /* Switch to segments, starting with everything in OUT_BUF */
+    conn->seg_head = conn->seg_count = conn->seg_sent = 0;
+    push_seg(conn, conn->out_len - conn->out_sent, NULL, NULL);
+  }
+  push_seg(conn, val->val_size, val->val, shard);
+  conn->ref_bytes += val->val_size;
+}
+
+/* Send all queued output in one write (barring short sends), blocking
+   until it has gone. Returns -1 on failure, in which case the output
+   is discarded. Output must not include referenced values. */
+int conn_flush(Conn *conn) {
+  assert(!has_segs(conn));
+  size_t len = conn_pending(conn);
+  uint8_t *buf = conn->out_buf + conn->out_sent;
+  conn->out_len = conn->out_sent = 0;
+  if (!len)
+    return 0;
+  return send_all(conn->fd, buf, &len);
+}
+
+/* Mark N bytes of segmented output sent, dropping the references to
+   values sent in full */
+void consume_segs(Conn *conn, size_t n) {
+  while (n) {
+    OutSeg *seg = &conn->segs[conn->seg_head];
+    size_t k = min(n, seg->len - conn->seg_sent);
+    if (!seg->val)
+      conn->out_sent += k;
+    conn->seg_sent += k;
+    n -= k;
+    if (conn->seg_sent == seg->len) {
+      if (seg->val)
+        release_seg(conn, seg);
+      ++conn->seg_head;
+      conn->seg_sent = 0;
     }
-  } else {
-    /* No size information yet message */
-    if (!conn->bytes_received)
-      conn->msg_buf = malloc(sizeof(MessageSize));
-    /* This logic handles where less than sizeof(MessageSize) bytes is
-       received by storing partial bytes in the buffer. */
-    outstanding_bytes = sizeof(MessageSize) - conn->bytes_received;
-    *bytes_read = min(buf_size, outstanding_bytes);
-    memcpy(conn->msg_buf + conn->bytes_received, buf, *bytes_read);
-    conn->bytes_received += *bytes_read;
-    assert(conn->bytes_received <= sizeof(MessageSize));
-    if (conn->bytes_received == sizeof(MessageSize)) {
-      conn->msg_size = ntohl(((uint32_t *)conn->msg_buf)[0]);
-      conn->msg_buf = realloc(conn->msg_buf, conn->msg_size);
-      conn->bytes_received = 0;
+  }
+}
+
+/* Send segmented output, gathering up to CONN_IOV_MAX segments into
+   each sendmsg(). See conn_send. */
+int send_segs(Conn *conn) {
+  struct iovec iov[CONN_IOV_MAX];
+  struct msghdr hdr;
+  while (has_segs(conn)) {
+    size_t buf_pos = conn->out_sent;
+    size_t skip = conn->seg_sent;
+    size_t n_iov = 0;
+    for (size_t i = conn->seg_head; i < conn->seg_count && n_iov < CONN_IOV_MAX; i++) {
+      OutSeg *seg = &conn->segs[i];
+      if (seg->val)
+        iov[n_iov].iov_base = seg->val + skip;
+      else {
+        iov[n_iov].iov_base = conn->out_buf + buf_pos;
+        buf_pos += seg->len - skip;
+      }
+      iov[n_iov++].iov_len = seg->len - skip;
+      skip = 0;
     }
+    memset(&hdr, 0, sizeof hdr);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = n_iov;
+    ssize_t n = sendmsg(conn->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    }
+    consume_segs(conn, n);
   }
-  return msg;
+  conn->seg_head = conn->seg_count = 0;
+  conn->out_len = conn->out_sent = 0;
+  return 0;
+}
+
+/* Send as much queued output as the socket takes without blocking.
+   Returns 0 once everything has been sent, 1 if output remains, or
+   -1 on failure. */
+int conn_send(Conn *conn) {
+  if (has_segs(conn))
+    return send_segs(conn);
+  while (conn->out_sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out_buf + conn->out_sent,
+                     conn->out_len - conn->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    }
+    conn->out_sent += n;
+  }
+  conn->out_len = conn->out_sent = 0;
+  return 0;
+}
+
+/* Return the number of queued bytes not yet sent */
+size_t conn_pending(Conn *conn) {
+  return conn->out_len - conn->out_sent + conn->ref_bytes;
+}
+
+/* Keep LEN bytes of received input at BUF to handle later */
+void conn_stash_input(Conn *conn, uint8_t *buf, size_t len) {
+  conn->in_buf = realloc(conn->in_buf, conn->in_len + len);
+  assert(conn->in_buf != 0);
+  memcpy(conn->in_buf + conn->in_len, buf, len);
+  conn->in_len += len;
 }
 
 int send_all(int sockfd, uint8_t *buf, size_t *len) {
   size_t total = 0; // how many bytes we've sent
   size_t bytesleft = *len; // how many we have left to send
-  int n;
+  int n = 0;
 
   while(total < *len) {
     n = send(sockfd, buf + total, bytesleft, 0);
@@ -3,24 +3,139 @@
 
 #include "message.h"
 #include "hash_table.h"
+#include "shard.h"
 
-/* A client connection */
+/* GET values of at least this many bytes are sent by reference to the
+   table rather than copied, when a connection allows it */
+#define CONN_SHARE_VAL_MIN 1024
+
+/* Default largest message a connection receives. A larger one is
+   refused rather than buffered, as its size is the sender's to claim. */
+#define CONN_MAX_MSG_SIZE MGET_RESP_MAX_SIZE
+
+/* Segments passed to one sendmsg() */
+#define CONN_IOV_MAX 64
+
+/* A run of queued output: LEN bytes of the connection's output buffer,
+   or a value held in SHARD's table (see hash_table_ref_val) */
+typedef struct OutSeg {
+  size_t len;
+  uint8_t *val;               /* Referenced value bytes, or NULL */
+  Shard *shard;
+} OutSeg;
+
+/*
+ * Buffers for messages straddling reads, each MESSAGE_MAX_SIZE bytes
+ * and shared among one thread's connections. A connection only holds
+ * one while it has a message partly received, so idle connections
+ * cost no input memory. Not thread-safe.
+ */
+typedef struct MsgBufPool {
+  uint8_t **bufs;
+  size_t count;
+  size_t max;                 /* Free buffers kept */
+} MsgBufPool;
+
+/*
+ * A client connection. Queued output is normally just OUT_BUF. Once a
+ * value is queued by reference, the output is described by SEGS
+ * instead, in order, until it has all been sent; buffer segments
+ * cover OUT_BUF from OUT_SENT onwards.
+ */
 typedef struct Conn {
-  MessageSize msg_size;
-  uint8_t *msg_buf;
-  size_t bytes_received;      /* Running count of buffer allocated */
+  int fd;
+  MessageSize msg_size;       /* Size of the buffered message, once known */
+  uint8_t *msg_buf;           /* A message straddling reads, with its size */
+  size_t msg_cap;
+  MsgBufPool *pool;           /* Source of MSG_BUF, or NULL to allocate */
+  size_t max_msg_size;        /* Larger messages are refused */
+  size_t bytes_received;      /* Bytes of it buffered so far */
+  uint8_t *out_buf;           /* Serialised messages waiting to be sent */
+  size_t out_len;
+  size_t out_cap;
+  size_t out_sent;            /* Bytes at the front of OUT_BUF already sent */
+  bool read_paused;           /* Too much output queued to read requests */
+  uint8_t *in_buf;            /* Input received while paused, not yet handled */
+  size_t in_len;
+  bool write_wait;            /* Waiting for the socket to become writable */
+  bool share_vals;            /* Queue large GET values by reference */
+  OutSeg *segs;
+  size_t seg_count;
+  size_t seg_cap;
+  size_t seg_head;            /* First unsent segment */
+  size_t seg_sent;            /* Bytes of it already sent */
+  size_t ref_bytes;           /* Unsent bytes of referenced values */
+  bool refused;               /* Shut down by the server, or sent a message
+                                 over MAX_MSG_SIZE: input is dropped */
 } Conn;
 
+void
+init_msg_buf_pool(MsgBufPool *pool, size_t max);
+
+void
+free_msg_buf_pool(MsgBufPool *pool);
+
 void
 init_conn(Conn *conn);
 
+Conn *
+create_conn(int fd);
+
+void
+free_conn(Conn *take_conn);
+
+bool
+is_write(Message *msg);
+
 /* Handle message, returning response message */
 Message *
 out_handle_msg(Message *msg, HashTable *ht);
 
+Message *
+out_handle_shared_msg(Message *msg, ShardedTable *st);
+
+void
+conn_handle_msg(Conn *conn, Message *msg, HashTable *ht);
+
+void
+conn_handle_shared_msg(Conn *conn, Message *msg, ShardedTable *st);
+
+bool
+conn_next_msg(Conn *conn, uint8_t **pos, uint8_t *end, Message *msg);
+
+bool
+conn_has_msg(Conn *conn);
+
+uint8_t *
+conn_msg_space(Conn *conn, size_t *len);
+
+void
+conn_msg_received(Conn *conn, size_t len);
+
+void
+conn_release_msg_buf(Conn *conn);
+
 Message *
 out_recv_msg(Conn *conn, size_t buf_size, uint8_t *buf, size_t *bytes_read);
 
+void
+conn_queue_msg(Conn *conn, Message *msg);
+
+void
+conn_queue_val(Conn *conn, Val *val, Shard *shard);
+
+int
+conn_flush(Conn *conn);
+
+int
+conn_send(Conn *conn);
+
+size_t
+conn_pending(Conn *conn);
+
+void
+conn_stash_input(Conn *conn, uint8_t *buf, size_t len);
+
 int
 send_all(int socketfd, uint8_t *buf, size_t *len);
 
@@ -0,0 +1,98 @@
+/*
+ * Key hashing. hash_bytes is in the style of wyhash: the input is
+ * read 8 or 4 bytes at a time and each pair of words folded in with a
+ * single 64x64->128-bit multiply, so short keys cost a couple of
+ * multiplies rather than a dependent step per byte. Every output bit
+ * depends on every input bit, so callers may take different bit
+ * ranges of one hash for independent purposes (shard, bucket,
+ * fingerprint).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/random.h>
+#include "hash.h"
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+uint64_t hash_seed = 0;
+
+/* Multiply A and B, folding the 128-bit product into 64 bits */
+uint64_t hash_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+uint64_t read_le64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return le64toh(v);
+}
+
+uint64_t read_le32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return le32toh(v);
+}
+
+/* Hash LEN bytes at BUF with SEED */
+uint64_t hash_bytes(const uint8_t *buf, size_t len, uint64_t seed) {
+  uint64_t a, b;
+  seed ^= hash_mix(seed ^ HASH_P0, HASH_P1);
+  if (len <= 16) {
+    if (len >= 4) {
+      /* Two possibly overlapping reads from each end cover 4-16 bytes */
+      size_t off = (len >> 3) << 2;
+      a = read_le32(buf) << 32 | read_le32(buf + off);
+      b = read_le32(buf + len - 4) << 32 | read_le32(buf + len - 4 - off);
+    } else if (len > 0) {
+      a = (uint64_t)buf[0] << 16 | (uint64_t)buf[len >> 1] << 8 | buf[len - 1];
+      b = 0;
+    } else
+      a = b = 0;
+  } else {
+    size_t i = len;
+    const uint8_t *p = buf;
+    while (i > 16) {
+      /* The seed goes into both words, so no input can zero one
+         without knowing it */
+      seed = hash_mix(read_le64(p) ^ HASH_P1 ^ seed, read_le64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = read_le64(p + i - 16);
+    b = read_le64(p + i - 8);
+  }
+  __uint128_t r = (__uint128_t)(a ^ HASH_P1) * (b ^ seed);
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return hash_mix(a ^ HASH_P0 ^ len, b ^ HASH_P2);
+}
+
+/*
+ * djb2 hash (see http://www.cse.yorku.ca/~oz/hash.html), the original
+ * key hash, kept for comparison in benchmarks
+ */
+uint64_t djb2_hash(const uint8_t *buf, size_t len) {
+  uint64_t hash = 5381;
+  for (size_t i = 0; i < len; i++)
+    hash = ((hash << 5) + hash) + buf[i]; /* hash * 33 + buf[i] */
+  return hash;
+}
+
+void hash_set_seed(uint64_t seed) {
+  hash_seed = seed;
+}
+
+/* Set a random seed. Returns -1, setting errno, on failure. */
+int hash_seed_random(void) {
+  uint64_t seed;
+  if (getrandom(&seed, sizeof seed, 0) != sizeof seed)
+    return -1;
+  hash_set_seed(seed);
+  return 0;
+}
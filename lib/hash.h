@@ -0,0 +1,23 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Seed mixed into every key hash. Fixed by default so that results
+ * are reproducible; a server picks a random one at startup (see
+ * hash_seed_random) so that clients can't predict which keys collide.
+ * Must not change while any table holds entries.
+ */
+extern uint64_t hash_seed;
+
+uint64_t hash_bytes(const uint8_t *buf, size_t len, uint64_t seed);
+
+uint64_t djb2_hash(const uint8_t *buf, size_t len);
+
+void hash_set_seed(uint64_t seed);
+
+int hash_seed_random(void);
+
+#endif
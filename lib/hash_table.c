@@ -1,6 +1,10 @@
 /*
- * Hash table implementation. The array size of the hash table is
- * fixed. Not thread-safe.
+ * Hash table implementation. The bucket array is resized
+ * incrementally as the load factor changes (see HashTable). Not
+ * thread-safe.
+ *
+ * This file implements ENGINE_CHAINED and dispatches to open_table.c
+ * for ENGINE_OPEN and mapped_table.c for ENGINE_MAPPED.
  */
 
 #include <stdint.h>
@@ -9,7 +13,23 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "hash_table.h"
+#include "open_table.h"
+#include "mapped_table.h"
+#include "hash.h"
+
+/* Grow when there are more than HT_MAX_LOAD items per bucket */
+#define HT_MAX_LOAD 1
+/* Shrink when there are fewer than one item per HT_MIN_LOAD_INV buckets */
+#define HT_MIN_LOAD_INV 8
+/* Non-empty buckets migrated per operation during a resize */
+#define HT_REHASH_STEP 4
+/* Bound on empty buckets skipped per operation during a resize */
+#define HT_REHASH_EMPTY_VISITS (HT_REHASH_STEP * 10)
+/* Slab pages are sized for at least this many to fit in the memory
+   limit */
+#define HT_LIMIT_PAGES 16
 
 /* Create a new Key by copying the given buffer */
 Key *create_key(KeySize size, uint8_t *buf) {
@@ -51,69 +71,585 @@ size_t val_size(Val *val) {
   return sizeof(val->val_size) + val->val_size;
 }
 
-void free_list(List *take_elem) {
-  free_key(take_elem->key);
-  free_val(take_elem->val);
-  free(take_elem);
+/* Inline value capacity reserved for a value of SIZE bytes. Rounded
+   up so that small changes in size can be written in place. */
+uint8_t inline_cap(ValSize size) {
+  return size > INLINE_VAL_MAX ? 0 : (size + 7) & ~7;
+}
+
+uint8_t *inline_val(Entry *entry) {
+  return entry->data + entry->key_size;
+}
+
+/* Values are inline exactly when they fit in VAL_CAP */
+bool val_is_inline(Entry *entry) {
+  return entry->val.val_size <= entry->val_cap;
+}
+
+/* Bytes allocated for an entry */
+size_t entry_alloc_size(KeySize key_size, uint8_t val_cap) {
+  return sizeof(Entry) + key_size + val_cap;
+}
+
+/* Set in the first word of a ValBuf. An Entry's first word is an
+   aligned pointer, so the two can be told apart when every chunk of a
+   slab page is evicted (see evict_chunk). */
+#define VAL_BUF_TAG ((uintptr_t)1)
+
+/* Header of an out-of-line value buffer, see hash_table_ref_val */
+typedef struct ValBuf {
+  uintptr_t owner;              /* Holding Entry, or NULL, | VAL_BUF_TAG */
+  uint32_t refs;
+  ValSize size;
+  uint8_t data[];
+} ValBuf;
+
+ValBuf *val_buf(uint8_t *val) {
+  return (ValBuf *)(val - offsetof(ValBuf, data));
+}
+
+uint8_t *alloc_val_buf(Slab *slab, ValSize size, Entry *owner) {
+  ValBuf *buf = slab_alloc(slab, sizeof(ValBuf) + size);
+  buf->owner = (uintptr_t)owner | VAL_BUF_TAG;
+  buf->refs = 0;
+  buf->size = size;
+  return buf->data;
+}
+
+/* Return TRUE if no entry holds BUF any more */
+bool val_buf_detached(ValBuf *buf) {
+  return buf->owner == VAL_BUF_TAG;
+}
+
+/* Release an entry's hold on an out-of-line value. Referenced buffers
+   are freed by the last hash_table_unref_val instead. */
+void free_val_buf(Slab *slab, uint8_t *val) {
+  ValBuf *buf = val_buf(val);
+  if (buf->refs)
+    buf->owner = VAL_BUF_TAG;
+  else
+    slab_free(slab, buf, sizeof(ValBuf) + buf->size);
+}
+
+/* Create a new Entry in SLAB by copying KEY and VAL. Values no larger
+   than INLINE_VAL_MAX share the entry's allocation. */
+Entry *create_entry(Slab *slab, Key *key, Val *val) {
+  uint8_t cap = inline_cap(val->val_size);
+  Entry *entry = slab_alloc(slab, entry_alloc_size(key->key_size, cap));
+  entry->next = NULL;
+  entry->timer_next = NULL;
+  entry->timer_pprev = NULL;
+  entry->expires_at = 0;
+  entry->flags = ENTRY_REFERENCED;
+  entry->key_size = key->key_size;
+  entry->val_cap = cap;
+  memcpy(entry->data, key->key, key->key_size);
+  entry->val.val_size = val->val_size;
+  if (val_is_inline(entry))
+    entry->val.val = inline_val(entry);
+  else
+    entry->val.val = alloc_val_buf(slab, val->val_size, entry);
+  memcpy(entry->val.val, val->val, val->val_size);
+  return entry;
 }
 
 /*
- * djb2 hash (see http://www.cse.yorku.ca/~oz/hash.html)
+ * Replace the value of an entry by copying VAL. The entry may need to
+ * be reallocated to grow its inline storage, so the returned pointer
+ * must replace TAKE_ENTRY wherever it is referenced. An out-of-line
+ * value buffer is only written in place while no references to it
+ * are held.
  */
-unsigned long hash(Key *key) {
-  unsigned long hash = 5381;
-  for (unsigned int i = 0; i < key->key_size; i++)
-    hash = ((hash << 5) + hash) + key->key[i]; /* hash * 33 + key->key[i] */
-  return hash;
+Entry *entry_set_val(Slab *slab, Entry *take_entry, Val *val) {
+  Entry *entry = take_entry;
+  bool was_inline = val_is_inline(entry);
+  if (val->val_size <= INLINE_VAL_MAX) {
+    if (!was_inline)
+      free_val_buf(slab, entry->val.val);
+    if (val->val_size > entry->val_cap) {
+      uint8_t cap = inline_cap(val->val_size);
+      entry = slab_realloc(slab, entry,
+                           entry_alloc_size(entry->key_size, entry->val_cap),
+                           entry_alloc_size(entry->key_size, cap));
+      entry->val_cap = cap;
+      if (entry != take_entry && timer_wheel_is_linked(entry))
+        timer_wheel_moved(entry);
+    }
+    entry->val.val = inline_val(entry);
+  } else if (was_inline
+             || val_buf(entry->val.val)->refs
+             || !slab_same_class(slab, sizeof(ValBuf) + entry->val.val_size,
+                                 sizeof(ValBuf) + val->val_size)) {
+    /* Out of line, reusing the existing buffer if large enough */
+    if (!was_inline)
+      free_val_buf(slab, entry->val.val);
+    entry->val.val = alloc_val_buf(slab, val->val_size, entry);
+  } else
+    val_buf(entry->val.val)->size = val->val_size;
+  entry->val.val_size = val->val_size;
+  memcpy(entry->val.val, val->val, val->val_size);
+  return entry;
 }
 
-/* Construct a new hash table of fixed size SIZE. */
+/* Return a Key referencing the entry's key bytes */
+Key entry_key(Entry *entry) {
+  Key key = { .key_size = entry->key_size, .key = entry->data };
+  return key;
+}
+
+bool entry_has_key(Entry *entry, Key *key) {
+  return entry->key_size == key->key_size
+    && !memcmp(entry->data, key->key, key->key_size);
+}
+
+/* Expire ENTRY TTL seconds from now, or never if TTL is zero */
+void entry_set_ttl(HashTable *ht, Entry *entry, uint32_t ttl) {
+  if (timer_wheel_is_linked(entry))
+    timer_wheel_remove(&ht->wheel, entry);
+  entry->expires_at = 0;
+  if (ttl) {
+    entry->expires_at = ht->now > UINT32_MAX - ttl ? UINT32_MAX : ht->now + ttl;
+    timer_wheel_add(&ht->wheel, entry);
+  }
+}
+
+bool entry_is_expired(HashTable *ht, Entry *entry) {
+  return entry->expires_at && entry->expires_at <= ht->now;
+}
+
+/* Free an entry which has been unlinked from the table */
+void drop_entry(HashTable *ht, Entry *take_entry) {
+  if (timer_wheel_is_linked(take_entry))
+    timer_wheel_remove(&ht->wheel, take_entry);
+  free_entry(&ht->slab, take_entry);
+}
+
+void free_entry(Slab *slab, Entry *take_entry) {
+  if (!val_is_inline(take_entry))
+    free_val_buf(slab, take_entry->val.val);
+  slab_free(slab, take_entry, entry_alloc_size(take_entry->key_size, take_entry->val_cap));
+}
+
+/* Hash KEY with the process-wide seed (see hash.h) */
+uint64_t hash(Key *key) {
+  return hash_bytes(key->key, key->key_size, hash_seed);
+}
+
+/* Construct a new chained hash table with SIZE initial buckets. The
+   table never shrinks below SIZE. */
 HashTable *create_hash_table(unsigned int size) {
-  List **arr = malloc(sizeof(List *) * size);
-  assert(arr != 0);
-  memset(arr, 0, size);
-  HashTable *ht = malloc(sizeof(HashTable));
+  return create_hash_table_engine(ENGINE_CHAINED, size);
+}
+
+/* Construct a new hash table using ENGINE. SIZE is the initial bucket
+   count (ENGINE_CHAINED) or a lower bound on the slot count
+   (ENGINE_OPEN). ENGINE_MAPPED tables are opened with
+   open_mapped_hash_table instead. */
+HashTable *create_hash_table_engine(HashTableEngine engine, unsigned int size) {
+  assert(size > 0);
+  assert(engine != ENGINE_MAPPED);
+  HashTable *ht = calloc(1, sizeof(HashTable));
   assert(ht != 0);
-  ht->size = size;
+  ht->engine = engine;
+  init_slab(&ht->slab);
+  init_timer_wheel(&ht->wheel);
   ht->item_count = 0;
-  ht->arr = arr;
+  ht->old_size = 0;
+  ht->rehash_idx = 0;
+  switch (engine) {
+  case ENGINE_CHAINED:
+    ht->arr = calloc(size, sizeof(Entry *));
+    assert(ht->arr != 0);
+    ht->size = size;
+    ht->min_size = size;
+    break;
+  case ENGINE_OPEN:
+    open_table_init(ht, size);
+    break;
+  }
   return ht;
 }
 
+/* Release an entry's out-of-line value, for free_hash_table */
+int free_entry_val(Entry *entry, void *arg) {
+  HashTable *ht = arg;
+  if (!val_is_inline(entry))
+    free_val_buf(&ht->slab, entry->val.val);
+  return 0;
+}
+
+/* Free a table made by create_hash_table_engine and everything stored
+   in it. Values must no longer be referenced. Entries live in the
+   slab's pages, so only values too large for the slab are freed one by
+   one. */
+void free_hash_table(HashTable *take_ht) {
+  assert(take_ht->engine != ENGINE_MAPPED);
+  hash_table_for_each(take_ht, free_entry_val, take_ht);
+  free(take_ht->arr);
+  free(take_ht->old_arr);
+  free(take_ht->ctrl);
+  free(take_ht->slots);
+  free(take_ht->old_ctrl);
+  free(take_ht->old_slots);
+  free_slab(&take_ht->slab);
+  free(take_ht);
+}
+
+/* Parse an engine name as given on the command line. Returns FALSE if
+   NAME is not recognised. */
+bool parse_hash_table_engine(const char *name, HashTableEngine *engine) {
+  if (!strcmp(name, "chained"))
+    *engine = ENGINE_CHAINED;
+  else if (!strcmp(name, "open"))
+    *engine = ENGINE_OPEN;
+  else
+    return false;
+  return true;
+}
+
+bool hash_table_is_resizing(HashTable *ht) {
+  return ht->old_size != 0;
+}
+
+/* Begin migrating entries into a new bucket array of NEW_SIZE. */
+void start_resize(HashTable *ht, unsigned int new_size) {
+  Entry **arr = calloc(new_size, sizeof(Entry *));
+  assert(arr != 0);
+  ht->old_arr = ht->arr;
+  ht->old_size = ht->size;
+  ht->rehash_idx = 0;
+  ht->arr = arr;
+  ht->size = new_size;
+}
+
+/* Move a bounded number of buckets from OLD_ARR to ARR, finishing the
+   resize once every old bucket is empty. */
+void rehash_step(HashTable *ht) {
+  unsigned int moved = 0;
+  unsigned int visits = 0;
+  while (ht->rehash_idx < ht->old_size
+         && moved < HT_REHASH_STEP
+         && visits < HT_REHASH_EMPTY_VISITS) {
+    Entry *elem = ht->old_arr[ht->rehash_idx];
+    if (elem) {
+      while (elem) {
+        Entry *next = elem->next;
+        Key key = entry_key(elem);
+        Entry **dst = &ht->arr[hash(&key) % ht->size];
+        elem->next = *dst;
+        *dst = elem;
+        elem = next;
+      }
+      ht->old_arr[ht->rehash_idx] = NULL;
+      ++moved;
+    } else
+      ++visits;
+    ++ht->rehash_idx;
+  }
+  if (ht->rehash_idx == ht->old_size) {
+    free(ht->old_arr);
+    ht->old_arr = NULL;
+    ht->old_size = 0;
+    ht->rehash_idx = 0;
+  }
+}
+
+/* Advance any resize in progress, or start one if the load factor is
+   out of bounds. Called at the start of every operation. */
+void maintain(HashTable *ht) {
+  if (ht->old_arr)
+    rehash_step(ht);
+  else if (ht->item_count > ht->size * HT_MAX_LOAD)
+    start_resize(ht, ht->size * 2);
+  else if (ht->size / 2 >= ht->min_size
+           && ht->item_count < ht->size / HT_MIN_LOAD_INV)
+    start_resize(ht, ht->size / 2);
+}
+
+/* Return the bucket currently holding entries with hash H. Old
+   buckets at or past REHASH_IDX have not been migrated, so their
+   entries (and any new entries hashing to them) live there. */
+Entry **bucket(HashTable *ht, uint64_t h) {
+  if (ht->old_arr) {
+    unsigned int i = h % ht->old_size;
+    if (i >= ht->rehash_idx)
+      return &ht->old_arr[i];
+  }
+  return &ht->arr[h % ht->size];
+}
+
 bool cmp_keys(Key *key, Key *other) {
   return key->key_size == other->key_size && !memcmp(key->key, other->key, key->key_size);
 }
 
-/*
- * Store a value for the given key in a hash table. The key and value
- * pointers are COPIED.
- *
- * Returns FALSE if new entry added, TRUE if existing entry updated.
- */
-bool hash_table_put(HashTable *ht, Key *key, Val *val) {
-  List **ptr = &ht->arr[hash(key) % ht->size];
-  List *elem;
+/* Store a value in a chained table, see hash_table_put_hashed */
+bool chained_put(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h) {
+  maintain(ht);
+  Entry **ptr = bucket(ht, h);
+  Entry *elem;
   while (elem = *ptr) {
-    if (cmp_keys(key, elem->key)) {
-      /* Update existing elem */
-      /* Free existing key if different instance from current */
-      free_val(elem->val);
-      elem->val = create_val(val->val_size, val->val);
-      return 1;
+    if (entry_has_key(elem, key)) {
+      /* Update existing elem, which may move. An expired elem is
+         reused, but reported as a new entry. */
+      bool expired = entry_is_expired(ht, elem);
+      elem = *ptr = entry_set_val(&ht->slab, elem, val);
+      elem->flags |= ENTRY_REFERENCED;
+      entry_set_ttl(ht, elem, ttl);
+      ht->expirations += expired;
+      return !expired;
     }
     ptr = &(*ptr)->next;
   }
-  /* Append new list item */
-  elem = malloc(sizeof(List));
-  assert(elem != 0);
-  elem->next = 0;
-  elem->key = create_key(key->key_size, key->key);
-  elem->val = create_val(val->val_size, val->val);
-  *ptr = elem;
+  /* Append new entry */
+  elem = *ptr = create_entry(&ht->slab, key, val);
+  entry_set_ttl(ht, elem, ttl);
   ++ht->item_count;
   return 0;
 }
 
+Val *chained_get(HashTable *ht, Key *key, uint64_t h) {
+  maintain(ht);
+  Entry **ptr = bucket(ht, h);
+  Entry *elem;
+  while (elem = *ptr) {
+    if (entry_has_key(elem, key)) {
+      if (entry_is_expired(ht, elem)) {
+        *ptr = elem->next;
+        drop_entry(ht, elem);
+        --ht->item_count;
+        ++ht->expirations;
+        return NULL;
+      }
+      elem->flags |= ENTRY_REFERENCED;
+      return &elem->val;
+    }
+    ptr = &(*ptr)->next;
+  }
+  return NULL;
+}
+
+int chained_delete(HashTable *ht, Key *key, uint64_t h) {
+ maintain(ht);
+ Entry **ptr = bucket(ht, h);
+ Entry *elem;
+ while (elem = *ptr) {
+   if (entry_has_key(elem, key)) {
+     bool expired = entry_is_expired(ht, elem);
+     *ptr = elem->next;
+     drop_entry(ht, elem);
+     --ht->item_count;
+     ht->expirations += expired;
+     return expired;
+   }
+   ptr = &(*ptr)->next;
+ }
+ return 1;
+}
+
+/* Return the bucket at position POS of the clock sweep, which covers
+   the old array (if resizing) followed by the current one. */
+Entry **clock_bucket(HashTable *ht, unsigned int pos) {
+  if (pos < ht->old_size)
+    return &ht->old_arr[pos];
+  return &ht->arr[pos - ht->old_size];
+}
+
+/* Evict one entry from a non-empty chained table, see evict_one */
+void chained_evict(HashTable *ht) {
+  for (;;) {
+    ht->clock_hand %= ht->old_size + ht->size;
+    Entry **ptr = clock_bucket(ht, ht->clock_hand);
+    Entry *elem;
+    while (elem = *ptr) {
+      if (elem->flags & ENTRY_REFERENCED) {
+        elem->flags &= ~ENTRY_REFERENCED;
+      } else {
+        *ptr = elem->next;
+        drop_entry(ht, elem);
+        --ht->item_count;
+        return;
+      }
+      ptr = &(*ptr)->next;
+    }
+    ++ht->clock_hand;
+  }
+}
+
+/*
+ * Evict one entry using the CLOCK algorithm: the hand sweeps the
+ * table, clearing the referenced bit of each entry it passes and
+ * evicting the first entry found without it. Entries are marked
+ * referenced when written or read, so reads never reorder anything.
+ */
+void evict_one(HashTable *ht) {
+  assert(ht->item_count > 0);
+  if (ht->engine == ENGINE_OPEN)
+    open_table_evict(ht);
+  else if (ht->engine == ENGINE_MAPPED)
+    mapped_table_evict(ht);
+  else
+    chained_evict(ht);
+  ++ht->evictions;
+}
+
+/* Return the link to ENTRY from its bucket chain or slot */
+Entry **entry_ref(HashTable *ht, Entry *entry) {
+  Key key = entry_key(entry);
+  uint64_t h = hash(&key);
+  if (ht->engine == ENGINE_OPEN)
+    return open_table_ref(ht, &key, h);
+  Entry **ptr = bucket(ht, h);
+  while (*ptr != entry)
+    ptr = &(*ptr)->next;
+  return ptr;
+}
+
+/* Move CHUNK, from a slab page being reclaimed, to another chunk of
+   its class (see slab_reclaim_page). Value buffers still referenced
+   by readers stay where they are. */
+void move_chunk(void *chunk, void *arg) {
+  HashTable *ht = arg;
+  uintptr_t first = *(uintptr_t *)chunk;
+  if (first & VAL_BUF_TAG) {
+    ValBuf *buf = chunk;
+    Entry *entry = (Entry *)(first & ~VAL_BUF_TAG);
+    if (!entry || buf->refs)
+      return;
+    size_t size = sizeof(ValBuf) + buf->size;
+    ValBuf *copy = slab_alloc(&ht->slab, size);
+    memcpy(copy, buf, size);
+    entry->val.val = copy->data;
+    slab_free(&ht->slab, buf, size);
+    return;
+  }
+  Entry *entry = chunk;
+  size_t size = entry_alloc_size(entry->key_size, entry->val_cap);
+  Entry *copy = slab_alloc(&ht->slab, size);
+  memcpy(copy, entry, size);
+  *entry_ref(ht, entry) = copy;
+  if (val_is_inline(copy))
+    copy->val.val = inline_val(copy);
+  else
+    val_buf(copy->val.val)->owner = (uintptr_t)copy | VAL_BUF_TAG;
+  if (timer_wheel_is_linked(copy))
+    timer_wheel_moved(copy);
+  slab_free(&ht->slab, entry, size);
+}
+
+/*
+ * Free some memory. A size class left with a page's worth of chunks
+ * free, as happens when the sizes being stored shift away from it,
+ * gives up its emptiest page, whose chunks are moved to the class's
+ * other pages; otherwise one entry is evicted by CLOCK.
+ */
+void reclaim(HashTable *ht) {
+  if (ht->engine == ENGINE_MAPPED) {
+    if (!mapped_table_reclaim_page(ht))
+      evict_one(ht);
+    return;
+  }
+  SlabPage *page = slab_reclaimable_page(&ht->slab);
+  if (!page || !slab_reclaim_page(&ht->slab, page, move_chunk, ht))
+    evict_one(ht);
+}
+
+/*
+ * Before storing KEY and VAL, free memory until the chunks they need
+ * can be allocated within the limit. A class with no chunk free only
+ * takes another page when the limit allows it, so at the limit the
+ * entries evicted make room in the class that is short.
+ */
+void make_room(HashTable *ht, Key *key, Val *val) {
+  if (!ht->mem_limit)
+    return;
+  size_t sizes[] = {
+    entry_alloc_size(key->key_size, inline_cap(val->val_size)),
+    sizeof(ValBuf) + val->val_size
+  };
+  unsigned int count = val->val_size > INLINE_VAL_MAX ? 2 : 1;
+  size_t growth;
+  while (ht->item_count
+         && (growth = ht->engine == ENGINE_MAPPED ? mapped_table_growth(ht, key, val)
+             : slab_growth(&ht->slab, sizes, count))
+         && hash_table_mem_used(ht) + growth > ht->mem_limit)
+    reclaim(ht);
+}
+
+/* Free memory until the table is within its limit */
+void enforce_mem_limit(HashTable *ht) {
+  if (!ht->mem_limit)
+    return;
+  while (hash_table_mem_used(ht) > ht->mem_limit) {
+    if (ht->engine != ENGINE_MAPPED && ht->slab.spare)
+      slab_release_spare(&ht->slab);
+    else if (ht->item_count)
+      reclaim(ht);
+    else
+      break;
+  }
+}
+
+/*
+ * Return bytes used by the table: slab pages held for entries and
+ * values, whether or not their chunks are in use, and oversized
+ * values, plus the bucket or slot arrays.
+ */
+size_t hash_table_mem_used(HashTable *ht) {
+  if (ht->engine == ENGINE_MAPPED)
+    return mapped_table_mem_used(ht);
+  size_t slot_bytes = ht->engine == ENGINE_OPEN
+    ? sizeof(Entry *) + sizeof(uint8_t) : sizeof(Entry *);
+  return slab_total_bytes(&ht->slab)
+    + (size_t)(ht->size + ht->old_size) * slot_bytes;
+}
+
+/*
+ * Limit memory used by the table to LIMIT bytes (0 for no limit),
+ * evicting least recently used entries once it is exceeded. While the
+ * table is empty, its slab pages are also sized to a fraction of the
+ * limit, so that pages assigned to one size class are a small part of
+ * it.
+ */
+void hash_table_set_mem_limit(HashTable *ht, size_t limit) {
+  ht->mem_limit = limit;
+  if (ht->engine == ENGINE_MAPPED) {
+    mapped_table_set_mem_limit(ht, limit);
+  } else if (limit) {
+    size_t page_size = SLAB_PAGE_SIZE;
+    while (page_size > SLAB_MIN_PAGE_SIZE && page_size > limit / HT_LIMIT_PAGES)
+      page_size /= 2;
+    slab_set_page_size(&ht->slab, page_size);
+  }
+  enforce_mem_limit(ht);
+}
+
+/*
+ * Store a value for the given key in a hash table, expiring TTL
+ * seconds after the table's current time (or never, if TTL is
+ * zero). The key and value pointers are COPIED. Entries are evicted
+ * as needed to keep the table within its memory limit.
+ *
+ * Returns FALSE if new entry added, TRUE if existing entry updated.
+ */
+bool hash_table_put_ttl(HashTable *ht, Key *key, Val *val, uint32_t ttl) {
+  return hash_table_put_hashed(ht, key, val, ttl, hash(key));
+}
+
+/* As hash_table_put_ttl, for a key whose hash(), H, is already known */
+bool hash_table_put_hashed(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h) {
+  make_room(ht, key, val);
+  bool is_update = ht->engine == ENGINE_OPEN ? open_table_put(ht, key, val, ttl, h)
+    : ht->engine == ENGINE_MAPPED ? mapped_table_put(ht, key, val, ttl, h)
+    : chained_put(ht, key, val, ttl, h);
+  enforce_mem_limit(ht);
+  return is_update;
+}
+
+/* Store a value which never expires, see hash_table_put_ttl */
+bool hash_table_put(HashTable *ht, Key *key, Val *val) {
+  return hash_table_put_ttl(ht, key, val, 0);
+}
+
 /*
  * Fetch pointer to value for a given key. This is a pointer to the
  * data stored in the hash table, so must be copied if modification is
@@ -122,14 +658,42 @@ bool hash_table_put(HashTable *ht, Key *key, Val *val) {
  * Returns NULL if nothing found.
  */
 Val *hash_table_get(HashTable *ht, Key *key) {
-  List **ptr = &ht->arr[hash(key) % ht->size];
-  List *elem;
-  while (elem = *ptr) {
-    if (cmp_keys(key, elem->key))
-      return elem->val;
-    ptr = &(*ptr)->next;
-  }
-  return NULL;
+  return hash_table_get_hashed(ht, key, hash(key));
+}
+
+/* As hash_table_get, for a key whose hash(), H, is already known */
+Val *hash_table_get_hashed(HashTable *ht, Key *key, uint64_t h) {
+  if (ht->engine == ENGINE_OPEN)
+    return open_table_get(ht, key, h);
+  if (ht->engine == ENGINE_MAPPED)
+    return mapped_table_get(ht, key, h);
+  return chained_get(ht, key, h);
+}
+
+/*
+ * Take a reference to VAL, as returned by hash_table_get, so that its
+ * bytes stay valid after the table lock is dropped, even if the key
+ * is overwritten, deleted, expired or evicted meanwhile. Only values
+ * larger than INLINE_VAL_MAX are held apart from their entry and can
+ * be referenced, and none in an ENGINE_MAPPED table; returns FALSE
+ * for others, which must be copied.
+ *
+ * Each reference must be dropped with hash_table_unref_val, under the
+ * same locking as other calls on HT.
+ */
+bool hash_table_ref_val(HashTable *ht, Val *val) {
+  if (val->val_size <= INLINE_VAL_MAX || ht->engine == ENGINE_MAPPED)
+    return false;
+  ++val_buf(val->val)->refs;
+  return true;
+}
+
+/* Drop a reference taken by hash_table_ref_val on the value bytes VAL */
+void hash_table_unref_val(HashTable *ht, uint8_t *val) {
+  ValBuf *buf = val_buf(val);
+  assert(buf->refs > 0);
+  if (!--buf->refs && val_buf_detached(buf))
+    slab_free(&ht->slab, buf, sizeof(ValBuf) + buf->size);
 }
 
 /*
@@ -138,16 +702,112 @@ Val *hash_table_get(HashTable *ht, Key *key) {
  * Returns 0 on success, 1 if no elem deleted.
  */
 int hash_table_delete(HashTable *ht, Key *key) {
- List **ptr = &ht->arr[hash(key) % ht->size];
- List *elem;
- while (elem = *ptr) {
-   if (cmp_keys(key, elem->key)) {
-     *ptr = elem->next;
-     free_list(elem);
-     --ht->item_count;
-     return 0;
-   }
-   ptr = &(*ptr)->next;
- }
- return 1;
+  return hash_table_delete_hashed(ht, key, hash(key));
+}
+
+/* As hash_table_delete, for a key whose hash(), H, is already known */
+int hash_table_delete_hashed(HashTable *ht, Key *key, uint64_t h) {
+  if (ht->engine == ENGINE_OPEN)
+    return open_table_delete(ht, key, h);
+  if (ht->engine == ENGINE_MAPPED)
+    return mapped_table_delete(ht, key, h);
+  return chained_delete(ht, key, h);
+}
+
+/*
+ * Call FN with each entry of HT and ARG, in no particular order,
+ * stopping early if FN returns non-zero. Returns the last value FN
+ * returned, or zero if HT is empty. FN must not modify the table.
+ * Expired entries not yet reaped are included.
+ */
+int hash_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg) {
+  int ret;
+  if (ht->engine == ENGINE_OPEN)
+    return open_table_for_each(ht, fn, arg);
+  if (ht->engine == ENGINE_MAPPED)
+    return mapped_table_for_each(ht, fn, arg);
+  for (unsigned int i = 0; i < ht->old_size + ht->size; i++)
+    for (Entry *elem = *clock_bucket(ht, i); elem; elem = elem->next)
+      if ((ret = fn(elem, arg)))
+        return ret;
+  return 0;
+}
+
+/*
+ * Size an empty table to hold COUNT entries without resizing, as
+ * before a bulk load, raising the size it never shrinks below to
+ * match. Does nothing if the table holds entries or is resizing.
+ */
+void hash_table_reserve(HashTable *ht, unsigned int count) {
+  if (ht->item_count || ht->old_size)
+    return;
+  if (ht->engine == ENGINE_OPEN) {
+    open_table_reserve(ht, count);
+    return;
+  }
+  if (ht->engine == ENGINE_MAPPED) {
+    mapped_table_reserve(ht, count);
+    return;
+  }
+  unsigned int size = ht->size;
+  while ((unsigned long)size * HT_MAX_LOAD < count)
+    size *= 2;
+  if (size == ht->size)
+    return;
+  free(ht->arr);
+  ht->arr = calloc(size, sizeof(Entry *));
+  assert(ht->arr != 0);
+  ht->size = ht->min_size = size;
+}
+
+/*
+ * Set the table's notion of the current time in seconds. Entries
+ * which expire at or before NOW are treated as absent, and are freed
+ * when next accessed or by hash_table_expire.
+ */
+void hash_table_set_time(HashTable *ht, uint32_t now) {
+  ht->now = now;
+}
+
+/* Flush a table's contents to where they persist, if they do (see
+   mapped_table_sync); a no-op for tables held only in memory */
+void hash_table_sync(HashTable *ht) {
+  if (ht->engine == ENGINE_MAPPED)
+    mapped_table_sync(ht);
+}
+
+/*
+ * Remove up to MAX expired entries, returning the number removed. The
+ * cost depends on the number of expired entries rather than the size
+ * of the table, so this can be called regularly from an event loop.
+ */
+unsigned int hash_table_expire(HashTable *ht, unsigned int max) {
+  unsigned int n = 0;
+  uint8_t buf[UINT8_MAX];
+  Key key = { .key = buf };
+  if (ht->engine == ENGINE_MAPPED)
+    return mapped_table_expire(ht, max);
+  timer_wheel_advance(&ht->wheel, ht->now);
+  while (n < max && ht->wheel.due) {
+    Entry *entry = ht->wheel.due;
+    /* Copy the key, as deleting frees the entry */
+    key.key_size = entry->key_size;
+    memcpy(buf, entry->data, entry->key_size);
+    hash_table_delete(ht, &key);
+    assert(ht->wheel.due != entry);
+    ++n;
+  }
+  return n;
+}
+
+/* Print table occupancy, memory and slab stats */
+void print_hash_table_stats(HashTable *ht, FILE *out) {
+  fprintf(out, "items: %u size: %u mem_used: %zu mem_limit: %zu evictions: %lu"
+          " expirations: %lu\n",
+          ht->item_count, ht->size, hash_table_mem_used(ht), ht->mem_limit,
+          ht->evictions, ht->expirations);
+  if (ht->engine == ENGINE_MAPPED)
+    print_mapped_table_stats(ht, out);
+  else
+    print_slab_stats(&ht->slab, out);
 }
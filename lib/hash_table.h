@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include "slab.h"
+#include "timer_wheel.h"
 
 typedef uint8_t KeySize;
 typedef uint16_t ValSize;
@@ -17,26 +20,148 @@ typedef struct Val {
   uint8_t *val;
 } Val;
 
-typedef struct List {
-  struct List *next;
-  Key *key;
-  Val *val;
-} List;
-
+/* Values up to this size are stored inline in their Entry */
+#define INLINE_VAL_MAX 64
+
+/* Entry flags */
+#define ENTRY_REFERENCED 0x01   /* Accessed since last clock sweep */
+
+/*
+ * A stored key-value pair, held in a single allocation where
+ * possible. DATA holds the key bytes followed by VAL_CAP bytes of
+ * inline value storage. VAL.val points into DATA if the value fits in
+ * VAL_CAP, and otherwise to a separately allocated buffer.
+ *
+ * Entries with a TTL are linked into the table's TimerWheel.
+ */
+typedef struct Entry {
+  struct Entry *next;           /* Bucket chain (ENGINE_CHAINED) */
+  Val val;
+  struct Entry *timer_next;
+  struct Entry **timer_pprev;   /* NULL unless in the timer wheel */
+  uint32_t expires_at;          /* Seconds, or zero for no expiry */
+  KeySize key_size;
+  uint8_t val_cap;
+  uint8_t flags;
+  uint8_t data[];
+} Entry;
+
+/*
+ * Storage engine behind the hash_table_* API. ENGINE_CHAINED keeps a
+ * linked list of Entries per bucket. ENGINE_OPEN uses open addressing
+ * over an array of Entry pointers, with a parallel array of control
+ * bytes holding a 7-bit fingerprint of each slot's hash (see
+ * open_table.c). ENGINE_MAPPED chains entries as ENGINE_CHAINED does,
+ * but keeps them in a memory-mapped file so that they survive a
+ * restart (see mapped_table.h); such tables are opened with
+ * open_mapped_hash_table rather than created.
+ */
+typedef enum HashTableEngine {
+  ENGINE_CHAINED,
+  ENGINE_OPEN,
+  ENGINE_MAPPED
+} HashTableEngine;
+
+/*
+ * The table grows and shrinks with its load factor. A resize does not
+ * move every entry at once: the previous array is kept alive and a
+ * few of its buckets (or slots) are migrated into the new one on each
+ * operation, so OLD_ARR (or OLD_CTRL/OLD_SLOTS) is still live from
+ * REHASH_IDX onwards while a resize is in progress.
+ */
 typedef struct HashTable {
-  unsigned int size;
+  HashTableEngine engine;
+  unsigned int size;            /* Buckets, or slots if ENGINE_OPEN */
   unsigned  item_count;
-  List **arr;
+  unsigned int min_size;        /* Table never shrinks below this */
+  unsigned int old_size;        /* Zero unless resizing */
+  unsigned int rehash_idx;      /* Next old bucket/slot to migrate */
+  /* ENGINE_CHAINED */
+  Entry **arr;
+  Entry **old_arr;
+  /* ENGINE_OPEN */
+  uint8_t *ctrl;
+  Entry **slots;
+  uint8_t *old_ctrl;
+  Entry **old_slots;
+  unsigned int tombstones;      /* Deleted slots in CTRL */
+  /* ENGINE_MAPPED */
+  struct MappedTable *mapped;
+  Slab slab;                    /* Entry and value storage */
+  size_t mem_limit;             /* Zero for no limit */
+  unsigned long evictions;
+  unsigned int clock_hand;      /* Eviction sweep position */
+  uint32_t now;                 /* Seconds, see hash_table_set_time */
+  TimerWheel wheel;
+  unsigned long expirations;
 } HashTable;
 
 HashTable *create_hash_table(unsigned int size);
 
+HashTable *create_hash_table_engine(HashTableEngine engine, unsigned int size);
+
+void free_hash_table(HashTable *take_ht);
+
+bool parse_hash_table_engine(const char *name, HashTableEngine *engine);
+
+bool hash_table_is_resizing(HashTable *ht);
+
 bool hash_table_put(HashTable *ht, Key *key, Val *val);
 
+bool hash_table_put_ttl(HashTable *ht, Key *key, Val *val, uint32_t ttl);
+
+bool hash_table_put_hashed(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h);
+
 Val *hash_table_get(HashTable *ht, Key *key);
 
+Val *hash_table_get_hashed(HashTable *ht, Key *key, uint64_t h);
+
 int hash_table_delete(HashTable *ht, Key *key);
 
+int hash_table_delete_hashed(HashTable *ht, Key *key, uint64_t h);
+
+bool hash_table_ref_val(HashTable *ht, Val *val);
+
+void hash_table_unref_val(HashTable *ht, uint8_t *val);
+
+int hash_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg);
+
+void hash_table_reserve(HashTable *ht, unsigned int count);
+
+void hash_table_set_time(HashTable *ht, uint32_t now);
+
+void hash_table_sync(HashTable *ht);
+
+unsigned int hash_table_expire(HashTable *ht, unsigned int max);
+
+size_t hash_table_mem_used(HashTable *ht);
+
+void hash_table_set_mem_limit(HashTable *ht, size_t limit);
+
+void print_hash_table_stats(HashTable *ht, FILE *out);
+
+uint64_t hash(Key *key);
+
+Key *create_key(KeySize size, uint8_t *buf);
+
+Val *create_val(ValSize size, uint8_t *buf);
+
+Entry *create_entry(Slab *slab, Key *key, Val *val);
+
+Entry *entry_set_val(Slab *slab, Entry *take_entry, Val *val);
+
+Key entry_key(Entry *entry);
+
+bool entry_has_key(Entry *entry, Key *key);
+
+void entry_set_ttl(HashTable *ht, Entry *entry, uint32_t ttl);
+
+bool entry_is_expired(HashTable *ht, Entry *entry);
+
+void drop_entry(HashTable *ht, Entry *take_entry);
+
+void free_entry(Slab *slab, Entry *take_entry);
+
 size_t key_size(Key *key);
 
 size_t val_size(Val *val);
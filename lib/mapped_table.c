@@ -0,0 +1,1051 @@
+/*
+ * Memory-mapped engine (ENGINE_MAPPED, see mapped_table.h). The
+ * buckets and their resizing work as for ENGINE_CHAINED, with chains
+ * linked by file offset, zero standing for NULL.
+ *
+ * Space in the file is handed out by a size-class allocator like
+ * slab.c's: pages, aligned to their size within the file, are
+ * assigned to classes, released when empty and reclaimed for other
+ * classes, with lists linked by offset and kept in the header.
+ * Bucket arrays, and entries too large for any class, take runs of
+ * 4 KB units, and freed runs are merged with their neighbours and
+ * reused first-fit, pages included. The whole capacity is reserved when the file is
+ * mapped, and the file grows within it, so the mapping never moves
+ * and pointers into it stay valid while the table is open.
+ *
+ * Values are always stored in their entry, which is reallocated when
+ * a larger value no longer fits, so they can't be referenced past the
+ * table's lock (see hash_table_ref_val). Expired entries are reaped
+ * by sweeping the buckets rather than by the timer wheel, whose links
+ * are pointers.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hash_table.h"
+#include "hash.h"
+#include "mapped_table.h"
+
+#define MAPPED_HEADER_SIZE 4096
+#define MAPPED_MIN_CHUNK 32
+#define MAPPED_MAX_CHUNK (1 << 17)
+#define MAPPED_GROWTH_EIGHTHS 10
+/* Free space, bucket arrays and entries too large for any class are
+   runs of multiples of this */
+#define MAPPED_RUN_UNIT 4096
+/* Largest chunk, as a fraction of the page size */
+#define MAPPED_PAGE_CHUNKS_MIN 8
+/* Pages are sized to this fraction of the memory limit, or of the
+   capacity if there is none */
+#define MAPPED_LIMIT_PAGES 16
+/* The file grows by at least this much, and at most by its own size */
+#define MAPPED_MIN_GROWTH ((size_t)1 << 20)
+#define MAPPED_MAX_GROWTH ((size_t)1 << 30)
+/* Load factors and resize pace, as for ENGINE_CHAINED */
+#define MAPPED_MAX_LOAD 1
+#define MAPPED_MIN_LOAD_INV 8
+#define MAPPED_REHASH_STEP 4
+#define MAPPED_REHASH_EMPTY_VISITS (MAPPED_REHASH_STEP * 10)
+/* hash_table_expire visits up to this many buckets per entry it may
+   reap, plus a share of the table such that a sweep of an idle table
+   takes this many calls */
+#define MAPPED_EXPIRE_VISITS 8
+#define MAPPED_SWEEP_CALLS 1024
+
+/* An entry in the file, in a chunk of mapped_entry_size() bytes */
+typedef struct MappedEntry {
+  uint64_t next;                /* Bucket chain, or zero */
+  Val val;                      /* VAL.val is set whenever VAL is returned */
+  uint32_t expires_at;          /* Seconds, or zero for no expiry */
+  uint32_t val_cap;             /* Value bytes after the key */
+  KeySize key_size;
+  uint8_t flags;
+  uint8_t data[];               /* Key, then value */
+} MappedEntry;
+
+/* A page of entries of one class, as a SlabPage but linked by offset */
+typedef struct MappedPage {
+  uint64_t next;                /* Circular list of the class's pages */
+  uint64_t prev;
+  uint64_t free_list;           /* Linked through first word of chunk */
+  uint32_t cls;
+  uint32_t used;                /* Chunks handed out */
+  uint32_t carved;              /* Chunks carved so far, from the start */
+  uint32_t reserved;
+  uint64_t live[];
+} MappedPage;
+
+/* Free space below the top, merged with any free space either side */
+typedef struct FreeRun {
+  uint64_t next;                /* Following free run in the file */
+  uint64_t size;
+} FreeRun;
+
+MappedTable *mapped(HashTable *ht) {
+  return ht->mapped;
+}
+
+void *mapped_at(MappedTable *mt, uint64_t off) {
+  return mt->base + off;
+}
+
+MappedEntry *mapped_entry(MappedTable *mt, uint64_t off) {
+  return mapped_at(mt, off);
+}
+
+size_t mapped_entry_size(KeySize key_size, uint32_t val_cap) {
+  return offsetof(MappedEntry, data) + key_size + val_cap;
+}
+
+size_t entry_chunk_size(MappedEntry *entry) {
+  return mapped_entry_size(entry->key_size, entry->val_cap);
+}
+
+uint8_t *mapped_val(MappedEntry *entry) {
+  return entry->data + entry->key_size;
+}
+
+bool mapped_has_key(MappedEntry *entry, Key *key) {
+  return entry->key_size == key->key_size
+    && !memcmp(entry->data, key->key, key->key_size);
+}
+
+bool mapped_is_expired(HashTable *ht, MappedEntry *entry) {
+  return entry->expires_at && entry->expires_at <= ht->now;
+}
+
+/* Lay out pages of PAGE_SIZE bytes and the classes carved from them,
+   see init_slab_classes */
+void init_classes(MappedTable *mt, size_t page_size) {
+  size_t bitmap = (page_size / MAPPED_MIN_CHUNK + 63) / 64 * sizeof(uint64_t);
+  uint32_t max = page_size / MAPPED_PAGE_CHUNKS_MIN;
+  if (max > MAPPED_MAX_CHUNK)
+    max = MAPPED_MAX_CHUNK;
+  mt->page_size = page_size;
+  mt->page_header = (offsetof(MappedPage, live) + bitmap + 63) & ~(size_t)63;
+  mt->class_count = 0;
+  uint32_t size = MAPPED_MIN_CHUNK;
+  for (;;) {
+    assert(mt->class_count < MAPPED_MAX_CLASSES);
+    mt->class_chunks[mt->class_count] = (page_size - mt->page_header) / size;
+    mt->class_sizes[mt->class_count++] = size;
+    if (size == max)
+      break;
+    size = ((size * MAPPED_GROWTH_EIGHTHS / 8) + 7) & ~(uint32_t)7;
+    if (size > max)
+      size = max;
+  }
+}
+
+/* Return the smallest class holding SIZE bytes, or -1 if none does */
+int mapped_class(MappedTable *mt, size_t size) {
+  if (size > mt->class_sizes[mt->class_count - 1])
+    return -1;
+  int lo = 0, hi = mt->class_count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (mt->class_sizes[mid] < size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Bytes of the run holding SIZE bytes */
+size_t run_size(size_t size) {
+  return (size + MAPPED_RUN_UNIT - 1) & ~(size_t)(MAPPED_RUN_UNIT - 1);
+}
+
+/* Round OFF up to a multiple of ALIGN past the header */
+uint64_t mapped_align(uint64_t off, size_t align) {
+  return MAPPED_HEADER_SIZE + ((off - MAPPED_HEADER_SIZE + align - 1) & ~(uint64_t)(align - 1));
+}
+
+/* Extend the file to hold at least END bytes. Returns FALSE, setting
+   errno, if it would exceed the capacity or the space can't be
+   allocated. */
+bool mapped_grow(MappedTable *mt, size_t end) {
+  if (end <= mt->file_size)
+    return true;
+  if (end > mt->capacity) {
+    errno = ENOSPC;
+    return false;
+  }
+  size_t growth = mt->file_size < MAPPED_MIN_GROWTH ? MAPPED_MIN_GROWTH
+    : mt->file_size > MAPPED_MAX_GROWTH ? MAPPED_MAX_GROWTH : mt->file_size;
+  size_t new_size = mt->file_size + growth;
+  /* Grow ahead no further than the memory limit allows for */
+  if (mt->mem_limit && new_size > MAPPED_HEADER_SIZE + mt->mem_limit)
+    new_size = MAPPED_HEADER_SIZE + mt->mem_limit;
+  if (new_size < end)
+    new_size = end;
+  if (new_size > mt->capacity)
+    new_size = mt->capacity;
+  /* Allocate the blocks now, so that running out of disk fails here
+     rather than as SIGBUS on first touch */
+  int err = posix_fallocate(mt->fd, mt->file_size, new_size - mt->file_size);
+  if (err) {
+    errno = err;
+    return false;
+  }
+  mt->file_size = new_size;
+  return true;
+}
+
+/* Take SIZE bytes from the end of the space handed out so far */
+uint64_t mapped_bump(MappedTable *mt, size_t size) {
+  uint64_t off = mt->hdr->top;
+  if (!mapped_grow(mt, off + size))
+    return 0;
+  mt->full = false;
+  mt->hdr->top += size;
+  return off;
+}
+
+FreeRun *free_run(MappedTable *mt, uint64_t off) {
+  return mapped_at(mt, off);
+}
+
+/* Free the run of SIZE bytes at OFF, merging them with the free runs
+   either side. Pages at the end of the space handed out are handed
+   back. */
+void mapped_free_run(MappedTable *mt, uint64_t off, size_t size) {
+  MappedHeader *hdr = mt->hdr;
+  uint64_t *link = &hdr->free_runs, *prev_link = NULL;
+  hdr->used_bytes -= size;
+  while (*link && *link < off) {
+    prev_link = link;
+    link = &free_run(mt, *link)->next;
+  }
+  FreeRun *run = free_run(mt, off);
+  run->size = size;
+  run->next = *link;
+  *link = off;
+  if (run->next && off + run->size == run->next) {
+    run->size += free_run(mt, run->next)->size;
+    run->next = free_run(mt, run->next)->next;
+  }
+  if (prev_link && *prev_link + free_run(mt, *prev_link)->size == off) {
+    link = prev_link;
+    free_run(mt, *link)->size += run->size;
+    free_run(mt, *link)->next = run->next;
+    run = free_run(mt, *link);
+  }
+  if (!run->next && *link + run->size == hdr->top) {
+    hdr->top = *link;
+    *link = 0;
+  }
+}
+
+/* Allocate a run of SIZE bytes, a multiple of MAPPED_RUN_UNIT,
+   aligned to ALIGN, from the first free run it fits in, or else from
+   the end of the space handed out. Returns zero, setting errno, if
+   the file can't grow. */
+uint64_t mapped_alloc_run(MappedTable *mt, size_t size, size_t align) {
+  MappedHeader *hdr = mt->hdr;
+  for (uint64_t *link = &hdr->free_runs; *link; link = &free_run(mt, *link)->next) {
+    uint64_t off = *link;
+    FreeRun *run = free_run(mt, off);
+    uint64_t start = mapped_align(off, align), end = off + run->size, next = run->next;
+    if (start + size > end)
+      continue;
+    /* Keep what is left either side free */
+    if (start > off) {
+      run->size = start - off;
+      link = &run->next;
+    }
+    if (start + size < end) {
+      FreeRun *rest = free_run(mt, start + size);
+      rest->size = end - start - size;
+      rest->next = next;
+      *link = start + size;
+    } else {
+      *link = next;
+    }
+    hdr->used_bytes += size;
+    return start;
+  }
+  uint64_t top = hdr->top, start = mapped_align(top, align);
+  if (!mapped_bump(mt, start + size - top))
+    return 0;
+  hdr->used_bytes += start + size - top;
+  if (start > top)
+    mapped_free_run(mt, top, start - top);
+  return start;
+}
+
+MappedPage *mapped_page(MappedTable *mt, uint64_t off) {
+  return mapped_at(mt, off);
+}
+
+/* Return the offset of the page holding the chunk at OFF */
+uint64_t mapped_page_of(MappedTable *mt, uint64_t off) {
+  return MAPPED_HEADER_SIZE + ((off - MAPPED_HEADER_SIZE) & ~(uint64_t)(mt->page_size - 1));
+}
+
+uint64_t mapped_page_chunk(MappedTable *mt, uint64_t page, unsigned int i) {
+  return page + mt->page_header + (uint64_t)i * mt->class_sizes[mapped_page(mt, page)->cls];
+}
+
+unsigned int mapped_page_chunk_index(MappedTable *mt, uint64_t page, uint64_t off) {
+  return (off - page - mt->page_header) / mt->class_sizes[mapped_page(mt, page)->cls];
+}
+
+uint32_t mapped_class_free_chunks(MappedTable *mt, unsigned int c) {
+  return mt->hdr->class_page_counts[c] * mt->class_chunks[c] - mt->hdr->class_used[c];
+}
+
+/* Make the page at OFF the first of class C's pages */
+void mapped_link_page(MappedTable *mt, unsigned int c, uint64_t off) {
+  MappedPage *page = mapped_page(mt, off);
+  uint64_t first = mt->hdr->class_pages[c];
+  if (!first) {
+    page->next = page->prev = off;
+  } else {
+    page->next = first;
+    page->prev = mapped_page(mt, first)->prev;
+    mapped_page(mt, page->prev)->next = off;
+    mapped_page(mt, first)->prev = off;
+  }
+  mt->hdr->class_pages[c] = off;
+}
+
+void mapped_unlink_page(MappedTable *mt, unsigned int c, uint64_t off) {
+  MappedPage *page = mapped_page(mt, off);
+  if (page->next == off) {
+    mt->hdr->class_pages[c] = 0;
+    return;
+  }
+  mapped_page(mt, page->prev)->next = page->next;
+  mapped_page(mt, page->next)->prev = page->prev;
+  if (mt->hdr->class_pages[c] == off)
+    mt->hdr->class_pages[c] = page->next;
+}
+
+/* Assign a page to class C, returning its offset, or zero if the
+   file can't grow */
+uint64_t mapped_add_page(MappedTable *mt, unsigned int c) {
+  uint64_t off = mapped_alloc_run(mt, mt->page_size, mt->page_size);
+  if (!off)
+    return 0;
+  memset(mapped_at(mt, off), 0, mt->page_header);
+  mapped_page(mt, off)->cls = c;
+  mapped_link_page(mt, c, off);
+  ++mt->hdr->class_page_counts[c];
+  return off;
+}
+
+/* Free an empty page, already unlinked from its class */
+void mapped_retire_page(MappedTable *mt, uint64_t off) {
+  --mt->hdr->class_page_counts[mapped_page(mt, off)->cls];
+  mapped_free_run(mt, off, mt->page_size);
+}
+
+/* Allocate SIZE bytes of the file, returning their offset, or zero,
+   setting errno, if the file can't grow. Chunks too large for any
+   class are runs. */
+uint64_t mapped_alloc(MappedTable *mt, size_t size) {
+  MappedHeader *hdr = mt->hdr;
+  int c = mapped_class(mt, size);
+  if (c < 0)
+    return mapped_alloc_run(mt, run_size(size), MAPPED_RUN_UNIT);
+  /* Pages with free chunks come first, see slab_alloc */
+  uint64_t page_off = hdr->class_pages[c];
+  if (!page_off || mapped_page(mt, page_off)->used == mt->class_chunks[c])
+    if (!(page_off = mapped_add_page(mt, c)))
+      return 0;
+  MappedPage *page = mapped_page(mt, page_off);
+  uint64_t off;
+  unsigned int i;
+  if (page->free_list) {
+    off = page->free_list;
+    page->free_list = *(uint64_t *)mapped_at(mt, off);
+    i = mapped_page_chunk_index(mt, page_off, off);
+  } else {
+    i = page->carved++;
+    off = mapped_page_chunk(mt, page_off, i);
+  }
+  page->live[i / 64] |= (uint64_t)1 << (i % 64);
+  ++page->used;
+  ++hdr->class_used[c];
+  if (page->used == mt->class_chunks[c])
+    hdr->class_pages[c] = page->next;
+  return off;
+}
+
+/* Free the chunk at OFF, allocated with SIZE. Its page is freed once
+   empty. */
+void mapped_free(MappedTable *mt, uint64_t off, size_t size) {
+  MappedHeader *hdr = mt->hdr;
+  int c = mapped_class(mt, size);
+  if (c < 0) {
+    mapped_free_run(mt, off, run_size(size));
+    return;
+  }
+  uint64_t page_off = mapped_page_of(mt, off);
+  MappedPage *page = mapped_page(mt, page_off);
+  unsigned int i = mapped_page_chunk_index(mt, page_off, off);
+  page->live[i / 64] &= ~((uint64_t)1 << (i % 64));
+  *(uint64_t *)mapped_at(mt, off) = page->free_list;
+  page->free_list = off;
+  --page->used;
+  --hdr->class_used[c];
+  if (page_off == mt->pinned)
+    return;
+  if (!page->used) {
+    mapped_unlink_page(mt, c, page_off);
+    mapped_retire_page(mt, page_off);
+  } else if (page->used == mt->class_chunks[c] - 1) {
+    mapped_unlink_page(mt, c, page_off);
+    mapped_link_page(mt, c, page_off);
+  }
+}
+
+/* Bucket arrays are runs, so that every chunk of a class's pages is
+   an entry */
+size_t buckets_size(unsigned int count) {
+  return run_size((size_t)count * sizeof(uint64_t));
+}
+
+/* Allocate an empty array of COUNT buckets, or return zero */
+uint64_t mapped_alloc_buckets(MappedTable *mt, unsigned int count) {
+  uint64_t off = mapped_alloc_run(mt, buckets_size(count), MAPPED_RUN_UNIT);
+  if (off)
+    memset(mapped_at(mt, off), 0, (size_t)count * sizeof(uint64_t));
+  return off;
+}
+
+void mapped_free_buckets(MappedTable *mt, uint64_t off, unsigned int count) {
+  mapped_free_run(mt, off, buckets_size(count));
+}
+
+uint64_t *mapped_arr(MappedTable *mt) {
+  return mapped_at(mt, mt->hdr->arr);
+}
+
+uint64_t *mapped_old_arr(MappedTable *mt) {
+  return mapped_at(mt, mt->hdr->old_arr);
+}
+
+/* Mark the file as in use before its first change since it was last
+   synced, so that a crash before the next sync is noticed */
+void mapped_begin(HashTable *ht) {
+  MappedTable *mt = mapped(ht);
+  if (mt->dirty)
+    return;
+  mt->hdr->state = MAPPED_DIRTY;
+  msync(mt->base, MAPPED_HEADER_SIZE, MS_SYNC);
+  mt->dirty = true;
+}
+
+/* Begin migrating entries into a new bucket array of NEW_SIZE, unless
+   the file has no room for it */
+void mapped_start_resize(HashTable *ht, unsigned int new_size) {
+  MappedTable *mt = mapped(ht);
+  uint64_t arr = mapped_alloc_buckets(mt, new_size);
+  if (!arr)
+    return;
+  mt->hdr->old_arr = mt->hdr->arr;
+  ht->old_size = ht->size;
+  ht->rehash_idx = 0;
+  mt->hdr->arr = arr;
+  ht->size = new_size;
+}
+
+/* Move a bounded number of old buckets into the current array, see
+   rehash_step */
+void mapped_rehash_step(HashTable *ht) {
+  MappedTable *mt = mapped(ht);
+  uint64_t *old_arr = mapped_old_arr(mt);
+  uint64_t *arr = mapped_arr(mt);
+  unsigned int moved = 0;
+  unsigned int visits = 0;
+  while (ht->rehash_idx < ht->old_size
+         && moved < MAPPED_REHASH_STEP
+         && visits < MAPPED_REHASH_EMPTY_VISITS) {
+    uint64_t off = old_arr[ht->rehash_idx];
+    if (off) {
+      while (off) {
+        MappedEntry *entry = mapped_entry(mt, off);
+        uint64_t next = entry->next;
+        Key key = { .key_size = entry->key_size, .key = entry->data };
+        uint64_t *dst = &arr[hash(&key) % ht->size];
+        entry->next = *dst;
+        *dst = off;
+        off = next;
+      }
+      old_arr[ht->rehash_idx] = 0;
+      ++moved;
+    } else
+      ++visits;
+    ++ht->rehash_idx;
+  }
+  if (ht->rehash_idx == ht->old_size) {
+    /* The sweep's positions in the current array move down */
+    mt->expire_idx = mt->expire_idx >= ht->old_size ? mt->expire_idx - ht->old_size : 0;
+    mapped_free_buckets(mt, mt->hdr->old_arr, ht->old_size);
+    mt->hdr->old_arr = 0;
+    ht->old_size = 0;
+    ht->rehash_idx = 0;
+  }
+}
+
+/* Mark the file in use, then advance or start a resize, see maintain */
+void mapped_maintain(HashTable *ht) {
+  mapped_begin(ht);
+  if (ht->old_size)
+    mapped_rehash_step(ht);
+  else if (ht->item_count > ht->size * MAPPED_MAX_LOAD)
+    mapped_start_resize(ht, ht->size * 2);
+  else if (ht->size / 2 >= ht->min_size
+           && ht->item_count < ht->size / MAPPED_MIN_LOAD_INV)
+    mapped_start_resize(ht, ht->size / 2);
+}
+
+/* Return the bucket currently holding entries with hash H, see
+   bucket */
+uint64_t *mapped_bucket(HashTable *ht, uint64_t h) {
+  MappedTable *mt = mapped(ht);
+  if (ht->old_size) {
+    unsigned int i = h % ht->old_size;
+    if (i >= ht->rehash_idx)
+      return &mapped_old_arr(mt)[i];
+  }
+  return &mapped_arr(mt)[h % ht->size];
+}
+
+/* Return the link to the entry for KEY, or the zero link ending its
+   bucket if absent */
+uint64_t *mapped_find(HashTable *ht, Key *key, uint64_t h) {
+  MappedTable *mt = mapped(ht);
+  uint64_t *link = mapped_bucket(ht, h);
+  while (*link && !mapped_has_key(mapped_entry(mt, *link), key))
+    link = &mapped_entry(mt, *link)->next;
+  return link;
+}
+
+/* Unlink and free the entry at *LINK */
+void mapped_remove(HashTable *ht, uint64_t *link) {
+  MappedTable *mt = mapped(ht);
+  uint64_t off = *link;
+  MappedEntry *entry = mapped_entry(mt, off);
+  *link = entry->next;
+  mapped_free(mt, off, entry_chunk_size(entry));
+  --ht->item_count;
+}
+
+void mapped_set_ttl(HashTable *ht, MappedEntry *entry, uint32_t ttl) {
+  MappedTable *mt = mapped(ht);
+  entry->expires_at = !ttl ? 0 : ht->now > UINT32_MAX - ttl ? UINT32_MAX : ht->now + ttl;
+  if (!entry->expires_at)
+    return;
+  if (entry->expires_at < mt->next_expiry)
+    mt->next_expiry = entry->expires_at;
+  if (entry->expires_at < mt->sweep_min)
+    mt->sweep_min = entry->expires_at;
+}
+
+void mapped_set_val(MappedEntry *entry, Val *val) {
+  entry->val.val_size = val->val_size;
+  entry->val.val = mapped_val(entry);
+  memcpy(entry->val.val, val->val, val->val_size);
+}
+
+/* Value bytes an entry reserves for a value of SIZE */
+uint32_t mapped_val_cap(ValSize size) {
+  return (size + 7) & ~(uint32_t)7;
+}
+
+/*
+ * Store a value, see hash_table_put_hashed. A value too large for the
+ * existing entry's space is written to a new entry, which replaces it
+ * in the chain. If the file has no room for that entry and can't
+ * grow, the write is dropped, along with any value it would have
+ * replaced, and logged.
+ */
+bool mapped_table_put(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h) {
+  MappedTable *mt = mapped(ht);
+  uint32_t cap = mapped_val_cap(val->val_size);
+  mapped_maintain(ht);
+  uint64_t *link = mapped_find(ht, key, h);
+  MappedEntry *old = *link ? mapped_entry(mt, *link) : NULL;
+  MappedEntry *entry = old;
+  bool expired = old && mapped_is_expired(ht, old);
+  if (!old || val->val_size > old->val_cap) {
+    uint64_t off = mapped_alloc(mt, mapped_entry_size(key->key_size, cap));
+    if (!off) {
+      /* Logged once until the file next grows */
+      if (!mt->full)
+        error(0, errno, "%s: table file full, dropping writes", mt->path);
+      mt->full = true;
+      if (old) {
+        mapped_remove(ht, link);
+        ht->expirations += expired;
+      }
+      return false;
+    }
+    entry = mapped_entry(mt, off);
+    entry->key_size = key->key_size;
+    entry->val_cap = cap;
+    memcpy(entry->data, key->key, key->key_size);
+    entry->next = old ? old->next : 0;
+    *link = off;
+    if (old)
+      mapped_free(mt, (uint8_t *)old - mt->base, entry_chunk_size(old));
+    else
+      ++ht->item_count;
+  }
+  mapped_set_val(entry, val);
+  mapped_set_ttl(ht, entry, ttl);
+  entry->flags = ENTRY_REFERENCED;
+  /* An expired entry is reused, but reported as a new entry */
+  ht->expirations += expired;
+  return old && !expired;
+}
+
+Val *mapped_table_get(HashTable *ht, Key *key, uint64_t h) {
+  mapped_maintain(ht);
+  uint64_t *link = mapped_find(ht, key, h);
+  if (!*link)
+    return NULL;
+  MappedEntry *entry = mapped_entry(mapped(ht), *link);
+  if (mapped_is_expired(ht, entry)) {
+    mapped_remove(ht, link);
+    ++ht->expirations;
+    return NULL;
+  }
+  entry->flags |= ENTRY_REFERENCED;
+  /* Point at the value in this mapping of the file */
+  entry->val.val = mapped_val(entry);
+  return &entry->val;
+}
+
+int mapped_table_delete(HashTable *ht, Key *key, uint64_t h) {
+  mapped_maintain(ht);
+  uint64_t *link = mapped_find(ht, key, h);
+  if (!*link)
+    return 1;
+  bool expired = mapped_is_expired(ht, mapped_entry(mapped(ht), *link));
+  mapped_remove(ht, link);
+  ht->expirations += expired;
+  return expired;
+}
+
+/* Return bucket POS of a sweep over the old array (if resizing)
+   followed by the current one, see clock_bucket */
+uint64_t *mapped_sweep_bucket(HashTable *ht, unsigned int pos) {
+  if (pos < ht->old_size)
+    return &mapped_old_arr(mapped(ht))[pos];
+  return &mapped_arr(mapped(ht))[pos - ht->old_size];
+}
+
+/* Evict one entry from a non-empty table by CLOCK (see evict_one),
+   taking expired entries first */
+void mapped_table_evict(HashTable *ht) {
+  MappedTable *mt = mapped(ht);
+  mapped_begin(ht);
+  for (;;) {
+    ht->clock_hand %= ht->old_size + ht->size;
+    uint64_t *link = mapped_sweep_bucket(ht, ht->clock_hand);
+    while (*link) {
+      MappedEntry *entry = mapped_entry(mt, *link);
+      if (!(entry->flags & ENTRY_REFERENCED) || mapped_is_expired(ht, entry)) {
+        mapped_remove(ht, link);
+        return;
+      }
+      entry->flags &= ~ENTRY_REFERENCED;
+      link = &entry->next;
+    }
+    ++ht->clock_hand;
+  }
+}
+
+/*
+ * Call FN on each entry, see hash_table_for_each. FN is passed a copy
+ * of each entry's header and key, laid out as an Entry, with its value
+ * pointing into the file.
+ */
+int mapped_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg) {
+  MappedTable *mt = mapped(ht);
+  union {
+    Entry entry;
+    uint8_t bytes[sizeof(Entry) + UINT8_MAX];
+  } copy;
+  int ret;
+  memset(&copy.entry, 0, sizeof(Entry));
+  for (unsigned int i = 0; i < ht->old_size + ht->size; i++)
+    for (uint64_t off = *mapped_sweep_bucket(ht, i); off; off = mapped_entry(mt, off)->next) {
+      MappedEntry *entry = mapped_entry(mt, off);
+      copy.entry.val.val_size = entry->val.val_size;
+      copy.entry.val.val = mapped_val(entry);
+      copy.entry.expires_at = entry->expires_at;
+      copy.entry.key_size = entry->key_size;
+      copy.entry.flags = entry->flags;
+      memcpy(copy.entry.data, entry->data, entry->key_size);
+      if ((ret = fn(&copy.entry, arg)))
+        return ret;
+    }
+  return 0;
+}
+
+/* Size an empty table for COUNT entries, see hash_table_reserve */
+void mapped_table_reserve(HashTable *ht, unsigned int count) {
+  MappedTable *mt = mapped(ht);
+  unsigned int size = ht->size;
+  while ((unsigned long)size * MAPPED_MAX_LOAD < count)
+    size *= 2;
+  if (size == ht->size)
+    return;
+  mapped_begin(ht);
+  uint64_t arr = mapped_alloc_buckets(mt, size);
+  if (!arr)
+    return;
+  mapped_free_buckets(mt, mt->hdr->arr, ht->size);
+  mt->hdr->arr = arr;
+  ht->size = ht->min_size = size;
+}
+
+/*
+ * Remove up to MAX expired entries, see hash_table_expire, sweeping
+ * on from where the last call stopped. Each completed sweep learns
+ * when the next entry will expire, and until then this returns at
+ * once, so that the event loop only pays for sweeping while entries
+ * are expiring.
+ */
+unsigned int mapped_table_expire(HashTable *ht, unsigned int max) {
+  MappedTable *mt = mapped(ht);
+  unsigned int n = 0;
+  unsigned long visits = (unsigned long)max * MAPPED_EXPIRE_VISITS
+    + (ht->old_size + ht->size) / MAPPED_SWEEP_CALLS;
+  if (!max || !ht->item_count || ht->now < mt->next_expiry)
+    return 0;
+  mapped_begin(ht);
+  while (n < max && visits--) {
+    if (mt->expire_idx >= ht->old_size + ht->size) {
+      mt->expire_idx = 0;
+      mt->next_expiry = mt->sweep_min;
+      mt->sweep_min = UINT32_MAX;
+      if (ht->now < mt->next_expiry)
+        break;
+    }
+    uint64_t *link = mapped_sweep_bucket(ht, mt->expire_idx++);
+    while (*link) {
+      MappedEntry *entry = mapped_entry(mt, *link);
+      if (mapped_is_expired(ht, entry)) {
+        mapped_remove(ht, link);
+        ++ht->expirations;
+        ++n;
+      } else {
+        if (entry->expires_at && entry->expires_at < mt->sweep_min)
+          mt->sweep_min = entry->expires_at;
+        link = &entry->next;
+      }
+    }
+  }
+  return n;
+}
+
+/* Bytes of the file held by the table: pages assigned to classes,
+   whether or not their chunks are in use, and bucket arrays */
+size_t mapped_table_mem_used(HashTable *ht) {
+  return mapped(ht)->hdr->used_bytes;
+}
+
+/* Bytes by which storing KEY and VAL in a new entry would grow
+   mapped_table_mem_used, see slab_growth */
+size_t mapped_table_growth(HashTable *ht, Key *key, Val *val) {
+  MappedTable *mt = mapped(ht);
+  size_t size = mapped_entry_size(key->key_size, mapped_val_cap(val->val_size));
+  int c = mapped_class(mt, size);
+  if (c < 0)
+    return run_size(size);
+  return mapped_class_free_chunks(mt, c) ? 0 : mt->page_size;
+}
+
+/* Move the entry at OFF, on a page being reclaimed, to another chunk
+   of its class */
+void mapped_move_entry(HashTable *ht, uint64_t off) {
+  MappedTable *mt = mapped(ht);
+  MappedEntry *entry = mapped_entry(mt, off);
+  size_t size = entry_chunk_size(entry);
+  uint64_t copy = mapped_alloc(mt, size);
+  /* The class has room on its other pages, see mapped_table_reclaim_page */
+  assert(copy != 0);
+  memcpy(mapped_at(mt, copy), entry, size);
+  Key key = { .key_size = entry->key_size, .key = entry->data };
+  *mapped_find(ht, &key, hash(&key)) = copy;
+  mapped_free(mt, off, size);
+}
+
+/*
+ * Free a page for reassignment to another class, as
+ * slab_reclaimable_page and slab_reclaim_page do: the emptiest page
+ * of a class with a page's worth of chunks free has its entries moved
+ * to the class's other pages. Returns FALSE if no class has that much
+ * free.
+ */
+bool mapped_table_reclaim_page(HashTable *ht) {
+  MappedTable *mt = mapped(ht);
+  uint64_t best = 0;
+  for (unsigned int c = 0; c < mt->class_count; c++) {
+    if (mapped_class_free_chunks(mt, c) < mt->class_chunks[c])
+      continue;
+    uint64_t off = mt->hdr->class_pages[c];
+    do {
+      if (!best || mapped_page(mt, off)->used < mapped_page(mt, best)->used)
+        best = off;
+      off = mapped_page(mt, off)->next;
+    } while (off != mt->hdr->class_pages[c]);
+  }
+  if (!best)
+    return false;
+  mapped_begin(ht);
+  MappedPage *page = mapped_page(mt, best);
+  mapped_unlink_page(mt, page->cls, best);
+  mt->pinned = best;
+  for (unsigned int w = 0; w < (page->carved + 63) / 64; w++)
+    while (page->live[w])
+      mapped_move_entry(ht, mapped_page_chunk(mt, best, w * 64 + __builtin_ctzll(page->live[w])));
+  mt->pinned = 0;
+  mapped_retire_page(mt, best);
+  return true;
+}
+
+/* Empty the file's space, laying it out in pages of PAGE_SIZE */
+void mapped_layout(MappedTable *mt, size_t page_size) {
+  MappedHeader *hdr = mt->hdr;
+  hdr->top = MAPPED_HEADER_SIZE;
+  hdr->used_bytes = 0;
+  hdr->free_runs = 0;
+  hdr->page_size = page_size;
+  memset(hdr->class_pages, 0, sizeof hdr->class_pages);
+  memset(hdr->class_page_counts, 0, sizeof hdr->class_page_counts);
+  memset(hdr->class_used, 0, sizeof hdr->class_used);
+  init_classes(mt, page_size);
+}
+
+/* Size of pages for a table of up to BYTES */
+size_t mapped_page_size(size_t bytes) {
+  size_t page_size = MAPPED_MAX_PAGE_SIZE;
+  while (page_size > MAPPED_MIN_PAGE_SIZE && page_size > bytes / MAPPED_LIMIT_PAGES)
+    page_size /= 2;
+  return page_size;
+}
+
+/* Use pages of PAGE_SIZE bytes, as slab_set_page_size does, starting
+   the file afresh. Returns FALSE, changing nothing, unless the table
+   is empty. */
+bool mapped_table_set_page_size(HashTable *ht, size_t page_size) {
+  MappedTable *mt = mapped(ht);
+  size_t old_page_size = mt->page_size;
+  assert(page_size >= MAPPED_MIN_PAGE_SIZE && page_size <= MAPPED_MAX_PAGE_SIZE);
+  assert(!(page_size & (page_size - 1)));
+  if (page_size == old_page_size)
+    return true;
+  if (ht->item_count || ht->old_size)
+    return false;
+  mapped_begin(ht);
+  mapped_layout(mt, page_size);
+  if ((mt->hdr->arr = mapped_alloc_buckets(mt, ht->size)))
+    return true;
+  /* The file can't grow to fit the larger pages */
+  mapped_layout(mt, old_page_size);
+  mt->hdr->arr = mapped_alloc_buckets(mt, ht->size);
+  assert(mt->hdr->arr != 0);
+  return false;
+}
+
+/* Grow the file no further than LIMIT bytes of entries and bucket
+   arrays need, see hash_table_set_mem_limit. While the table is
+   empty, its pages are also sized to a fraction of the limit. */
+void mapped_table_set_mem_limit(HashTable *ht, size_t limit) {
+  MappedTable *mt = mapped(ht);
+  mt->mem_limit = limit;
+  mapped_table_set_page_size(ht, mapped_page_size(limit ? limit : mt->capacity));
+}
+
+/* Return TRUE if the header at HDR, of a file of FILE_SIZE bytes, is
+   from a clean close of table SHARD of SHARD_COUNT */
+bool mapped_header_ok(MappedHeader *hdr, size_t file_size, uint32_t shard,
+                      uint32_t shard_count) {
+  return file_size >= MAPPED_HEADER_SIZE
+    && !memcmp(hdr->magic, MAPPED_MAGIC, sizeof hdr->magic)
+    && hdr->version == MAPPED_VERSION
+    && hdr->state == MAPPED_CLEAN
+    && hdr->shard == shard && hdr->shard_count == shard_count
+    && hdr->page_size >= MAPPED_MIN_PAGE_SIZE && hdr->page_size <= MAPPED_MAX_PAGE_SIZE
+    && !(hdr->page_size & (hdr->page_size - 1))
+    && hdr->top <= file_size && hdr->arr && hdr->size;
+}
+
+/*
+ * Read the hash seed of the cleanly closed table file at PATH into
+ * *SEED, if it is for one of SHARD_COUNT tables, so that a process
+ * can adopt it (see hash_set_seed) before reopening its tables.
+ * Returns FALSE if there is no such file.
+ */
+bool read_mapped_seed(const char *path, uint32_t shard_count, uint64_t *seed) {
+  MappedHeader hdr;
+  struct stat sb;
+  bool ok = false;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+  if (fstat(fd, &sb) == 0 && pread(fd, &hdr, sizeof hdr, 0) == sizeof hdr
+      && mapped_header_ok(&hdr, sb.st_size, hdr.shard, shard_count)) {
+    *seed = hdr.seed;
+    ok = true;
+  }
+  close(fd);
+  return ok;
+}
+
+/* Empty the file and set up a table of SIZE buckets in it, with pages
+   sized for the capacity. Returns FALSE, setting errno, on failure. */
+bool mapped_reset(MappedTable *mt, unsigned int size, uint32_t shard, uint32_t shard_count) {
+  if (ftruncate(mt->fd, 0) == -1)
+    return false;
+  mt->file_size = 0;
+  if (!mapped_grow(mt, MAPPED_HEADER_SIZE))
+    return false;
+  MappedHeader *hdr = mt->hdr;
+  memcpy(hdr->magic, MAPPED_MAGIC, sizeof hdr->magic);
+  hdr->version = MAPPED_VERSION;
+  hdr->state = MAPPED_DIRTY;
+  hdr->seed = hash_seed;
+  hdr->shard = shard;
+  hdr->shard_count = shard_count;
+  hdr->size = hdr->min_size = size;
+  mapped_layout(mt, mapped_page_size(mt->capacity));
+  return (hdr->arr = mapped_alloc_buckets(mt, size)) != 0;
+}
+
+/*
+ * Open the table in the file at PATH, creating it (or emptying it, see
+ * mapped_table.h) with SIZE initial buckets if need be. The file may
+ * grow to CAPACITY bytes, which are reserved as address space up front
+ * (MAPPED_DEFAULT_CAPACITY if zero). SHARD and SHARD_COUNT identify
+ * the table among those sharing a keyspace (0 and 1 for a lone table).
+ * Returns NULL, setting errno, on failure.
+ */
+HashTable *open_mapped_hash_table(const char *path, unsigned int size, size_t capacity,
+                                  uint32_t shard, uint32_t shard_count) {
+  struct stat sb;
+  assert(size > 0);
+  if (!capacity)
+    capacity = MAPPED_DEFAULT_CAPACITY;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &sb) == -1) {
+    close(fd);
+    return NULL;
+  }
+  if ((size_t)sb.st_size > capacity)
+    capacity = sb.st_size;
+  void *base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  MappedTable *mt = calloc(1, sizeof(MappedTable));
+  assert(mt != 0);
+  mt->fd = fd;
+  mt->path = strdup(path);
+  assert(mt->path != 0);
+  mt->base = base;
+  mt->hdr = base;
+  mt->capacity = capacity;
+  mt->file_size = sb.st_size;
+  MappedHeader *hdr = mt->hdr;
+  mt->reopened = mapped_header_ok(hdr, sb.st_size, shard, shard_count)
+    && hdr->seed == hash_seed;
+  if (mt->reopened)
+    init_classes(mt, hdr->page_size);
+  if (!mt->reopened && !mapped_reset(mt, size, shard, shard_count)) {
+    int err = errno;
+    munmap(base, capacity);
+    close(fd);
+    free(mt->path);
+    free(mt);
+    errno = err;
+    return NULL;
+  }
+
+  HashTable *ht = calloc(1, sizeof(HashTable));
+  assert(ht != 0);
+  ht->engine = ENGINE_MAPPED;
+  ht->mapped = mt;
+  init_slab(&ht->slab);
+  init_timer_wheel(&ht->wheel);
+  ht->item_count = hdr->item_count;
+  ht->size = hdr->size;
+  ht->min_size = hdr->min_size;
+  ht->old_size = hdr->old_size;
+  ht->rehash_idx = hdr->rehash_idx;
+  ht->clock_hand = hdr->clock_hand;
+  ht->evictions = hdr->evictions;
+  ht->expirations = hdr->expirations;
+  /* Entries kept may be due, so sweep once to find out */
+  mt->next_expiry = mt->reopened ? 0 : UINT32_MAX;
+  mt->sweep_min = UINT32_MAX;
+  /* Written back as the file is now in use */
+  mt->dirty = false;
+  mapped_begin(ht);
+  return ht;
+}
+
+/*
+ * Write the table's state to its file and flush the file to disk,
+ * marking it clean so that it can be reopened. The next change marks
+ * it in use again. Dirty pages are written back as the kernel sees
+ * fit meanwhile, so this costs in proportion to the data changed
+ * since the last sync.
+ */
+void mapped_table_sync(HashTable *ht) {
+  MappedTable *mt = mapped(ht);
+  MappedHeader *hdr = mt->hdr;
+  hdr->item_count = ht->item_count;
+  hdr->size = ht->size;
+  hdr->min_size = ht->min_size;
+  hdr->old_size = ht->old_size;
+  hdr->rehash_idx = ht->rehash_idx;
+  hdr->clock_hand = ht->clock_hand;
+  hdr->evictions = ht->evictions;
+  hdr->expirations = ht->expirations;
+  if (msync(mt->base, hdr->top, MS_SYNC) == -1)
+    error(0, errno, "%s", mt->path);
+  hdr->state = MAPPED_CLEAN;
+  msync(mt->base, MAPPED_HEADER_SIZE, MS_SYNC);
+  mt->dirty = false;
+}
+
+/* Sync the table (see mapped_table_sync), then unmap and free it */
+void close_mapped_hash_table(HashTable *take_ht) {
+  MappedTable *mt = mapped(take_ht);
+  mapped_table_sync(take_ht);
+  munmap(mt->base, mt->capacity);
+  close(mt->fd);
+  free(mt->path);
+  free(mt);
+  free_slab(&take_ht->slab);
+  free(take_ht);
+}
+
+void print_mapped_table_stats(HashTable *ht, FILE *out) {
+  MappedTable *mt = mapped(ht);
+  fprintf(out, "file: %s file_size: %zu top: %lu used: %lu page: %zu reopened: %s\n",
+          mt->path, mt->file_size, (unsigned long)mt->hdr->top,
+          (unsigned long)mt->hdr->used_bytes, mt->page_size, mt->reopened ? "yes" : "no");
+}
@@ -0,0 +1,120 @@
+#ifndef _MAPPED_TABLE_H
+#define _MAPPED_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "hash_table.h"
+
+/*
+ * ENGINE_MAPPED: a chained table kept entirely in a file mapped into
+ * memory, so that a restarted server maps the file and serves from it
+ * at once, faulting pages in as they are touched, instead of loading
+ * every entry. The file holds a header, bucket arrays and entries,
+ * which refer to each other by offset from the start of the file
+ * rather than by pointer, so the file may be mapped anywhere.
+ *
+ * A file is only reopened if it was closed cleanly (see
+ * mapped_table_sync), as a crash midway through an update can leave
+ * it inconsistent. Otherwise, or if it was built by a different
+ * version, for a different shard, or with a different hash seed, it
+ * is emptied. Integers are stored in host byte order.
+ */
+#define MAPPED_MAGIC "CACHEMAP"
+#define MAPPED_VERSION 2
+#define MAPPED_MAX_CLASSES 64
+#define MAPPED_MIN_PAGE_SIZE (1 << 12)
+#define MAPPED_MAX_PAGE_SIZE (1 << 20)
+/* MappedHeader states */
+#define MAPPED_CLEAN 1
+#define MAPPED_DIRTY 2
+/* Address space reserved for a table's file unless asked for more */
+#define MAPPED_DEFAULT_CAPACITY ((size_t)1 << 36)
+
+/* The first page of a table file. Fields below ITEM_COUNT are only
+   brought up to date when the file is synced. */
+typedef struct MappedHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t state;               /* MAPPED_CLEAN, or MAPPED_DIRTY while in use */
+  uint64_t seed;                /* hash_seed the buckets were filled with */
+  uint32_t shard;               /* Which of SHARD_COUNT tables this is */
+  uint32_t shard_count;
+  uint64_t top;                 /* End of the space handed out */
+  uint64_t used_bytes;          /* In pages of classes, and other runs */
+  uint64_t arr;                 /* Bucket arrays, as for ENGINE_CHAINED */
+  uint64_t old_arr;
+  uint64_t free_runs;           /* Free space below TOP, by offset */
+  uint32_t page_size;
+  uint32_t reserved;
+  uint64_t class_pages[MAPPED_MAX_CLASSES];     /* First page of each class */
+  uint32_t class_page_counts[MAPPED_MAX_CLASSES];
+  uint32_t class_used[MAPPED_MAX_CLASSES];      /* Chunks in use */
+  uint32_t item_count;
+  uint32_t size;
+  uint32_t min_size;
+  uint32_t old_size;
+  uint32_t rehash_idx;
+  uint32_t clock_hand;
+  uint64_t evictions;
+  uint64_t expirations;
+} MappedHeader;
+
+/* Process-side state of a mapped table */
+typedef struct MappedTable {
+  int fd;
+  char *path;
+  uint8_t *base;                /* CAPACITY bytes reserved, FILE_SIZE backed */
+  MappedHeader *hdr;            /* At BASE */
+  size_t capacity;
+  size_t file_size;
+  size_t mem_limit;             /* Of the table, or zero, see mapped_grow */
+  size_t page_size;
+  size_t page_header;           /* Bytes before the first chunk of a page */
+  unsigned int class_count;
+  uint32_t class_sizes[MAPPED_MAX_CLASSES];
+  uint32_t class_chunks[MAPPED_MAX_CLASSES];    /* Chunks per page */
+  uint64_t pinned;              /* Page being reclaimed, or zero */
+  unsigned int expire_idx;      /* Next bucket for hash_table_expire */
+  uint32_t next_expiry;         /* No entry expires before this */
+  uint32_t sweep_min;           /* Earliest expiry seen this sweep */
+  bool dirty;                   /* Marked MAPPED_DIRTY since the last sync */
+  bool reopened;                /* Entries were kept from a previous run */
+  bool full;                    /* Failed to grow, and not grown since */
+} MappedTable;
+
+HashTable *open_mapped_hash_table(const char *path, unsigned int size, size_t capacity,
+                                  uint32_t shard, uint32_t shard_count);
+
+bool read_mapped_seed(const char *path, uint32_t shard_count, uint64_t *seed);
+
+void mapped_table_sync(HashTable *ht);
+
+void close_mapped_hash_table(HashTable *take_ht);
+
+bool mapped_table_put(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h);
+
+Val *mapped_table_get(HashTable *ht, Key *key, uint64_t h);
+
+int mapped_table_delete(HashTable *ht, Key *key, uint64_t h);
+
+void mapped_table_evict(HashTable *ht);
+
+int mapped_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg);
+
+void mapped_table_reserve(HashTable *ht, unsigned int count);
+
+unsigned int mapped_table_expire(HashTable *ht, unsigned int max);
+
+size_t mapped_table_mem_used(HashTable *ht);
+
+size_t mapped_table_growth(HashTable *ht, Key *key, Val *val);
+
+bool mapped_table_reclaim_page(HashTable *ht);
+
+void mapped_table_set_mem_limit(HashTable *ht, size_t limit);
+
+void print_mapped_table_stats(HashTable *ht, FILE *out);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <assert.h>
 #include <error.h>
 #include <string.h>
 #include <stdint.h>
@@ -29,33 +30,111 @@ int write_val(uint8_t *buf, Val *val) {
   return val->val_size + sizeof(ValSize);
 }
 
-MessageSize get_message_size(Message *msg) {
-  MessageSize s;
+int write_ttl(uint8_t *buf, uint32_t ttl) {
+  *(uint32_t *)buf = htonl(ttl);
+  return sizeof(uint32_t);
+}
+
+int write_count(uint8_t *buf, BatchCount count) {
+  *(BatchCount *)buf = htons(count);
+  return sizeof(BatchCount);
+}
+
+/* Serialised size of a batch's COUNT and KEYS */
+size_t keys_size(BatchCount count, Key *keys) {
+  size_t s = sizeof(BatchCount);
+  for (BatchCount i = 0; i < count; i++)
+    s += key_size(&keys[i]);
+  return s;
+}
+
+size_t write_keys(uint8_t *buf, BatchCount count, Key *keys) {
+  size_t offset = write_count(buf, count);
+  for (BatchCount i = 0; i < count; i++)
+    offset += write_key(buf + offset, &keys[i]);
+  return offset;
+}
+
+/* Write a batch's COUNT and its COUNT one-byte FLAGS */
+size_t write_flags(uint8_t *buf, BatchCount count, bool *flags) {
+  size_t offset = write_count(buf, count);
+  for (BatchCount i = 0; i < count; i++)
+    buf[offset++] = flags[i];
+  return offset;
+}
+
+/* Serialised size of PUT's key, value and TTL */
+size_t put_size(MessagePut *put) {
+  return key_size(&put->key) + val_size(&put->val) + sizeof(put->ttl);
+}
+
+/* Return the serialised size of MSG, excluding its size. Computed in
+   size_t, as a large MGET_RESP can exceed MessageSize. */
+size_t get_message_size(Message *msg) {
+  size_t s;
   switch (msg->type) {
   case GET:
     s = key_size(&msg->message.get.key);
     break;
   case PUT:
-    s = key_size(&msg->message.put.key) + val_size(&msg->message.put.val);
+    s = put_size(&msg->message.put);
     break;
   case GET_RESP:
     s = msg->message.get_resp.val != NULL ? val_size(msg->message.get_resp.val) : 0;
     break;
   case PUT_RESP:
+  case DELETE_RESP:
+  case SNAPSHOT_RESP:
     s = 1;
     break;
+  case SNAPSHOT:
+    s = 0;
+    break;
+  case DELETE:
+    s = key_size(&msg->message.delete.key);
+    break;
+  case MGET:
+    s = keys_size(msg->message.mget.count, msg->message.mget.keys);
+    break;
+  case MDELETE:
+    s = keys_size(msg->message.mdelete.count, msg->message.mdelete.keys);
+    break;
+  case MPUT:
+    s = sizeof(BatchCount);
+    for (BatchCount i = 0; i < msg->message.mput.count; i++)
+      s += put_size(&msg->message.mput.puts[i]);
+    break;
+  case MGET_RESP:
+    /* Each result is a found flag, followed by the value if found */
+    s = sizeof(BatchCount) + msg->message.mget_resp.count;
+    for (BatchCount i = 0; i < msg->message.mget_resp.count; i++)
+      if (msg->message.mget_resp.vals[i])
+        s += val_size(msg->message.mget_resp.vals[i]);
+    break;
+  case MPUT_RESP:
+    s = sizeof(BatchCount) + msg->message.mput_resp.count;
+    break;
+  case MDELETE_RESP:
+    s = sizeof(BatchCount) + msg->message.mdelete_resp.count;
+    break;
   default:
     error(-1, 0, "Unrecognised message type: %d", msg->type);
   }
   return s + sizeof(MessageType);
 }
 
-/* Allocate buffer to serialise a message in network byte order,
-   prepending message size. Stores buffer size in BUF_SIZE. */
-uint8_t *out_serialise_message(Message *msg, size_t *buf_size) {
-  MessageSize msg_size = get_message_size(msg);
-  uint8_t *buf = malloc(msg_size + sizeof(MessageSize));
-  int offset = write_message_size(buf, msg_size);
+/* Return the number of bytes MSG serialises to, including its size */
+size_t serialised_message_size(Message *msg) {
+  return get_message_size(msg) + sizeof(MessageSize);
+}
+
+/* Serialise a message in network byte order into BUF, prepending
+   message size. BUF must have room for serialised_message_size()
+   bytes. */
+void serialise_message(Message *msg, uint8_t *buf) {
+  size_t msg_size = get_message_size(msg);
+  assert(msg_size <= UINT32_MAX);
+  size_t offset = write_message_size(buf, msg_size);
   offset += write_message_type(buf + offset, msg->type);
   switch (msg->type) {
   case GET:
@@ -63,7 +142,49 @@ uint8_t *out_serialise_message(Message *msg, size_t *buf_size) {
     break;
   case PUT:
     offset += write_key(buf + offset, &msg->message.put.key);
-    write_val(buf + offset, &msg->message.put.val);
+    offset += write_val(buf + offset, &msg->message.put.val);
+    write_ttl(buf + offset, msg->message.put.ttl);
+    break;
+  case DELETE:
+    write_key(buf + offset, &msg->message.delete.key);
+    break;
+  case MGET:
+    write_keys(buf + offset, msg->message.mget.count, msg->message.mget.keys);
+    break;
+  case MDELETE:
+    write_keys(buf + offset, msg->message.mdelete.count, msg->message.mdelete.keys);
+    break;
+  case MPUT:
+    offset += write_count(buf + offset, msg->message.mput.count);
+    for (BatchCount i = 0; i < msg->message.mput.count; i++) {
+      MessagePut *put = &msg->message.mput.puts[i];
+      offset += write_key(buf + offset, &put->key);
+      offset += write_val(buf + offset, &put->val);
+      offset += write_ttl(buf + offset, put->ttl);
+    }
+    break;
+  case MGET_RESP:
+    offset += write_count(buf + offset, msg->message.mget_resp.count);
+    for (BatchCount i = 0; i < msg->message.mget_resp.count; i++) {
+      Val *val = msg->message.mget_resp.vals[i];
+      buf[offset++] = val != NULL;
+      if (val)
+        offset += write_val(buf + offset, val);
+    }
+    break;
+  case MPUT_RESP:
+    write_flags(buf + offset, msg->message.mput_resp.count, msg->message.mput_resp.is_update);
+    break;
+  case MDELETE_RESP:
+    write_flags(buf + offset, msg->message.mdelete_resp.count, msg->message.mdelete_resp.deleted);
+    break;
+  case DELETE_RESP:
+    buf[offset] = msg->message.delete_resp.deleted;
+    break;
+  case SNAPSHOT:
+    break;
+  case SNAPSHOT_RESP:
+    buf[offset] = msg->message.snapshot_resp.started;
     break;
   case GET_RESP:
     /* If VAL is NULL, write nothing */
@@ -76,7 +197,24 @@ uint8_t *out_serialise_message(Message *msg, size_t *buf_size) {
   default:
     error(-1, 0, "Unrecognised message type: %d", msg->type);
   };
-  *buf_size = msg_size + sizeof(MessageSize);
+}
+
+/* Serialise the part of a GET_RESP for VAL preceding the value bytes,
+   which the caller sends separately. BUF must have room for
+   GET_RESP_HEADER_SIZE bytes. */
+void serialise_get_resp_header(Val *val, uint8_t *buf) {
+  Message msg = { .type = GET_RESP, .message.get_resp.val = val };
+  size_t offset = write_message_size(buf, get_message_size(&msg));
+  offset += write_message_type(buf + offset, GET_RESP);
+  *(ValSize *)(buf + offset) = htons(val->val_size);
+}
+
+/* Allocate buffer to serialise a message in network byte order,
+   prepending message size. Stores buffer size in BUF_SIZE. */
+uint8_t *out_serialise_message(Message *msg, size_t *buf_size) {
+  *buf_size = serialised_message_size(msg);
+  uint8_t *buf = malloc(*buf_size);
+  serialise_message(msg, buf);
   return buf;
 }
 
@@ -96,10 +234,32 @@ int deserialise_val(uint8_t *buf, Val *val) {
   return sizeof(ValSize) + val->val_size;
 }
 
+/* Read a batch's count into *COUNT and its keys into a new array at
+   *KEYS, returning bytes read */
+int deserialise_keys(uint8_t *buf, BatchCount *count, Key **keys) {
+  int offset = sizeof(BatchCount);
+  *count = read_u16(buf);
+  *keys = malloc(*count * sizeof(Key));
+  for (BatchCount i = 0; i < *count; i++)
+    offset += deserialise_key(buf + offset, &(*keys)[i]);
+  return offset;
+}
+
+/* Read a batch's count and one-byte flags, see deserialise_keys */
+int deserialise_flags(uint8_t *buf, BatchCount *count, bool **flags) {
+  int offset = sizeof(BatchCount);
+  *count = read_u16(buf);
+  *flags = malloc(*count * sizeof(bool));
+  for (BatchCount i = 0; i < *count; i++)
+    (*flags)[i] = buf[offset++];
+  return offset;
+}
+
 /* Deserialise a message (excluding MessageSize header) */
 Message *out_deserialise_message(uint8_t *buf, size_t buf_size) {
   MessageType msg_type = buf[0];
   size_t offset = sizeof(MessageType);
+  BatchCount count;
   Message *msg = malloc(sizeof(Message));
   msg->type = msg_type;
   switch (msg_type) {
@@ -108,7 +268,8 @@ Message *out_deserialise_message(uint8_t *buf, size_t buf_size) {
     break;
   case PUT:
     offset += deserialise_key(buf + offset, &msg->message.put.key);
-    deserialise_val(buf + offset, &msg->message.put.val);
+    offset += deserialise_val(buf + offset, &msg->message.put.val);
+    msg->message.put.ttl = ntohl(*(uint32_t *)(buf + offset));
     break;
   case GET_RESP:
     if (offset < buf_size) {
@@ -120,6 +281,56 @@ Message *out_deserialise_message(uint8_t *buf, size_t buf_size) {
   case PUT_RESP:
     msg->message.put_resp.is_update = buf[offset];
     break;
+  case DELETE:
+    deserialise_key(buf + offset, &msg->message.delete.key);
+    break;
+  case DELETE_RESP:
+    msg->message.delete_resp.deleted = buf[offset];
+    break;
+  case SNAPSHOT:
+    break;
+  case SNAPSHOT_RESP:
+    msg->message.snapshot_resp.started = buf[offset];
+    break;
+  case MGET:
+    deserialise_keys(buf + offset, &msg->message.mget.count, &msg->message.mget.keys);
+    break;
+  case MDELETE:
+    deserialise_keys(buf + offset, &msg->message.mdelete.count, &msg->message.mdelete.keys);
+    break;
+  case MPUT:
+    count = msg->message.mput.count = read_u16(buf + offset);
+    offset += sizeof(BatchCount);
+    msg->message.mput.puts = malloc(count * sizeof(MessagePut));
+    for (BatchCount i = 0; i < count; i++) {
+      MessagePut *put = &msg->message.mput.puts[i];
+      offset += deserialise_key(buf + offset, &put->key);
+      offset += deserialise_val(buf + offset, &put->val);
+      put->ttl = read_u32(buf + offset);
+      offset += sizeof(uint32_t);
+    }
+    break;
+  case MGET_RESP:
+    count = msg->message.mget_resp.count = read_u16(buf + offset);
+    offset += sizeof(BatchCount);
+    msg->message.mget_resp.vals = malloc(count * sizeof(Val *));
+    for (BatchCount i = 0; i < count; i++) {
+      Val *val = NULL;
+      if (buf[offset++]) {
+        val = malloc(sizeof(Val));
+        offset += deserialise_val(buf + offset, val);
+      }
+      msg->message.mget_resp.vals[i] = val;
+    }
+    break;
+  case MPUT_RESP:
+    deserialise_flags(buf + offset, &msg->message.mput_resp.count,
+                      &msg->message.mput_resp.is_update);
+    break;
+  case MDELETE_RESP:
+    deserialise_flags(buf + offset, &msg->message.mdelete_resp.count,
+                      &msg->message.mdelete_resp.deleted);
+    break;
   default:
     error(0, 0, "Unrecognised message type: %d", msg_type);
     free(msg);
@@ -129,6 +340,234 @@ Message *out_deserialise_message(uint8_t *buf, size_t buf_size) {
   return msg;
 }
 
+/* Read a big-endian integer from BUF, which need not be aligned */
+uint16_t read_u16(uint8_t *buf) {
+  uint16_t n;
+  memcpy(&n, buf, sizeof n);
+  return ntohs(n);
+}
+
+uint32_t read_u32(uint8_t *buf) {
+  uint32_t n;
+  memcpy(&n, buf, sizeof n);
+  return ntohl(n);
+}
+
+/* Write a big-endian integer to BUF, which need not be aligned */
+void put_u16(uint8_t *buf, uint16_t n) {
+  n = htons(n);
+  memcpy(buf, &n, sizeof n);
+}
+
+void put_u32(uint8_t *buf, uint32_t n) {
+  n = htonl(n);
+  memcpy(buf, &n, sizeof n);
+}
+
+/* Parse a key at *OFFSET of the BUF_SIZE bytes at BUF into a view,
+   advancing *OFFSET past it. Returns FALSE if it overruns BUF. */
+bool parse_key(uint8_t *buf, size_t buf_size, size_t *offset, Key *key) {
+  if (buf_size < *offset + sizeof(KeySize))
+    return false;
+  key->key_size = buf[*offset];
+  key->key = buf + *offset + sizeof(KeySize);
+  *offset += sizeof(KeySize) + key->key_size;
+  return *offset <= buf_size;
+}
+
+/* Parse a PUT's key, value and TTL, see parse_key */
+bool parse_put(uint8_t *buf, size_t buf_size, size_t *offset, MessagePut *put) {
+  if (!parse_key(buf, buf_size, offset, &put->key)
+      || buf_size < *offset + sizeof(ValSize))
+    return false;
+  put->val.val_size = read_u16(buf + *offset);
+  put->val.val = buf + *offset + sizeof(ValSize);
+  *offset += sizeof(ValSize) + put->val.val_size;
+  if (buf_size < *offset + sizeof(uint32_t))
+    return false;
+  put->ttl = read_u32(buf + *offset);
+  *offset += sizeof(uint32_t);
+  return true;
+}
+
+/* Parse a batch's count into *COUNT and its keys into views in a new
+   array at *KEYS, see parse_key. The array is allocated even if
+   parsing fails. */
+bool parse_keys(uint8_t *buf, size_t buf_size, size_t *offset, BatchCount *count,
+                Key **keys) {
+  *count = 0;
+  *keys = NULL;
+  if (buf_size < *offset + sizeof(BatchCount))
+    return false;
+  *count = read_u16(buf + *offset);
+  *offset += sizeof(BatchCount);
+  *keys = malloc(*count * sizeof(Key));
+  for (BatchCount i = 0; i < *count; i++)
+    if (!parse_key(buf, buf_size, offset, &(*keys)[i]))
+      return false;
+  return true;
+}
+
+/* Parse a batch of PUTs, see parse_keys */
+bool parse_puts(uint8_t *buf, size_t buf_size, size_t *offset, BatchCount *count,
+                MessagePut **puts) {
+  *count = 0;
+  *puts = NULL;
+  if (buf_size < *offset + sizeof(BatchCount))
+    return false;
+  *count = read_u16(buf + *offset);
+  *offset += sizeof(BatchCount);
+  *puts = malloc(*count * sizeof(MessagePut));
+  for (BatchCount i = 0; i < *count; i++)
+    if (!parse_put(buf, buf_size, offset, &(*puts)[i]))
+      return false;
+  return true;
+}
+
+/*
+ * Parse a request (excluding MessageSize header) from the BUF_SIZE
+ * bytes at BUF into MSG without copying: keys and values point into
+ * BUF, which must outlive MSG, and MSG must not be passed to
+ * free_message. The arrays of a batch request are allocated, and
+ * freed with free_message_views. Returns FALSE if BUF doesn't hold a
+ * well-formed request.
+ */
+bool parse_request(uint8_t *buf, size_t buf_size, Message *msg) {
+  size_t offset = sizeof(MessageType);
+  bool ok;
+  if (buf_size < offset)
+    return false;
+  msg->type = buf[0];
+  switch (msg->type) {
+  case GET:
+    ok = parse_key(buf, buf_size, &offset, &msg->message.get.key);
+    break;
+  case PUT:
+    ok = parse_put(buf, buf_size, &offset, &msg->message.put);
+    break;
+  case DELETE:
+    ok = parse_key(buf, buf_size, &offset, &msg->message.delete.key);
+    break;
+  case MGET:
+    ok = parse_keys(buf, buf_size, &offset, &msg->message.mget.count,
+                    &msg->message.mget.keys);
+    break;
+  case MPUT:
+    ok = parse_puts(buf, buf_size, &offset, &msg->message.mput.count,
+                    &msg->message.mput.puts);
+    break;
+  case MDELETE:
+    ok = parse_keys(buf, buf_size, &offset, &msg->message.mdelete.count,
+                    &msg->message.mdelete.keys);
+    break;
+  case SNAPSHOT:
+    ok = true;
+    break;
+  default:
+    return false;
+  }
+  if (ok && offset == buf_size)
+    return true;
+  free_message_views(msg);
+  return false;
+}
+
+/* Parse a value at *OFFSET into a view, see parse_key */
+bool parse_val(uint8_t *buf, size_t buf_size, size_t *offset, Val *val) {
+  if (buf_size < *offset + sizeof(ValSize))
+    return false;
+  val->val_size = read_u16(buf + *offset);
+  val->val = buf + *offset + sizeof(ValSize);
+  *offset += sizeof(ValSize) + val->val_size;
+  return *offset <= buf_size;
+}
+
+/* Parse a batch response's flags into a new array, see parse_keys */
+bool parse_flags(uint8_t *buf, size_t buf_size, size_t *offset, BatchCount *count,
+                 bool **flags) {
+  *count = 0;
+  *flags = NULL;
+  if (buf_size < *offset + sizeof(BatchCount))
+    return false;
+  *count = read_u16(buf + *offset);
+  *offset += sizeof(BatchCount);
+  *flags = malloc(*count * sizeof(bool));
+  if (buf_size < *offset + *count)
+    return false;
+  for (BatchCount i = 0; i < *count; i++)
+    (*flags)[i] = buf[(*offset)++];
+  return true;
+}
+
+/*
+ * Parse a response from the BUF_SIZE bytes at BUF into MSG without
+ * copying, as parse_request does for requests. A GET_RESP's value is
+ * described by *VAL. An MGET_RESP's array of value pointers is
+ * allocated together with the Vals they point to. Returns FALSE if BUF
+ * doesn't hold a well-formed response.
+ */
+bool parse_response(uint8_t *buf, size_t buf_size, Message *msg, Val *val) {
+  size_t offset = sizeof(MessageType);
+  bool ok = true;
+  if (buf_size < offset)
+    return false;
+  msg->type = buf[0];
+  switch (msg->type) {
+  case GET_RESP:
+    msg->message.get_resp.val = NULL;
+    if (offset < buf_size) {
+      ok = parse_val(buf, buf_size, &offset, val);
+      msg->message.get_resp.val = val;
+    }
+    break;
+  case PUT_RESP:
+    if ((ok = offset < buf_size))
+      msg->message.put_resp.is_update = buf[offset++];
+    break;
+  case DELETE_RESP:
+    if ((ok = offset < buf_size))
+      msg->message.delete_resp.deleted = buf[offset++];
+    break;
+  case SNAPSHOT_RESP:
+    if ((ok = offset < buf_size))
+      msg->message.snapshot_resp.started = buf[offset++];
+    break;
+  case MGET_RESP: {
+    if (buf_size < offset + sizeof(BatchCount))
+      return false;
+    BatchCount count = msg->message.mget_resp.count = read_u16(buf + offset);
+    offset += sizeof(BatchCount);
+    Val **vals = malloc(count * (sizeof(Val *) + sizeof(Val)));
+    Val *found = (Val *)(vals + count);
+    msg->message.mget_resp.vals = vals;
+    for (BatchCount i = 0; ok && i < count; i++) {
+      vals[i] = NULL;
+      if (!(ok = offset < buf_size))
+        break;
+      if (buf[offset++]) {
+        vals[i] = &found[i];
+        ok = parse_val(buf, buf_size, &offset, vals[i]);
+      }
+    }
+    break;
+  }
+  case MPUT_RESP:
+    ok = parse_flags(buf, buf_size, &offset, &msg->message.mput_resp.count,
+                     &msg->message.mput_resp.is_update);
+    break;
+  case MDELETE_RESP:
+    ok = parse_flags(buf, buf_size, &offset, &msg->message.mdelete_resp.count,
+                     &msg->message.mdelete_resp.deleted);
+    break;
+  default:
+    return false;
+  }
+  if (ok && offset == buf_size)
+    return true;
+  free_message_views(msg);
+  return false;
+}
+
 void
 free_message(Message *take_msg) {
   switch(take_msg->type) {
@@ -146,6 +585,58 @@ free_message(Message *take_msg) {
     if (take_msg->message.get_resp.val != NULL)
       free_val(take_msg->message.get_resp.val);
     break;
+  case DELETE:
+    free(take_msg->message.delete.key.key);
+    break;
+  case MGET:
+    for (BatchCount i = 0; i < take_msg->message.mget.count; i++)
+      free(take_msg->message.mget.keys[i].key);
+    break;
+  case MDELETE:
+    for (BatchCount i = 0; i < take_msg->message.mdelete.count; i++)
+      free(take_msg->message.mdelete.keys[i].key);
+    break;
+  case MPUT:
+    for (BatchCount i = 0; i < take_msg->message.mput.count; i++) {
+      free(take_msg->message.mput.puts[i].key.key);
+      free(take_msg->message.mput.puts[i].val.val);
+    }
+    break;
+  case MGET_RESP:
+    for (BatchCount i = 0; i < take_msg->message.mget_resp.count; i++)
+      if (take_msg->message.mget_resp.vals[i] != NULL)
+        free_val(take_msg->message.mget_resp.vals[i]);
+    break;
   }
+  free_message_views(take_msg);
   free(take_msg);
 };
+
+/* Free the arrays of a batch message, but not the keys and values
+   they hold, as for requests from parse_request or responses pointing
+   into a table. Does nothing for other messages. */
+void
+free_message_views(Message *msg) {
+  switch (msg->type) {
+  case MGET:
+    free(msg->message.mget.keys);
+    break;
+  case MPUT:
+    free(msg->message.mput.puts);
+    break;
+  case MGET_RESP:
+    free(msg->message.mget_resp.vals);
+    break;
+  case MPUT_RESP:
+    free(msg->message.mput_resp.is_update);
+    break;
+  case MDELETE:
+    free(msg->message.mdelete.keys);
+    break;
+  case MDELETE_RESP:
+    free(msg->message.mdelete_resp.deleted);
+    break;
+  default:
+    break;
+  }
+}
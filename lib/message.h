@@ -2,10 +2,12 @@
 #define _MESSAGE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "hash_table.h"
 
 typedef uint32_t MessageSize;
+typedef uint16_t BatchCount;
 
 typedef struct MessageGet {
   Key key;
@@ -18,17 +20,74 @@ typedef struct MessageGetResp {
 typedef struct MessagePut {
   Key key;
   Val val;
+  uint32_t ttl;                 /* Seconds, or zero for no expiry */
 } MessagePut;
 
 typedef struct MessagePutResp {
   bool is_update;
 } MessagePutResp;
 
+typedef struct MessageDelete {
+  Key key;
+} MessageDelete;
+
+typedef struct MessageDeleteResp {
+  bool deleted;                 /* FALSE if the key wasn't found */
+} MessageDeleteResp;
+
+/* SNAPSHOT takes no arguments, and starts a background dump of the
+   table (see snapshot.h) */
+typedef struct MessageSnapshotResp {
+  bool started;                 /* FALSE if one is already running */
+} MessageSnapshotResp;
+
+/* Batch requests carry COUNT keys (and values), and their responses
+   COUNT results in the same order */
+typedef struct MessageMGet {
+  BatchCount count;
+  Key *keys;
+} MessageMGet;
+
+typedef struct MessageMGetResp {
+  BatchCount count;
+  Val **vals;                   /* NULL where the key wasn't found */
+} MessageMGetResp;
+
+typedef struct MessageMPut {
+  BatchCount count;
+  MessagePut *puts;
+} MessageMPut;
+
+typedef struct MessageMPutResp {
+  BatchCount count;
+  bool *is_update;
+} MessageMPutResp;
+
+typedef struct MessageMDelete {
+  BatchCount count;
+  Key *keys;
+} MessageMDelete;
+
+typedef struct MessageMDeleteResp {
+  BatchCount count;
+  bool *deleted;
+} MessageMDeleteResp;
+
 enum MessageType {
   GET,
   PUT,
   GET_RESP,
-  PUT_RESP
+  PUT_RESP,
+  MGET,
+  MPUT,
+  MGET_RESP,
+  MPUT_RESP,
+  DELETE,
+  DELETE_RESP,
+  MDELETE,
+  MDELETE_RESP,
+  SNAPSHOT,
+  SNAPSHOT_RESP
 } __attribute__ ((__packed__));
 
 typedef enum MessageType MessageType;
@@ -38,6 +97,15 @@ typedef union MessageUnion {
   MessagePut put;
   MessageGetResp get_resp;
   MessagePutResp put_resp;
+  MessageMGet mget;
+  MessageMPut mput;
+  MessageMGetResp mget_resp;
+  MessageMPutResp mput_resp;
+  MessageDelete delete;
+  MessageDeleteResp delete_resp;
+  MessageMDelete mdelete;
+  MessageMDeleteResp mdelete_resp;
+  MessageSnapshotResp snapshot_resp;
 } MessageUnion;
 
 typedef struct Message {
@@ -45,11 +113,46 @@ typedef struct Message {
   MessageUnion message;
 } Message;
 
+/* Serialised size of the largest single-key request, a PUT of the
+   largest key and value */
+#define MESSAGE_MAX_SIZE (sizeof(MessageSize) + sizeof(MessageType)  \
+                          + sizeof(KeySize) + UINT8_MAX               \
+                          + sizeof(ValSize) + UINT16_MAX + sizeof(uint32_t))
+
+/* Largest MGET_RESP the server sends. A batch of large values could
+   otherwise need more than a MessageSize can hold, so an MGET whose
+   response would be larger is refused with an empty MGET_RESP. */
+#define MGET_RESP_MAX_SIZE ((size_t)64 << 20)
+
+/* Bytes of a GET_RESP with a value which precede the value bytes */
+#define GET_RESP_HEADER_SIZE (sizeof(MessageSize) + sizeof(MessageType) + sizeof(ValSize))
+
+size_t serialised_message_size(Message *msg);
+
+void serialise_message(Message *msg, uint8_t *buf);
+
+void serialise_get_resp_header(Val *val, uint8_t *buf);
+
 uint8_t *out_serialise_message(Message *msg, size_t *buf_size);
 
 Message *out_deserialise_message(uint8_t *buf, size_t buf_size);
 
+bool parse_request(uint8_t *buf, size_t buf_size, Message *msg);
+
+bool parse_response(uint8_t *buf, size_t buf_size, Message *msg, Val *val);
+
+uint16_t read_u16(uint8_t *buf);
+
+uint32_t read_u32(uint8_t *buf);
+
+void put_u16(uint8_t *buf, uint16_t n);
+
+void put_u32(uint8_t *buf, uint32_t n);
+
 void
 free_message(Message *msg);
 
+void
+free_message_views(Message *msg);
+
 #endif
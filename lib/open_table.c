@@ -0,0 +1,345 @@
+/*
+ * Open-addressing engine (ENGINE_OPEN), in the style of Swiss
+ * tables. Slots are arranged in groups of GROUP_WIDTH, and each slot
+ * has a control byte which is either CTRL_EMPTY, CTRL_DELETED or, for
+ * a full slot, a 7-bit fingerprint of its hash. A probe loads a whole
+ * group of control bytes as one word and only compares keys for slots
+ * whose fingerprint matches, so most misses never touch key bytes.
+ *
+ * Groups are probed in triangular order from the group selected by
+ * the remaining hash bits, which visits every group since the group
+ * count is a power of two. A probe stops at the first group holding
+ * an empty slot.
+ *
+ * Resizing is incremental as for ENGINE_CHAINED, but an entry's old
+ * position says nothing about its new one, so lookups during a resize
+ * search the new array and then the old one.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <endian.h>
+#include "hash_table.h"
+#include "open_table.h"
+
+#define GROUP_WIDTH 8
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define LSBS 0x0101010101010101ULL
+#define MSBS 0x8080808080808080ULL
+
+/* Grow when full and deleted slots exceed 7/8 of the table */
+#define OPEN_MAX_LOAD_NUM 7
+#define OPEN_MAX_LOAD_DEN 8
+/* Shrink when fewer than one slot in OPEN_MIN_LOAD_INV is full */
+#define OPEN_MIN_LOAD_INV 8
+/* Old groups migrated per operation during a resize */
+#define OPEN_REHASH_GROUPS 2
+
+typedef uint64_t Group;
+
+uint8_t fingerprint(uint64_t h) {
+  return h & 0x7f;
+}
+
+bool is_full(uint8_t ctrl) {
+  return !(ctrl & CTRL_EMPTY);
+}
+
+/* Load the control bytes of group G, byte i of the group in bits
+   [8i, 8i + 8) */
+Group load_group(uint8_t *ctrl, unsigned int g) {
+  Group grp;
+  memcpy(&grp, ctrl + g * GROUP_WIDTH, sizeof(Group));
+  return le64toh(grp);
+}
+
+/* Return a mask with the high bit set in each byte of GRP equal to
+   FP. May report false positives, which the caller must reject. */
+uint64_t group_match(Group grp, uint8_t fp) {
+  Group x = grp ^ (LSBS * fp);
+  return (x - LSBS) & ~x & MSBS;
+}
+
+/* Return a mask with the high bit set in each CTRL_EMPTY byte */
+uint64_t group_match_empty(Group grp) {
+  return grp & ~(grp << 6) & MSBS;
+}
+
+/* Return a mask with the high bit set in each empty or deleted byte */
+uint64_t group_match_free(Group grp) {
+  return grp & MSBS;
+}
+
+/* Index within a group of the lowest byte flagged in MASK */
+unsigned int mask_index(uint64_t mask) {
+  return __builtin_ctzll(mask) / 8;
+}
+
+/* Return the slot index holding KEY in CTRL/SLOTS, or -1 if absent */
+long open_find(uint8_t *ctrl, Entry **slots, unsigned int size, Key *key, uint64_t h) {
+  unsigned int mask = size / GROUP_WIDTH - 1;
+  unsigned int g = (h >> 7) & mask;
+  uint8_t fp = fingerprint(h);
+  for (unsigned int step = 1; ; step++) {
+    Group grp = load_group(ctrl, g);
+    for (uint64_t m = group_match(grp, fp); m; m &= m - 1) {
+      unsigned int i = g * GROUP_WIDTH + mask_index(m);
+      if (ctrl[i] == fp && entry_has_key(slots[i], key))
+        return i;
+    }
+    if (group_match_empty(grp) || step > mask)
+      return -1;
+    g = (g + step) & mask;
+  }
+}
+
+/* Return the first empty or deleted slot on the probe sequence for
+   H. The table must not be full. */
+unsigned int open_find_free(uint8_t *ctrl, unsigned int size, uint64_t h) {
+  unsigned int mask = size / GROUP_WIDTH - 1;
+  unsigned int g = (h >> 7) & mask;
+  for (unsigned int step = 1; ; step++) {
+    uint64_t m = group_match_free(load_group(ctrl, g));
+    if (m)
+      return g * GROUP_WIDTH + mask_index(m);
+    assert(step <= mask);
+    g = (g + step) & mask;
+  }
+}
+
+/* Store ENTRY, whose key hashes to H, in the current array */
+void open_insert(HashTable *ht, Entry *take_entry, uint64_t h) {
+  unsigned int i = open_find_free(ht->ctrl, ht->size, h);
+  if (ht->ctrl[i] == CTRL_DELETED)
+    --ht->tombstones;
+  ht->ctrl[i] = fingerprint(h);
+  ht->slots[i] = take_entry;
+}
+
+/* Free slot I of CTRL/SLOTS. If its group still has an empty slot, no
+   probe has ever continued past the group, so the slot can be marked
+   empty rather than deleted. Returns TRUE if a tombstone was left. */
+bool open_erase(HashTable *ht, uint8_t *ctrl, Entry **slots, unsigned int i) {
+  drop_entry(ht, slots[i]);
+  slots[i] = NULL;
+  if (group_match_empty(load_group(ctrl, i / GROUP_WIDTH))) {
+    ctrl[i] = CTRL_EMPTY;
+    return false;
+  }
+  ctrl[i] = CTRL_DELETED;
+  return true;
+}
+
+/* Allocate the current arrays with SIZE slots, all empty */
+void open_alloc(HashTable *ht, unsigned int size) {
+  ht->ctrl = malloc(size);
+  assert(ht->ctrl != 0);
+  memset(ht->ctrl, CTRL_EMPTY, size);
+  ht->slots = calloc(size, sizeof(Entry *));
+  assert(ht->slots != 0);
+  ht->size = size;
+  ht->tombstones = 0;
+}
+
+/* Initialise an empty table with at least SIZE slots */
+void open_table_init(HashTable *ht, unsigned int size) {
+  unsigned int n = GROUP_WIDTH;
+  while (n < size)
+    n *= 2;
+  open_alloc(ht, n);
+  ht->min_size = n;
+  ht->old_ctrl = NULL;
+  ht->old_slots = NULL;
+}
+
+void open_start_resize(HashTable *ht, unsigned int new_size) {
+  ht->old_ctrl = ht->ctrl;
+  ht->old_slots = ht->slots;
+  ht->old_size = ht->size;
+  ht->rehash_idx = 0;
+  open_alloc(ht, new_size);
+}
+
+/* Move a bounded number of old groups into the current arrays,
+   finishing the resize once they have all been visited. Migrated
+   slots are marked deleted so lookups in the old array skip them. */
+void open_rehash_step(HashTable *ht) {
+  unsigned int end = ht->rehash_idx + OPEN_REHASH_GROUPS * GROUP_WIDTH;
+  if (end > ht->old_size)
+    end = ht->old_size;
+  for (unsigned int i = ht->rehash_idx; i < end; i++) {
+    if (is_full(ht->old_ctrl[i])) {
+      Entry *entry = ht->old_slots[i];
+      Key key = entry_key(entry);
+      open_insert(ht, entry, hash(&key));
+      ht->old_ctrl[i] = CTRL_DELETED;
+    }
+  }
+  ht->rehash_idx = end;
+  if (ht->rehash_idx == ht->old_size) {
+    free(ht->old_ctrl);
+    free(ht->old_slots);
+    ht->old_ctrl = NULL;
+    ht->old_slots = NULL;
+    ht->old_size = 0;
+    ht->rehash_idx = 0;
+  }
+}
+
+/* Advance any resize in progress, or start one if the load factor is
+   out of bounds. A table mostly full of tombstones is rebuilt at the
+   same size. */
+void open_maintain(HashTable *ht) {
+  if (ht->old_size)
+    open_rehash_step(ht);
+  else if ((unsigned long)(ht->item_count + ht->tombstones) * OPEN_MAX_LOAD_DEN
+           > (unsigned long)ht->size * OPEN_MAX_LOAD_NUM) {
+    if ((unsigned long)ht->item_count * 2 * OPEN_MAX_LOAD_DEN
+        > (unsigned long)ht->size * OPEN_MAX_LOAD_NUM)
+      open_start_resize(ht, ht->size * 2);
+    else
+      open_start_resize(ht, ht->size);
+  } else if (ht->size / 2 >= ht->min_size
+             && ht->item_count < ht->size / OPEN_MIN_LOAD_INV)
+    open_start_resize(ht, ht->size / 2);
+}
+
+bool open_table_put(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h) {
+  open_maintain(ht);
+  Entry *entry;
+  bool expired;
+  long i = open_find(ht->ctrl, ht->slots, ht->size, key, h);
+  if (i >= 0) {
+    expired = entry_is_expired(ht, ht->slots[i]);
+    entry = ht->slots[i] = entry_set_val(&ht->slab, ht->slots[i], val);
+  } else if (ht->old_size
+             && (i = open_find(ht->old_ctrl, ht->old_slots, ht->old_size, key, h)) >= 0) {
+    /* Migrate the existing entry along with its new value */
+    expired = entry_is_expired(ht, ht->old_slots[i]);
+    entry = entry_set_val(&ht->slab, ht->old_slots[i], val);
+    ht->old_ctrl[i] = CTRL_DELETED;
+    open_insert(ht, entry, h);
+  } else {
+    entry = create_entry(&ht->slab, key, val);
+    entry_set_ttl(ht, entry, ttl);
+    open_insert(ht, entry, h);
+    ++ht->item_count;
+    return 0;
+  }
+  /* An expired entry is reused, but reported as a new entry */
+  entry->flags |= ENTRY_REFERENCED;
+  entry_set_ttl(ht, entry, ttl);
+  ht->expirations += expired;
+  return !expired;
+}
+
+/* Erase slot I of the current (or, if IS_OLD, old) array */
+void open_remove(HashTable *ht, bool is_old, unsigned int i) {
+  if (is_old)
+    /* Tombstones in the old array are discarded with it */
+    open_erase(ht, ht->old_ctrl, ht->old_slots, i);
+  else
+    ht->tombstones += open_erase(ht, ht->ctrl, ht->slots, i);
+  --ht->item_count;
+}
+
+/* Return the slot index holding KEY, with hash H, in either array,
+   setting IS_OLD if found in the old one, or -1 if absent */
+long open_lookup(HashTable *ht, Key *key, uint64_t h, bool *is_old) {
+  long i = open_find(ht->ctrl, ht->slots, ht->size, key, h);
+  *is_old = false;
+  if (i < 0 && ht->old_size) {
+    i = open_find(ht->old_ctrl, ht->old_slots, ht->old_size, key, h);
+    *is_old = true;
+  }
+  return i;
+}
+
+/* Return the slot holding KEY, which must be present, without
+   migrating any slots */
+Entry **open_table_ref(HashTable *ht, Key *key, uint64_t h) {
+  bool is_old;
+  long i = open_lookup(ht, key, h, &is_old);
+  assert(i >= 0);
+  return is_old ? &ht->old_slots[i] : &ht->slots[i];
+}
+
+Val *open_table_get(HashTable *ht, Key *key, uint64_t h) {
+  open_maintain(ht);
+  bool is_old;
+  long i = open_lookup(ht, key, h, &is_old);
+  if (i < 0)
+    return NULL;
+  Entry *entry = is_old ? ht->old_slots[i] : ht->slots[i];
+  if (entry_is_expired(ht, entry)) {
+    open_remove(ht, is_old, i);
+    ++ht->expirations;
+    return NULL;
+  }
+  entry->flags |= ENTRY_REFERENCED;
+  return &entry->val;
+}
+
+int open_table_delete(HashTable *ht, Key *key, uint64_t h) {
+  open_maintain(ht);
+  bool is_old;
+  long i = open_lookup(ht, key, h, &is_old);
+  if (i < 0)
+    return 1;
+  Entry *entry = is_old ? ht->old_slots[i] : ht->slots[i];
+  bool expired = entry_is_expired(ht, entry);
+  open_remove(ht, is_old, i);
+  ht->expirations += expired;
+  return expired;
+}
+
+/* Evict one entry from a non-empty table by CLOCK (see evict_one).
+   The hand sweeps the old slots (if resizing) followed by the current
+   ones. */
+void open_table_evict(HashTable *ht) {
+  for (;;) {
+    ht->clock_hand %= ht->old_size + ht->size;
+    unsigned int pos = ht->clock_hand++;
+    bool is_old = pos < ht->old_size;
+    uint8_t *ctrl = is_old ? ht->old_ctrl : ht->ctrl;
+    Entry **slots = is_old ? ht->old_slots : ht->slots;
+    unsigned int i = is_old ? pos : pos - ht->old_size;
+    if (!is_full(ctrl[i]))
+      continue;
+    if (slots[i]->flags & ENTRY_REFERENCED) {
+      slots[i]->flags &= ~ENTRY_REFERENCED;
+      continue;
+    }
+    open_remove(ht, is_old, i);
+    return;
+  }
+}
+
+/* Call FN on each entry, see hash_table_for_each */
+int open_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg) {
+  int ret;
+  for (unsigned int i = 0; i < ht->old_size; i++)
+    if (is_full(ht->old_ctrl[i]) && (ret = fn(ht->old_slots[i], arg)))
+      return ret;
+  for (unsigned int i = 0; i < ht->size; i++)
+    if (is_full(ht->ctrl[i]) && (ret = fn(ht->slots[i], arg)))
+      return ret;
+  return 0;
+}
+
+/* Size an empty table for COUNT entries, see hash_table_reserve */
+void open_table_reserve(HashTable *ht, unsigned int count) {
+  unsigned int n = ht->size;
+  while ((unsigned long)n * OPEN_MAX_LOAD_NUM < (unsigned long)count * OPEN_MAX_LOAD_DEN)
+    n *= 2;
+  if (n == ht->size)
+    return;
+  free(ht->ctrl);
+  free(ht->slots);
+  open_alloc(ht, n);
+  ht->min_size = n;
+}
@@ -0,0 +1,25 @@
+#ifndef _OPEN_TABLE_H
+#define _OPEN_TABLE_H
+
+#include <stdbool.h>
+#include "hash_table.h"
+
+/* ENGINE_OPEN implementation of the hash_table_* API */
+
+void open_table_init(HashTable *ht, unsigned int size);
+
+bool open_table_put(HashTable *ht, Key *key, Val *val, uint32_t ttl, uint64_t h);
+
+Val *open_table_get(HashTable *ht, Key *key, uint64_t h);
+
+Entry **open_table_ref(HashTable *ht, Key *key, uint64_t h);
+
+int open_table_delete(HashTable *ht, Key *key, uint64_t h);
+
+void open_table_evict(HashTable *ht);
+
+int open_table_for_each(HashTable *ht, int (*fn)(Entry *entry, void *arg), void *arg);
+
+void open_table_reserve(HashTable *ht, unsigned int count);
+
+#endif
@@ -0,0 +1,478 @@
+/*
+ * Replication (see repl.h). The primary's thread polls its listener
+ * and replica connections, which are non-blocking once their snapshot
+ * has been sent, so a slow replica only grows its own queue. A
+ * replica's thread reads the stream with blocking reads and applies
+ * each request under the locks of its keys' shards, so reads carry on
+ * alongside it.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "hash_table.h"
+#include "message.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "repl.h"
+
+#define REPL_BUF_SIZE (1 << 20)
+/* Each record starts with the time it was applied, as in the log */
+#define REPL_RECORD_HEADER (sizeof(uint32_t) + sizeof(MessageSize))
+
+/* Make room for SIZE bytes in *BUF, of capacity *CAP */
+void repl_grow(uint8_t **buf, size_t *cap, size_t size) {
+  if (size <= *cap)
+    return;
+  size_t new_cap = *cap ? *cap : REPL_BUF_SIZE;
+  while (new_cap < size)
+    new_cap *= 2;
+  *buf = realloc(*buf, new_cap);
+  assert(*buf != 0);
+  *cap = new_cap;
+}
+
+void *run_primary(void *arg);
+
+/*
+ * Start replicating the writes made to ST, which are to be passed to
+ * primary_append, to each replica connecting to LISTENER, a listening
+ * socket. Writes are sent in batches every BATCH_MS milliseconds.
+ * Returns NULL, setting errno, on failure. Mapped tables can't be
+ * replicated (ENOTSUP), as the snapshot is sent from a forked copy.
+ */
+Primary *create_primary(ShardedTable *st, int listener, unsigned int batch_ms) {
+  if (sharded_table_is_mapped(st)) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+  Primary *primary = calloc(1, sizeof(Primary));
+  assert(primary != 0);
+  pthread_mutex_init(&primary->lock, NULL);
+  primary->st = st;
+  primary->listener = listener;
+  primary->batch_ms = batch_ms;
+  int err = pthread_create(&primary->thread, NULL, run_primary, primary);
+  if (err) {
+    pthread_mutex_destroy(&primary->lock);
+    free(primary);
+    errno = err;
+    return NULL;
+  }
+  st->primary = primary;
+  return primary;
+}
+
+/*
+ * Queue write request MSG, applied at time NOW (as the table's clock
+ * read), for the replicas. Must be called while holding the locks of
+ * the shards owning MSG's keys, so that replicas apply each key's
+ * writes in the same order, and so that no write is missed by a
+ * replica's snapshot.
+ */
+void primary_append(Primary *primary, Message *msg, uint32_t now) {
+  pthread_mutex_lock(&primary->lock);
+  if (primary->replica_count) {
+    size_t size = sizeof(uint32_t) + serialised_message_size(msg);
+    repl_grow(&primary->buf, &primary->cap, primary->len + size);
+    uint8_t *p = primary->buf + primary->len;
+    put_u32(p, now);
+    serialise_message(msg, p + sizeof(uint32_t));
+    primary->len += size;
+  }
+  pthread_mutex_unlock(&primary->lock);
+}
+
+void free_link(ReplicaLink *take_link) {
+  if (take_link->sync_pid) {
+    kill(take_link->sync_pid, SIGKILL);
+    waitpid(take_link->sync_pid, NULL, 0);
+  }
+  close(take_link->fd);
+  free(take_link->out);
+  free(take_link);
+}
+
+/* Disconnect the replica at *LINK, reporting WHY unless it's NULL, as
+   when the replica hung up. Links are only added and removed by the
+   primary's thread, which takes the lock to do so, as others only
+   read them. */
+void drop_link(Primary *primary, ReplicaLink **link, const char *why) {
+  ReplicaLink *dropped = *link;
+  if (why)
+    error(0, 0, "dropping replica on socket %d: %s", dropped->fd, why);
+  pthread_mutex_lock(&primary->lock);
+  *link = dropped->next;
+  --primary->replica_count;
+  pthread_mutex_unlock(&primary->lock);
+  free_link(dropped);
+}
+
+/* Send what LINK has queued, as far as the socket takes it, adding
+   the bytes sent to *SENT. Returns -1, setting errno, if the
+   connection has failed. */
+int flush_link(ReplicaLink *link, size_t *sent) {
+  while (link->out_sent < link->out_len) {
+    ssize_t n = send(link->fd, link->out + link->out_sent, link->out_len - link->out_sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    link->out_sent += n;
+    *sent += n;
+  }
+  link->out_len = link->out_sent = 0;
+  return 0;
+}
+
+/* Queue LEN bytes at BUF for LINK */
+void queue_link(ReplicaLink *link, uint8_t *buf, size_t len) {
+  if (!len)
+    return;
+  if (link->out_sent) {
+    memmove(link->out, link->out + link->out_sent, link->out_len - link->out_sent);
+    link->out_len -= link->out_sent;
+    link->out_sent = 0;
+  }
+  repl_grow(&link->out, &link->out_cap, link->out_len + len);
+  memcpy(link->out + link->out_len, buf, len);
+  link->out_len += len;
+}
+
+/*
+ * Accept a replica on FD: fork a child to send it a snapshot, and
+ * queue the writes appended from then on. Every shard is locked
+ * across the fork, as for fork_snapshot, so each write is either in
+ * the snapshot or queued.
+ */
+void start_sync(Primary *primary, int fd) {
+  ShardedTable *st = primary->st;
+  ReplicaLink *link = calloc(1, sizeof(ReplicaLink));
+  assert(link != 0);
+  link->fd = fd;
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_lock(&st->shards[i]);
+  pthread_mutex_lock(&primary->lock);
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* Don't hold the other replicas' connections open */
+    for (ReplicaLink *other = primary->links; other; other = other->next)
+      close(other->fd);
+    _exit(write_snapshot(st, fd) == -1);
+  }
+  if (pid == -1) {
+    error(0, errno, "fork");
+    close(fd);
+    free(link);
+  } else {
+    link->sync_pid = pid;
+    link->skip = primary->len;
+    link->next = primary->links;
+    primary->links = link;
+    ++primary->replica_count;
+    ++primary->syncs;
+  }
+  pthread_mutex_unlock(&primary->lock);
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_unlock(&st->shards[i]);
+}
+
+/* Once LINK's snapshot child has exited, switch it to streaming, or
+   return -1 if the snapshot failed */
+int check_sync(ReplicaLink *link) {
+  int status;
+  pid_t pid = waitpid(link->sync_pid, &status, WNOHANG);
+  if (pid == 0 || (pid == -1 && errno == EINTR))
+    return 0;
+  link->sync_pid = 0;
+  if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+    return -1;
+  fcntl(link->fd, F_SETFL, fcntl(link->fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+/* Queue the writes appended since the last batch for every replica,
+   and send each what it can take. Replicas still being sent their
+   snapshot only queue. */
+void send_batch(Primary *primary) {
+  size_t sent = 0;
+  pthread_mutex_lock(&primary->lock);
+  uint8_t *buf = primary->buf;
+  size_t len = primary->len;
+  size_t cap = primary->cap;
+  primary->buf = primary->out;
+  primary->cap = primary->out_cap;
+  primary->len = 0;
+  primary->out = buf;
+  primary->out_cap = cap;
+  pthread_mutex_unlock(&primary->lock);
+  for (ReplicaLink **link = &primary->links; *link;) {
+    ReplicaLink *l = *link;
+    size_t skip = l->skip < len ? l->skip : len;
+    l->skip = 0;
+    queue_link(l, buf + skip, len - skip);
+    const char *why = NULL;
+    if (l->sync_pid && check_sync(l) == -1)
+      why = "snapshot failed";
+    else if (!l->sync_pid && flush_link(l, &sent) == -1)
+      why = strerror(errno);
+    else if (l->out_len - l->out_sent > REPL_MAX_BACKLOG)
+      why = "too far behind";
+    if (why)
+      drop_link(primary, link, why);
+    else
+      link = &l->next;
+  }
+  pthread_mutex_lock(&primary->lock);
+  primary->batches += len != 0;
+  primary->bytes_sent += sent;
+  pthread_mutex_unlock(&primary->lock);
+}
+
+/* Return TRUE if the replica at FD has hung up. Replicas send
+   nothing, so any input means the connection is over. */
+bool link_closed(int fd) {
+  uint8_t byte;
+  ssize_t n = recv(fd, &byte, 1, MSG_DONTWAIT);
+  return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+bool primary_stopping(Primary *primary) {
+  pthread_mutex_lock(&primary->lock);
+  bool stop = primary->stop;
+  pthread_mutex_unlock(&primary->lock);
+  return stop;
+}
+
+/*
+ * The primary's thread, accepting replicas and sending a batch of
+ * writes every BATCH_MS. It polls the replicas too, to notice them
+ * hanging up and to finish sends their sockets couldn't take at once.
+ */
+void *run_primary(void *arg) {
+  Primary *primary = arg;
+  struct pollfd *pfds = NULL;
+  size_t pfd_cap = 0;
+  while (!primary_stopping(primary)) {
+    size_t n = 0;
+    if (pfd_cap < primary->replica_count + 1) {
+      pfd_cap = primary->replica_count + 1;
+      pfds = realloc(pfds, pfd_cap * sizeof(struct pollfd));
+      assert(pfds != 0);
+    }
+    pfds[n++] = (struct pollfd) { .fd = primary->listener, .events = POLLIN };
+    for (ReplicaLink *link = primary->links; link; link = link->next)
+      pfds[n++] = (struct pollfd) {
+        .fd = link->fd,
+        .events = POLLIN | (link->out_sent < link->out_len ? POLLOUT : 0)
+      };
+    poll(pfds, n, primary->batch_ms);
+    for (size_t i = 1; i < n; i++) {
+      if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) || !link_closed(pfds[i].fd))
+        continue;
+      for (ReplicaLink **link = &primary->links; *link; link = &(*link)->next)
+        if ((*link)->fd == pfds[i].fd) {
+          drop_link(primary, link, NULL);
+          break;
+        }
+    }
+    int fd;
+    if ((pfds[0].revents & POLLIN) && (fd = accept(primary->listener, NULL, NULL)) != -1)
+      start_sync(primary, fd);
+    send_batch(primary);
+  }
+  free(pfds);
+  return NULL;
+}
+
+/* Stop the primary's thread. Appends are still queued, for
+   free_primary to send. Must be called with no shard locked, as
+   syncing a replica locks them all. */
+void primary_stop(Primary *primary) {
+  pthread_mutex_lock(&primary->lock);
+  bool running = !primary->stop;
+  primary->stop = true;
+  pthread_mutex_unlock(&primary->lock);
+  if (running)
+    pthread_join(primary->thread, NULL);
+}
+
+/* Stop replicating, sending each replica what its socket takes of the
+   last batch and disconnecting it. Must not run alongside writes to
+   the table, nor with any shard locked unless primary_stop has been
+   called first. */
+void free_primary(Primary *take_primary) {
+  primary_stop(take_primary);
+  send_batch(take_primary);
+  if (take_primary->st->primary == take_primary)
+    take_primary->st->primary = NULL;
+  while (take_primary->links) {
+    ReplicaLink *link = take_primary->links;
+    take_primary->links = link->next;
+    free_link(link);
+  }
+  pthread_mutex_destroy(&take_primary->lock);
+  free(take_primary->buf);
+  free(take_primary->out);
+  free(take_primary);
+}
+
+void print_primary_stats(Primary *primary, FILE *out) {
+  unsigned int syncing = 0;
+  pthread_mutex_lock(&primary->lock);
+  for (ReplicaLink *link = primary->links; link; link = link->next)
+    syncing += link->sync_pid != 0;
+  fprintf(out, "primary: replicas: %u syncing: %u syncs: %lu batches: %lu bytes_sent: %zu\n",
+          primary->replica_count, syncing, primary->syncs, primary->batches,
+          primary->bytes_sent);
+  pthread_mutex_unlock(&primary->lock);
+}
+
+/* Make sure at least N bytes are buffered from POS onwards. Returns
+   FALSE if the stream ends or fails first. */
+bool replica_fill(Replica *replica, size_t n) {
+  if (replica->len - replica->pos >= n)
+    return true;
+  if (replica->pos) {
+    memmove(replica->buf, replica->buf + replica->pos, replica->len - replica->pos);
+    replica->len -= replica->pos;
+    replica->pos = 0;
+  }
+  repl_grow(&replica->buf, &replica->cap, n);
+  while (replica->len < n) {
+    ssize_t got = read(replica->fd, replica->buf + replica->len, replica->cap - replica->len);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (got == 0)
+        errno = 0;
+      return false;
+    }
+    replica->len += got;
+    __atomic_fetch_add(&replica->bytes_received, got, __ATOMIC_RELAXED);
+  }
+  return true;
+}
+
+void apply_put(ShardedTable *st, MessagePut *put, uint32_t then) {
+  Shard *shard = sharded_table_shard(st, &put->key);
+  shard_lock(shard);
+  replay_put(st, put, then);
+  shard_unlock(shard);
+}
+
+void apply_delete(ShardedTable *st, Key *key) {
+  Shard *shard = sharded_table_shard(st, key);
+  shard_lock(shard);
+  replay_delete(st, key);
+  shard_unlock(shard);
+}
+
+/* Apply MSG, applied by the primary at time THEN, to ST, one key at a
+   time. Returns FALSE if MSG isn't a write. */
+bool apply_request(ShardedTable *st, Message *msg, uint32_t then) {
+  switch (msg->type) {
+  case PUT:
+    apply_put(st, &msg->message.put, then);
+    return true;
+  case DELETE:
+    apply_delete(st, &msg->message.delete.key);
+    return true;
+  case MPUT:
+    for (BatchCount i = 0; i < msg->message.mput.count; i++)
+      apply_put(st, &msg->message.mput.puts[i], then);
+    return true;
+  case MDELETE:
+    for (BatchCount i = 0; i < msg->message.mdelete.count; i++)
+      apply_delete(st, &msg->message.mdelete.keys[i]);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* The replica's thread, applying the primary's writes until the
+   stream ends */
+void *run_replica(void *arg) {
+  Replica *replica = arg;
+  Message msg;
+  for (;;) {
+    if (!replica_fill(replica, REPL_RECORD_HEADER))
+      break;
+    uint8_t *rec = replica->buf + replica->pos;
+    size_t size = REPL_RECORD_HEADER + read_u32(rec + sizeof(uint32_t));
+    if (!replica_fill(replica, size))
+      break;
+    rec = replica->buf + replica->pos;
+    if (!parse_request(rec + REPL_RECORD_HEADER, size - REPL_RECORD_HEADER, &msg)) {
+      errno = EINVAL;
+      break;
+    }
+    bool ok = apply_request(replica->st, &msg, read_u32(rec));
+    free_message_views(&msg);
+    if (!ok) {
+      errno = EINVAL;
+      break;
+    }
+    replica->pos += size;
+    __atomic_fetch_add(&replica->applied, 1, __ATOMIC_RELAXED);
+  }
+  if (!__atomic_load_n(&replica->stopping, __ATOMIC_RELAXED))
+    error(0, errno, "replication stream ended");
+  __atomic_store_n(&replica->ended, true, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/*
+ * Load the snapshot sent by the primary connected on FD into ST,
+ * which should be empty, then apply the primary's writes to ST in the
+ * background from then on. Returns NULL, setting errno, if the
+ * snapshot can't be loaded. The replica owns FD.
+ */
+Replica *create_replica(ShardedTable *st, int fd) {
+  Replica *replica = calloc(1, sizeof(Replica));
+  assert(replica != 0);
+  replica->st = st;
+  replica->fd = fd;
+  replica->loaded = read_snapshot(st, fd, &replica->buf, &replica->len);
+  replica->cap = replica->len;
+  int err = errno;
+  if (replica->loaded != -1
+      && (err = pthread_create(&replica->thread, NULL, run_replica, replica)) == 0)
+    return replica;
+  close(fd);
+  free(replica->buf);
+  free(replica);
+  errno = err;
+  return NULL;
+}
+
+/* Stop applying the primary's writes and disconnect from it */
+void free_replica(Replica *take_replica) {
+  __atomic_store_n(&take_replica->stopping, true, __ATOMIC_RELAXED);
+  shutdown(take_replica->fd, SHUT_RDWR);
+  pthread_join(take_replica->thread, NULL);
+  close(take_replica->fd);
+  free(take_replica->buf);
+  free(take_replica);
+}
+
+void print_replica_stats(Replica *replica, FILE *out) {
+  fprintf(out, "replica: loaded: %ld applied: %lu bytes_received: %zu streaming: %s\n",
+          replica->loaded, __atomic_load_n(&replica->applied, __ATOMIC_RELAXED),
+          __atomic_load_n(&replica->bytes_received, __ATOMIC_RELAXED),
+          __atomic_load_n(&replica->ended, __ATOMIC_RELAXED) ? "no" : "yes");
+}
@@ -0,0 +1,98 @@
+#ifndef _REPL_H
+#define _REPL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "message.h"
+#include "shard.h"
+
+/*
+ * Asynchronous replication of a ShardedTable from a primary server to
+ * replicas, which serve reads from their own copies.
+ *
+ * A replica connects to the primary's replication listener and is
+ * sent a snapshot of the table (see snapshot.h), written from a forked
+ * child's copy as for SNAPSHOT requests. It is then sent every write
+ * request (PUT, DELETE, MPUT and MDELETE) applied since the fork, in
+ * the records of the append-only log (see aof.h) without their
+ * checksums, which TCP makes redundant: the time the request was
+ * applied, as a big-endian u32, followed by the request as serialised
+ * on the wire.
+ *
+ * On the primary, appends only copy the request into a buffer. A
+ * background thread takes the buffer every BATCH_MS milliseconds and
+ * sends it to each replica with one write, so the primary answers
+ * writes without waiting for replicas, which lag behind by about a
+ * batch. A replica more than REPL_MAX_BACKLOG bytes behind is
+ * disconnected, and must reconnect to be sent a fresh snapshot.
+ */
+#define REPL_MAX_BACKLOG ((size_t)256 << 20)
+
+/* The primary's end of a replica's connection */
+typedef struct ReplicaLink {
+  int fd;
+  pid_t sync_pid;               /* Child sending the snapshot, or zero */
+  size_t skip;                  /* Bytes of the next batch predating the fork */
+  uint8_t *out;                 /* Queued for the replica */
+  size_t out_len;
+  size_t out_cap;
+  size_t out_sent;
+  struct ReplicaLink *next;
+} ReplicaLink;
+
+typedef struct Primary {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  ShardedTable *st;
+  int listener;
+  unsigned int batch_ms;
+  uint8_t *buf;                 /* Appended since the last batch */
+  size_t len;
+  size_t cap;
+  uint8_t *out;                 /* The batch being sent */
+  size_t out_cap;
+  ReplicaLink *links;
+  unsigned int replica_count;   /* Appends are dropped while zero */
+  bool stop;
+  unsigned long syncs;
+  unsigned long batches;
+  size_t bytes_sent;
+} Primary;
+
+/* A replica's end of its connection to the primary */
+typedef struct Replica {
+  pthread_t thread;
+  ShardedTable *st;
+  int fd;
+  uint8_t *buf;                 /* Received, not yet applied */
+  size_t cap;
+  size_t pos;
+  size_t len;
+  long loaded;                  /* Entries in the primary's snapshot */
+  unsigned long applied;        /* Requests applied since */
+  size_t bytes_received;
+  bool ended;                   /* The stream has broken off */
+  bool stopping;                /* Being freed, so the end is expected */
+} Replica;
+
+Primary *create_primary(ShardedTable *st, int listener, unsigned int batch_ms);
+
+void primary_append(Primary *primary, Message *msg, uint32_t now);
+
+void primary_stop(Primary *primary);
+
+void free_primary(Primary *take_primary);
+
+void print_primary_stats(Primary *primary, FILE *out);
+
+Replica *create_replica(ShardedTable *st, int fd);
+
+void free_replica(Replica *take_replica);
+
+void print_replica_stats(Replica *replica, FILE *out);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Sharded hash table (see ShardedTable). Callers lock the shard owning
+ * a key around each operation on its table.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+#include <stdio.h>
+#include <errno.h>
+#include "hash_table.h"
+#include "mapped_table.h"
+#include "hash.h"
+#include "shard.h"
+
+/* Construct SHARD_COUNT shards, each a table of SIZE buckets using
+   ENGINE. MEM_LIMIT (zero for none) is divided evenly between them. */
+ShardedTable *create_sharded_table(unsigned int shard_count, HashTableEngine engine,
+                                   unsigned int size, size_t mem_limit) {
+  assert(shard_count > 0);
+  ShardedTable *st = malloc(sizeof(ShardedTable));
+  assert(st != 0);
+  st->shard_count = shard_count;
+  st->aof = NULL;
+  st->primary = NULL;
+  st->shards = malloc(sizeof(Shard) * shard_count);
+  assert(st->shards != 0);
+  for (unsigned int i = 0; i < shard_count; i++) {
+    pthread_mutex_init(&st->shards[i].lock, NULL);
+    st->shards[i].ht = create_hash_table_engine(engine, size);
+    hash_table_set_mem_limit(st->shards[i].ht, mem_limit / shard_count);
+  }
+  return st;
+}
+
+/*
+ * Open SHARD_COUNT mapped tables (see mapped_table.h) in the files
+ * DIR/shard-N.map, each created with SIZE buckets if need be, with
+ * MEM_LIMIT divided between them as for create_sharded_table. If the
+ * files were closed cleanly, the hash seed they were filled with is
+ * adopted first (see hash_set_seed) so that they are reopened intact.
+ * Returns NULL, setting errno, on failure.
+ */
+ShardedTable *create_mapped_sharded_table(const char *dir, unsigned int shard_count,
+                                          unsigned int size, size_t mem_limit) {
+  char path[PATH_MAX];
+  uint64_t seed;
+  assert(shard_count > 0);
+  snprintf(path, sizeof path, "%s/shard-0.map", dir);
+  if (read_mapped_seed(path, shard_count, &seed))
+    hash_set_seed(seed);
+  /* Leave room for the limit and for fragmentation within the file */
+  size_t capacity = 2 * (mem_limit / shard_count);
+  if (capacity < MAPPED_DEFAULT_CAPACITY)
+    capacity = MAPPED_DEFAULT_CAPACITY;
+  ShardedTable *st = malloc(sizeof(ShardedTable));
+  assert(st != 0);
+  st->shard_count = shard_count;
+  st->aof = NULL;
+  st->primary = NULL;
+  st->shards = malloc(sizeof(Shard) * shard_count);
+  assert(st->shards != 0);
+  for (unsigned int i = 0; i < shard_count; i++) {
+    snprintf(path, sizeof path, "%s/shard-%u.map", dir, i);
+    HashTable *ht = open_mapped_hash_table(path, size, capacity, i, shard_count);
+    if (!ht) {
+      int err = errno;
+      while (i--)
+        close_mapped_hash_table(st->shards[i].ht);
+      free(st->shards);
+      free(st);
+      errno = err;
+      return NULL;
+    }
+    pthread_mutex_init(&st->shards[i].lock, NULL);
+    st->shards[i].ht = ht;
+    hash_table_set_mem_limit(ht, mem_limit / shard_count);
+  }
+  return st;
+}
+
+/* Return TRUE if ST's tables are ENGINE_MAPPED */
+bool sharded_table_is_mapped(ShardedTable *st) {
+  return st->shards[0].ht->engine == ENGINE_MAPPED;
+}
+
+/* Return the shard index for KEY */
+unsigned int shard_index(ShardedTable *st, Key *key) {
+  return hash_shard_index(st, hash(key));
+}
+
+/*
+ * Return the shard index for a key with hash H. The index is taken
+ * from the high 32 bits (scaled to the shard count rather than
+ * reduced modulo it), while tables index buckets and fingerprints
+ * from the low bits, so one hash serves both without the keys of a
+ * shard crowding into a subset of its buckets.
+ */
+unsigned int hash_shard_index(ShardedTable *st, uint64_t h) {
+  return ((h >> 32) * st->shard_count) >> 32;
+}
+
+Shard *sharded_table_shard(ShardedTable *st, Key *key) {
+  return &st->shards[shard_index(st, key)];
+}
+
+/* Return the shard owning a key with hash H */
+Shard *sharded_table_shard_hashed(ShardedTable *st, uint64_t h) {
+  return &st->shards[hash_shard_index(st, h)];
+}
+
+void shard_lock(Shard *shard) {
+  pthread_mutex_lock(&shard->lock);
+}
+
+void shard_unlock(Shard *shard) {
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Set the time to NOW and reap up to MAX expired entries from each of
+ * shards FIRST, FIRST + STRIDE, ... so that several threads can share
+ * the work. Returns the largest number reaped from one shard.
+ */
+unsigned int sharded_table_expire(ShardedTable *st, uint32_t now, unsigned int first,
+                                  unsigned int stride, unsigned int max) {
+  unsigned int most = 0;
+  for (unsigned int i = first; i < st->shard_count; i += stride) {
+    Shard *shard = &st->shards[i];
+    shard_lock(shard);
+    hash_table_set_time(shard->ht, now);
+    unsigned int n = hash_table_expire(shard->ht, max);
+    shard_unlock(shard);
+    if (n > most)
+      most = n;
+  }
+  return most;
+}
+
+void print_sharded_table_stats(ShardedTable *st, FILE *out) {
+  for (unsigned int i = 0; i < st->shard_count; i++) {
+    shard_lock(&st->shards[i]);
+    fprintf(out, "shard %u: ", i);
+    print_hash_table_stats(st->shards[i].ht, out);
+    shard_unlock(&st->shards[i]);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "hash_table.h"
+
+/* A HashTable guarded by its own lock */
+typedef struct Shard {
+  pthread_mutex_t lock;
+  HashTable *ht;
+} Shard;
+
+/*
+ * A keyspace split across independently locked shards, so that
+ * threads working on different keys rarely contend. Each key belongs
+ * to exactly one shard, chosen from its hash.
+ */
+typedef struct ShardedTable {
+  unsigned int shard_count;
+  Shard *shards;
+  struct Aof *aof;              /* Log of writes, or NULL (see aof.h) */
+  struct Primary *primary;      /* Replicas of writes, or NULL (see repl.h) */
+} ShardedTable;
+
+ShardedTable *create_sharded_table(unsigned int shard_count, HashTableEngine engine,
+                                   unsigned int size, size_t mem_limit);
+
+ShardedTable *create_mapped_sharded_table(const char *dir, unsigned int shard_count,
+                                          unsigned int size, size_t mem_limit);
+
+bool sharded_table_is_mapped(ShardedTable *st);
+
+unsigned int shard_index(ShardedTable *st, Key *key);
+
+unsigned int hash_shard_index(ShardedTable *st, uint64_t h);
+
+Shard *sharded_table_shard(ShardedTable *st, Key *key);
+
+Shard *sharded_table_shard_hashed(ShardedTable *st, uint64_t h);
+
+void shard_lock(Shard *shard);
+
+void shard_unlock(Shard *shard);
+
+unsigned int sharded_table_expire(ShardedTable *st, uint32_t now, unsigned int first,
+                                  unsigned int stride, unsigned int max);
+
+void print_sharded_table_stats(ShardedTable *st, FILE *out);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Slab allocator serving fixed-size chunks from large pages (see
+ * Slab). Callers pass the size of a chunk back when freeing it, so
+ * chunks carry no header; the page a chunk belongs to is found by
+ * rounding its address down to the page size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+/* Each class is at least this factor (in eighths) larger than the
+   last */
+#define SLAB_GROWTH_EIGHTHS 10
+/* Largest chunk, as a fraction of the page size */
+#define SLAB_PAGE_CHUNKS_MIN 8
+
+/* Lay out pages of PAGE_SIZE bytes and the classes carved from them */
+void init_slab_classes(Slab *slab, size_t page_size) {
+  size_t bitmap = (page_size / SLAB_MIN_CHUNK + 63) / 64 * sizeof(uint64_t);
+  size_t max = page_size / SLAB_PAGE_CHUNKS_MIN;
+  if (max > SLAB_MAX_CHUNK)
+    max = SLAB_MAX_CHUNK;
+  slab->page_size = page_size;
+  slab->page_header = (offsetof(SlabPage, live) + bitmap + 63) & ~(size_t)63;
+  slab->class_count = 0;
+  size_t size = SLAB_MIN_CHUNK;
+  for (;;) {
+    assert(slab->class_count < SLAB_MAX_CLASSES);
+    SlabClass *cls = &slab->classes[slab->class_count++];
+    cls->chunk_size = size;
+    cls->page_chunks = (page_size - slab->page_header) / size;
+    if (size == max)
+      break;
+    size = ((size * SLAB_GROWTH_EIGHTHS / 8) + 7) & ~(size_t)7;
+    if (size > max)
+      size = max;
+  }
+}
+
+void init_slab(Slab *slab) {
+  memset(slab, 0, sizeof(Slab));
+  init_slab_classes(slab, SLAB_PAGE_SIZE);
+}
+
+/* Map a page aligned to its own size */
+SlabPage *map_page(Slab *slab) {
+  size_t size = slab->page_size;
+  uint8_t *map = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(map != MAP_FAILED);
+  uint8_t *page = (uint8_t *)(((uintptr_t)map + size - 1) & ~(uintptr_t)(size - 1));
+  if (page > map)
+    munmap(map, page - map);
+  munmap(page + size, map + size - page);
+  return (SlabPage *)page;
+}
+
+void unmap_page(Slab *slab, SlabPage *take_page) {
+  munmap(take_page, slab->page_size);
+}
+
+/* Release every page. Oversized chunks must be freed separately. */
+void free_slab(Slab *slab) {
+  for (unsigned int i = 0; i < slab->class_count; i++) {
+    SlabClass *cls = &slab->classes[i];
+    while (cls->pages) {
+      SlabPage *page = cls->pages;
+      cls->pages = page->next == page ? NULL : page->next;
+      page->prev->next = page->next;
+      page->next->prev = page->prev;
+      unmap_page(slab, page);
+    }
+    cls->page_count = cls->used_chunks = 0;
+  }
+  slab_release_spare(slab);
+  slab->page_count = 0;
+}
+
+/*
+ * Use pages of PAGE_SIZE bytes, a power of two from SLAB_MIN_PAGE_SIZE
+ * to SLAB_PAGE_SIZE. Smaller pages bound the memory a class can hold
+ * unused more tightly, at the cost of a smaller largest class. Returns
+ * FALSE, changing nothing, if any chunk is allocated.
+ */
+bool slab_set_page_size(Slab *slab, size_t page_size) {
+  assert(page_size >= SLAB_MIN_PAGE_SIZE && page_size <= SLAB_PAGE_SIZE);
+  assert(!(page_size & (page_size - 1)));
+  if (slab->used_bytes || slab->page_count)
+    return false;
+  slab_release_spare(slab);
+  init_slab_classes(slab, page_size);
+  return true;
+}
+
+/* Return the index of the smallest class holding SIZE bytes, or -1 if
+   SIZE exceeds the largest class. */
+int slab_class(Slab *slab, size_t size) {
+  if (size > slab->classes[slab->class_count - 1].chunk_size)
+    return -1;
+  int lo = 0, hi = slab->class_count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (slab->classes[mid].chunk_size < size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Return TRUE if chunks of SIZE and OTHER bytes are interchangeable */
+bool slab_same_class(Slab *slab, size_t size, size_t other) {
+  int c = slab_class(slab, size);
+  return c >= 0 && c == slab_class(slab, other);
+}
+
+SlabPage *slab_page_of(Slab *slab, void *chunk) {
+  return (SlabPage *)((uintptr_t)chunk & ~(uintptr_t)(slab->page_size - 1));
+}
+
+uint8_t *page_chunk(Slab *slab, SlabPage *page, unsigned int i) {
+  return (uint8_t *)page + slab->page_header + i * slab->classes[page->cls].chunk_size;
+}
+
+unsigned int page_chunk_index(Slab *slab, SlabPage *page, void *chunk) {
+  return ((uint8_t *)chunk - (uint8_t *)page - slab->page_header)
+    / slab->classes[page->cls].chunk_size;
+}
+
+/* Make PAGE the first of CLS's pages */
+void link_page(SlabClass *cls, SlabPage *page) {
+  if (!cls->pages) {
+    page->next = page->prev = page;
+  } else {
+    page->next = cls->pages;
+    page->prev = cls->pages->prev;
+    page->prev->next = page;
+    page->next->prev = page;
+  }
+  cls->pages = page;
+}
+
+void unlink_page(SlabClass *cls, SlabPage *page) {
+  if (page->next == page) {
+    cls->pages = NULL;
+    return;
+  }
+  page->prev->next = page->next;
+  page->next->prev = page->prev;
+  if (cls->pages == page)
+    cls->pages = page->next;
+}
+
+/* Assign a page to class C, reusing the spare page if there is one */
+SlabPage *add_page(Slab *slab, unsigned int c) {
+  SlabPage *page = slab->spare;
+  if (page)
+    slab->spare = NULL;
+  else
+    page = map_page(slab);
+  memset(page, 0, slab->page_header);
+  page->cls = c;
+  link_page(&slab->classes[c], page);
+  ++slab->classes[c].page_count;
+  ++slab->page_count;
+  return page;
+}
+
+/* Take an empty page, already unlinked, back from its class, keeping
+   it as the spare if there is none yet */
+void retire_page(Slab *slab, SlabPage *page) {
+  --slab->classes[page->cls].page_count;
+  --slab->page_count;
+  if (slab->spare)
+    unmap_page(slab, page);
+  else
+    slab->spare = page;
+}
+
+/* Chunks free in CLS's pages, on free lists or not yet carved */
+size_t class_free_chunks(SlabClass *cls) {
+  return cls->page_count * cls->page_chunks - cls->used_chunks;
+}
+
+void *slab_alloc(Slab *slab, size_t size) {
+  int c = slab_class(slab, size);
+  if (c < 0) {
+    slab->large_bytes += size;
+    slab->used_bytes += size;
+    void *ptr = malloc(size);
+    assert(ptr != 0);
+    return ptr;
+  }
+  SlabClass *cls = &slab->classes[c];
+  /* Pages with free chunks come first, so if the first is full all
+     are */
+  SlabPage *page = cls->pages;
+  if (!page || page->used == cls->page_chunks)
+    page = add_page(slab, c);
+  void *chunk;
+  unsigned int i;
+  if (page->free_list) {
+    chunk = page->free_list;
+    page->free_list = *(void **)chunk;
+    i = page_chunk_index(slab, page, chunk);
+  } else {
+    i = page->carved++;
+    chunk = page_chunk(slab, page, i);
+  }
+  page->live[i / 64] |= (uint64_t)1 << (i % 64);
+  ++page->used;
+  ++cls->used_chunks;
+  slab->used_bytes += cls->chunk_size;
+  if (page->used == cls->page_chunks)
+    cls->pages = page->next;
+  return chunk;
+}
+
+/* Free a chunk allocated with SIZE bytes. Its page is released once
+   empty. */
+void slab_free(Slab *slab, void *take_ptr, size_t size) {
+  int c = slab_class(slab, size);
+  if (c < 0) {
+    slab->large_bytes -= size;
+    slab->used_bytes -= size;
+    free(take_ptr);
+    return;
+  }
+  SlabClass *cls = &slab->classes[c];
+  SlabPage *page = slab_page_of(slab, take_ptr);
+  assert(page->cls == (unsigned int)c);
+  unsigned int i = page_chunk_index(slab, page, take_ptr);
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  assert(page->live[i / 64] & bit);
+  page->live[i / 64] &= ~bit;
+  *(void **)take_ptr = page->free_list;
+  page->free_list = take_ptr;
+  --page->used;
+  --cls->used_chunks;
+  slab->used_bytes -= cls->chunk_size;
+  if (page == slab->pinned)
+    return;
+  if (!page->used) {
+    unlink_page(cls, page);
+    retire_page(slab, page);
+  } else if (page->used == cls->page_chunks - 1) {
+    /* No longer full, so move it ahead of the full pages */
+    unlink_page(cls, page);
+    link_page(cls, page);
+  }
+}
+
+/* Resize a chunk allocated with OLD_SIZE bytes, preserving its
+   contents up to the smaller size. The chunk is only moved if its
+   class changes. */
+void *slab_realloc(Slab *slab, void *take_ptr, size_t old_size, size_t new_size) {
+  if (slab_same_class(slab, old_size, new_size))
+    return take_ptr;
+  void *ptr = slab_alloc(slab, new_size);
+  memcpy(ptr, take_ptr, old_size < new_size ? old_size : new_size);
+  slab_free(slab, take_ptr, old_size);
+  return ptr;
+}
+
+/*
+ * Return the bytes by which allocating a chunk of each of the COUNT
+ * SIZES would grow slab_total_bytes: a page for each class without
+ * enough chunks free, less the spare page, plus any oversized chunks.
+ */
+size_t slab_growth(Slab *slab, const size_t *sizes, unsigned int count) {
+  size_t large = 0;
+  unsigned int pages = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    int c = slab_class(slab, sizes[i]);
+    if (c < 0) {
+      large += sizes[i];
+      continue;
+    }
+    size_t wanted = 1;
+    for (unsigned int j = 0; j < i; j++)
+      wanted += slab_class(slab, sizes[j]) == c;
+    /* A new page holds more chunks than are ever asked for at once */
+    if (class_free_chunks(&slab->classes[c]) + 1 == wanted)
+      ++pages;
+  }
+  if (pages && slab->spare)
+    --pages;
+  return pages * slab->page_size + large;
+}
+
+/*
+ * Return the page cheapest to reclaim for reassignment to another
+ * class: the one with fewest chunks in use, of those in classes which
+ * have at least a page's worth of chunks free between their pages, so
+ * that the chunks in use fit in the class's other pages. Returns NULL
+ * if no class has that much free.
+ */
+SlabPage *slab_reclaimable_page(Slab *slab) {
+  SlabPage *best = NULL;
+  for (unsigned int i = 0; i < slab->class_count; i++) {
+    SlabClass *cls = &slab->classes[i];
+    if (class_free_chunks(cls) < cls->page_chunks)
+      continue;
+    SlabPage *page = cls->pages;
+    do {
+      if (!best || page->used < best->used)
+        best = page;
+      page = page->next;
+    } while (page != cls->pages);
+  }
+  return best;
+}
+
+/*
+ * Empty PAGE, as returned by slab_reclaimable_page, by calling MOVE
+ * with each chunk in use on it and ARG. MOVE is expected to copy the
+ * chunk to a new one allocated from its class, which will not be on
+ * PAGE, and free it, but may leave a chunk which can't be moved.
+ * Returns TRUE if the page was emptied and released, making room for a
+ * page of any class.
+ */
+bool slab_reclaim_page(Slab *slab, SlabPage *page,
+                       void (*move)(void *chunk, void *arg), void *arg) {
+  SlabClass *cls = &slab->classes[page->cls];
+  size_t words = (page->carved + 63) / 64;
+  unlink_page(cls, page);
+  slab->pinned = page;
+  for (size_t w = 0; w < words; w++) {
+    uint64_t kept = 0, live;
+    while ((live = page->live[w] & ~kept)) {
+      unsigned int b = __builtin_ctzll(live);
+      move(page_chunk(slab, page, w * 64 + b), arg);
+      if (page->live[w] & ((uint64_t)1 << b))
+        kept |= (uint64_t)1 << b;
+    }
+  }
+  slab->pinned = NULL;
+  if (!page->used) {
+    retire_page(slab, page);
+    return true;
+  }
+  link_page(cls, page);
+  if (page->used == cls->page_chunks)
+    cls->pages = page->next;
+  return false;
+}
+
+/* Unmap the spare page, if any */
+void slab_release_spare(Slab *slab) {
+  if (slab->spare)
+    unmap_page(slab, slab->spare);
+  slab->spare = NULL;
+}
+
+/* Bytes in chunks currently handed out, including rounding */
+size_t slab_used_bytes(Slab *slab) {
+  return slab->used_bytes;
+}
+
+/* Bytes held from the system, used or not */
+size_t slab_total_bytes(Slab *slab) {
+  return (slab->page_count + (slab->spare != NULL)) * slab->page_size
+    + slab->large_bytes;
+}
+
+/* Print used and free bytes for each class with pages assigned */
+void print_slab_stats(Slab *slab, FILE *out) {
+  fprintf(out, "%8s %8s %12s %12s\n", "chunk", "pages", "used", "free");
+  for (unsigned int i = 0; i < slab->class_count; i++) {
+    SlabClass *cls = &slab->classes[i];
+    if (!cls->page_count)
+      continue;
+    fprintf(out, "%8zu %8zu %12zu %12zu\n", cls->chunk_size, cls->page_count,
+            cls->used_chunks * cls->chunk_size,
+            class_free_chunks(cls) * cls->chunk_size);
+  }
+  fprintf(out, "page: %zu large: %zu used: %zu total: %zu\n", slab->page_size,
+          slab->large_bytes, slab_used_bytes(slab), slab_total_bytes(slab));
+}
@@ -0,0 +1,97 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#define SLAB_PAGE_SIZE (1 << 20)        /* Default, and largest, page size */
+#define SLAB_MIN_PAGE_SIZE (1 << 12)
+#define SLAB_MIN_CHUNK 32
+#define SLAB_MAX_CHUNK (1 << 16)
+#define SLAB_MAX_CLASSES 64
+
+/*
+ * A page of chunks of one class, aligned to the slab's page size so
+ * that the page of any chunk can be found from its address. The
+ * header is followed by a bitmap of the chunks handed out, then the
+ * chunks themselves.
+ */
+typedef struct SlabPage {
+  struct SlabPage *next;        /* Circular list of the class's pages */
+  struct SlabPage *prev;
+  void *free_list;              /* Linked through first word of chunk */
+  unsigned int cls;
+  unsigned int used;            /* Chunks handed out */
+  unsigned int carved;          /* Chunks carved so far, from the start */
+  uint64_t live[];
+} SlabPage;
+
+/*
+ * Chunks of a single size. Pages are assigned to a class on demand
+ * and listed with those holding free chunks first. A page is returned
+ * to the slab as soon as its last chunk is freed, so that it can be
+ * reassigned to whichever class needs one next.
+ */
+typedef struct SlabClass {
+  size_t chunk_size;
+  unsigned int page_chunks;     /* Chunks per page */
+  SlabPage *pages;              /* NULL, or first of circular list */
+  size_t page_count;
+  size_t used_chunks;
+} SlabClass;
+
+/*
+ * Size-class allocator. Requests are rounded up to the nearest class,
+ * whose sizes grow geometrically from SLAB_MIN_CHUNK to an eighth of
+ * the page size, or SLAB_MAX_CHUNK if smaller. Larger requests fall
+ * through to malloc. One empty page is kept back for reuse and the
+ * rest are unmapped. Not thread-safe.
+ */
+typedef struct Slab {
+  size_t page_size;
+  size_t page_header;           /* Bytes before the first chunk of a page */
+  unsigned int class_count;
+  SlabClass classes[SLAB_MAX_CLASSES];
+  size_t page_count;            /* Assigned to a class */
+  SlabPage *spare;              /* Empty page kept for reuse, or NULL */
+  SlabPage *pinned;             /* Being emptied by slab_reclaim_page */
+  size_t large_bytes;           /* Bytes malloc'd for oversized chunks */
+  size_t used_bytes;            /* Bytes in chunks handed out */
+} Slab;
+
+void init_slab(Slab *slab);
+
+void free_slab(Slab *slab);
+
+bool slab_set_page_size(Slab *slab, size_t page_size);
+
+int slab_class(Slab *slab, size_t size);
+
+bool slab_same_class(Slab *slab, size_t size, size_t other);
+
+void *slab_alloc(Slab *slab, size_t size);
+
+void *slab_realloc(Slab *slab, void *take_ptr, size_t old_size, size_t new_size);
+
+void slab_free(Slab *slab, void *take_ptr, size_t size);
+
+SlabPage *slab_page_of(Slab *slab, void *chunk);
+
+SlabPage *slab_reclaimable_page(Slab *slab);
+
+size_t slab_growth(Slab *slab, const size_t *sizes, unsigned int count);
+
+bool slab_reclaim_page(Slab *slab, SlabPage *page,
+                       void (*move)(void *chunk, void *arg), void *arg);
+
+void slab_release_spare(Slab *slab);
+
+size_t slab_used_bytes(Slab *slab);
+
+size_t slab_total_bytes(Slab *slab);
+
+void print_slab_stats(Slab *slab, FILE *out);
+
+#endif
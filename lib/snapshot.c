@@ -0,0 +1,359 @@
+/*
+ * Snapshot files (see snapshot.h). Saving streams entries out through
+ * a large buffer, and is meant to run in a forked child (see
+ * fork_snapshot) so that serving carries on against the parent's copy
+ * of the table. Loading streams the file back in through a similar
+ * buffer, inserting each entry straight from it with its hash computed
+ * once, into tables sized up front for the whole file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include "hash_table.h"
+#include "message.h"
+#include "shard.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_BUF_SIZE (1 << 20)
+#define SNAPSHOT_HEADER_SIZE (sizeof(SNAPSHOT_MAGIC) - 1 + sizeof(uint32_t) + sizeof(uint64_t))
+#define SNAPSHOT_MIN_RECORD (1 + sizeof(KeySize) + sizeof(ValSize) + sizeof(uint32_t))
+/* Record types */
+#define SNAPSHOT_END 0
+#define SNAPSHOT_ENTRY 1
+
+typedef struct SnapshotWriter {
+  int fd;
+  uint8_t *buf;                 /* SNAPSHOT_BUF_SIZE bytes */
+  size_t len;
+  uint32_t now;                 /* Entries expiring by now are skipped */
+  uint64_t count;
+} SnapshotWriter;
+
+typedef struct SnapshotReader {
+  int fd;
+  uint8_t *buf;                 /* SNAPSHOT_BUF_SIZE bytes */
+  size_t pos;
+  size_t len;
+} SnapshotReader;
+
+/* Write out the buffered bytes. Returns -1, setting errno, on failure. */
+int snapshot_flush(SnapshotWriter *w) {
+  size_t off = 0;
+  while (off < w->len) {
+    ssize_t n = write(w->fd, w->buf + off, w->len - off);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    off += n;
+  }
+  w->len = 0;
+  return 0;
+}
+
+/* Return where to write the next SIZE bytes, flushing first if the
+   buffer lacks room, or NULL on failure */
+uint8_t *snapshot_reserve(SnapshotWriter *w, size_t size) {
+  if (w->len + size > SNAPSHOT_BUF_SIZE && snapshot_flush(w) == -1)
+    return NULL;
+  uint8_t *p = w->buf + w->len;
+  w->len += size;
+  return p;
+}
+
+/* See put_u32 */
+void put_u64(uint8_t *buf, uint64_t n) {
+  n = htobe64(n);
+  memcpy(buf, &n, sizeof n);
+}
+
+/* See read_u32 */
+uint64_t read_u64(uint8_t *buf) {
+  uint64_t n;
+  memcpy(&n, buf, sizeof n);
+  return be64toh(n);
+}
+
+/* Append ENTRY's record, unless it has expired (hash_table_for_each
+   callback) */
+int write_entry(Entry *entry, void *arg) {
+  SnapshotWriter *w = arg;
+  if (entry->expires_at && entry->expires_at <= w->now)
+    return 0;
+  size_t size = 1 + sizeof(KeySize) + entry->key_size + sizeof(ValSize)
+    + entry->val.val_size + sizeof(uint32_t);
+  uint8_t *p = snapshot_reserve(w, size);
+  if (!p)
+    return -1;
+  *p++ = SNAPSHOT_ENTRY;
+  *p++ = entry->key_size;
+  memcpy(p, entry->data, entry->key_size);
+  p += entry->key_size;
+  put_u16(p, entry->val.val_size);
+  p += sizeof(ValSize);
+  memcpy(p, entry->val.val, entry->val.val_size);
+  p += entry->val.val_size;
+  put_u32(p, entry->expires_at);
+  ++w->count;
+  return 0;
+}
+
+/*
+ * Write every live entry of ST to FD in the snapshot format. The
+ * caller must keep the table from changing meanwhile, by holding every
+ * shard's lock or (as in fork_snapshot) by owning a private copy.
+ * Returns -1, setting errno, on failure.
+ */
+int write_snapshot(ShardedTable *st, int fd) {
+  SnapshotWriter w = { .fd = fd, .len = 0, .count = 0 };
+  uint64_t estimate = 0;
+  int ret = -1;
+  w.buf = malloc(SNAPSHOT_BUF_SIZE);
+  if (!w.buf)
+    return -1;
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    estimate += st->shards[i].ht->item_count;
+
+  uint8_t *p = snapshot_reserve(&w, SNAPSHOT_HEADER_SIZE);
+  memcpy(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+  p += sizeof(SNAPSHOT_MAGIC) - 1;
+  put_u32(p, SNAPSHOT_VERSION);
+  put_u64(p + sizeof(uint32_t), estimate);
+
+  for (unsigned int i = 0; i < st->shard_count; i++) {
+    HashTable *ht = st->shards[i].ht;
+    w.now = ht->now;
+    if (hash_table_for_each(ht, write_entry, &w))
+      goto out;
+  }
+  if (!(p = snapshot_reserve(&w, 1 + sizeof(uint64_t))))
+    goto out;
+  *p = SNAPSHOT_END;
+  put_u64(p + 1, w.count);
+  ret = snapshot_flush(&w);
+out:
+  free(w.buf);
+  return ret;
+}
+
+/*
+ * Save a snapshot of ST to PATH, replacing it only once the new file
+ * is complete and on disk, so a crash midway leaves the last snapshot
+ * intact. See write_snapshot for locking. Returns -1, setting errno,
+ * on failure.
+ */
+int save_snapshot(ShardedTable *st, const char *path) {
+  size_t len = strlen(path) + sizeof(".tmp");
+  char *tmp = malloc(len);
+  if (!tmp)
+    return -1;
+  snprintf(tmp, len, "%s.tmp", path);
+  int ret = -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1) {
+    if (write_snapshot(st, fd) == 0 && fsync(fd) == 0)
+      ret = 0;
+    if (close(fd) == -1)
+      ret = -1;
+    if (ret == 0 && rename(tmp, path) == -1)
+      ret = -1;
+    if (ret == -1)
+      unlink(tmp);
+  }
+  free(tmp);
+  return ret;
+}
+
+/*
+ * Fork a child process which saves a snapshot of ST to PATH from its
+ * copy-on-write view of memory, exiting with status zero on success.
+ * Every shard is locked across the fork, so the child's copy is
+ * consistent and holds no table mid-update. The threads serving ST
+ * only wait while fork() copies the page tables; the dump itself runs
+ * alongside them, costing the parent a page copy for each page it
+ * writes to meanwhile. Returns the child's pid, or -1 (setting errno)
+ * on failure. Mapped tables are shared with the child rather than
+ * copied, so can't be dumped this way (ENOTSUP).
+ */
+pid_t fork_snapshot(ShardedTable *st, const char *path) {
+  if (sharded_table_is_mapped(st)) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_lock(&st->shards[i]);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (save_snapshot(st, path) == -1) {
+      perror(path);
+      _exit(1);
+    }
+    _exit(0);
+  }
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_unlock(&st->shards[i]);
+  return pid;
+}
+
+/* Make sure at least N bytes are buffered from POS onwards, moving
+   them to the front of the buffer first if need be. Returns FALSE if
+   the file ends first or can't be read, setting errno. */
+bool snapshot_fill(SnapshotReader *r, size_t n) {
+  if (r->len - r->pos >= n)
+    return true;
+  memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+  r->len -= r->pos;
+  r->pos = 0;
+  while (r->len < n) {
+    ssize_t got = read(r->fd, r->buf + r->len, SNAPSHOT_BUF_SIZE - r->len);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (got == 0)
+        errno = EINVAL;         /* Truncated */
+      return false;
+    }
+    r->len += got;
+  }
+  return true;
+}
+
+/* Size each shard of ST for its part of a snapshot of COUNT entries,
+   which can't be more than fit in FD if it's a file */
+void reserve_shards(ShardedTable *st, uint64_t count, int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1)
+    return;
+  if (S_ISREG(sb.st_mode) && count > (uint64_t)sb.st_size / SNAPSHOT_MIN_RECORD)
+    count = sb.st_size / SNAPSHOT_MIN_RECORD;
+  uint64_t per_shard = count / st->shard_count;
+  /* Allow for keys spreading unevenly */
+  per_shard += per_shard / 8;
+  if (per_shard > UINT32_MAX / 2)
+    per_shard = UINT32_MAX / 2;
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    hash_table_reserve(st->shards[i].ht, per_shard);
+}
+
+/* Insert the entries of R until its end record into ST. Returns the
+   number loaded, or -1 (setting errno) on failure. */
+long load_entries(SnapshotReader *r, ShardedTable *st) {
+  long loaded = 0;
+  uint64_t records = 0;
+  for (;;) {
+    if (!snapshot_fill(r, 1))
+      return -1;
+    if (r->buf[r->pos] == SNAPSHOT_END) {
+      if (!snapshot_fill(r, 1 + sizeof(uint64_t)))
+        return -1;
+      if (read_u64(r->buf + r->pos + 1) != records) {
+        errno = EINVAL;
+        return -1;
+      }
+      return loaded;
+    }
+    if (r->buf[r->pos] != SNAPSHOT_ENTRY || !snapshot_fill(r, 1 + sizeof(KeySize))) {
+      errno = EINVAL;
+      return -1;
+    }
+    size_t off = 1;
+    Key key;
+    Val val;
+    key.key_size = r->buf[r->pos + off];
+    off += sizeof(KeySize);
+    if (!snapshot_fill(r, off + key.key_size + sizeof(ValSize)))
+      return -1;
+    off += key.key_size;
+    val.val_size = read_u16(r->buf + r->pos + off);
+    off += sizeof(ValSize);
+    if (!snapshot_fill(r, off + val.val_size + sizeof(uint32_t)))
+      return -1;
+    /* Point into the buffer only now that the record won't move */
+    uint8_t *rec = r->buf + r->pos;
+    key.key = rec + 1 + sizeof(KeySize);
+    val.val = rec + off;
+    uint32_t expires_at = read_u32(rec + off + val.val_size);
+    r->pos += off + val.val_size + sizeof(uint32_t);
+    ++records;
+
+    uint64_t h = hash(&key);
+    HashTable *ht = sharded_table_shard_hashed(st, h)->ht;
+    if (expires_at && expires_at <= ht->now)
+      continue;
+    hash_table_put_hashed(ht, &key, &val, expires_at ? expires_at - ht->now : 0, h);
+    ++loaded;
+  }
+}
+
+/* Load the snapshot read through R into ST, see load_snapshot */
+long load_from(SnapshotReader *r, ShardedTable *st) {
+  if (!snapshot_fill(r, SNAPSHOT_HEADER_SIZE))
+    return -1;
+  if (memcmp(r->buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1)
+      || read_u32(r->buf + sizeof(SNAPSHOT_MAGIC) - 1) != SNAPSHOT_VERSION) {
+    errno = EINVAL;
+    return -1;
+  }
+  reserve_shards(st, read_u64(r->buf + sizeof(SNAPSHOT_MAGIC) - 1 + sizeof(uint32_t)), r->fd);
+  r->pos = SNAPSHOT_HEADER_SIZE;
+  return load_entries(r, st);
+}
+
+/*
+ * Load the snapshot at PATH into ST, which should be empty so that its
+ * tables can be sized for the whole file up front. Entries keep their
+ * expiry times, measured against each shard's current time, and those
+ * already expired are skipped. Must not run alongside other users of
+ * ST. Returns the number of entries loaded, or -1 on failure, setting
+ * errno: ENOENT if there is no snapshot, or EINVAL if the file is not
+ * a complete snapshot, in which case the entries before the damage
+ * have still been loaded.
+ */
+long load_snapshot(ShardedTable *st, const char *path) {
+  SnapshotReader r = { .pos = 0, .len = 0 };
+  long loaded = -1;
+  r.fd = open(path, O_RDONLY);
+  if (r.fd == -1)
+    return -1;
+  posix_fadvise(r.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  r.buf = malloc(SNAPSHOT_BUF_SIZE);
+  if (r.buf)
+    loaded = load_from(&r, st);
+  free(r.buf);
+  close(r.fd);
+  return loaded;
+}
+
+/*
+ * Load a snapshot streamed over FD, such as a socket, into ST, as for
+ * load_snapshot. Whatever follows the snapshot may have been read
+ * with it, so those bytes are returned in *OUT_REST (allocated, or
+ * NULL if none) and their count in *REST_LEN. FD is left open.
+ */
+long read_snapshot(ShardedTable *st, int fd, uint8_t **out_rest, size_t *rest_len) {
+  SnapshotReader r = { .fd = fd, .pos = 0, .len = 0 };
+  long loaded = -1;
+  *out_rest = NULL;
+  *rest_len = 0;
+  r.buf = malloc(SNAPSHOT_BUF_SIZE);
+  if (r.buf && (loaded = load_from(&r, st)) != -1) {
+    /* Step over the end record */
+    r.pos += 1 + sizeof(uint64_t);
+    if ((*rest_len = r.len - r.pos)) {
+      *out_rest = malloc(*rest_len);
+      assert(*out_rest != 0);
+      memcpy(*out_rest, r.buf + r.pos, *rest_len);
+    }
+  }
+  free(r.buf);
+  return loaded;
+}
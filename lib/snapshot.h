@@ -0,0 +1,30 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "shard.h"
+
+/*
+ * Snapshot files hold every live entry of a ShardedTable, so that a
+ * restarted server can be warmed from disk. A file is a header (magic,
+ * version and an estimate of the entry count, used to size the tables
+ * before loading), then one record per entry, then an end record with
+ * the exact count. Records are a type byte followed, for entries, by
+ * the key and value as in requests and the absolute expiry time (zero
+ * for none). Integers are big-endian.
+ */
+#define SNAPSHOT_MAGIC "CACHESNP"
+#define SNAPSHOT_VERSION 1
+
+int write_snapshot(ShardedTable *st, int fd);
+
+int save_snapshot(ShardedTable *st, const char *path);
+
+pid_t fork_snapshot(ShardedTable *st, const char *path);
+
+long load_snapshot(ShardedTable *st, const char *path);
+
+long read_snapshot(ShardedTable *st, int fd, uint8_t **out_rest, size_t *rest_len);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Hierarchical timer wheel (see TimerWheel). Not thread-safe.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include "hash_table.h"
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void init_timer_wheel(TimerWheel *tw) {
+  memset(tw, 0, sizeof(TimerWheel));
+}
+
+/* Link ENTRY at the head of the list at HEAD */
+void timer_link(struct Entry **head, Entry *entry) {
+  entry->timer_next = *head;
+  if (*head)
+    (*head)->timer_pprev = &entry->timer_next;
+  entry->timer_pprev = head;
+  *head = entry;
+}
+
+void timer_unlink(Entry *entry) {
+  *entry->timer_pprev = entry->timer_next;
+  if (entry->timer_next)
+    entry->timer_next->timer_pprev = entry->timer_pprev;
+  entry->timer_next = NULL;
+  entry->timer_pprev = NULL;
+}
+
+/* Entries expiring at or before the current time are due, and all
+   others are in a slot */
+bool is_due(TimerWheel *tw, Entry *entry) {
+  return entry->expires_at <= tw->current;
+}
+
+/* Return the list ENTRY belongs in, given the current time */
+Entry **timer_slot(TimerWheel *tw, Entry *entry) {
+  uint32_t expires = entry->expires_at;
+  if (is_due(tw, entry))
+    return &tw->due;
+  uint64_t delta = expires - tw->current;
+  for (int level = 0; level < TW_LEVELS; level++) {
+    if (delta < (uint64_t)1 << (TW_BITS * (level + 1)))
+      return &tw->slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+  }
+  /* Out of range: park in the top-level slot furthest from now, which
+     is cascaded (and the entry placed again) last */
+  int top = TW_LEVELS - 1;
+  return &tw->slots[top][((tw->current >> (TW_BITS * top)) - 1) & TW_MASK];
+}
+
+/* Add ENTRY, which must have a non-zero EXPIRES_AT */
+void timer_wheel_add(TimerWheel *tw, Entry *entry) {
+  assert(entry->expires_at);
+  timer_link(timer_slot(tw, entry), entry);
+  if (!is_due(tw, entry))
+    ++tw->count;
+}
+
+void timer_wheel_remove(TimerWheel *tw, Entry *entry) {
+  if (!is_due(tw, entry))
+    --tw->count;
+  timer_unlink(entry);
+}
+
+bool timer_wheel_is_linked(Entry *entry) {
+  return entry->timer_pprev != NULL;
+}
+
+/* Repair the links to ENTRY after it has been moved in memory */
+void timer_wheel_moved(Entry *entry) {
+  *entry->timer_pprev = entry;
+  if (entry->timer_next)
+    entry->timer_next->timer_pprev = &entry->timer_next;
+}
+
+/* Re-place every entry in a slot relative to the current time */
+void cascade(TimerWheel *tw, int level, unsigned int idx) {
+  Entry *entry = tw->slots[level][idx];
+  tw->slots[level][idx] = NULL;
+  while (entry) {
+    Entry *next = entry->timer_next;
+    timer_link(timer_slot(tw, entry), entry);
+    if (is_due(tw, entry))
+      --tw->count;
+    entry = next;
+  }
+}
+
+/* Jump straight to NOW, re-placing every entry, including those due,
+   as a step back can make them no longer due */
+void rebase(TimerWheel *tw, uint32_t now) {
+  Entry *entries = tw->due;
+  tw->due = NULL;
+  for (int level = 0; level < TW_LEVELS; level++) {
+    for (int idx = 0; idx < TW_SLOTS; idx++) {
+      Entry *entry = tw->slots[level][idx];
+      tw->slots[level][idx] = NULL;
+      while (entry) {
+        Entry *next = entry->timer_next;
+        timer_link(&entries, entry);
+        entry = next;
+      }
+    }
+  }
+  tw->current = now;
+  tw->count = 0;
+  while (entries) {
+    Entry *next = entries->timer_next;
+    timer_wheel_add(tw, entries);
+    entries = next;
+  }
+}
+
+/* Advance the wheel to NOW, moving every entry which expires at or
+   before NOW to the due list. If the clock has stepped back, the wheel
+   is moved back to NOW, so that entries added since with expiry times
+   between the two aren't taken to be due. */
+void timer_wheel_advance(TimerWheel *tw, uint32_t now) {
+  if (now < tw->current) {
+    rebase(tw, now);
+    return;
+  }
+  if (tw->count == 0) {
+    /* Nothing to cascade, so jump straight there */
+    if (now > tw->current)
+      tw->current = now;
+    return;
+  }
+  if (now > tw->current && now - tw->current >= (uint32_t)1 << (TW_BITS * TW_LEVELS)) {
+    /* Ticking through more than the whole wheel would visit every
+       slot many times over, so re-place the entries instead */
+    rebase(tw, now);
+    return;
+  }
+  while (tw->current < now) {
+    ++tw->current;
+    /* Cascade each level whose lower levels have wrapped round */
+    for (int level = 1; level < TW_LEVELS; level++) {
+      if (tw->current & (((uint32_t)1 << (TW_BITS * level)) - 1))
+        break;
+      cascade(tw, level, (tw->current >> (TW_BITS * level)) & TW_MASK);
+    }
+    cascade(tw, 0, tw->current & TW_MASK);
+  }
+}
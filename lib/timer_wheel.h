@@ -0,0 +1,45 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+struct Entry;
+
+/*
+ * Hierarchical timer wheel of table entries, keyed by their
+ * EXPIRES_AT (in seconds). Level L has TW_SLOTS slots, each covering
+ * TW_SLOTS^L seconds, so the wheel spans TW_SLOTS^TW_LEVELS seconds
+ * (about 194 days) and later expiries are parked in the last slot
+ * until they come into range. Entries are linked into slots through
+ * their own TIMER_NEXT/TIMER_PPREV fields, so adding and removing an
+ * entry is O(1).
+ *
+ * As the wheel advances, entries in higher levels cascade down and
+ * entries whose time has come move to the DUE list, where they wait
+ * for the owning table to remove them.
+ */
+typedef struct TimerWheel {
+  uint32_t current;             /* Time processed up to */
+  unsigned long count;          /* Entries in slots, excluding DUE */
+  struct Entry *slots[TW_LEVELS][TW_SLOTS];
+  struct Entry *due;
+} TimerWheel;
+
+void init_timer_wheel(TimerWheel *tw);
+
+void timer_wheel_add(TimerWheel *tw, struct Entry *entry);
+
+void timer_wheel_remove(TimerWheel *tw, struct Entry *entry);
+
+bool timer_wheel_is_linked(struct Entry *entry);
+
+void timer_wheel_moved(struct Entry *entry);
+
+void timer_wheel_advance(TimerWheel *tw, uint32_t now);
+
+#endif
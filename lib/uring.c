@@ -0,0 +1,210 @@
+/*
+ * io_uring through raw system calls (see Uring), so that the server
+ * needs no library beyond glibc.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up RING with room for ENTRIES submissions. Returns -1, setting
+ * errno, if io_uring is unavailable or lacks the features relied on:
+ * a single mapping for both queues, and timeouts on waits.
+ */
+int init_uring(Uring *ring, unsigned int entries) {
+  struct io_uring_params p;
+  memset(ring, 0, sizeof(Uring));
+  memset(&p, 0, sizeof p);
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if (ring->fd == -1)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    return -1;
+  }
+
+  uint8_t *ptr = ring->ring_ptr;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+  ring->sq_khead = (unsigned int *)(ptr + p.sq_off.head);
+  ring->sq_ktail = (unsigned int *)(ptr + p.sq_off.tail);
+  ring->sq_array = (unsigned int *)(ptr + p.sq_off.array);
+  ring->sq_tail = *ring->sq_ktail;
+  ring->cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+  ring->cq_khead = (unsigned int *)(ptr + p.cq_off.head);
+  ring->cq_ktail = (unsigned int *)(ptr + p.cq_off.tail);
+  ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+  return 0;
+}
+
+void free_uring(Uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring_ptr, ring->ring_size);
+  close(ring->fd);
+}
+
+/* Make pending submissions visible to the kernel */
+void publish_sqes(Uring *ring) {
+  __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return a cleared submission queue entry for the caller to fill in.
+ * If the queue is full, pending entries are submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  while (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    if (uring_submit_and_wait(ring, 0, 0) == -1 && errno != EINTR && errno != EBUSY)
+      return NULL;
+  }
+  unsigned int idx = ring->sq_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[idx] = idx;
+  ++ring->sq_tail;
+  ++ring->sq_pending;
+  return sqe;
+}
+
+/*
+ * Submit pending entries and wait until at least WAIT_NR completions
+ * are available, for at most TIMEOUT_MS milliseconds (or without limit
+ * if negative). Returns -1, setting errno, on failure; ETIME means the
+ * wait timed out and EINTR that a signal arrived.
+ */
+int uring_submit_and_wait(Uring *ring, unsigned int wait_nr, int timeout_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned int flags = 0;
+  void *argp = NULL;
+  size_t argsz = 0;
+  publish_sqes(ring);
+  if (wait_nr) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      memset(&arg, 0, sizeof arg);
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof arg;
+    }
+  }
+  ++ring->enters;
+  int ret = sys_io_uring_enter(ring->fd, ring->sq_pending, wait_nr, flags, argp, argsz);
+  if (ret >= 0)
+    ring->sq_pending -= ret;
+  return ret;
+}
+
+/* Return the next completion, or NULL if there are none */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+  unsigned int head = *ring->cq_khead;
+  if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Release the completion returned by uring_peek_cqe() */
+void uring_cqe_seen(Uring *ring) {
+  __atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register ENTRIES (a power of two) buffers of BUF_SIZE bytes with
+ * RING as group BGID. Returns -1, setting errno, on failure.
+ */
+int init_uring_buf_ring(Uring *ring, UringBufRing *br, uint16_t bgid,
+                        unsigned int entries, unsigned int buf_size) {
+  size_t ring_bytes = entries * sizeof(struct io_uring_buf);
+  br->ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br->ring == MAP_FAILED)
+    return -1;
+  br->bufs = malloc((size_t)entries * buf_size);
+  if (!br->bufs) {
+    munmap(br->ring, ring_bytes);
+    return -1;
+  }
+  br->entries = entries;
+  br->buf_size = buf_size;
+  br->bgid = bgid;
+  br->tail = 0;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    free(br->bufs);
+    munmap(br->ring, ring_bytes);
+    return -1;
+  }
+  for (unsigned int i = 0; i < entries; i++)
+    uring_buf_recycle(br, i);
+  return 0;
+}
+
+void free_uring_buf_ring(Uring *ring, UringBufRing *br) {
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.bgid = br->bgid;
+  sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(br->ring, br->entries * sizeof(struct io_uring_buf));
+  free(br->bufs);
+}
+
+uint8_t *uring_buf(UringBufRing *br, uint16_t bid) {
+  return br->bufs + (size_t)bid * br->buf_size;
+}
+
+/* Hand buffer BID back to the kernel for another receive */
+void uring_buf_recycle(UringBufRing *br, uint16_t bid) {
+  struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+  buf->len = br->buf_size;
+  buf->bid = bid;
+  ++br->tail;
+  __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
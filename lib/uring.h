@@ -0,0 +1,70 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper over the raw system calls. Submission
+ * queue entries are filled in place and handed to the kernel in one
+ * io_uring_enter() along with the wait for completions, so a batch of
+ * operations costs one system call. Not thread-safe: each thread owns
+ * its ring.
+ */
+typedef struct Uring {
+  int fd;
+  unsigned int sq_entries;
+  unsigned int sq_mask;
+  unsigned int sq_tail;         /* Local tail, published on submit */
+  unsigned int sq_pending;      /* Entries filled but not yet submitted */
+  unsigned int *sq_khead;
+  unsigned int *sq_ktail;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int cq_mask;
+  unsigned int *cq_khead;
+  unsigned int *cq_ktail;
+  struct io_uring_cqe *cqes;
+  void *ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+  unsigned long enters;         /* Count of io_uring_enter() calls */
+} Uring;
+
+/*
+ * A ring of equally sized buffers provided to the kernel, which picks
+ * one for each completed receive. The buffer's id is reported in the
+ * completion, and the buffer must be recycled once consumed.
+ */
+typedef struct UringBufRing {
+  struct io_uring_buf_ring *ring;
+  uint8_t *bufs;
+  unsigned int entries;
+  unsigned int buf_size;
+  uint16_t bgid;
+  uint16_t tail;
+} UringBufRing;
+
+int init_uring(Uring *ring, unsigned int entries);
+
+void free_uring(Uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+int uring_submit_and_wait(Uring *ring, unsigned int wait_nr, int timeout_ms);
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+void uring_cqe_seen(Uring *ring);
+
+int init_uring_buf_ring(Uring *ring, UringBufRing *br, uint16_t bgid,
+                        unsigned int entries, unsigned int buf_size);
+
+void free_uring_buf_ring(Uring *ring, UringBufRing *br);
+
+uint8_t *uring_buf(UringBufRing *br, uint16_t bid);
+
+void uring_buf_recycle(UringBufRing *br, uint16_t bid);
+
+#endif
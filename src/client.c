@@ -11,35 +11,47 @@
 #include "../lib/message.h"
 #include "../lib/hash_table.h"
 #include "../lib/conn.h"
+#include "../lib/cluster.h"
 
 #define PORT "9034" // the port client will be connecting to
 
-Message *out_receive_msg(int sockfd) {
-  size_t buf_size = 128;
-  uint8_t *recv_buf = malloc(buf_size);
+#define MAX_PIPELINE 1024 // Requests queued by one pipeline command
+#define MAX_BATCH_KEYS 256 // Keys in one mget or mdelete line
+
+/* A connection to the server, with bytes received but not yet parsed,
+   as several pipelined responses may arrive in one read */
+typedef struct Client {
   Conn conn;
-  init_conn(&conn);
-  int recv_bytes;
+  uint8_t recv_buf[128];
+  size_t recv_pos;
+  size_t recv_len;
+} Client;
+
+/* Receive the next message from the server, or NULL on error */
+Message *out_receive_msg(Client *client) {
   size_t processed_bytes;
-  Message *msg = NULL;
   for (;;) {
-    if ((recv_bytes = recv(sockfd, recv_buf, buf_size, 0)) == -1) {
-	    perror("recv");
-      goto cleanup;
-    }
-    uint8_t *buf_pos = recv_buf;
-    for (;;) {
-      msg = out_recv_msg(&conn, recv_bytes, buf_pos, &processed_bytes);
+    while (client->recv_pos < client->recv_len) {
+      Message *msg = out_recv_msg(&client->conn, client->recv_len - client->recv_pos,
+                                  client->recv_buf + client->recv_pos, &processed_bytes);
+      client->recv_pos += processed_bytes;
       if (msg)
-        goto cleanup;
-      buf_pos += processed_bytes;
-      if (buf_pos >= recv_buf + recv_bytes)
-        break;                  /* Wait on further messages from the network */
+        return msg;
+      if (client->conn.refused) {
+        fprintf(stderr, "response too large\n");
+        return NULL;
+      }
     }
+    /* Wait on further messages from the network */
+    ssize_t recv_bytes = recv(client->conn.fd, client->recv_buf, sizeof client->recv_buf, 0);
+    if (recv_bytes <= 0) {
+      if (recv_bytes == -1)
+        perror("recv");
+      return NULL;
+    }
+    client->recv_pos = 0;
+    client->recv_len = recv_bytes;
   }
- cleanup:
-  free(recv_buf);
-  return msg;
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -98,90 +110,284 @@ Val *out_read_val() {
   return val;
 }
 
-void handle_get(int sockfd, Key *take_key) {
-  Message *msg;
-  size_t buf_size;
-  uint8_t *buf;
-  Val *val;
-  bool error = false;
-
-  /* Send message */
-  msg = malloc(sizeof(Message));
-  msg->type = GET;
-  msg->message.get.key.key_size = take_key->key_size;
-  msg->message.get.key.key = take_key->key;
-  free(take_key);
-
-  buf = out_serialise_message(msg, &buf_size);
-  if (send_all(sockfd, buf, &buf_size)) {
-    perror("handle_get:sendall");
-    error = true;
-  };
+/* Read a TTL in seconds, where an empty line means no expiry.
+   Returns FALSE on invalid input. */
+bool read_ttl(uint32_t *ttl) {
+  char *buf = NULL;
+  size_t buf_size = 0;
+  char *end;
+  bool ok = true;
+
+  printf("ttl> ");
+  int ttl_size = getline(&buf, &buf_size, stdin);
+  if (ttl_size < 0) {
+    perror("read_ttl");
+    ok = false;
+  } else if (ttl_size - 1 == 0) {
+    *ttl = 0;
+  } else {
+    *ttl = strtoul(buf, &end, 10);
+    if (*end != '\n') {
+      printf("Invalid ttl\n");
+      ok = false;
+    }
+  }
   free(buf);
-  free_message(msg);
+  return ok;
+}
 
-  if (error)
-    return;
+/* Queue a GET of KEY, to be sent by conn_flush() */
+void queue_get(Conn *conn, Key *take_key) {
+  Message msg;
+  msg.type = GET;
+  msg.message.get.key = *take_key;
+  conn_queue_msg(conn, &msg);
+  free_key(take_key);
+}
 
-  /* Receive response */
-  msg = out_receive_msg(sockfd);
-  if (msg) {
-    if (msg->type == GET_RESP) {
-      val = msg->message.get_resp.val;
-      if (val) {
-        printf("Value: ");
-        fwrite(val->val, 1, val->val_size, stdout);
-        printf("\n");
-      } else
-        printf("Value not found\n");
-    } else
-      printf("Unexpected message type: %d\n", msg->type);
+/* Queue a DELETE of KEY, to be sent by conn_flush() */
+void queue_delete(Conn *conn, Key *take_key) {
+  Message msg;
+  msg.type = DELETE;
+  msg.message.delete.key = *take_key;
+  conn_queue_msg(conn, &msg);
+  free_key(take_key);
+}
+
+/* Queue an MGET or MDELETE (as TYPE) of the space separated keys read
+   by strtok_r() from *SAVE, to be sent by conn_flush(). Returns FALSE
+   if there are no keys or any is too long. */
+bool queue_batch(Conn *conn, MessageType type, char **save) {
+  Key keys[MAX_BATCH_KEYS];
+  Message msg = { .type = type };
+  BatchCount count = 0;
+  char *key;
+  while (count < MAX_BATCH_KEYS && (key = strtok_r(NULL, " ", save))) {
+    if (strlen(key) > UINT8_MAX)
+      return false;
+    keys[count].key_size = strlen(key);
+    keys[count++].key = (uint8_t *)key;
+  }
+  if (!count)
+    return false;
+  if (type == MGET) {
+    msg.message.mget.count = count;
+    msg.message.mget.keys = keys;
+  } else {
+    msg.message.mdelete.count = count;
+    msg.message.mdelete.keys = keys;
+  }
+  conn_queue_msg(conn, &msg);
+  return true;
+}
+
+/* Queue a PUT of VAL at KEY, to be sent by conn_flush() */
+void queue_put(Conn *conn, Key *take_key, Val *take_val, uint32_t ttl) {
+  Message msg;
+  msg.type = PUT;
+  msg.message.put.key = *take_key;
+  msg.message.put.val = *take_val;
+  msg.message.put.ttl = ttl;
+  conn_queue_msg(conn, &msg);
+  free_key(take_key);
+  free_val(take_val);
+}
+
+/* Receive and print the response to a request of type TYPE */
+void print_val(Val *val) {
+  if (val) {
+    printf("Value: ");
+    fwrite(val->val, 1, val->val_size, stdout);
+    printf("\n");
   } else
-    printf("Error receiving message\n");
+    printf("Value not found\n");
+}
 
-  free_message(msg);
+void print_deleted(bool deleted) {
+  printf(deleted ? "Value deleted\n" : "Value not found\n");
 }
 
-void handle_put(int sockfd, Key *take_key, Val *take_val) {
-  Message *msg;
-  size_t buf_size;
-  uint8_t *buf;
-  bool error = false;
-
-  /* Send message */
-  msg = malloc(sizeof(Message));
-  msg->type = PUT;
-  msg->message.put.key.key_size = take_key->key_size;
-  msg->message.put.key.key = take_key->key;
-  msg->message.put.val.val_size = take_val->val_size;
-  msg->message.put.val.val = take_val->val;
-  free(take_key);
-  free(take_val);
-  buf = out_serialise_message(msg, &buf_size);
-  if (send_all(sockfd, buf, &buf_size)) {
-    perror("handle_get:sendall");
-    error = true;
-  };
-  free(buf);
+void print_response(Client *client, MessageType type) {
+  Message *msg = out_receive_msg(client);
+  if (!msg) {
+    printf("Error receiving message\n");
+    return;
+  }
+  if (type == GET && msg->type == GET_RESP) {
+    print_val(msg->message.get_resp.val);
+  } else if (type == MGET && msg->type == MGET_RESP) {
+    for (BatchCount i = 0; i < msg->message.mget_resp.count; i++)
+      print_val(msg->message.mget_resp.vals[i]);
+  } else if (type == DELETE && msg->type == DELETE_RESP) {
+    print_deleted(msg->message.delete_resp.deleted);
+  } else if (type == MDELETE && msg->type == MDELETE_RESP) {
+    for (BatchCount i = 0; i < msg->message.mdelete_resp.count; i++)
+      print_deleted(msg->message.mdelete_resp.deleted[i]);
+  } else if (type == SNAPSHOT && msg->type == SNAPSHOT_RESP) {
+    if (msg->message.snapshot_resp.started)
+      printf("Snapshot started\n");
+    else
+      printf("Snapshot not started (disabled or already running)\n");
+  } else if (type == PUT && msg->type == PUT_RESP) {
+    if (msg->message.put_resp.is_update)
+      printf("Value updated\n");
+    else
+      printf("Value added\n");
+  } else
+    printf("Unexpected message type: %d\n", msg->type);
+
   free_message(msg);
+}
 
-  if (error)
+/* Send queued requests of the given TYPES in one write, then print
+   their responses in order */
+void send_requests(Client *client, MessageType *types, unsigned int count) {
+  if (conn_flush(&client->conn)) {
+    perror("send_requests:send_all");
     return;
+  }
+  for (unsigned int i = 0; i < count; i++)
+    print_response(client, types[i]);
+}
 
-  /* Receive response */
-  msg = out_receive_msg(sockfd);
-  if (msg) {
-    if (msg->type == PUT_RESP) {
-      if (msg->message.put_resp.is_update)
-        printf("Value updated\n");
+/*
+ * Read requests, one per line as "get KEY", "put KEY VAL [TTL]",
+ * "delete KEY", "mget KEY..." or "mdelete KEY...", until an empty
+ * line. They are then sent together, without waiting
+ * for each response, and the responses printed in order.
+ */
+void handle_pipeline(Client *client) {
+  MessageType types[MAX_PIPELINE];
+  unsigned int count = 0;
+  char *line = NULL;
+  size_t line_buf_size = 0;
+  ssize_t line_size;
+
+  printf("Enter requests, then an empty line to send them\n");
+  while (count < MAX_PIPELINE) {
+    printf("pipeline> ");
+    line_size = getline(&line, &line_buf_size, stdin);
+    if (line_size <= 1)
+      break;
+    line[line_size - 1] = '\0';   /* Replace newline */
+    char *save;
+    char *cmd = strtok_r(line, " ", &save);
+    if (cmd && (!strcmp(cmd, "mget") || !strcmp(cmd, "mdelete"))) {
+      MessageType type = !strcmp(cmd, "mget") ? MGET : MDELETE;
+      if (queue_batch(&client->conn, type, &save))
+        types[count++] = type;
       else
-        printf("Value added\n");
-    } else
-      printf("Unexpected message type: %d\n", msg->type);
-  } else
-    printf("Error receiving message\n");
+        printf("Invalid request\n");
+      continue;
+    }
+    char *key = strtok_r(NULL, " ", &save);
+    char *val = strtok_r(NULL, " ", &save);
+    char *ttl = strtok_r(NULL, " ", &save);
+    if (!cmd || !key || strlen(key) > UINT8_MAX) {
+      printf("Invalid request\n");
+    } else if (!strcmp(cmd, "get") && !val) {
+      queue_get(&client->conn, create_key(strlen(key), (uint8_t *)key));
+      types[count++] = GET;
+    } else if (!strcmp(cmd, "delete") && !val) {
+      queue_delete(&client->conn, create_key(strlen(key), (uint8_t *)key));
+      types[count++] = DELETE;
+    } else if (!strcmp(cmd, "put") && val && strlen(val) <= UINT16_MAX) {
+      queue_put(&client->conn, create_key(strlen(key), (uint8_t *)key),
+                create_val(strlen(val), (uint8_t *)val),
+                ttl ? strtoul(ttl, NULL, 10) : 0);
+      types[count++] = PUT;
+    } else {
+      printf("Invalid request\n");
+    }
+  }
+  free(line);
+  send_requests(client, types, count);
+}
 
-  free_message(msg);
+/* Read space separated keys and get them all with one MGET per
+   server */
+void handle_cluster_mget(Cluster *cluster) {
+  Key keys[MAX_BATCH_KEYS];
+  Val *vals[MAX_BATCH_KEYS];
+  BatchCount count = 0;
+  char *line = NULL;
+  size_t line_buf_size = 0;
+  char *key, *save;
+
+  printf("keys> ");
+  ssize_t line_size = getline(&line, &line_buf_size, stdin);
+  if (line_size > 0) {
+    line[line_size - 1] = '\0';   /* Replace newline */
+    for (key = strtok_r(line, " ", &save); key && count < MAX_BATCH_KEYS;
+         key = strtok_r(NULL, " ", &save)) {
+      if (strlen(key) > UINT8_MAX)
+        break;
+      keys[count].key_size = strlen(key);
+      keys[count++].key = (uint8_t *)key;
+    }
+  }
+  if (!count || key)
+    printf("Invalid keys\n");
+  else if (cluster_mget(cluster, count, keys, vals) == -1)
+    perror("mget");
+  else
+    for (BatchCount i = 0; i < count; i++) {
+      print_val(vals[i]);
+      if (vals[i])
+        free_val(vals[i]);
+    }
+  free(line);
+}
+
+/* Prompt for commands as for a single server, sending each key to the
+   server owning it in CLUSTER */
+void run_cluster(Cluster *cluster) {
+  for (;;) {
+    printf("get/put/delete/mget> ");
+
+    char *cmd = NULL;
+    size_t cmd_buf_size = 0;
+    int cmd_size = getline(&cmd, &cmd_buf_size, stdin);
+    Key *key = NULL;
+    Val *val = NULL;
+    uint32_t ttl;
+    bool found;
+    if (cmd_size == -1) {
+      perror("getline");
+      exit(1);
+    }
+    cmd[cmd_size - 1] = '\0';   /* Replace newline */
+    if (!strcmp(cmd, "get")) {
+      if ((key = out_read_key())) {
+        if (cluster_get(cluster, key, &val) == -1)
+          perror("get");
+        else
+          print_val(val);
+      }
+    } else if (!strcmp(cmd, "put")) {
+      if ((key = out_read_key()) && (val = out_read_val()) && read_ttl(&ttl)) {
+        if (cluster_put(cluster, key, val, ttl, &found) == -1)
+          perror("put");
+        else
+          printf(found ? "Value updated\n" : "Value added\n");
+      }
+    } else if (!strcmp(cmd, "delete")) {
+      if ((key = out_read_key())) {
+        if (cluster_delete(cluster, key, &found) == -1)
+          perror("delete");
+        else
+          print_deleted(found);
+      }
+    } else if (!strcmp(cmd, "mget")) {
+      handle_cluster_mget(cluster);
+    } else
+      printf("Unrecognised command\n");
+    if (key)
+      free_key(key);
+    if (val)
+      free_val(val);
+    free(cmd);
+  }
 }
 
 int main(int argc, char *argv[])
@@ -191,8 +397,18 @@ int main(int argc, char *argv[])
 	int rv;
 	char s[INET6_ADDRSTRLEN];
 
-	if (argc != 2) {
-    fprintf(stderr,"usage: client hostname\n");
+	if (argc >= 3 && !strcmp(argv[1], "-c")) {
+    Cluster *cluster = create_cluster(argv + 2, argc - 2);
+    if (!cluster) {
+      fprintf(stderr, "client: servers must be given as host:port\n");
+      exit(1);
+    }
+    run_cluster(cluster);
+  }
+
+	if (argc != 2 && argc != 3) {
+    fprintf(stderr,"usage: client hostname [port]\n"
+            "       client -c host:port...\n");
     exit(1);
 	}
 
@@ -200,7 +416,7 @@ int main(int argc, char *argv[])
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
-	if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(argv[1], argc == 3 ? argv[2] : PORT, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		return 1;
 	}
@@ -233,14 +449,21 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo); // all done with this structure
 
+  Client client;
+  init_conn(&client.conn);
+  client.conn.fd = sockfd;
+  client.recv_pos = client.recv_len = 0;
+  MessageType type;
+
   for (;;) {
-    printf("get/put> ");
+    printf("get/put/delete/snapshot/pipeline> ");
 
     char *cmd = NULL;
     size_t cmd_buf_size = 0;
     int cmd_size = getline(&cmd, &cmd_buf_size, stdin);
     Key *key;
     Val *val;
+    uint32_t ttl;
     size_t key_buf_size, val_buf_size;
     if (cmd_size == -1) {
       perror("getline");
@@ -252,8 +475,10 @@ int main(int argc, char *argv[])
       key = out_read_key();
       if (!key)
         continue;
-      handle_get(sockfd, key);
+      queue_get(&client.conn, key);
       /* KEY now invalid */
+      type = GET;
+      send_requests(&client, &type, 1);
     } else if (!strcmp(cmd, "put")) {
       /* Handle put */
       key = out_read_key();
@@ -262,8 +487,27 @@ int main(int argc, char *argv[])
       val = out_read_val();
       if (!val)
         continue;
-      handle_put(sockfd, key, val);
+      if (!read_ttl(&ttl))
+        continue;
+      queue_put(&client.conn, key, val, ttl);
       /* KEY and VAL now invalid */
+      type = PUT;
+      send_requests(&client, &type, 1);
+    } else if (!strcmp(cmd, "delete")) {
+      key = out_read_key();
+      if (!key)
+        continue;
+      queue_delete(&client.conn, key);
+      /* KEY now invalid */
+      type = DELETE;
+      send_requests(&client, &type, 1);
+    } else if (!strcmp(cmd, "snapshot")) {
+      Message msg = { .type = SNAPSHOT };
+      conn_queue_msg(&client.conn, &msg);
+      type = SNAPSHOT;
+      send_requests(&client, &type, 1);
+    } else if (!strcmp(cmd, "pipeline")) {
+      handle_pipeline(&client);
     } else
       printf("Unrecognised command\n");
     free(cmd);
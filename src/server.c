@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,11 +9,43 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include "../lib/aof.h"
 #include "../lib/conn.h"
 #include "../lib/hash_table.h"
+#include "../lib/hash.h"
+#include "../lib/repl.h"
+#include "../lib/shard.h"
+#include "../lib/snapshot.h"
+#include "../lib/uring.h"
 
 #define PORT "9034"   // Port we're listening on
+#define EXPIRE_BATCH 128      // Expired entries reaped per loop iteration
+#define EXPIRE_INTERVAL 1000  // Max ms between reaping expired entries
+#define SHARDS_PER_WORKER 4   // Default shard count per worker thread
+#define MAX_EVENTS 64         // Events handled per epoll_wait
+#define OUT_FLUSH_BYTES 65536 // Queued output sent before reading on
+#define READ_BUF_SIZE 65536   // Bytes read from a connection at once
+#define DIRECT_READ_MIN 16384 // Rest of a message read straight into place
+#define MSG_POOL_BUFS 64      // Free message buffers kept per worker
+#define OUT_LIMIT_KB 1024     // Default per-connection output limit
+#define IN_LIMIT_KB 65536     // Default request size limit
+#define URING_ENTRIES 256     // io_uring submission queue size
+#define URING_BUFS 256        // Receive buffers provided to io_uring
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0          // Buffer group id of the receive buffers
+#define AOF_SYNC_MS 100       // Default ms between log syncs
+#define AOF_SYNC_KB 4096      // Default KB logged before syncing sooner
+#define AOF_REWRITE_MB 64     // Default log size before rewriting
+#define REPL_BATCH_MS 5       // Ms between batches of writes sent to replicas
 
 // Get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -24,8 +57,8 @@ void *get_in_addr(struct sockaddr *sa)
   return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-// Return a listening socket
-int get_listener_socket(void)
+// Return a listening socket on PORT
+int get_listener_socket(const char *port)
 {
   int listener;     // Listening socket descriptor
   int yes=1;        // For setsockopt() SO_REUSEADDR, below
@@ -38,7 +71,7 @@ int get_listener_socket(void)
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE;
-  if ((rv = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
+  if ((rv = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
     fprintf(stderr, "selectserver: %s\n", gai_strerror(rv));
     exit(1);
   }
@@ -51,6 +84,8 @@ int get_listener_socket(void)
 
     // Lose the pesky "address already in use" error message
     setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    // Let each worker thread bind its own listener to the port
+    setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
 
     if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
       close(listener);
@@ -72,164 +107,1084 @@ int get_listener_socket(void)
     return -1;
   }
 
+  // Accept without blocking, as the event loop accepts until EAGAIN
+  // (accepted sockets don't inherit this)
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+
   return listener;
 }
 
-// Add a new file descriptor to the set
-void add_to_pfds(struct pollfd *pfds[], int newfd, int *fd_count, int *fd_size)
+// Return a socket connected to the primary at ADDR, given as
+// host:port, or -1 setting errno
+int connect_to_primary(char *addr)
+{
+  char *colon = strrchr(addr, ':');
+  if (!colon) {
+    errno = EINVAL;
+    return -1;
+  }
+  *colon = '\0';
+  struct addrinfo hints, *ai, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rv = getaddrinfo(addr, colon + 1, &hints, &ai);
+  *colon = ':';
+  if (rv != 0) {
+    fprintf(stderr, "%s: %s\n", addr, gai_strerror(rv));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for (p = ai; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+volatile sig_atomic_t stats_requested = 0;
+volatile sig_atomic_t shutdown_requested = 0;
+
+// Print table stats from the main loop on SIGUSR1
+void handle_sigusr1(int sig)
+{
+  stats_requested = 1;
+}
+
+// Shut down from the main loop on SIGTERM or SIGINT
+void handle_shutdown(int sig)
+{
+  shutdown_requested = 1;
+}
+
+// Saves snapshots one at a time on its own thread, when requested and
+// every INTERVAL seconds
+typedef struct Snapshotter {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  ShardedTable *st;
+  const char *path;             // NULL if snapshots are disabled
+  unsigned int interval;        // Zero for none
+  bool requested;
+  bool running;
+} Snapshotter;
+
+// Ask for a snapshot to be taken. Returns false if snapshots are
+// disabled, or one is already pending or running.
+bool request_snapshot(Snapshotter *snap)
+{
+  if (!snap->path)
+    return false;
+  pthread_mutex_lock(&snap->lock);
+  bool ok = !snap->requested && !snap->running;
+  if (ok) {
+    snap->requested = true;
+    pthread_cond_signal(&snap->cond);
+  }
+  pthread_mutex_unlock(&snap->lock);
+  return ok;
+}
+
+double elapsed_sec(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Fork a child to save a snapshot, and wait for it to finish. Workers
+// only pause for the fork itself.
+void take_snapshot(Snapshotter *snap)
 {
-  // If we don't have room, add more space in the pfds array
-  if (*fd_count == *fd_size) {
-    *fd_size *= 2; // Double it
+  struct timespec start;
+  int status;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork_snapshot(snap->st, snap->path);
+  if (pid == -1) {
+    perror("fork");
+    return;
+  }
+  printf("snapshot: forked in %.3f s\n", elapsed_sec(&start));
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    printf("snapshot: saved %s in %.3f s\n", snap->path, elapsed_sec(&start));
+  else
+    fprintf(stderr, "snapshot: failed to save %s\n", snap->path);
+  fflush(stdout);
+}
 
-    *pfds = realloc(*pfds, sizeof(**pfds) * (*fd_size));
+void *run_snapshotter(void *arg)
+{
+  Snapshotter *snap = arg;
+  struct timespec due;
+  pthread_mutex_lock(&snap->lock);
+  for (;;) {
+    // The next periodic snapshot is due INTERVAL after the last ended
+    clock_gettime(CLOCK_REALTIME, &due);
+    due.tv_sec += snap->interval;
+    while (!snap->requested) {
+      if (!snap->interval)
+        pthread_cond_wait(&snap->cond, &snap->lock);
+      else if (pthread_cond_timedwait(&snap->cond, &snap->lock, &due) == ETIMEDOUT)
+        snap->requested = true;
+    }
+    snap->requested = false;
+    snap->running = true;
+    pthread_mutex_unlock(&snap->lock);
+    take_snapshot(snap);
+    pthread_mutex_lock(&snap->lock);
+    snap->running = false;
   }
+  return NULL;
+}
 
-  (*pfds)[*fd_count].fd = newfd;
-  (*pfds)[*fd_count].events = POLLIN; // Check ready-to-read
+// Respond to a SNAPSHOT request on CONN, starting one in the
+// background
+void handle_snapshot_msg(Snapshotter *snap, Conn *conn)
+{
+  Message resp = { .type = SNAPSHOT_RESP };
+  resp.message.snapshot_resp.started = request_snapshot(snap);
+  conn_queue_msg(conn, &resp);
+}
 
-  (*fd_count)++;
+// A thread running its own event loop over its own connections
+typedef struct Worker {
+  pthread_t thread;
+  unsigned int id;
+  unsigned int worker_count;
+  struct Worker *workers;       // All workers, for stats
+  ShardedTable *st;
+  Snapshotter *snapshotter;
+  Replica *replica;             // Our link to the primary, if a replica
+  const char *port;
+  bool use_uring;
+  size_t out_limit;             // Output queued before reading pauses
+  size_t in_limit;              // Largest request taken
+  uint8_t *read_buf;            // READ_BUF_SIZE bytes for the epoll loop
+  MsgBufPool msg_pool;          // For messages straddling reads
+  unsigned long requests;       // Updated atomically, read by worker 0
+  unsigned long syscalls;
+} Worker;
+
+// Count work done by WORKER since the last call
+void count_work(Worker *worker, unsigned long requests, unsigned long syscalls)
+{
+  __atomic_fetch_add(&worker->requests, requests, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&worker->syscalls, syscalls, __ATOMIC_RELAXED);
 }
 
-void add_to_conns(Conn **conns, size_t *conns_size, unsigned int conn_count) {
-  if (conn_count == *conns_size) {
-    *conns_size *= 2;
-    *conns = realloc(*conns, sizeof(Conn) * *conns_size);
+// Print table stats, and how many system calls each worker has made
+// per request served
+void print_stats(Worker *worker)
+{
+  print_sharded_table_stats(worker->st, stdout);
+  if (worker->st->aof)
+    print_aof_stats(worker->st->aof, stdout);
+  if (worker->st->primary)
+    print_primary_stats(worker->st->primary, stdout);
+  if (worker->replica)
+    print_replica_stats(worker->replica, stdout);
+  for (unsigned int i = 0; i < worker->worker_count; i++) {
+    Worker *w = &worker->workers[i];
+    unsigned long requests = __atomic_load_n(&w->requests, __ATOMIC_RELAXED);
+    unsigned long syscalls = __atomic_load_n(&w->syscalls, __ATOMIC_RELAXED);
+    printf("worker %u: backend: %s requests: %lu syscalls: %lu syscalls/request: %.3f\n",
+           i, w->use_uring ? "uring" : "epoll", requests, syscalls,
+           requests ? (double)syscalls / requests : 0.0);
   }
-  init_conn(*conns + conn_count);
+  fflush(stdout);
 }
 
-// Remove an index from the set
-void del_from_pfds(struct pollfd pfds[], int i, int *fd_count)
+// Stop serving and exit, leaving the tables where they persist (see
+// hash_table_sync) and the log synced. The log's and the primary's
+// threads are stopped first, as they may be waiting for a shard lock.
+// Every shard then stays locked, so no write made after its table and
+// log are synced is lost.
+void shutdown_server(Worker *worker)
 {
-  // Copy the one from the end over this one
-  pfds[i] = pfds[*fd_count-1];
+  ShardedTable *st = worker->st;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (st->aof)
+    aof_stop(st->aof);
+  if (st->primary)
+    primary_stop(st->primary);
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    shard_lock(&st->shards[i]);
+  if (st->aof)
+    free_aof(st->aof);
+  if (st->primary)
+    free_primary(st->primary);
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    hash_table_sync(st->shards[i].ht);
+  printf("shut down in %.3f s\n", elapsed_sec(&start));
+  exit(0);
+}
 
-  (*fd_count)--;
+// Reap expired entries from this worker's share of the shards, print
+// stats and shut down if asked. Returns how long the loop may then
+// wait (ms).
+int run_timers(Worker *worker)
+{
+  // Reap a bounded number of expired entries, polling again
+  // immediately if more remain
+  int timeout = sharded_table_expire(worker->st, time(NULL), worker->id,
+                                     worker->worker_count, EXPIRE_BATCH)
+    == EXPIRE_BATCH ? 0 : EXPIRE_INTERVAL;
+
+  if (worker->id == 0 && stats_requested) {
+    stats_requested = 0;
+    print_stats(worker);
+  }
+  if (worker->id == 0 && shutdown_requested)
+    shutdown_server(worker);
+  return timeout;
 }
 
-void del_from_conns(Conn *conns, int i, unsigned int conn_count) {
-  /* Copy end conn over this one */
-  conns[i] = conns[conn_count - 1];
+// Handle the requests in the LEN bytes at BUF received on CONN,
+// queueing their responses. Requests wholly within BUF are parsed in
+// place, so a GET costs no allocation beyond growing the output
+// buffer. Once output (including IN_FLIGHT bytes being sent
+// separately) reaches the worker's limit, reading pauses and the rest
+// of the input is kept on CONN until resume_input(). A message
+// straddling reads holds one of the worker's pooled buffers only until
+// it's handled. A replica takes writes only from its primary, so a
+// client sending one is shut out, and the rest of its input dropped
+// until it's closed, as is one sending a request over the worker's
+// size limit before it is buffered.
+void handle_input(Worker *worker, Conn *conn, uint8_t *buf, size_t len, size_t in_flight)
+{
+  if (conn->refused)
+    return;
+  unsigned long requests = 0;
+  uint8_t *pos = buf, *end = buf + len;
+  Message msg;
+  while (!conn->read_paused && (pos < end || conn_has_msg(conn))) {
+    if (!conn_next_msg(conn, &pos, end, &msg)) {
+      if (conn->refused) {
+        printf("pollserver: socket %d sent a request over %zu bytes\n", conn->fd,
+               conn->max_msg_size);
+        shutdown(conn->fd, SHUT_RDWR);
+        conn_release_msg_buf(conn);
+        count_work(worker, requests, 1);
+        return;
+      }
+      continue;
+    }
+    if (worker->replica && is_write(&msg)) {
+      free_message_views(&msg);
+      shutdown(conn->fd, SHUT_RDWR);
+      conn->refused = true;
+      conn_release_msg_buf(conn);
+      count_work(worker, requests, 1);
+      return;
+    }
+    if (msg.type == SNAPSHOT)
+      handle_snapshot_msg(worker->snapshotter, conn);
+    else
+      conn_handle_shared_msg(conn, &msg, worker->st);
+    free_message_views(&msg);
+    ++requests;
+    if (conn_pending(conn) + in_flight >= worker->out_limit)
+      conn->read_paused = true;
+  }
+  if (pos < end)
+    conn_stash_input(conn, pos, end - pos);
+  conn_release_msg_buf(conn);
+  count_work(worker, requests, 0);
 }
 
-// Main
-int main(void)
+// Unpause reading on CONN, first handling input kept while paused.
+// Reading may pause again if that input produces enough output.
+void resume_input(Worker *worker, Conn *conn, size_t in_flight)
 {
-  int listener;     // Listening socket descriptor
+  uint8_t *buf = conn->in_buf;
+  size_t len = conn->in_len;
+  conn->read_paused = false;
+  conn->in_buf = NULL;
+  conn->in_len = 0;
+  handle_input(worker, conn, buf, len, in_flight);
+  free(buf);
+}
+
+void print_new_connection(struct sockaddr_storage *remoteaddr, int newfd)
+{
+  char remoteIP[INET6_ADDRSTRLEN];
 
+  printf("pollserver: new connection from %s on "
+         "socket %d\n",
+         inet_ntop(remoteaddr->ss_family,
+                   get_in_addr((struct sockaddr*)remoteaddr),
+                   remoteIP, INET6_ADDRSTRLEN),
+         newfd);
+}
+
+// Accept every pending connection on LISTENER, registering each with
+// EPFD. The listener is edge-triggered, so keep going until EAGAIN.
+void accept_conns(Worker *worker, int epfd, int listener)
+{
   int newfd;        // Newly accept()ed socket descriptor
   struct sockaddr_storage remoteaddr; // Client address
   socklen_t addrlen;
 
-  uint8_t buf[256];    // Buffer for client data
+  for (;;) {
+    addrlen = sizeof remoteaddr;
+    // Non-blocking, so a slow reader can't stall the loop on a send
+    newfd = accept4(listener,
+                    (struct sockaddr *)&remoteaddr,
+                    &addrlen, SOCK_NONBLOCK);
+    count_work(worker, 0, 1);
 
-  char remoteIP[INET6_ADDRSTRLEN];
+    if (newfd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
 
-  // Start off with room for 5 connections
-  // (We'll realloc as necessary)
-  int fd_count = 0;
-  int fd_size = 5;
-  struct pollfd *pfds = malloc(sizeof *pfds * fd_size);
-  size_t conns_size = fd_size - 1;
-  Conn *conns = malloc(sizeof(Conn) * conns_size);
-  HashTable *ht = create_hash_table(128); /* TODO: update size */
+    Conn *conn = create_conn(newfd);
+    conn->pool = &worker->msg_pool;
+    conn->max_msg_size = worker->in_limit;
+    // Large GET values go out by reference with sendmsg(); the uring
+    // backend's sends copy output, so it doesn't share
+    conn->share_vals = true;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = conn;
+    count_work(worker, 0, 1);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+      perror("epoll_ctl");
+      close(newfd);
+      free_conn(conn);
+      continue;
+    }
 
-  // Set up and get a listening socket
-  listener = get_listener_socket();
+    print_new_connection(&remoteaddr, newfd);
+  }
+}
 
-  if (listener == -1) {
-    fprintf(stderr, "error getting listening socket\n");
+// Send as much of CONN's queued output as the socket takes, counting
+// the system call. Returns -1 on failure.
+int send_conn(Worker *worker, Conn *conn)
+{
+  if (!conn_pending(conn))
+    return 0;
+  count_work(worker, 0, 1);
+  if (conn_send(conn) == -1) {
+    perror("send");
+    return -1;
+  }
+  return 0;
+}
+
+// Read everything available on CONN, handling each complete request.
+// Responses to all the requests read are queued and sent together,
+// so a client pipelining requests costs one write per read event.
+// Reading pauses while more than the worker's output limit is queued,
+// so a client that doesn't read its responses can't make the server
+// buffer without bound. The large remainder of a message straddling
+// reads is received straight into its buffer rather than copied
+// there. Returns -1 if the connection should be closed.
+int handle_readable(Worker *worker, Conn *conn)
+{
+  unsigned long syscalls = 0;
+  int ret = 0;
+
+  // Resumed once the output drains (see handle_event)
+  while (!conn->read_paused) {
+    size_t want;
+    uint8_t *buf = conn_msg_space(conn, &want);
+    bool direct = buf && want >= DIRECT_READ_MIN;
+    if (!direct) {
+      buf = worker->read_buf;
+      want = READ_BUF_SIZE;
+    }
+    int nbytes = recv(conn->fd, buf, want, 0);
+    ++syscalls;
+
+    if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;           // Drained: wait for the next edge
+
+    if (nbytes <= 0) {
+      // Got error or connection closed by client
+      if (nbytes == 0) {
+        // Connection closed
+        printf("pollserver: socket %d hung up\n", conn->fd);
+      } else {
+        perror("recv");
+      }
+      ret = -1;
+      break;
+    }
+
+    if (direct) {
+      conn_msg_received(conn, nbytes);
+      handle_input(worker, conn, NULL, 0, 0);
+    } else
+      handle_input(worker, conn, buf, nbytes, 0);
+    // Start sending a long pipeline's responses before reading on
+    if (conn_pending(conn) >= OUT_FLUSH_BYTES && send_conn(worker, conn) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  count_work(worker, 0, syscalls);
+  if (ret == 0 && send_conn(worker, conn) == -1)
+    ret = -1;
+  return ret;
+}
+
+// Register interest in CONN becoming writable only while it has
+// output the socket wouldn't take. Returns -1 on failure.
+int update_events(Worker *worker, int epfd, Conn *conn)
+{
+  bool want_write = conn_pending(conn) > 0;
+  if (want_write == conn->write_wait)
+    return 0;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  count_work(worker, 0, 1);
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  conn->write_wait = want_write;
+  return 0;
+}
+
+// Handle EVENTS on CONN. Returns -1 if the connection should be
+// closed.
+int handle_event(Worker *worker, int epfd, Conn *conn, uint32_t events)
+{
+  if (events & EPOLLOUT && send_conn(worker, conn) == -1)
+    return -1;
+  // Errors and hangups are picked up by recv
+  bool readable = events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+  for (;;) {
+    if (conn->read_paused && conn_pending(conn) < worker->out_limit) {
+      resume_input(worker, conn, 0);
+      // Input may have arrived while paused, with no edge to come
+      readable = true;
+    }
+    if (!readable)
+      break;
+    readable = false;
+    // This may pause reading again, but then sends, which may drain
+    // the output without waiting for the socket
+    if (handle_readable(worker, conn) == -1)
+      return -1;
+  }
+  return update_events(worker, epfd, conn);
+}
+
+// Serve connections on LISTENER with edge-triggered epoll
+void run_epoll_worker(Worker *worker, int listener)
+{
+  struct epoll_event events[MAX_EVENTS];
+  // Requests arriving whole in a read are parsed in place, so one
+  // large buffer shared by all the worker's connections keeps copying
+  // to the few that straddle reads
+  worker->read_buf = malloc(READ_BUF_SIZE);
+
+  // Connections are reached directly from their event's data
+  // pointer, so the cost of an event doesn't depend on how many
+  // connections are open. The listener has a NULL pointer.
+  int epfd = epoll_create1(0);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  // Main loop
+  for(;;) {
+    int timeout = run_timers(worker);
+
+    int event_count = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    count_work(worker, 0, 1);
+
+    if (event_count == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < event_count; i++) {
+      Conn *conn = events[i].data.ptr;
+      if (!conn) {
+        accept_conns(worker, epfd, listener);
+      } else if (handle_event(worker, epfd, conn, events[i].events) == -1) {
+        close(conn->fd); // Bye! Closing also removes it from epoll.
+        count_work(worker, 0, 1);
+        free_conn(conn);
+      }
+    }
+  } // END for(;;)
+}
+
+// Operation a completion is for, stored in the low bits of its
+// user data alongside the UringConn pointer
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL };
+#define OP_MASK 3
+
+// A connection served through io_uring. Responses are queued on the
+// Conn while a send of SENDING is in flight, and the two buffers swap
+// when it completes, so each connection has at most one send
+// outstanding and the responses to a burst of requests go out together.
+typedef struct UringConn {
+  Conn conn;
+  uint8_t *sending;
+  size_t send_len, send_cap, send_off;
+  bool recv_armed;
+  bool send_armed;
+  bool closing;
+} UringConn;
+
+uint64_t op_data(UringConn *uc, int op)
+{
+  return (uint64_t)(uintptr_t)uc | op;
+}
+
+struct io_uring_sqe *get_sqe(Uring *ring)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe) {
+    perror("io_uring_enter");
     exit(1);
   }
+  return sqe;
+}
+
+// Accept connections on LISTENER until cancelled, one completion each
+void queue_accept(Uring *ring, int listener)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listener;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = op_data(NULL, OP_ACCEPT);
+}
+
+// Receive into provided buffers until the connection ends, one
+// completion per buffer filled
+void queue_recv(Uring *ring, UringConn *uc)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->conn.fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = op_data(uc, OP_RECV);
+  uc->recv_armed = true;
+}
+
+void queue_send(Uring *ring, UringConn *uc)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = uc->conn.fd;
+  sqe->addr = (uint64_t)(uintptr_t)(uc->sending + uc->send_off);
+  sqe->len = uc->send_len - uc->send_off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = op_data(uc, OP_SEND);
+  uc->send_armed = true;
+}
+
+// Stop UC's multishot receive, so that its requests aren't read while
+// too much output is queued
+void queue_cancel_recv(Uring *ring, UringConn *uc)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = op_data(uc, OP_RECV);
+  sqe->user_data = op_data(uc, OP_CANCEL);
+}
+
+// Return the number of output bytes queued on UC, including any send
+// in flight
+size_t uring_pending(UringConn *uc)
+{
+  return uc->conn.out_len + uc->send_len - uc->send_off;
+}
+
+// Stop receiving on UC if handling its input has paused reading
+void pause_recv(Uring *ring, UringConn *uc, bool was_paused)
+{
+  if (uc->conn.read_paused && !was_paused && uc->recv_armed)
+    queue_cancel_recv(ring, uc);
+}
+
+// Handle UC's input kept while paused once its output has drained
+// enough, and receive again once its receive has ended
+void resume_recv(Worker *worker, Uring *ring, UringConn *uc)
+{
+  if (uc->closing)
+    return;
+  if (uc->conn.read_paused) {
+    if (uring_pending(uc) >= worker->out_limit)
+      return;
+    resume_input(worker, &uc->conn, uc->send_len - uc->send_off);
+    pause_recv(ring, uc, false);
+    if (uc->conn.read_paused)
+      return;
+  }
+  if (!uc->recv_armed)
+    queue_recv(ring, uc);
+}
+
+// Start sending any queued responses if no send is in flight
+void flush_output(Uring *ring, UringConn *uc)
+{
+  Conn *conn = &uc->conn;
+  if (uc->send_armed || !conn->out_len || uc->closing)
+    return;
+  uint8_t *buf = uc->sending;
+  size_t cap = uc->send_cap;
+  uc->sending = conn->out_buf;
+  uc->send_cap = conn->out_cap;
+  uc->send_len = conn->out_len;
+  uc->send_off = 0;
+  conn->out_buf = buf;
+  conn->out_cap = cap;
+  conn->out_len = 0;
+  queue_send(ring, uc);
+}
+
+// Close UC once nothing is in flight on it. Shutting the socket down
+// ends its multishot receive.
+void close_uring_conn(Worker *worker, UringConn *uc)
+{
+  if (!uc->closing && uc->recv_armed) {
+    shutdown(uc->conn.fd, SHUT_RDWR);
+    count_work(worker, 0, 1);
+  }
+  uc->closing = true;
+  if (uc->recv_armed || uc->send_armed)
+    return;
+  close(uc->conn.fd);
+  count_work(worker, 0, 1);
+  uc->conn.bytes_received = 0;
+  conn_release_msg_buf(&uc->conn);
+  free(uc->conn.out_buf);
+  free(uc->conn.in_buf);
+  free(uc->sending);
+  free(uc);
+}
 
-  // Add the listener to set
-  pfds[0].fd = listener;
-  pfds[0].events = POLLIN; // Report ready to read on incoming connection
+void handle_accept(Worker *worker, Uring *ring, int listener, int res, unsigned int flags)
+{
+  if (!(flags & IORING_CQE_F_MORE))
+    queue_accept(ring, listener);
+  if (res < 0) {
+    fprintf(stderr, "accept: %s\n", strerror(-res));
+    return;
+  }
+
+  UringConn *uc = calloc(1, sizeof(UringConn));
+  init_conn(&uc->conn);
+  uc->conn.fd = res;
+  uc->conn.pool = &worker->msg_pool;
+  uc->conn.max_msg_size = worker->in_limit;
+  queue_recv(ring, uc);
+
+  struct sockaddr_storage remoteaddr;
+  socklen_t addrlen = sizeof remoteaddr;
+  getpeername(res, (struct sockaddr *)&remoteaddr, &addrlen);
+  count_work(worker, 0, 1);
+  print_new_connection(&remoteaddr, res);
+}
+
+void handle_recv(Worker *worker, Uring *ring, UringBufRing *br, UringConn *uc,
+                 int res, unsigned int flags)
+{
+  if (!(flags & IORING_CQE_F_MORE))
+    uc->recv_armed = false;
+
+  if (res > 0) {
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *buf = uring_buf(br, bid);
+    bool was_paused = uc->conn.read_paused;
+    if (was_paused)
+      // Received before the receive was cancelled
+      conn_stash_input(&uc->conn, buf, res);
+    else
+      handle_input(worker, &uc->conn, buf, res, uc->send_len - uc->send_off);
+    uring_buf_recycle(br, bid);
+    flush_output(ring, uc);
+    // Stop receiving if the client isn't keeping up with its responses
+    pause_recv(ring, uc, was_paused);
+  } else if (res == 0) {
+    printf("pollserver: socket %d hung up\n", uc->conn.fd);
+  } else if (res != -ENOBUFS && res != -ECANCELED) {
+    fprintf(stderr, "recv: %s\n", strerror(-res));
+  }
+
+  if (!uc->recv_armed) {
+    // Running out of buffers or being paused ends a receive, and
+    // buffers are recycled as completions are handled, so receive
+    // again. Otherwise the connection has ended.
+    if (!uc->closing && (res > 0 || res == -ENOBUFS || res == -ECANCELED))
+      resume_recv(worker, ring, uc);
+    else
+      close_uring_conn(worker, uc);
+  }
+}
+
+void handle_send(Worker *worker, Uring *ring, UringConn *uc, int res)
+{
+  uc->send_armed = false;
+  if (res < 0) {
+    if (!uc->closing)
+      fprintf(stderr, "send: %s\n", strerror(-res));
+    close_uring_conn(worker, uc);
+    return;
+  }
+  if (uc->closing) {
+    close_uring_conn(worker, uc);
+    return;
+  }
+  uc->send_off += res;
+  if (uc->send_off < uc->send_len)
+    queue_send(ring, uc);
+  else
+    flush_output(ring, uc);
+  if (uc->conn.read_paused) {
+    resume_recv(worker, ring, uc);
+    flush_output(ring, uc);
+  }
+}
 
-  fd_count = 1; // For the listener
+// Serve connections on LISTENER through RING, with multishot accept
+// and receive into provided buffers. Each loop iteration submits all
+// queued operations and waits for completions in one system call.
+void run_uring_worker(Worker *worker, int listener, Uring *ring)
+{
+  UringBufRing br;
+  if (init_uring_buf_ring(ring, &br, URING_BGID, URING_BUFS, URING_BUF_SIZE) == -1) {
+    perror("io_uring buffer ring");
+    exit(1);
+  }
+  queue_accept(ring, listener);
 
   // Main loop
   for(;;) {
-    int poll_count = poll(pfds, fd_count, -1);
+    int timeout = run_timers(worker);
 
-    if (poll_count == -1) {
-      perror("poll");
+    unsigned long enters = ring->enters;
+    int ret = uring_submit_and_wait(ring, 1, timeout);
+    count_work(worker, 0, ring->enters - enters);
+    if (ret == -1 && errno != ETIME && errno != EINTR) {
+      perror("io_uring_enter");
       exit(1);
     }
 
-    // Run through the existing connections looking for data to read
-    for(int i = 0; i < fd_count; i++) {
-
-      // Check if someone's ready to read
-      if (pfds[i].revents & POLLIN) { // We got one!!
-
-        if (pfds[i].fd == listener) {
-          // If listener is ready to read, handle new connection
-
-          addrlen = sizeof remoteaddr;
-          newfd = accept(listener,
-                         (struct sockaddr *)&remoteaddr,
-                         &addrlen);
-
-          if (newfd == -1) {
-            perror("accept");
-          } else {
-            add_to_conns(&conns, &conns_size, fd_count - 1);
-            add_to_pfds(&pfds, newfd, &fd_count, &fd_size);
-
-            printf("pollserver: new connection from %s on "
-                   "socket %d\n",
-                   inet_ntop(remoteaddr.ss_family,
-                             get_in_addr((struct sockaddr*)&remoteaddr),
-                             remoteIP, INET6_ADDRSTRLEN),
-                   newfd);
-          }
-        } else {
-          // If not the listener, we're just a regular client
-          int nbytes = recv(pfds[i].fd, buf, sizeof buf, 0);
-
-          int sender_fd = pfds[i].fd;
-
-          if (nbytes <= 0) {
-            // Got error or connection closed by client
-            if (nbytes == 0) {
-              // Connection closed
-              printf("pollserver: socket %d hung up\n", sender_fd);
-            } else {
-              perror("recv");
-            }
-
-            close(pfds[i].fd); // Bye!
-
-            del_from_conns(conns, i - 1, fd_count - 1);
-            del_from_pfds(pfds, i, &fd_count);
-          } else {
-            size_t bytes_read;
-            uint8_t *buf_pos = buf;
-            for (;;) {
-              Message *msg = out_recv_msg(conns + i - 1, nbytes, buf_pos, &bytes_read);
-              if (msg) {
-                Message *resp = out_handle_msg(msg, ht);
-                if (resp) {
-                  size_t resp_buf_size;
-                  uint8_t *resp_buf = out_serialise_message(resp, &resp_buf_size);
-                  if (send_all(sender_fd, resp_buf, &resp_buf_size))
-                    perror("send_all");
-                  free(resp_buf);
-                  free_message(resp);
-                }
-                free_message(msg);
-              }
-              buf_pos += bytes_read;
-              if (buf_pos >= buf + nbytes)
-                break;
-            }
-          }
-        } // END handle data from client
-      } // END got ready-to-read from poll()
-    } // END looping through file descriptors
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring))) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned int flags = cqe->flags;
+      uring_cqe_seen(ring);
+
+      UringConn *uc = (UringConn *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+      switch (data & OP_MASK) {
+      case OP_ACCEPT:
+        handle_accept(worker, ring, listener, res, flags);
+        break;
+      case OP_RECV:
+        handle_recv(worker, ring, &br, uc, res, flags);
+        break;
+      case OP_SEND:
+        handle_send(worker, ring, uc, res);
+        break;
+      case OP_CANCEL:
+        // The cancelled receive completes separately
+        break;
+      }
+    }
   } // END for(;;)
+}
+
+void *run_worker(void *arg)
+{
+  Worker *worker = arg;
+  init_msg_buf_pool(&worker->msg_pool, MSG_POOL_BUFS);
+
+  // Set up and get a listening socket. Each worker has its own,
+  // and the kernel spreads connections between them.
+  int listener = get_listener_socket(worker->port);
+
+  if (listener == -1) {
+    fprintf(stderr, "error getting listening socket\n");
+    exit(1);
+  }
+
+  if (worker->use_uring) {
+    Uring ring;
+    if (init_uring(&ring, URING_ENTRIES) == 0) {
+      run_uring_worker(worker, listener, &ring);
+      return NULL;
+    }
+    fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+    worker->use_uring = false;
+  }
+  run_epoll_worker(worker, listener);
+
+  return NULL;
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: server [-b epoll|uring] [-e chained|open] [-m megabytes] [-t threads]\n"
+          "              [-s shards] [-o output_limit_kb] [-q request_limit_kb]\n"
+          "              [-f snapshot_file [-l] [-i snapshot_interval]]\n"
+          "              [-a log_file [-w sync_ms] [-W sync_kb] [-r rewrite_mb]]\n"
+          "              [-d table_dir] [-p port]\n"
+          "              [-P replication_port | -R primary_host:port]\n");
+  exit(1);
+}
+
+// Main
+int main(int argc, char *argv[])
+{
+  HashTableEngine engine = ENGINE_CHAINED;
+  size_t mem_limit = 0;
+  unsigned int worker_count = 1;
+  unsigned int shard_count = 0;
+  bool use_uring = false;
+  size_t out_limit = OUT_LIMIT_KB << 10;
+  size_t in_limit = (size_t)IN_LIMIT_KB << 10;
+  Snapshotter snap = { .path = NULL, .interval = 0 };
+  bool load = false;
+  const char *aof_path = NULL;
+  unsigned int sync_ms = AOF_SYNC_MS;
+  size_t sync_bytes = AOF_SYNC_KB << 10;
+  size_t rewrite_min = (size_t)AOF_REWRITE_MB << 20;
+  bool aof_opts = false;
+  const char *table_dir = NULL;
+  const char *port = PORT;
+  const char *repl_port = NULL;
+  char *primary_addr = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:e:m:t:s:o:q:f:li:a:w:W:r:d:p:P:R:")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (!strcmp(optarg, "uring"))
+        use_uring = true;
+      else if (strcmp(optarg, "epoll"))
+        usage();
+      break;
+    case 'e':
+      if (!parse_hash_table_engine(optarg, &engine))
+        usage();
+      break;
+    case 'm':
+      mem_limit = strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 't':
+      worker_count = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      shard_count = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      out_limit = strtoul(optarg, NULL, 10) << 10;
+      break;
+    case 'q':
+      in_limit = strtoul(optarg, NULL, 10) << 10;
+      break;
+    case 'f':
+      snap.path = optarg;
+      break;
+    case 'l':
+      load = true;
+      break;
+    case 'i':
+      snap.interval = strtoul(optarg, NULL, 10);
+      break;
+    case 'a':
+      aof_path = optarg;
+      break;
+    case 'w':
+      sync_ms = strtoul(optarg, NULL, 10);
+      aof_opts = true;
+      break;
+    case 'W':
+      sync_bytes = strtoul(optarg, NULL, 10) << 10;
+      aof_opts = true;
+      break;
+    case 'r':
+      rewrite_min = strtoul(optarg, NULL, 10) << 20;
+      aof_opts = true;
+      break;
+    case 'd':
+      table_dir = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'P':
+      repl_port = optarg;
+      break;
+    case 'R':
+      primary_addr = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (!worker_count || !out_limit || !in_limit || ((load || snap.interval) && !snap.path)
+      || (aof_opts && !aof_path) || !sync_ms
+      // Mapped tables persist themselves, and can't be dumped by a fork
+      || (table_dir && (snap.path || aof_path || repl_port))
+      // A replica's table comes from its primary, and isn't passed on
+      || (primary_addr && (load || aof_path || table_dir || repl_port)))
+    usage();
+  if (!shard_count)
+    shard_count = worker_count * SHARDS_PER_WORKER;
+
+  // A per-process seed keeps clients from choosing keys which collide
+  if (hash_seed_random() == -1)
+    perror("getrandom");
+  ShardedTable *st;
+  if (table_dir) {
+    // Reopening the tables adopts the seed they were filled with
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    st = create_mapped_sharded_table(table_dir, shard_count, 128, mem_limit);
+    if (!st) {
+      fprintf(stderr, "error opening tables in %s: %s\n", table_dir, strerror(errno));
+      exit(1);
+    }
+    unsigned long items = 0;
+    for (unsigned int i = 0; i < shard_count; i++)
+      items += st->shards[i].ht->item_count;
+    printf("opened %lu entries in %s in %.3f s\n", items, table_dir, elapsed_sec(&start));
+    fflush(stdout);
+  } else
+    st = create_sharded_table(shard_count, engine, 128, mem_limit);
+  // Start every shard's clock now, as any worker may serve a TTL put
+  // to a shard before the worker that reaps it first runs
+  sharded_table_expire(st, time(NULL), 0, 1, 0);
+
+  // Warm the table before any worker accepts connections. The log is
+  // the more recent record, so the snapshot is only loaded without one.
+  long replayed = -1, loaded = -1;
+  if (aof_path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    replayed = aof_replay(st, aof_path);
+    if (replayed == -1 && errno != ENOENT) {
+      // Appending to a damaged log would lose whatever follows
+      fprintf(stderr, "error replaying log %s: %s\n", aof_path, strerror(errno));
+      exit(1);
+    } else if (replayed != -1)
+      printf("replayed %ld requests from %s in %.3f s\n", replayed, aof_path,
+             elapsed_sec(&start));
+    fflush(stdout);
+  }
+  if (load && replayed == -1) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    loaded = load_snapshot(st, snap.path);
+    if (loaded == -1 && errno != ENOENT)
+      fprintf(stderr, "error loading snapshot %s: %s\n", snap.path, strerror(errno));
+    else if (loaded != -1)
+      printf("loaded %ld entries from %s in %.3f s\n", loaded, snap.path,
+             elapsed_sec(&start));
+    fflush(stdout);
+  }
+  snap.st = st;
+  pthread_mutex_init(&snap.lock, NULL);
+  pthread_cond_init(&snap.cond, NULL);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handle_sigusr1;
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = handle_shutdown;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  // Worker 0 runs on the main thread. The others block SIGUSR1,
+  // SIGTERM and SIGINT so that they interrupt worker 0, which prints
+  // the stats or shuts down.
+  Worker *workers = calloc(worker_count, sizeof(Worker));
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  if (snap.path && pthread_create(&snap.thread, NULL, run_snapshotter, &snap)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  if (aof_path) {
+    Aof *aof = create_aof(aof_path, st, sync_ms, sync_bytes, rewrite_min);
+    if (!aof) {
+      perror(aof_path);
+      exit(1);
+    }
+    // Start a new log from the snapshot, so that it's complete
+    if (loaded > 0)
+      aof_rewrite(aof);
+  }
+  if (repl_port) {
+    int listener = get_listener_socket(repl_port);
+    if (listener == -1 || !create_primary(st, listener, REPL_BATCH_MS)) {
+      fprintf(stderr, "error replicating on port %s: %s\n", repl_port, strerror(errno));
+      exit(1);
+    }
+  }
+  // A replica is synced before it serves any reads
+  Replica *replica = NULL;
+  if (primary_addr) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fd = connect_to_primary(primary_addr);
+    if (fd == -1 || !(replica = create_replica(st, fd))) {
+      fprintf(stderr, "error syncing from %s: %s\n", primary_addr, strerror(errno));
+      exit(1);
+    }
+    printf("synced %ld entries from %s in %.3f s\n", replica->loaded, primary_addr,
+           elapsed_sec(&start));
+    fflush(stdout);
+  }
+  for (unsigned int i = 0; i < worker_count; i++) {
+    workers[i].id = i;
+    workers[i].worker_count = worker_count;
+    workers[i].workers = workers;
+    workers[i].st = st;
+    workers[i].snapshotter = &snap;
+    workers[i].replica = replica;
+    workers[i].port = port;
+    workers[i].use_uring = use_uring;
+    workers[i].out_limit = out_limit;
+    workers[i].in_limit = in_limit;
+    if (i && pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  run_worker(&workers[0]);
 
   return 0;
 }
@@ -2,9 +2,30 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <endian.h>
 #include "../lib/hash_table.h"
+#include "../lib/hash.h"
 #include "../lib/message.h"
 #include "../lib/conn.h"
+#include "../lib/slab.h"
+#include "../lib/shard.h"
+#include "../lib/snapshot.h"
+#include "../lib/aof.h"
+#include "../lib/mapped_table.h"
+#include "../lib/repl.h"
+#include "../lib/cluster.h"
+#include "../lib/client_pool.h"
 
 /**************/
 /* Test utils */
@@ -12,6 +33,7 @@
 
 #define MAX_TESTS 500
 #define TEST_HT_SIZE 5
+#define TEST_SHARDS 8
 
 void (*tests[MAX_TESTS])();
 int test_count = 0;
@@ -30,9 +52,10 @@ void run_tests() {
 /* hash_table tests */
 /********************/
 
-/* The following two keys conflict when hashed, modulo TEST_HT_SIZE */
+/* The following two keys conflict when hashed with the default seed,
+   modulo TEST_HT_SIZE */
 #define TEST_KEY 5
-#define TEST_OTHER_KEY 0
+#define TEST_OTHER_KEY 7
 #define TEST_VAL 2
 #define TEST_OTHER_VAL 17
 
@@ -66,6 +89,28 @@ Val *get_val(uint8_t n) {
   return val;
 }
 
+/* Initialise a four-byte key from N */
+void init_int_key(Key *key, uint32_t n) {
+  key->key_size = sizeof(n);
+  key->key = malloc(sizeof(n));
+  memcpy(key->key, &n, sizeof(n));
+}
+
+#define MAPPED_TEST_PATH "/tmp/cache-test.map"
+#define MAPPED_TEST_CAPACITY (64 << 20)
+
+/* Construct an empty table of TEST_HT_SIZE using ENGINE, in a new
+   file if ENGINE_MAPPED */
+HashTable *create_test_table(HashTableEngine engine) {
+  if (engine != ENGINE_MAPPED)
+    return create_hash_table_engine(engine, TEST_HT_SIZE);
+  unlink(MAPPED_TEST_PATH);
+  HashTable *ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE,
+                                         MAPPED_TEST_CAPACITY, 0, 1);
+  assert(ht != NULL);
+  return ht;
+}
+
 bool cmp_vals(struct Val *val, struct Val *other) {
   return val->val_size == other->val_size && !memcmp(val->val, other->val, val->val_size);
 }
@@ -109,6 +154,7 @@ void test_ht_put_conflict(void) {
   Key *other_key = get_key(TEST_OTHER_KEY);
   Val *val = get_val(1);
   Val *other_val = get_val(2);
+  assert(hash(key) % TEST_HT_SIZE == hash(other_key) % TEST_HT_SIZE);
   assert(hash_table_put(ht, key, val) == false);
   assert(hash_table_put(ht, other_key, other_val) == false);
   assert(cmp_vals(hash_table_get(ht, key), val));
@@ -149,6 +195,929 @@ void test_ht_delete(void) {
   assert(ht->item_count == 0);
 }
 
+#define RESIZE_TEST_KEYS 1000
+
+/* Overwrite a value with sizes moving between inline and out-of-line
+   storage */
+void check_put_resize_val(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  Key *key = get_key(TEST_KEY);
+  ValSize sizes[] = { 1, 200, 3, 60, INLINE_VAL_MAX, INLINE_VAL_MAX + 1, 0, 8 };
+  uint8_t buf[200];
+  Val val = { .val = buf };
+  for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    val.val_size = sizes[i];
+    memset(buf, i, sizes[i]);
+    assert(hash_table_put(ht, key, &val) == (i > 0));
+    assert(cmp_vals(hash_table_get(ht, key), &val));
+  }
+  assert(!hash_table_delete(ht, key));
+  assert(ht->item_count == 0);
+}
+
+void check_grow(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  Key key;
+  Val *val = get_val(TEST_VAL);
+  bool resized = false;
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    assert(hash_table_put(ht, &key, val) == false);
+    free(key.key);
+    resized |= hash_table_is_resizing(ht);
+    /* Every key inserted so far is reachable mid-resize */
+    for (uint32_t j = 0; j <= i; j += 37) {
+      init_int_key(&key, j);
+      assert(cmp_vals(hash_table_get(ht, &key), val));
+      free(key.key);
+    }
+  }
+  assert(resized);
+  assert(ht->item_count == RESIZE_TEST_KEYS);
+  assert(ht->size > TEST_HT_SIZE);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    assert(cmp_vals(hash_table_get(ht, &key), val));
+    free(key.key);
+  }
+}
+
+void check_shrink(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  Key key;
+  Val *val = get_val(TEST_VAL);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_put(ht, &key, val);
+    free(key.key);
+  }
+  unsigned int grown_size = ht->size;
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    assert(!hash_table_delete(ht, &key));
+    assert(hash_table_get(ht, &key) == NULL);
+    free(key.key);
+  }
+  assert(ht->item_count == 0);
+  /* Drive any outstanding migration to completion */
+  init_int_key(&key, 0);
+  for (int i = 0; i < RESIZE_TEST_KEYS; i++)
+    hash_table_get(ht, &key);
+  free(key.key);
+  assert(ht->size < grown_size);
+  assert(ht->size >= TEST_HT_SIZE);
+}
+
+/* Interleave puts, gets and deletes across several resizes, checking
+   the table against a reference array */
+void check_resize_interleaved(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  uint8_t present[RESIZE_TEST_KEYS] = {0};
+  unsigned int count = 0;
+  Key key;
+  Val val;
+  for (uint32_t round = 0; round < 4; round++) {
+    for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+      uint32_t k = (i * 7 + round * 13) % RESIZE_TEST_KEYS;
+      init_int_key(&key, k);
+      if ((i + round) % 3 == 0) {
+        assert(hash_table_delete(ht, &key) == !present[k]);
+        count -= present[k] != 0;
+        present[k] = 0;
+      } else {
+        uint8_t v = (uint8_t)(k % 100 + round);
+        val.val_size = 1;
+        val.val = &v;
+        assert(hash_table_put(ht, &key, &val) == (present[k] != 0));
+        count += !present[k];
+        present[k] = v + 1;
+      }
+      free(key.key);
+      /* Probe a key unrelated to the mutation */
+      k = (k * 31 + 5) % RESIZE_TEST_KEYS;
+      init_int_key(&key, k);
+      Val *got = hash_table_get(ht, &key);
+      if (present[k])
+        assert(got != NULL && got->val_size == 1 && got->val[0] == present[k] - 1);
+      else
+        assert(got == NULL);
+      free(key.key);
+      assert(ht->item_count == count);
+    }
+  }
+}
+
+#define MEM_LIMIT_TEST_BYTES (64 * 1024)
+
+void check_mem_limit(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  hash_table_set_mem_limit(ht, MEM_LIMIT_TEST_BYTES);
+  Key key;
+  uint8_t buf[100] = {0};
+  Val val = { .val_size = sizeof(buf), .val = buf };
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS * 10; i++) {
+    init_int_key(&key, i);
+    assert(hash_table_put(ht, &key, &val) == false);
+    free(key.key);
+    assert(hash_table_mem_used(ht) <= MEM_LIMIT_TEST_BYTES);
+  }
+  assert(ht->evictions > 0);
+  assert(ht->item_count + ht->evictions == RESIZE_TEST_KEYS * 10);
+  /* Lowering the limit evicts immediately */
+  hash_table_set_mem_limit(ht, MEM_LIMIT_TEST_BYTES / 2);
+  assert(hash_table_mem_used(ht) <= MEM_LIMIT_TEST_BYTES / 2);
+}
+
+/* A key read between every insert is never chosen for eviction */
+void check_evict_unreferenced(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  hash_table_set_mem_limit(ht, MEM_LIMIT_TEST_BYTES);
+  Key *hot = get_key(TEST_KEY);
+  Val *val = get_val(TEST_VAL);
+  Key key;
+  hash_table_put(ht, hot, val);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS * 10; i++) {
+    init_int_key(&key, i);
+    hash_table_put(ht, &key, val);
+    free(key.key);
+    assert(cmp_vals(hash_table_get(ht, hot), val));
+  }
+  assert(ht->evictions > 0);
+}
+
+#define SHIFT_TEST_LIMIT (1024 * 1024)
+
+/* Pages held by one value size are reassigned as the sizes stored
+   shift, so the slab, or the table file, stays bounded by the limit */
+void check_mem_limit_shift(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  hash_table_set_mem_limit(ht, SHIFT_TEST_LIMIT);
+  static const ValSize sizes[] = { 100, 1000, 300, 3000, 100 };
+  static uint8_t buf[3000];
+  Key key;
+  Val val = { .val = buf };
+  uint32_t n = 0;
+  for (size_t s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+    val.val_size = sizes[s];
+    for (uint32_t i = 0; i < 3 * SHIFT_TEST_LIMIT / sizes[s]; i++) {
+      init_int_key(&key, n++);
+      hash_table_put(ht, &key, &val);
+      free(key.key);
+      assert(hash_table_mem_used(ht) <= SHIFT_TEST_LIMIT);
+      assert(slab_total_bytes(&ht->slab) <= SHIFT_TEST_LIMIT);
+      /* The file also holds runs freed by bucket array resizes */
+      if (engine == ENGINE_MAPPED)
+        assert(ht->mapped->hdr->top <= SHIFT_TEST_LIMIT * 5 / 4);
+    }
+  }
+  assert(ht->item_count > SHIFT_TEST_LIMIT / 4 / 100);
+}
+
+#define TTL_TEST_START 1000
+
+void check_ttl_lazy(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  Key *key = get_key(TEST_KEY);
+  Key *other_key = get_key(TEST_OTHER_KEY);
+  Val *val = get_val(TEST_VAL);
+  hash_table_set_time(ht, TTL_TEST_START);
+  assert(hash_table_put_ttl(ht, key, val, 10) == false);
+  assert(hash_table_put_ttl(ht, other_key, val, 10) == false);
+  hash_table_set_time(ht, TTL_TEST_START + 9);
+  assert(cmp_vals(hash_table_get(ht, key), val));
+  /* Expired entries are absent without being reaped */
+  hash_table_set_time(ht, TTL_TEST_START + 10);
+  assert(hash_table_get(ht, key) == NULL);
+  assert(ht->item_count == 1);
+  assert(hash_table_delete(ht, other_key));
+  assert(ht->item_count == 0);
+  assert(ht->expirations == 2);
+  /* Writing over an expired entry adds a new one, and a PUT without
+     a TTL clears it */
+  assert(hash_table_put_ttl(ht, key, val, 5) == false);
+  hash_table_set_time(ht, TTL_TEST_START + 15);
+  assert(hash_table_put_ttl(ht, key, val, 5) == false);
+  assert(hash_table_put(ht, key, val) == true);
+  hash_table_set_time(ht, UINT32_MAX);
+  assert(cmp_vals(hash_table_get(ht, key), val));
+  assert(hash_table_expire(ht, RESIZE_TEST_KEYS) == 0);
+}
+
+/* Reap entries with a spread of TTLs (some beyond the timer wheel's
+   range), overwriting values so entries move in memory */
+void check_ttl_reap(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  uint32_t ttls[RESIZE_TEST_KEYS];
+  uint8_t buf[INLINE_VAL_MAX] = {0};
+  Val val = { .val = buf };
+  Key key;
+  hash_table_set_time(ht, TTL_TEST_START);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    ttls[i] = i % 4 == 0 ? 0 : i % 4 == 1 ? i % 70 + 1 : i % 4 == 2 ? i * 300 : (1 << 24) + i;
+    init_int_key(&key, i);
+    val.val_size = 1;
+    hash_table_put_ttl(ht, &key, &val, ttls[i]);
+    val.val_size = INLINE_VAL_MAX;
+    hash_table_put_ttl(ht, &key, &val, ttls[i]);
+    free(key.key);
+  }
+  uint32_t times[] = { 1, 30, 69, 70, 71, 5000, 100000, 300000, 1 << 24, (1 << 24) + 500, (1 << 24) + 1000 };
+  for (unsigned int t = 0; t < sizeof(times) / sizeof(times[0]); t++) {
+    uint32_t now = TTL_TEST_START + times[t];
+    hash_table_set_time(ht, now);
+    while (hash_table_expire(ht, 10) == 10)
+      ;
+    unsigned int live = 0;
+    for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+      bool expect = !ttls[i] || TTL_TEST_START + ttls[i] > now;
+      live += expect;
+    }
+    /* Reaping alone brought the count down, without lookups */
+    assert(ht->item_count == live);
+    for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+      init_int_key(&key, i);
+      assert((hash_table_get(ht, &key) != NULL) == (!ttls[i] || TTL_TEST_START + ttls[i] > now));
+      free(key.key);
+    }
+  }
+  assert(ht->item_count == RESIZE_TEST_KEYS / 4);
+}
+
+/* Moving the clock further than the wheel spans must not tick through
+   every second in between */
+void test_ht_ttl_clock_jump(void) {
+  HashTable *ht = create_hash_table(TEST_HT_SIZE);
+  Val val;
+  init_val(&val, 1);
+  Key key;
+  hash_table_set_time(ht, TTL_TEST_START);
+  init_key(&key, 1);
+  hash_table_put_ttl(ht, &key, &val, 5);
+  free(key.key);
+  init_key(&key, 2);
+  hash_table_put_ttl(ht, &key, &val, 1 << 30);
+  hash_table_set_time(ht, TTL_TEST_START + (1 << 28));
+  assert(hash_table_expire(ht, 10) == 1);
+  assert(hash_table_get(ht, &key) != NULL);
+  hash_table_set_time(ht, TTL_TEST_START + (1 << 30));
+  assert(hash_table_expire(ht, 10) == 1);
+  assert(ht->item_count == 0);
+  free(key.key);
+  free(val.val);
+}
+
+/* A clock stepped back doesn't make entries added since due early */
+void test_ht_ttl_clock_back(void) {
+  HashTable *ht = create_hash_table(TEST_HT_SIZE);
+  Val val;
+  init_val(&val, 1);
+  Key key, other;
+  init_key(&key, 1);
+  init_key(&other, 2);
+  hash_table_set_time(ht, TTL_TEST_START);
+  hash_table_put_ttl(ht, &other, &val, 40);
+  hash_table_set_time(ht, TTL_TEST_START + 50);
+  assert(hash_table_expire(ht, 10) == 1);
+  hash_table_put_ttl(ht, &other, &val, 20);
+  hash_table_set_time(ht, TTL_TEST_START);
+  hash_table_put_ttl(ht, &key, &val, 30);
+  assert(hash_table_expire(ht, 10) == 0);
+  assert(hash_table_get(ht, &key) != NULL);
+  assert(hash_table_get(ht, &other) != NULL);
+  /* Both still expire once their times come round again */
+  hash_table_set_time(ht, TTL_TEST_START + 30);
+  assert(hash_table_expire(ht, 10) == 1);
+  assert(hash_table_get(ht, &key) == NULL);
+  hash_table_set_time(ht, TTL_TEST_START + 70);
+  assert(hash_table_expire(ht, 10) == 1);
+  assert(ht->item_count == 0);
+  free(key.key);
+  free(other.key);
+  free(val.val);
+}
+
+void test_ht_ttl_lazy(void) {
+  check_ttl_lazy(ENGINE_CHAINED);
+}
+
+void test_ht_ttl_reap(void) {
+  check_ttl_reap(ENGINE_CHAINED);
+}
+
+void test_ht_mem_limit(void) {
+  check_mem_limit(ENGINE_CHAINED);
+}
+
+void test_ht_evict_unreferenced(void) {
+  check_evict_unreferenced(ENGINE_CHAINED);
+}
+
+void test_ht_mem_limit_shift(void) {
+  check_mem_limit_shift(ENGINE_CHAINED);
+}
+
+void test_ht_put_resize_val(void) {
+  check_put_resize_val(ENGINE_CHAINED);
+}
+
+void test_ht_grow(void) {
+  check_grow(ENGINE_CHAINED);
+}
+
+void test_ht_shrink(void) {
+  check_shrink(ENGINE_CHAINED);
+}
+
+void test_ht_resize_interleaved(void) {
+  check_resize_interleaved(ENGINE_CHAINED);
+}
+
+int count_entry(Entry *entry, void *arg) {
+  ++*(unsigned int *)arg;
+  return 0;
+}
+
+/* A reserved table takes its entries without resizing, and visits
+   each once */
+void check_reserve(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  hash_table_reserve(ht, RESIZE_TEST_KEYS);
+  unsigned int size = ht->size;
+  assert(size >= RESIZE_TEST_KEYS);
+  Key key;
+  Val *val = get_val(TEST_VAL);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_put(ht, &key, val);
+    free(key.key);
+    assert(!hash_table_is_resizing(ht));
+  }
+  assert(ht->size == size);
+  unsigned int visited = 0;
+  assert(hash_table_for_each(ht, count_entry, &visited) == 0);
+  assert(visited == RESIZE_TEST_KEYS);
+  /* A table holding entries is left alone */
+  hash_table_reserve(ht, RESIZE_TEST_KEYS * 4);
+  assert(ht->size == size);
+}
+
+/* Free a table part way through a resize, holding inline values,
+   values in the slab and a value too large for it */
+void check_free(HashTableEngine engine) {
+  HashTable *ht = create_test_table(engine);
+  Key key;
+  Val small = { .val_size = 1, .val = (uint8_t *)"a" };
+  Val big = { .val_size = UINT16_MAX, .val = calloc(UINT16_MAX, 1) };
+  Val mid = { .val_size = INLINE_VAL_MAX * 2, .val = big.val };
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_put(ht, &key, i % 2 ? &small : &mid);
+    free(key.key);
+  }
+  init_int_key(&key, RESIZE_TEST_KEYS);
+  hash_table_put(ht, &key, &big);
+  free(key.key);
+  free_hash_table(ht);
+  free(big.val);
+}
+
+void test_ht_reserve(void) {
+  check_reserve(ENGINE_CHAINED);
+}
+
+void test_ht_free(void) {
+  check_free(ENGINE_CHAINED);
+}
+
+/********************/
+/* open_table tests */
+/********************/
+
+void test_open_init(void) {
+  HashTable *ht = create_hash_table_engine(ENGINE_OPEN, TEST_HT_SIZE);
+  assert(ht->engine == ENGINE_OPEN);
+  assert(ht->size >= TEST_HT_SIZE);
+  assert(ht->item_count == 0);
+  assert(hash_table_get(ht, get_key(TEST_KEY)) == NULL);
+}
+
+void test_open_put_delete(void) {
+  HashTable *ht = create_hash_table_engine(ENGINE_OPEN, TEST_HT_SIZE);
+  Key *key = get_key(TEST_KEY);
+  Key *other_key = get_key(TEST_OTHER_KEY);
+  Val *val = get_val(1);
+  Val *other_val = get_val(2);
+  assert(hash_table_put(ht, key, val) == false);
+  assert(hash_table_put(ht, other_key, other_val) == false);
+  assert(hash_table_put(ht, key, other_val) == true);
+  assert(cmp_vals(hash_table_get(ht, key), other_val));
+  assert(cmp_vals(hash_table_get(ht, other_key), other_val));
+  assert(ht->item_count == 2);
+  assert(!hash_table_delete(ht, key));
+  assert(hash_table_delete(ht, key));
+  assert(hash_table_get(ht, key) == NULL);
+  assert(cmp_vals(hash_table_get(ht, other_key), other_val));
+  assert(ht->item_count == 1);
+}
+
+void test_open_ttl_lazy(void) {
+  check_ttl_lazy(ENGINE_OPEN);
+}
+
+void test_open_ttl_reap(void) {
+  check_ttl_reap(ENGINE_OPEN);
+}
+
+void test_open_mem_limit(void) {
+  check_mem_limit(ENGINE_OPEN);
+}
+
+void test_open_evict_unreferenced(void) {
+  check_evict_unreferenced(ENGINE_OPEN);
+}
+
+void test_open_mem_limit_shift(void) {
+  check_mem_limit_shift(ENGINE_OPEN);
+}
+
+void test_open_put_resize_val(void) {
+  check_put_resize_val(ENGINE_OPEN);
+}
+
+void test_open_grow(void) {
+  check_grow(ENGINE_OPEN);
+}
+
+void test_open_shrink(void) {
+  check_shrink(ENGINE_OPEN);
+}
+
+void test_open_resize_interleaved(void) {
+  check_resize_interleaved(ENGINE_OPEN);
+}
+
+void test_open_reserve(void) {
+  check_reserve(ENGINE_OPEN);
+}
+
+void test_open_free(void) {
+  check_free(ENGINE_OPEN);
+}
+
+/**********************/
+/* mapped_table tests */
+/**********************/
+
+#define MAPPED_TEST_DIR "/tmp/cache-test-mapped"
+
+void test_mapped_ttl_lazy(void) {
+  check_ttl_lazy(ENGINE_MAPPED);
+}
+
+void test_mapped_mem_limit(void) {
+  check_mem_limit(ENGINE_MAPPED);
+}
+
+void test_mapped_mem_limit_shift(void) {
+  check_mem_limit_shift(ENGINE_MAPPED);
+}
+
+void test_mapped_evict_unreferenced(void) {
+  check_evict_unreferenced(ENGINE_MAPPED);
+}
+
+void test_mapped_put_resize_val(void) {
+  check_put_resize_val(ENGINE_MAPPED);
+}
+
+void test_mapped_grow(void) {
+  check_grow(ENGINE_MAPPED);
+}
+
+void test_mapped_shrink(void) {
+  check_shrink(ENGINE_MAPPED);
+}
+
+void test_mapped_resize_interleaved(void) {
+  check_resize_interleaved(ENGINE_MAPPED);
+}
+
+void test_mapped_reserve(void) {
+  check_reserve(ENGINE_MAPPED);
+}
+
+/* Expired entries are reaped by sweeping, so a sweep of the whole
+   table takes many calls when few entries have expired */
+void test_mapped_ttl_reap(void) {
+  HashTable *ht = create_test_table(ENGINE_MAPPED);
+  Val *val = get_val(TEST_VAL);
+  Key key;
+  hash_table_set_time(ht, TTL_TEST_START);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_put_ttl(ht, &key, val, i % 2 ? i : 0);
+    free(key.key);
+  }
+  hash_table_set_time(ht, TTL_TEST_START + RESIZE_TEST_KEYS / 2);
+  unsigned int reaped = 0;
+  for (unsigned int i = 0; i < ht->size + ht->old_size; i++)
+    reaped += hash_table_expire(ht, 10);
+  assert(reaped == RESIZE_TEST_KEYS / 4);
+  assert(ht->item_count == RESIZE_TEST_KEYS * 3 / 4);
+  /* Nothing is due until the rest expire at once */
+  assert(hash_table_expire(ht, 10) == 0);
+  hash_table_set_time(ht, TTL_TEST_START + RESIZE_TEST_KEYS);
+  for (unsigned int i = 0; i < ht->size + ht->old_size; i++)
+    hash_table_expire(ht, 10);
+  assert(ht->item_count == RESIZE_TEST_KEYS / 2);
+  close_mapped_hash_table(ht);
+  unlink(MAPPED_TEST_PATH);
+}
+
+/* Value of key I in test_mapped_reopen, of varying size */
+void init_reopen_val(Val *val, uint8_t *buf, uint32_t i) {
+  val->val_size = i % 300;
+  val->val = buf;
+  memset(buf, i, val->val_size);
+}
+
+/* Entries, their TTLs and the table's counters survive closing and
+   reopening the file */
+void test_mapped_reopen(void) {
+  HashTable *ht = create_test_table(ENGINE_MAPPED);
+  uint8_t buf[300];
+  Val val;
+  Key key;
+  hash_table_set_time(ht, TTL_TEST_START);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    init_reopen_val(&val, buf, i);
+    hash_table_put_ttl(ht, &key, &val, i % 10 ? 0 : 100);
+    if (i % 7 == 0)
+      hash_table_delete(ht, &key);
+    free(key.key);
+  }
+  assert(!ht->mapped->reopened);
+  unsigned int count = ht->item_count;
+  /* Close midway through a resize */
+  for (uint32_t i = RESIZE_TEST_KEYS; !hash_table_is_resizing(ht); i++, count++) {
+    init_int_key(&key, i);
+    hash_table_put(ht, &key, &val);
+    free(key.key);
+  }
+  size_t used = hash_table_mem_used(ht);
+  close_mapped_hash_table(ht);
+
+  ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE, MAPPED_TEST_CAPACITY, 0, 1);
+  assert(ht != NULL && ht->mapped->reopened);
+  assert(ht->item_count == count);
+  assert(hash_table_mem_used(ht) == used);
+  hash_table_set_time(ht, TTL_TEST_START + 99);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    init_reopen_val(&val, buf, i);
+    Val *got = hash_table_get(ht, &key);
+    if (i % 7 == 0)
+      assert(got == NULL);
+    else
+      assert(got != NULL && cmp_vals(got, &val));
+    free(key.key);
+  }
+  hash_table_set_time(ht, TTL_TEST_START + 100);
+  init_int_key(&key, 10);
+  assert(hash_table_get(ht, &key) == NULL);
+  free(key.key);
+  close_mapped_hash_table(ht);
+  unlink(MAPPED_TEST_PATH);
+}
+
+#define FULL_TEST_CAPACITY (256 * 1024)
+
+/* Writes the file has no room for are dropped, along with any value
+   they would replace, and the table keeps serving */
+void test_mapped_full(void) {
+  unlink(MAPPED_TEST_PATH);
+  HashTable *ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE,
+                                         FULL_TEST_CAPACITY, 0, 1);
+  assert(ht != NULL);
+  static uint8_t buf[2000];
+  Val val = { .val_size = 1000, .val = buf };
+  Key key;
+  /* Silence the message logged when the file fills */
+  int saved_stderr = dup(2);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, 2);
+  uint32_t n = 0;
+  for (;; n++) {
+    assert(n < FULL_TEST_CAPACITY / val.val_size);
+    init_int_key(&key, n);
+    hash_table_put(ht, &key, &val);
+    bool stored = hash_table_get(ht, &key) != NULL;
+    free(key.key);
+    if (!stored)
+      break;
+  }
+  assert(ht->mapped->full && ht->item_count == n);
+  /* A larger value for an existing key doesn't fit either */
+  init_int_key(&key, 0);
+  val.val_size = sizeof(buf);
+  hash_table_put(ht, &key, &val);
+  assert(hash_table_get(ht, &key) == NULL && ht->item_count == n - 1);
+  free(key.key);
+  dup2(saved_stderr, 2);
+  close(saved_stderr);
+  close(null_fd);
+  /* Other entries are kept, and space freed is reused */
+  val.val_size = 1000;
+  for (uint32_t i = 1; i < n; i++) {
+    init_int_key(&key, i);
+    assert(hash_table_get(ht, &key) != NULL);
+    free(key.key);
+  }
+  init_int_key(&key, n);
+  hash_table_put(ht, &key, &val);
+  assert(hash_table_get(ht, &key) != NULL && ht->item_count == n);
+  free(key.key);
+  close_mapped_hash_table(ht);
+  unlink(MAPPED_TEST_PATH);
+}
+
+/* A file not closed cleanly, or for another table, is emptied */
+void test_mapped_reset(void) {
+  HashTable *ht = create_test_table(ENGINE_MAPPED);
+  Key *key = get_key(TEST_KEY);
+  Val *val = get_val(TEST_VAL);
+  hash_table_put(ht, key, val);
+  close_mapped_hash_table(ht);
+
+  uint32_t state = MAPPED_DIRTY;
+  int fd = open(MAPPED_TEST_PATH, O_WRONLY);
+  assert(pwrite(fd, &state, sizeof state, offsetof(MappedHeader, state)) == sizeof state);
+  close(fd);
+  ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE, MAPPED_TEST_CAPACITY, 0, 1);
+  assert(!ht->mapped->reopened && ht->item_count == 0);
+  assert(hash_table_get(ht, key) == NULL);
+  hash_table_put(ht, key, val);
+  close_mapped_hash_table(ht);
+
+  ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE, MAPPED_TEST_CAPACITY, 0, 2);
+  assert(!ht->mapped->reopened && ht->item_count == 0);
+  hash_table_put(ht, key, val);
+  close_mapped_hash_table(ht);
+  hash_set_seed(1);
+  ht = open_mapped_hash_table(MAPPED_TEST_PATH, TEST_HT_SIZE, MAPPED_TEST_CAPACITY, 0, 2);
+  assert(!ht->mapped->reopened && ht->item_count == 0);
+  close_mapped_hash_table(ht);
+  hash_set_seed(0);
+  unlink(MAPPED_TEST_PATH);
+}
+
+/**************/
+/* hash tests */
+/**************/
+
+#define HASH_TEST_LEN 64
+#define HASH_TEST_BUCKETS 64
+
+/* Every byte of keys of every length (word reads overlap at the
+   ends) affects the hash, as does the seed */
+void test_hash_bytes(void) {
+  uint8_t buf[HASH_TEST_LEN] = {0};
+  for (size_t len = 1; len <= HASH_TEST_LEN; len++) {
+    uint64_t h = hash_bytes(buf, len, 0);
+    assert(h == hash_bytes(buf, len, 0));
+    assert(h != hash_bytes(buf, len - 1, 0));
+    assert(h != hash_bytes(buf, len, 1));
+    for (size_t i = 0; i < len; i++) {
+      buf[i] = 1;
+      assert(hash_bytes(buf, len, 0) != h);
+      buf[i] = 0;
+    }
+  }
+}
+
+/* A long key whose first word matches the constant it is mixed with
+   still hashes by the seed */
+void test_hash_seed_crafted(void) {
+  uint8_t buf[HASH_TEST_LEN] = {0};
+  uint64_t word = htole64(0xe7037ed1a0b428dbULL);
+  memcpy(buf, &word, sizeof word);
+  assert(hash_bytes(buf, sizeof buf, 1) != hash_bytes(buf, sizeof buf, 2));
+}
+
+void test_hash_seed(void) {
+  Key *key = get_key(TEST_KEY);
+  uint64_t h = hash(key);
+  hash_set_seed(1);
+  assert(hash(key) != h);
+  assert(hash(key) == hash_bytes(key->key, key->key_size, 1));
+  hash_set_seed(0);
+  assert(hash(key) == h);
+}
+
+/* Keys sharing a long prefix and differing in a few digits spread
+   evenly over both the low bits used for buckets and the high bits
+   used for shards */
+void test_hash_spread(void) {
+  unsigned int low[HASH_TEST_BUCKETS] = {0};
+  unsigned int high[HASH_TEST_BUCKETS] = {0};
+  char buf[HASH_TEST_LEN];
+  for (unsigned int i = 0; i < RESIZE_TEST_KEYS * 8; i++) {
+    int len = snprintf(buf, sizeof buf, "session:user:%08u", i);
+    uint64_t h = hash_bytes((uint8_t *)buf, len, 0);
+    ++low[h % HASH_TEST_BUCKETS];
+    ++high[h >> 58];
+  }
+  for (unsigned int i = 0; i < HASH_TEST_BUCKETS; i++) {
+    assert(low[i] > RESIZE_TEST_KEYS * 8 / HASH_TEST_BUCKETS / 2);
+    assert(high[i] > RESIZE_TEST_KEYS * 8 / HASH_TEST_BUCKETS / 2);
+  }
+}
+
+/**************/
+/* slab tests */
+/**************/
+
+void test_slab_classes(void) {
+  Slab slab;
+  init_slab(&slab);
+  assert(slab_class(&slab, 1) == 0);
+  assert(slab.classes[0].chunk_size == SLAB_MIN_CHUNK);
+  assert(slab.classes[slab.class_count - 1].chunk_size == SLAB_MAX_CHUNK);
+  for (size_t size = 1; size <= SLAB_MAX_CHUNK; size += 97) {
+    int c = slab_class(&slab, size);
+    assert(slab.classes[c].chunk_size >= size);
+    assert(c == 0 || slab.classes[c - 1].chunk_size < size);
+  }
+  assert(slab_class(&slab, SLAB_MAX_CHUNK + 1) == -1);
+  free_slab(&slab);
+}
+
+void test_slab_reuse(void) {
+  Slab slab;
+  init_slab(&slab);
+  void *a = slab_alloc(&slab, 100);
+  void *b = slab_alloc(&slab, 100);
+  assert(a != b);
+  assert(slab_used_bytes(&slab) == 2 * slab.classes[slab_class(&slab, 100)].chunk_size);
+  assert(slab_total_bytes(&slab) == SLAB_PAGE_SIZE);
+  slab_free(&slab, a, 100);
+  /* Freed chunk is handed out again for any size in its class */
+  assert(slab_alloc(&slab, 99) == a);
+  /* Growing within a class does not move the chunk */
+  assert(slab_realloc(&slab, b, 100, 101) == b);
+  void *c = slab_realloc(&slab, b, 101, 1000);
+  assert(c != b);
+  slab_free(&slab, a, 99);
+  slab_free(&slab, c, 1000);
+  assert(slab_used_bytes(&slab) == 0);
+  /* Oversized chunks are malloc'd */
+  void *big = slab_alloc(&slab, SLAB_MAX_CHUNK + 1);
+  assert(slab.large_bytes == SLAB_MAX_CHUNK + 1);
+  slab_free(&slab, big, SLAB_MAX_CHUNK + 1);
+  assert(slab_used_bytes(&slab) == 0);
+  free_slab(&slab);
+}
+
+/* Emptied pages are released, and reused by any class */
+void test_slab_release(void) {
+  Slab slab;
+  init_slab(&slab);
+  assert(slab_set_page_size(&slab, SLAB_MIN_PAGE_SIZE));
+  unsigned int count = 3 * slab.classes[slab_class(&slab, 100)].page_chunks;
+  void *chunks[count];
+  for (unsigned int i = 0; i < count; i++)
+    chunks[i] = slab_alloc(&slab, 100);
+  assert(slab_total_bytes(&slab) == 3 * SLAB_MIN_PAGE_SIZE);
+  assert(!slab_set_page_size(&slab, SLAB_PAGE_SIZE));
+  for (unsigned int i = 0; i < count; i++)
+    slab_free(&slab, chunks[i], 100);
+  /* One empty page is kept back */
+  assert(slab_total_bytes(&slab) == SLAB_MIN_PAGE_SIZE);
+  void *other = slab_alloc(&slab, 300);
+  assert(slab_total_bytes(&slab) == SLAB_MIN_PAGE_SIZE);
+  slab_free(&slab, other, 300);
+  slab_release_spare(&slab);
+  assert(slab_total_bytes(&slab) == 0);
+  free_slab(&slab);
+}
+
+typedef struct MoveTest {
+  Slab *slab;
+  void *keep;                   /* Chunk which can't be moved, or NULL */
+  void *moved;                  /* Where the last chunk moved went */
+} MoveTest;
+
+void move_test_chunk(void *chunk, void *arg) {
+  MoveTest *test = arg;
+  if (chunk == test->keep)
+    return;
+  test->moved = slab_alloc(test->slab, 100);
+  memcpy(test->moved, chunk, 100);
+  slab_free(test->slab, chunk, 100);
+}
+
+/* The chunks left on a page are moved to the class's other pages so
+   that the page can be released */
+void test_slab_reclaim_page(void) {
+  Slab slab;
+  init_slab(&slab);
+  assert(slab_set_page_size(&slab, SLAB_MIN_PAGE_SIZE));
+  unsigned int count = 2 * slab.classes[slab_class(&slab, 100)].page_chunks;
+  void *chunks[count];
+  for (unsigned int i = 0; i < count; i++)
+    chunks[i] = slab_alloc(&slab, 100);
+  assert(!slab_reclaimable_page(&slab));
+  memset(chunks[1], 'x', 100);
+  /* Free all but one chunk of the first page, and one of the second */
+  for (unsigned int i = 0; i <= count / 2; i++)
+    if (i != 1)
+      slab_free(&slab, chunks[i], 100);
+  SlabPage *page = slab_reclaimable_page(&slab);
+  assert(page == slab_page_of(&slab, chunks[1]));
+  assert(page->used == 1);
+  /* A chunk which can't be moved keeps its page */
+  MoveTest test = { .slab = &slab, .keep = chunks[1] };
+  assert(!slab_reclaim_page(&slab, page, move_test_chunk, &test));
+  assert(slab_reclaimable_page(&slab) == page);
+  test.keep = NULL;
+  assert(slab_reclaim_page(&slab, page, move_test_chunk, &test));
+  assert(slab_page_of(&slab, test.moved) == slab_page_of(&slab, chunks[count - 1]));
+  for (unsigned int i = 0; i < 100; i++)
+    assert(((uint8_t *)test.moved)[i] == 'x');
+  /* The released page is kept as the spare */
+  assert(slab_total_bytes(&slab) == 2 * SLAB_MIN_PAGE_SIZE);
+  assert(!slab_reclaimable_page(&slab));
+  slab_release_spare(&slab);
+  assert(slab_total_bytes(&slab) == SLAB_MIN_PAGE_SIZE);
+  free_slab(&slab);
+}
+
+void test_ht_slab_accounting(void) {
+  HashTable *ht = create_hash_table(TEST_HT_SIZE);
+  Key key;
+  uint8_t buf[1000] = {0};
+  Val val = { .val = buf };
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    val.val_size = i % 2 ? 10 : 1000;
+    hash_table_put(ht, &key, &val);
+    free(key.key);
+  }
+  size_t peak = slab_total_bytes(&ht->slab);
+  assert(slab_used_bytes(&ht->slab) > 0);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_delete(ht, &key);
+    free(key.key);
+  }
+  assert(slab_used_bytes(&ht->slab) == 0);
+  /* Refilling reuses freed chunks */
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    val.val_size = i % 2 ? 10 : 1000;
+    hash_table_put(ht, &key, &val);
+    free(key.key);
+  }
+  assert(slab_total_bytes(&ht->slab) == peak);
+}
+
+#define SHARED_TEST_VAL_SIZE 2000
+
+/* A referenced value survives being overwritten and deleted, and is
+   freed when the last reference goes */
+void test_ht_ref_val_engine(HashTableEngine engine) {
+  HashTable *ht = create_hash_table_engine(engine, TEST_HT_SIZE);
+  Key *key = get_key(TEST_KEY);
+  uint8_t buf[SHARED_TEST_VAL_SIZE];
+  Val val = { .val_size = sizeof buf, .val = buf };
+  memset(buf, 'a', sizeof buf);
+  hash_table_put(ht, key, &val);
+  Val *stored = hash_table_get(ht, key);
+  uint8_t *bytes = stored->val;
+  assert(hash_table_ref_val(ht, stored));
+  assert(hash_table_ref_val(ht, stored));
+  memset(buf, 'b', sizeof buf);
+  hash_table_put(ht, key, &val);
+  assert(hash_table_get(ht, key)->val != bytes);
+  hash_table_delete(ht, key);
+  for (size_t i = 0; i < sizeof buf; i++)
+    assert(bytes[i] == 'a');
+  hash_table_unref_val(ht, bytes);
+  assert(slab_used_bytes(&ht->slab) > 0);
+  hash_table_unref_val(ht, bytes);
+  assert(slab_used_bytes(&ht->slab) == 0);
+  /* Small values live in their entry, and can't be referenced */
+  val.val_size = INLINE_VAL_MAX;
+  hash_table_put(ht, key, &val);
+  assert(!hash_table_ref_val(ht, hash_table_get(ht, key)));
+}
+
+void test_ht_ref_val(void) {
+  test_ht_ref_val_engine(ENGINE_CHAINED);
+  test_ht_ref_val_engine(ENGINE_OPEN);
+}
+
 /*****************/
 /* message tests */
 /*****************/
@@ -168,6 +1137,7 @@ void test_msg_serialise_put() {
   Message msg;
   init_key(&msg.message.put.key, 1);
   init_val(&msg.message.put.val, 2);
+  msg.message.put.ttl = 300;
   msg.type = PUT;
   size_t buf_size;
   uint8_t *buf = out_serialise_message(&msg, &buf_size);
@@ -176,6 +1146,7 @@ void test_msg_serialise_put() {
   assert(cmp_keys(&msg_copy->message.put.key, &msg.message.put.key));
   assert(msg_copy->message.put.val.val_size == 1);
   assert(msg_copy->message.put.val.val[0] == 2);
+  assert(msg_copy->message.put.ttl == 300);
 }
 
 void test_msg_serialise_get_resp() {
@@ -203,10 +1174,240 @@ void test_msg_serialise_get_resp_null() {
   assert(msg_copy->message.get_resp.val == NULL);
 }
 
+#define BATCH_TEST_KEYS 10
+
+/* Build an MPUT of keys 0 to COUNT - 1, each with its number as value */
+Message *create_mput(BatchCount count) {
+  Message *msg = malloc(sizeof(Message));
+  msg->type = MPUT;
+  msg->message.mput.count = count;
+  msg->message.mput.puts = malloc(count * sizeof(MessagePut));
+  for (BatchCount i = 0; i < count; i++) {
+    init_key(&msg->message.mput.puts[i].key, i);
+    init_val(&msg->message.mput.puts[i].val, i);
+    msg->message.mput.puts[i].ttl = i;
+  }
+  return msg;
+}
+
+/* Build an MGET of keys 0 to COUNT - 1 */
+Message *create_mget(BatchCount count) {
+  Message *msg = malloc(sizeof(Message));
+  msg->type = MGET;
+  msg->message.mget.count = count;
+  msg->message.mget.keys = malloc(count * sizeof(Key));
+  for (BatchCount i = 0; i < count; i++)
+    init_key(&msg->message.mget.keys[i], i);
+  return msg;
+}
+
+Message *serialise_round_trip(Message *msg) {
+  size_t buf_size;
+  uint8_t *buf = out_serialise_message(msg, &buf_size);
+  assert(buf_size == serialised_message_size(msg));
+  Message *copy = out_deserialise_message(buf + sizeof(MessageSize), buf_size - sizeof(MessageSize));
+  free(buf);
+  return copy;
+}
+
+void test_msg_serialise_mget() {
+  Message *msg = create_mget(BATCH_TEST_KEYS);
+  Message *copy = serialise_round_trip(msg);
+  assert(copy->type == MGET);
+  assert(copy->message.mget.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++)
+    assert(cmp_keys(&copy->message.mget.keys[i], &msg->message.mget.keys[i]));
+  free_message(copy);
+  free_message(msg);
+}
+
+void test_msg_serialise_mput() {
+  Message *msg = create_mput(BATCH_TEST_KEYS);
+  Message *copy = serialise_round_trip(msg);
+  assert(copy->type == MPUT);
+  assert(copy->message.mput.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++) {
+    MessagePut *put = &copy->message.mput.puts[i];
+    assert(cmp_keys(&put->key, &msg->message.mput.puts[i].key));
+    assert(cmp_vals(&put->val, &msg->message.mput.puts[i].val));
+    assert(put->ttl == i);
+  }
+  free_message(copy);
+  free_message(msg);
+}
+
+void test_msg_serialise_delete() {
+  Message msg = { .type = DELETE };
+  init_key(&msg.message.delete.key, TEST_KEY);
+  Message *copy = serialise_round_trip(&msg);
+  assert(copy->type == DELETE);
+  assert(cmp_keys(&copy->message.delete.key, &msg.message.delete.key));
+  free_message(copy);
+  free(msg.message.delete.key.key);
+
+  msg.type = DELETE_RESP;
+  msg.message.delete_resp.deleted = true;
+  copy = serialise_round_trip(&msg);
+  assert(copy->type == DELETE_RESP);
+  assert(copy->message.delete_resp.deleted);
+  free_message(copy);
+}
+
+void test_msg_serialise_snapshot() {
+  Message msg = { .type = SNAPSHOT };
+  Message *copy = serialise_round_trip(&msg);
+  assert(copy->type == SNAPSHOT);
+  free_message(copy);
+  assert(serialised_message_size(&msg) == sizeof(MessageSize) + sizeof(MessageType));
+
+  msg.type = SNAPSHOT_RESP;
+  msg.message.snapshot_resp.started = true;
+  copy = serialise_round_trip(&msg);
+  assert(copy->type == SNAPSHOT_RESP);
+  assert(copy->message.snapshot_resp.started);
+  free_message(copy);
+}
+
+void test_msg_serialise_mdelete() {
+  Message *mget = create_mget(BATCH_TEST_KEYS);
+  Message msg = { .type = MDELETE };
+  msg.message.mdelete.count = mget->message.mget.count;
+  msg.message.mdelete.keys = mget->message.mget.keys;
+  Message *copy = serialise_round_trip(&msg);
+  assert(copy->type == MDELETE);
+  assert(copy->message.mdelete.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++)
+    assert(cmp_keys(&copy->message.mdelete.keys[i], &msg.message.mdelete.keys[i]));
+  free_message(copy);
+  free_message(mget);
+
+  bool deleted[] = { false, true, true };
+  msg.type = MDELETE_RESP;
+  msg.message.mdelete_resp.count = 3;
+  msg.message.mdelete_resp.deleted = deleted;
+  copy = serialise_round_trip(&msg);
+  assert(copy->type == MDELETE_RESP);
+  assert(copy->message.mdelete_resp.count == 3);
+  assert(!copy->message.mdelete_resp.deleted[0] && copy->message.mdelete_resp.deleted[2]);
+  free_message(copy);
+}
+
+void test_msg_serialise_batch_resps() {
+  Message msg = { .type = MGET_RESP };
+  Val *vals[] = { get_val(1), NULL, get_val(3) };
+  msg.message.mget_resp.count = 3;
+  msg.message.mget_resp.vals = vals;
+  Message *copy = serialise_round_trip(&msg);
+  assert(copy->type == MGET_RESP);
+  assert(copy->message.mget_resp.count == 3);
+  assert(cmp_vals(copy->message.mget_resp.vals[0], vals[0]));
+  assert(copy->message.mget_resp.vals[1] == NULL);
+  assert(cmp_vals(copy->message.mget_resp.vals[2], vals[2]));
+  free_message(copy);
+
+  bool is_update[] = { true, false };
+  msg.type = MPUT_RESP;
+  msg.message.mput_resp.count = 2;
+  msg.message.mput_resp.is_update = is_update;
+  copy = serialise_round_trip(&msg);
+  assert(copy->type == MPUT_RESP);
+  assert(copy->message.mput_resp.count == 2);
+  assert(copy->message.mput_resp.is_update[0] && !copy->message.mput_resp.is_update[1]);
+  free_message(copy);
+}
+
 /**************/
 /* conn tests */
 /**************/
 
+/* Requests parse in place, pointing into the buffer */
+void test_msg_parse_request() {
+  Message msg;
+  init_key(&msg.message.put.key, 1);
+  init_val(&msg.message.put.val, 2);
+  msg.message.put.ttl = 300;
+  msg.type = PUT;
+  size_t buf_size;
+  uint8_t *buf = out_serialise_message(&msg, &buf_size);
+  uint8_t *payload = buf + sizeof(MessageSize);
+  size_t payload_size = buf_size - sizeof(MessageSize);
+  Message view;
+  assert(parse_request(payload, payload_size, &view));
+  assert(view.type == PUT);
+  assert(cmp_keys(&view.message.put.key, &msg.message.put.key));
+  assert(view.message.put.key.key > payload && view.message.put.key.key < payload + payload_size);
+  assert(cmp_vals(&view.message.put.val, &msg.message.put.val));
+  assert(view.message.put.ttl == 300);
+  /* Truncated or overlong requests are rejected */
+  for (size_t size = 0; size < payload_size; size++)
+    assert(!parse_request(payload, size, &view));
+  uint8_t overlong[64];
+  memcpy(overlong, payload, payload_size);
+  assert(!parse_request(overlong, payload_size + 1, &view));
+  free(buf);
+}
+
+/* Batch requests parse in place too, rejecting truncated ones */
+void test_msg_parse_batch_request() {
+  Message *msg = create_mput(BATCH_TEST_KEYS);
+  size_t buf_size;
+  uint8_t *buf = out_serialise_message(msg, &buf_size);
+  uint8_t *payload = buf + sizeof(MessageSize);
+  size_t payload_size = buf_size - sizeof(MessageSize);
+  Message view;
+  assert(parse_request(payload, payload_size, &view));
+  assert(view.type == MPUT);
+  assert(view.message.mput.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++) {
+    MessagePut *put = &view.message.mput.puts[i];
+    assert(put->key.key > payload && put->key.key < payload + payload_size);
+    assert(cmp_keys(&put->key, &msg->message.mput.puts[i].key));
+    assert(cmp_vals(&put->val, &msg->message.mput.puts[i].val));
+    assert(put->ttl == i);
+  }
+  free_message_views(&view);
+  for (size_t size = 0; size < payload_size; size++)
+    assert(!parse_request(payload, size, &view));
+  free(buf);
+  free_message(msg);
+}
+
+/* Responses parse in place as well, rejecting truncated ones */
+void test_msg_parse_response() {
+  Message msg = { .type = MGET_RESP };
+  Val *vals[] = { get_val(1), NULL, get_val(3) };
+  msg.message.mget_resp.count = 3;
+  msg.message.mget_resp.vals = vals;
+  size_t buf_size;
+  uint8_t *buf = out_serialise_message(&msg, &buf_size);
+  uint8_t *payload = buf + sizeof(MessageSize);
+  size_t payload_size = buf_size - sizeof(MessageSize);
+  Message view;
+  Val val;
+  assert(parse_response(payload, payload_size, &view, &val));
+  assert(view.type == MGET_RESP && view.message.mget_resp.count == 3);
+  assert(cmp_vals(view.message.mget_resp.vals[0], vals[0]));
+  assert(view.message.mget_resp.vals[0]->val > payload);
+  assert(view.message.mget_resp.vals[1] == NULL);
+  assert(cmp_vals(view.message.mget_resp.vals[2], vals[2]));
+  free_message_views(&view);
+  for (size_t size = 0; size < payload_size; size++)
+    assert(!parse_response(payload, size, &view, &val));
+  free(buf);
+
+  msg.type = GET_RESP;
+  msg.message.get_resp.val = vals[2];
+  buf = out_serialise_message(&msg, &buf_size);
+  assert(parse_response(buf + sizeof(MessageSize), buf_size - sizeof(MessageSize), &view, &val));
+  assert(view.type == GET_RESP && view.message.get_resp.val == &val && cmp_vals(&val, vals[2]));
+  /* Requests aren't responses */
+  buf[sizeof(MessageSize)] = GET;
+  assert(!parse_response(buf + sizeof(MessageSize), buf_size - sizeof(MessageSize), &view, &val));
+  free(buf);
+  free_val(vals[0]);
+  free_val(vals[2]);
+}
+
 void test_conn_handle_get() {
   HashTable *ht = create_hash_table(TEST_HT_SIZE);
   Key *key = get_key(TEST_KEY);
@@ -235,6 +1436,7 @@ void test_conn_handle_put() {
   Message msg;
   init_key(&msg.message.put.key, TEST_KEY);
   init_val(&msg.message.put.val, TEST_VAL);
+  msg.message.put.ttl = 0;
   msg.type = PUT;
   Message *resp = out_handle_msg(&msg, ht);
   assert(resp->type == PUT_RESP);
@@ -248,6 +1450,7 @@ void test_conn_handle_put_update() {
   init_key(&msg.message.put.key, TEST_KEY);
   hash_table_put(ht, &msg.message.put.key, get_val(TEST_VAL));
   init_val(&msg.message.put.val, TEST_OTHER_VAL);
+  msg.message.put.ttl = 0;
   msg.type = PUT;
   Message *resp = out_handle_msg(&msg, ht);
   assert(resp->type == PUT_RESP);
@@ -255,6 +1458,1180 @@ void test_conn_handle_put_update() {
   assert(cmp_vals(hash_table_get(ht, get_key(TEST_KEY)), get_val(TEST_OTHER_VAL)));
 }
 
+void test_conn_handle_delete() {
+  HashTable *ht = create_hash_table(TEST_HT_SIZE);
+  hash_table_put(ht, get_key(TEST_KEY), get_val(TEST_VAL));
+  Message msg = { .type = DELETE };
+  init_key(&msg.message.delete.key, TEST_KEY);
+  Message *resp = out_handle_msg(&msg, ht);
+  assert(resp->type == DELETE_RESP);
+  assert(resp->message.delete_resp.deleted);
+  assert(hash_table_get(ht, get_key(TEST_KEY)) == NULL);
+  free_message(resp);
+  resp = out_handle_msg(&msg, ht);
+  assert(!resp->message.delete_resp.deleted);
+  free_message(resp);
+}
+
+/* A batch's results come back in key order, missing keys included */
+void test_conn_handle_batch() {
+  HashTable *ht = create_hash_table(TEST_HT_SIZE);
+  Message *mput = create_mput(BATCH_TEST_KEYS / 2);
+  Message *resp = out_handle_msg(mput, ht);
+  assert(resp->type == MPUT_RESP);
+  assert(resp->message.mput_resp.count == BATCH_TEST_KEYS / 2);
+  assert(!resp->message.mput_resp.is_update[0]);
+  free_message(resp);
+  resp = out_handle_msg(mput, ht);
+  assert(resp->message.mput_resp.is_update[0]);
+  free_message(resp);
+
+  Message *mget = create_mget(BATCH_TEST_KEYS);
+  resp = out_handle_msg(mget, ht);
+  assert(resp->type == MGET_RESP);
+  assert(resp->message.mget_resp.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++) {
+    Val *val = resp->message.mget_resp.vals[i];
+    if (i < BATCH_TEST_KEYS / 2)
+      assert(cmp_vals(val, get_val(i)));
+    else
+      assert(val == NULL);
+  }
+  free_message(resp);
+
+  /* Delete the stored half and as many missing keys */
+  Message mdelete = { .type = MDELETE };
+  mdelete.message.mdelete.count = mget->message.mget.count;
+  mdelete.message.mdelete.keys = mget->message.mget.keys;
+  resp = out_handle_msg(&mdelete, ht);
+  assert(resp->type == MDELETE_RESP);
+  assert(resp->message.mdelete_resp.count == BATCH_TEST_KEYS);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++)
+    assert(resp->message.mdelete_resp.deleted[i] == (i < BATCH_TEST_KEYS / 2));
+  assert(ht->item_count == 0);
+  free_message(resp);
+  free_message(mget);
+  free_message(mput);
+}
+
+/* An MGET whose response couldn't be sized in a MessageSize, 65535
+   copies of a key holding a 65535-byte value, is answered with no
+   results instead of overflowing the output buffer */
+void test_conn_mget_too_large() {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  Key *key = get_key(TEST_KEY);
+  Val big = { .val_size = UINT16_MAX, .val = calloc(UINT16_MAX, 1) };
+  hash_table_put(sharded_table_shard(st, key)->ht, key, &big);
+  Message mget = { .type = MGET };
+  mget.message.mget.count = UINT16_MAX;
+  mget.message.mget.keys = malloc(UINT16_MAX * sizeof(Key));
+  for (BatchCount i = 0; i < UINT16_MAX; i++)
+    mget.message.mget.keys[i] = *key;
+
+  Message *resp = out_handle_shared_msg(&mget, st);
+  assert(resp->type == MGET_RESP && resp->message.mget_resp.count == 0);
+  free_message(resp);
+
+  Conn conn;
+  init_conn(&conn);
+  conn_handle_shared_msg(&conn, &mget, st);
+  Message view;
+  Val val;
+  assert(conn.out_len == sizeof(MessageSize) + read_u32(conn.out_buf));
+  assert(parse_response(conn.out_buf + sizeof(MessageSize), conn.out_len - sizeof(MessageSize),
+                        &view, &val));
+  assert(view.type == MGET_RESP && view.message.mget_resp.count == 0);
+  free_message_views(&view);
+
+  /* Fewer copies fit */
+  mget.message.mget.count = 100;
+  resp = out_handle_shared_msg(&mget, st);
+  assert(resp->message.mget_resp.count == 100 && cmp_vals(resp->message.mget_resp.vals[99], &big));
+  free_message(resp);
+  free(conn.out_buf);
+  free(mget.message.mget.keys);
+  free(big.val);
+}
+
+#define PIPELINE_TEST_MSGS 100
+
+/* Queued messages are serialised back to back */
+void test_conn_queue_msg() {
+  Conn conn;
+  init_conn(&conn);
+  Message get = { .type = GET };
+  init_key(&get.message.get.key, TEST_KEY);
+  Message put = { .type = PUT };
+  init_key(&put.message.put.key, TEST_OTHER_KEY);
+  init_val(&put.message.put.val, TEST_VAL);
+  put.message.put.ttl = 10;
+  conn_queue_msg(&conn, &get);
+  conn_queue_msg(&conn, &put);
+  size_t get_size, put_size;
+  uint8_t *get_buf = out_serialise_message(&get, &get_size);
+  uint8_t *put_buf = out_serialise_message(&put, &put_size);
+  assert(conn.out_len == get_size + put_size);
+  assert(!memcmp(conn.out_buf, get_buf, get_size));
+  assert(!memcmp(conn.out_buf + get_size, put_buf, put_size));
+  free(get_buf);
+  free(put_buf);
+  free(conn.out_buf);
+}
+
+/* Many queued responses are flushed together and parse back in order */
+void test_conn_flush_pipelined() {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  Conn *conn = create_conn(fds[0]);
+  Message resp = { .type = GET_RESP };
+  for (int i = 0; i < PIPELINE_TEST_MSGS; i++) {
+    resp.message.get_resp.val = i % 2 ? get_val(i) : NULL;
+    conn_queue_msg(conn, &resp);
+    if (resp.message.get_resp.val)
+      free_val(resp.message.get_resp.val);
+  }
+  assert(conn_flush(conn) == 0);
+  assert(conn->out_len == 0);
+
+  Conn reader;
+  init_conn(&reader);
+  uint8_t buf[4096];
+  ssize_t n = recv(fds[1], buf, sizeof buf, 0);
+  uint8_t *pos = buf;
+  int i = 0;
+  while (pos < buf + n) {
+    size_t bytes_read;
+    Message *msg = out_recv_msg(&reader, buf + n - pos, pos, &bytes_read);
+    pos += bytes_read;
+    if (msg) {
+      assert(msg->type == GET_RESP);
+      if (i % 2)
+        assert(cmp_vals(msg->message.get_resp.val, get_val(i)));
+      else
+        assert(msg->message.get_resp.val == NULL);
+      free_message(msg);
+      ++i;
+    }
+  }
+  /* Everything arrived in the first read */
+  assert(i == PIPELINE_TEST_MSGS);
+  free_conn(conn);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* Output the socket won't take stays queued until it drains */
+void test_conn_send_partial() {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  Conn *conn = create_conn(fds[0]);
+  uint8_t buf[UINT16_MAX];
+  memset(buf, 'x', sizeof buf);
+  Message resp = { .type = GET_RESP };
+  Val val = { .val_size = sizeof buf, .val = buf };
+  resp.message.get_resp.val = &val;
+  size_t total = 0;
+  while (conn_send(conn) == 0) {
+    conn_queue_msg(conn, &resp);
+    total += serialised_message_size(&resp);
+  }
+  assert(conn_pending(conn) > 0);
+  size_t received = 0;
+  while (received < total) {
+    ssize_t n = recv(fds[1], buf, sizeof buf, 0);
+    assert(n > 0);
+    received += n;
+    if (conn_pending(conn))
+      assert(conn_send(conn) >= 0);
+  }
+  assert(conn_pending(conn) == 0);
+  free_conn(conn);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* Large GET values are queued by reference and sent with the
+   surrounding responses in order, unaffected by later writes */
+void test_conn_share_val() {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  ShardedTable *st = create_sharded_table(1, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  Conn *conn = create_conn(fds[0]);
+  conn->share_vals = true;
+  uint8_t buf[SHARED_TEST_VAL_SIZE];
+  memset(buf, 'a', sizeof buf);
+  Message put = { .type = PUT };
+  init_key(&put.message.put.key, TEST_KEY);
+  put.message.put.val.val_size = sizeof buf;
+  put.message.put.val.val = buf;
+  put.message.put.ttl = 0;
+  Message get = { .type = GET };
+  init_key(&get.message.get.key, TEST_KEY);
+  conn_handle_shared_msg(conn, &put, st);
+  assert(conn_send(conn) == 0);
+  conn_handle_shared_msg(conn, &get, st);
+  conn_handle_shared_msg(conn, &get, st);
+  assert(conn->ref_bytes == 2 * sizeof buf);
+  memset(buf, 'b', sizeof buf);
+  conn_handle_shared_msg(conn, &put, st);
+  conn_handle_shared_msg(conn, &get, st);
+  assert(conn_send(conn) == 0);
+  assert(conn_pending(conn) == 0);
+  assert(slab_used_bytes(&st->shards[0].ht->slab) > 0);
+
+  Conn *client = create_conn(fds[1]);
+  uint8_t recv_buf[1024];
+  const char expect[] = { 0, 'a', 'a', 0, 'b' };
+  int received = 0;
+  while (received < (int)sizeof expect) {
+    ssize_t n = recv(fds[1], recv_buf, sizeof recv_buf, 0);
+    assert(n > 0);
+    uint8_t *pos = recv_buf;
+    while (pos < recv_buf + n) {
+      size_t used;
+      Message *resp = out_recv_msg(client, recv_buf + n - pos, pos, &used);
+      pos += used;
+      if (!resp)
+        continue;
+      if (expect[received]) {
+        assert(resp->type == GET_RESP);
+        assert(resp->message.get_resp.val->val_size == sizeof buf);
+        assert(resp->message.get_resp.val->val[0] == expect[received]);
+        assert(resp->message.get_resp.val->val[sizeof buf - 1] == expect[received]);
+      } else
+        assert(resp->type == PUT_RESP);
+      free_message(resp);
+      ++received;
+    }
+  }
+  free_conn(client);
+  free_conn(conn);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* The rest of a message straddling reads can be received straight
+   into its buffer, which goes back to the pool once it's handled */
+void test_conn_msg_pool() {
+  MsgBufPool pool;
+  init_msg_buf_pool(&pool, 1);
+  Conn *conn = create_conn(-1);
+  conn->pool = &pool;
+  uint8_t val_buf[SHARED_TEST_VAL_SIZE];
+  memset(val_buf, 'v', sizeof val_buf);
+  Message put = { .type = PUT };
+  init_key(&put.message.put.key, TEST_KEY);
+  put.message.put.val.val_size = sizeof val_buf;
+  put.message.put.val.val = val_buf;
+  put.message.put.ttl = 0;
+  size_t len;
+  uint8_t *stream = out_serialise_message(&put, &len);
+
+  Message msg;
+  uint8_t *pos = stream;
+  size_t first = 100;
+  assert(!conn_next_msg(conn, &pos, stream + first, &msg));
+  assert(pos == stream + first);
+  size_t want;
+  uint8_t *space = conn_msg_space(conn, &want);
+  assert(space && want == len - first);
+  assert(!conn_has_msg(conn));
+  memcpy(space, stream + first, want);
+  conn_msg_received(conn, want);
+  assert(conn_has_msg(conn));
+  pos = NULL;
+  assert(conn_next_msg(conn, &pos, NULL, &msg));
+  assert(msg.type == PUT);
+  assert(cmp_vals(&msg.message.put.val, &put.message.put.val));
+  conn_release_msg_buf(conn);
+  assert(conn->msg_buf == NULL);
+  assert(pool.count == 1);
+
+  /* A complete message needs no buffer */
+  pos = stream;
+  assert(conn_next_msg(conn, &pos, stream + len, &msg));
+  assert(conn->msg_buf == NULL);
+  free(stream);
+  free_conn(conn);
+  free_msg_buf_pool(&pool);
+}
+
+/* Requests are parsed whether they arrive whole or in pieces of any
+   size, and whole ones are parsed in place */
+void test_conn_next_msg_split() {
+  uint8_t stream[PIPELINE_TEST_MSGS * 16];
+  size_t len = 0;
+  Message msg = { .type = GET };
+  for (int i = 0; i < PIPELINE_TEST_MSGS; i++) {
+    init_key(&msg.message.get.key, i);
+    serialise_message(&msg, stream + len);
+    len += serialised_message_size(&msg);
+    free(msg.message.get.key.key);
+  }
+  for (size_t chunk = 1; chunk <= len; chunk *= 3) {
+    Conn conn;
+    init_conn(&conn);
+    int i = 0;
+    for (size_t off = 0; off < len; off += chunk) {
+      uint8_t *pos = stream + off;
+      uint8_t *end = off + chunk < len ? pos + chunk : stream + len;
+      while (pos < end) {
+        Message view;
+        if (!conn_next_msg(&conn, &pos, end, &view))
+          continue;
+        assert(view.type == GET);
+        assert(view.message.get.key.key_size == 1);
+        assert(view.message.get.key.key[0] == i);
+        if (chunk == 729)
+          assert(view.message.get.key.key > stream && view.message.get.key.key < stream + len);
+        ++i;
+      }
+    }
+    assert(i == PIPELINE_TEST_MSGS);
+    free(conn.msg_buf);
+  }
+}
+
+/* A message over the connection's limit is refused as soon as its
+   size is read, without buffering it, whether it straddles reads or
+   not, and the connection's later input is dropped */
+void test_conn_msg_too_large() {
+  uint8_t stream[128];
+  Message msg;
+  Conn conn;
+  init_conn(&conn);
+  conn.max_msg_size = 64;
+  put_u32(stream, UINT32_MAX);
+  uint8_t *pos = stream;
+  assert(!conn_next_msg(&conn, &pos, stream + 2, &msg));
+  assert(!conn.refused);
+  assert(!conn_next_msg(&conn, &pos, stream + 8, &msg));
+  assert(conn.refused && pos == stream + 8);
+  assert(conn.msg_cap <= MESSAGE_MAX_SIZE);
+  size_t want;
+  assert(!conn_has_msg(&conn) && !conn_msg_space(&conn, &want));
+  free(conn.msg_buf);
+
+  init_conn(&conn);
+  conn.max_msg_size = 64;
+  memset(stream, 0, sizeof stream);
+  put_u32(stream, 65);
+  pos = stream;
+  assert(!conn_next_msg(&conn, &pos, stream + sizeof stream, &msg));
+  assert(conn.refused && pos == stream + sizeof stream);
+  Message get = { .type = GET };
+  init_key(&get.message.get.key, TEST_KEY);
+  serialise_message(&get, stream);
+  pos = stream;
+  assert(!conn_next_msg(&conn, &pos, stream + serialised_message_size(&get), &msg));
+  free(get.message.get.key.key);
+}
+
+/***************/
+/* shard tests */
+/***************/
+
+#define TEST_THREADS 4
+
+void test_shard_spread(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  unsigned int counts[TEST_SHARDS] = {0};
+  Key key;
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    ++counts[shard_index(st, &key)];
+    free(key.key);
+  }
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    assert(counts[i] > RESIZE_TEST_KEYS / TEST_SHARDS / 2);
+}
+
+void test_shard_handle_msg(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  Message msg;
+  init_key(&msg.message.put.key, TEST_KEY);
+  init_val(&msg.message.put.val, TEST_VAL);
+  msg.message.put.ttl = 0;
+  msg.type = PUT;
+  Message *resp = out_handle_shared_msg(&msg, st);
+  assert(resp->type == PUT_RESP);
+  assert(resp->message.put_resp.is_update == false);
+  init_key(&msg.message.get.key, TEST_KEY);
+  msg.type = GET;
+  resp = out_handle_shared_msg(&msg, st);
+  assert(resp->type == GET_RESP);
+  assert(cmp_vals(resp->message.get_resp.val, get_val(TEST_VAL)));
+  Shard *shard = sharded_table_shard(st, get_key(TEST_KEY));
+  assert(shard->ht->item_count == 1);
+}
+
+/* A batch spanning shards is handled under all their locks, and
+   queues the same response as out_handle_shared_msg */
+void test_shard_handle_batch(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  Message *mput = create_mput(BATCH_TEST_KEYS);
+  free_message(out_handle_shared_msg(mput, st));
+  unsigned int items = 0;
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    items += st->shards[i].ht->item_count;
+  assert(items == BATCH_TEST_KEYS);
+
+  Message *mget = create_mget(BATCH_TEST_KEYS);
+  Message *resp = out_handle_shared_msg(mget, st);
+  for (BatchCount i = 0; i < BATCH_TEST_KEYS; i++)
+    assert(cmp_vals(resp->message.mget_resp.vals[i], get_val(i)));
+  size_t resp_size;
+  uint8_t *expected = out_serialise_message(resp, &resp_size);
+
+  Conn conn;
+  init_conn(&conn);
+  conn_handle_shared_msg(&conn, mget, st);
+  assert(conn.out_len == resp_size);
+  assert(!memcmp(conn.out_buf, expected, resp_size));
+  free(conn.out_buf);
+
+  Message mdelete = { .type = MDELETE };
+  mdelete.message.mdelete.count = mget->message.mget.count;
+  mdelete.message.mdelete.keys = mget->message.mget.keys;
+  init_conn(&conn);
+  conn_handle_shared_msg(&conn, &mdelete, st);
+  free(conn.out_buf);
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    assert(st->shards[i].ht->item_count == 0);
+  free(expected);
+  free_message(resp);
+  free_message(mget);
+  free_message(mput);
+}
+
+typedef struct ShardTestThread {
+  ShardedTable *st;
+  uint32_t first;
+} ShardTestThread;
+
+/* PUT and GET a disjoint range of keys through the shared table */
+void *shard_test_thread(void *arg) {
+  ShardTestThread *t = arg;
+  Message msg;
+  for (uint32_t i = t->first; i < t->first + RESIZE_TEST_KEYS; i++) {
+    init_int_key(&msg.message.put.key, i);
+    init_val(&msg.message.put.val, (uint8_t)i);
+    msg.message.put.ttl = 0;
+    msg.type = PUT;
+    Message *resp = out_handle_shared_msg(&msg, t->st);
+    assert(resp->message.put_resp.is_update == false);
+    free_message(resp);
+    free(msg.message.put.key.key);
+    free(msg.message.put.val.val);
+    init_int_key(&msg.message.get.key, i);
+    msg.type = GET;
+    resp = out_handle_shared_msg(&msg, t->st);
+    assert(resp->message.get_resp.val->val[0] == (uint8_t)i);
+    free_message(resp);
+    free(msg.message.get.key.key);
+  }
+  return NULL;
+}
+
+void test_shard_concurrent(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  ShardTestThread threads[TEST_THREADS];
+  pthread_t ids[TEST_THREADS];
+  for (unsigned int i = 0; i < TEST_THREADS; i++) {
+    threads[i].st = st;
+    threads[i].first = i * RESIZE_TEST_KEYS;
+    pthread_create(&ids[i], NULL, shard_test_thread, &threads[i]);
+  }
+  unsigned int total = 0;
+  for (unsigned int i = 0; i < TEST_THREADS; i++)
+    pthread_join(ids[i], NULL);
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    total += st->shards[i].ht->item_count;
+  assert(total == TEST_THREADS * RESIZE_TEST_KEYS);
+}
+
+/******************/
+/* snapshot tests */
+/******************/
+
+#define SNAPSHOT_TEST_PATH "/tmp/cache-test.snap"
+#define SNAPSHOT_TEST_KEYS 2000
+#define SNAPSHOT_TEST_START 1000
+
+/* Value of test key I: large for some keys, so stored out of line */
+void init_snapshot_val(Val *val, uint32_t i) {
+  val->val_size = i % 10 ? 1 + i % 7 : SHARED_TEST_VAL_SIZE;
+  val->val = malloc(val->val_size);
+  memset(val->val, (uint8_t)i, val->val_size);
+}
+
+/* Fill a new table with SNAPSHOT_TEST_KEYS keys at time
+   SNAPSHOT_TEST_START. Every third key expires after 10 seconds, and
+   every seventh after 1. */
+ShardedTable *create_snapshot_table(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  sharded_table_expire(st, SNAPSHOT_TEST_START, 0, 1, 0);
+  Key key;
+  Val val;
+  for (uint32_t i = 0; i < SNAPSHOT_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    init_snapshot_val(&val, i);
+    Shard *shard = sharded_table_shard(st, &key);
+    hash_table_put_ttl(shard->ht, &key, &val, i % 7 == 0 ? 1 : i % 3 == 0 ? 10 : 0);
+    free(key.key);
+    free(val.val);
+  }
+  return st;
+}
+
+/* Check that ST, at time NOW, holds exactly the keys of
+   create_snapshot_table which haven't expired */
+void check_snapshot_table(ShardedTable *st, uint32_t now) {
+  unsigned int items = 0;
+  Key key;
+  Val val;
+  sharded_table_expire(st, now, 0, 1, 0);
+  for (uint32_t i = 0; i < SNAPSHOT_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    init_snapshot_val(&val, i);
+    bool live = !(i % 7 == 0 && now >= SNAPSHOT_TEST_START + 1)
+      && !(i % 3 == 0 && now >= SNAPSHOT_TEST_START + 10);
+    Val *got = hash_table_get(sharded_table_shard(st, &key)->ht, &key);
+    assert(live ? got && cmp_vals(got, &val) : !got);
+    items += live;
+    free(key.key);
+    free(val.val);
+  }
+  unsigned int total = 0;
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    total += st->shards[i].ht->item_count;
+  assert(total == items);
+}
+
+/* Entries and their expiry times survive a save and load, except for
+   those already expired */
+void test_snapshot_round_trip(void) {
+  ShardedTable *st = create_snapshot_table();
+  sharded_table_expire(st, SNAPSHOT_TEST_START + 1, 0, 1, 0);
+  assert(save_snapshot(st, SNAPSHOT_TEST_PATH) == 0);
+
+  ShardedTable *loaded = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  sharded_table_expire(loaded, SNAPSHOT_TEST_START + 1, 0, 1, 0);
+  long n = load_snapshot(loaded, SNAPSHOT_TEST_PATH);
+  assert(n > 0);
+  check_snapshot_table(loaded, SNAPSHOT_TEST_START + 1);
+  check_snapshot_table(loaded, SNAPSHOT_TEST_START + 10);
+  unlink(SNAPSHOT_TEST_PATH);
+}
+
+/* A forked child saves the table as it was at the fork */
+void test_snapshot_fork(void) {
+  ShardedTable *st = create_snapshot_table();
+  pid_t pid = fork_snapshot(st, SNAPSHOT_TEST_PATH);
+  assert(pid > 0);
+  Key *key = get_key(TEST_KEY);
+  hash_table_put(sharded_table_shard(st, key)->ht, key, get_val(TEST_VAL));
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  ShardedTable *loaded = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  sharded_table_expire(loaded, SNAPSHOT_TEST_START, 0, 1, 0);
+  assert(load_snapshot(loaded, SNAPSHOT_TEST_PATH) == SNAPSHOT_TEST_KEYS);
+  check_snapshot_table(loaded, SNAPSHOT_TEST_START);
+  unlink(SNAPSHOT_TEST_PATH);
+}
+
+/* A missing or damaged snapshot is reported, keeping the entries
+   before the damage */
+void test_snapshot_errors(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  unlink(SNAPSHOT_TEST_PATH);
+  assert(load_snapshot(st, SNAPSHOT_TEST_PATH) == -1 && errno == ENOENT);
+
+  ShardedTable *full = create_snapshot_table();
+  assert(save_snapshot(full, SNAPSHOT_TEST_PATH) == 0);
+  struct stat sb;
+  assert(stat(SNAPSHOT_TEST_PATH, &sb) == 0);
+  assert(truncate(SNAPSHOT_TEST_PATH, sb.st_size - 1) == 0);
+  sharded_table_expire(st, SNAPSHOT_TEST_START, 0, 1, 0);
+  assert(load_snapshot(st, SNAPSHOT_TEST_PATH) == -1 && errno == EINVAL);
+  unsigned int items = 0;
+  for (unsigned int i = 0; i < TEST_SHARDS; i++)
+    items += st->shards[i].ht->item_count;
+  assert(items == SNAPSHOT_TEST_KEYS);
+
+  assert(truncate(SNAPSHOT_TEST_PATH, 4) == 0);
+  assert(load_snapshot(st, SNAPSHOT_TEST_PATH) == -1 && errno == EINVAL);
+  unlink(SNAPSHOT_TEST_PATH);
+}
+
+/*************/
+/* aof tests */
+/*************/
+
+#define AOF_TEST_PATH "/tmp/cache-test.aof"
+
+/* Create an empty table at time SNAPSHOT_TEST_START logging to a new
+   log at AOF_TEST_PATH */
+ShardedTable *create_aof_table(Aof **aof) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  sharded_table_expire(st, SNAPSHOT_TEST_START, 0, 1, 0);
+  unlink(AOF_TEST_PATH);
+  *aof = create_aof(AOF_TEST_PATH, st, 1, 1 << 20, 0);
+  assert(*aof != NULL && st->aof == *aof);
+  return st;
+}
+
+/* Replay AOF_TEST_PATH into a new table at time NOW, checking it
+   holds REQUESTS requests */
+ShardedTable *replay_aof_table(uint32_t now, long requests) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  sharded_table_expire(st, now, 0, 1, 0);
+  assert(aof_replay(st, AOF_TEST_PATH) == requests);
+  return st;
+}
+
+void put_logged(ShardedTable *st, uint8_t key, uint8_t val) {
+  Message msg = { .type = PUT };
+  init_key(&msg.message.put.key, key);
+  init_val(&msg.message.put.val, val);
+  msg.message.put.ttl = 0;
+  free(out_handle_shared_msg(&msg, st));
+  free(msg.message.put.key.key);
+  free(msg.message.put.val.val);
+}
+
+void delete_logged(ShardedTable *st, uint8_t key) {
+  Message msg = { .type = DELETE };
+  init_key(&msg.message.delete.key, key);
+  free(out_handle_shared_msg(&msg, st));
+  free(msg.message.delete.key.key);
+}
+
+/* Check the value of single-byte key N in ST, VAL or absent if
+   negative */
+void check_aof_key(ShardedTable *st, uint8_t n, int val) {
+  Key *key = get_key(n);
+  Val *got = hash_table_get(sharded_table_shard(st, key)->ht, key);
+  assert(val < 0 ? !got : got && got->val_size == 1 && got->val[0] == val);
+  free(key->key);
+  free(key);
+}
+
+/* Writes, and only writes, are replayed in order, with the TTLs of
+   PUTs counting from when they were logged */
+void test_aof_replay(void) {
+  Aof *aof;
+  ShardedTable *st = create_aof_table(&aof);
+  Message *mput = create_mput(BATCH_TEST_KEYS);
+  free_message(out_handle_shared_msg(mput, st));
+  delete_logged(st, 3);
+  Message *mdelete = create_mget(1);
+  mdelete->type = MDELETE;
+  mdelete->message.mdelete.keys[0].key[0] = 4;
+  free_message(out_handle_shared_msg(mdelete, st));
+  put_logged(st, TEST_KEY, TEST_OTHER_VAL);
+  Message *mget = create_mget(BATCH_TEST_KEYS);
+  free_message(out_handle_shared_msg(mget, st));
+  free_aof(aof);
+  assert(st->aof == NULL);
+
+  /* Keys 1 and 2 expire by then, 6 a few seconds later */
+  ShardedTable *replayed = replay_aof_table(SNAPSHOT_TEST_START + 2, 4);
+  for (uint8_t i = 0; i < BATCH_TEST_KEYS; i++)
+    check_aof_key(replayed, i, i == 1 || i == 2 || i == 3 || i == 4 ? -1
+                  : i == TEST_KEY ? TEST_OTHER_VAL : i);
+  sharded_table_expire(replayed, SNAPSHOT_TEST_START + 6, 0, 1, 0);
+  check_aof_key(replayed, 6, -1);
+  check_aof_key(replayed, 7, 7);
+  unlink(AOF_TEST_PATH);
+}
+
+/* A rewrite shrinks the log to one PUT per live entry, keeping writes
+   made while it runs */
+void test_aof_rewrite(void) {
+  Aof *aof;
+  ShardedTable *st = create_aof_table(&aof);
+  for (int i = 0; i < 10; i++)
+    free_message(out_handle_shared_msg(create_mput(BATCH_TEST_KEYS), st));
+  aof_rewrite(aof);
+  put_logged(st, TEST_KEY, TEST_OTHER_VAL);
+  for (;;) {
+    pthread_mutex_lock(&aof->lock);
+    bool done = aof->rewrites > 0;
+    pthread_mutex_unlock(&aof->lock);
+    if (done)
+      break;
+    usleep(1000);
+  }
+  delete_logged(st, 3);
+  free_aof(aof);
+
+  /* One PUT per key, plus the delete, if the PUT of TEST_KEY was
+     made before the fork */
+  ShardedTable *replayed = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  sharded_table_expire(replayed, SNAPSHOT_TEST_START + 2, 0, 1, 0);
+  long n = aof_replay(replayed, AOF_TEST_PATH);
+  assert(n >= BATCH_TEST_KEYS + 1 && n <= BATCH_TEST_KEYS + 2);
+  for (uint8_t i = 0; i < BATCH_TEST_KEYS; i++)
+    check_aof_key(replayed, i, i == 1 || i == 2 || i == 3 ? -1
+                  : i == TEST_KEY ? TEST_OTHER_VAL : i);
+  struct stat sb;
+  assert(stat(AOF_TEST_PATH ".rewrite", &sb) == -1 && errno == ENOENT);
+  unlink(AOF_TEST_PATH);
+}
+
+/* Writes made after the log's thread is stopped, as on shutdown, are
+   still synced when it is freed */
+void test_aof_stop(void) {
+  Aof *aof;
+  ShardedTable *st = create_aof_table(&aof);
+  put_logged(st, 1, 1);
+  aof_stop(aof);
+  put_logged(st, 2, 2);
+  free_aof(aof);
+  ShardedTable *replayed = replay_aof_table(SNAPSHOT_TEST_START, 2);
+  check_aof_key(replayed, 1, 1);
+  check_aof_key(replayed, 2, 2);
+  unlink(AOF_TEST_PATH);
+}
+
+/* Flip the bits of the byte at OFF in the test log */
+void damage_aof(off_t off) {
+  int fd = open(AOF_TEST_PATH, O_RDWR);
+  uint8_t byte;
+  assert(fd != -1 && pread(fd, &byte, 1, off) == 1);
+  byte = ~byte;
+  assert(pwrite(fd, &byte, 1, off) == 1);
+  close(fd);
+}
+
+/* A record torn by a crash is truncated away, as is a damaged header
+   with no intact record after it, while a malformed or damaged one,
+   even one whose damaged size runs past the end, or a missing log is
+   reported, leaving the log as it is */
+void test_aof_errors(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  unlink(AOF_TEST_PATH);
+  assert(aof_replay(st, AOF_TEST_PATH) == -1 && errno == ENOENT);
+
+  Aof *aof;
+  st = create_aof_table(&aof);
+  for (uint8_t i = 0; i < 3; i++)
+    put_logged(st, i, i);
+  free_aof(aof);
+  struct stat sb;
+  assert(stat(AOF_TEST_PATH, &sb) == 0);
+  off_t full = sb.st_size;
+  off_t rec = full / 3;
+  assert(truncate(AOF_TEST_PATH, full - 1) == 0);
+  ShardedTable *replayed = replay_aof_table(SNAPSHOT_TEST_START, 2);
+  check_aof_key(replayed, 1, 1);
+  check_aof_key(replayed, 2, -1);
+  assert(stat(AOF_TEST_PATH, &sb) == 0 && sb.st_size == rec * 2);
+
+  /* Torn within the header */
+  assert(truncate(AOF_TEST_PATH, rec + 3) == 0);
+  replay_aof_table(SNAPSHOT_TEST_START, 1);
+  assert(stat(AOF_TEST_PATH, &sb) == 0 && sb.st_size == rec);
+
+  /* A GET_RESP where a request should be */
+  FILE *f = fopen(AOF_TEST_PATH, "a");
+  uint8_t bad[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, GET_RESP };
+  aof_seal_record(bad, sizeof bad);
+  assert(fwrite(bad, sizeof bad, 1, f) == 1);
+  fclose(f);
+  st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  assert(aof_replay(st, AOF_TEST_PATH) == -1 && errno == EINVAL);
+  check_aof_key(st, 0, 0);
+
+  /* The top byte of the first record's size, and the value of the
+     second */
+  st = create_aof_table(&aof);
+  for (uint8_t i = 0; i < 3; i++)
+    put_logged(st, i, i);
+  free_aof(aof);
+  damage_aof(rec * 2 - 1);
+  st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  assert(aof_replay(st, AOF_TEST_PATH) == -1 && errno == EINVAL);
+  check_aof_key(st, 0, 0);
+  check_aof_key(st, 1, -1);
+  damage_aof(12);
+  st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  assert(aof_replay(st, AOF_TEST_PATH) == -1 && errno == EINVAL);
+  check_aof_key(st, 0, -1);
+  assert(stat(AOF_TEST_PATH, &sb) == 0 && sb.st_size == full);
+
+  /* Zeros past the last record, as a crash can leave behind */
+  st = create_aof_table(&aof);
+  for (uint8_t i = 0; i < 3; i++)
+    put_logged(st, i, i);
+  free_aof(aof);
+  assert(truncate(AOF_TEST_PATH, full + 4096) == 0);
+  replayed = replay_aof_table(SNAPSHOT_TEST_START, 3);
+  check_aof_key(replayed, 2, 2);
+  assert(stat(AOF_TEST_PATH, &sb) == 0 && sb.st_size == full);
+  /* A damaged header on the last record */
+  damage_aof(rec * 2 + 12);
+  replayed = replay_aof_table(SNAPSHOT_TEST_START, 2);
+  check_aof_key(replayed, 1, 1);
+  check_aof_key(replayed, 2, -1);
+  assert(stat(AOF_TEST_PATH, &sb) == 0 && sb.st_size == rec * 2);
+  unlink(AOF_TEST_PATH);
+}
+
+/**************/
+/* repl tests */
+/**************/
+
+/* Return a socket listening on an ephemeral loopback port, storing
+   its address in ADDR */
+int listen_loopback(struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd != -1);
+  memset(addr, 0, sizeof *addr);
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof *addr;
+  assert(bind(fd, (struct sockaddr *)addr, len) == 0);
+  assert(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+  assert(listen(fd, 4) == 0);
+  return fd;
+}
+
+/* Wait for the replica's copy of single-byte key N to be VAL, or
+   absent if negative */
+void wait_replicated_key(ShardedTable *st, uint8_t n, int val) {
+  Key *key = get_key(n);
+  Shard *shard = sharded_table_shard(st, key);
+  for (int tries = 0;; tries++) {
+    shard_lock(shard);
+    Val *got = hash_table_get(shard->ht, key);
+    bool done = val < 0 ? !got : got && got->val_size == 1 && got->val[0] == val;
+    shard_unlock(shard);
+    if (done)
+      break;
+    assert(tries < 5000);
+    usleep(1000);
+  }
+  free(key->key);
+  free(key);
+}
+
+/* A replica is sent the table as it was when it connected, then the
+   writes made since, in order */
+void test_repl_sync(void) {
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  sharded_table_expire(st, SNAPSHOT_TEST_START, 0, 1, 0);
+  struct sockaddr_in addr;
+  Primary *primary = create_primary(st, listen_loopback(&addr), 1);
+  assert(primary != NULL && st->primary == primary);
+  for (uint8_t i = 0; i < 10; i++)
+    put_logged(st, i, i);
+
+  ShardedTable *copy = create_sharded_table(TEST_SHARDS, ENGINE_OPEN, TEST_HT_SIZE, 0);
+  sharded_table_expire(copy, SNAPSHOT_TEST_START, 0, 1, 0);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0);
+  Replica *replica = create_replica(copy, fd);
+  assert(replica != NULL && replica->loaded == 10);
+  check_aof_key(copy, 9, 9);
+
+  put_logged(st, TEST_KEY, TEST_OTHER_VAL);
+  delete_logged(st, 3);
+  Message *mput = create_mput(BATCH_TEST_KEYS);
+  mput->message.mput.puts[0].val.val[0] = TEST_OTHER_VAL;
+  free_message(out_handle_shared_msg(mput, st));
+  Message *mdelete = create_mget(1);
+  mdelete->type = MDELETE;
+  mdelete->message.mdelete.keys[0].key[0] = 4;
+  free_message(out_handle_shared_msg(mdelete, st));
+  for (uint8_t i = 0; i < BATCH_TEST_KEYS; i++)
+    wait_replicated_key(copy, i, i == 4 ? -1 : i == 0 ? TEST_OTHER_VAL : i);
+  free_replica(replica);
+  free_primary(primary);
+  assert(st->primary == NULL);
+}
+
+/*****************/
+/* cluster tests */
+/*****************/
+
+#define CLUSTER_TEST_NODES 3
+#define CLUSTER_TEST_KEYS 10000
+
+/* Keys spread evenly over the servers, and a server joining only
+   takes keys from the others */
+void test_cluster_ring(void) {
+  char *addrs[] = { "10.0.0.1:9034", "10.0.0.2:9034", "10.0.0.3:9034", "10.0.0.4:9034",
+                    "10.0.0.5:9034" };
+  Cluster *four = create_cluster(addrs, 4);
+  Cluster *five = create_cluster(addrs, 5);
+  unsigned int counts[4] = { 0 };
+  unsigned int moved = 0;
+  Key key;
+  for (uint32_t i = 0; i < CLUSTER_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    unsigned int before = cluster_node_index(four, &key);
+    unsigned int after = cluster_node_index(five, &key);
+    ++counts[before];
+    if (after != before) {
+      assert(after == 4);
+      ++moved;
+    }
+    free(key.key);
+  }
+  for (unsigned int i = 0; i < 4; i++)
+    assert(counts[i] > CLUSTER_TEST_KEYS / 4 * 3 / 4 && counts[i] < CLUSTER_TEST_KEYS / 4 * 5 / 4);
+  assert(moved > CLUSTER_TEST_KEYS / 5 * 3 / 4 && moved < CLUSTER_TEST_KEYS / 5 * 5 / 4);
+  free_cluster(four);
+  free_cluster(five);
+  char *bad[] = { "10.0.0.1" };
+  assert(create_cluster(bad, 1) == NULL && errno == EINVAL);
+}
+
+typedef struct TestNode {
+  pthread_t thread;
+  int listener;
+  ShardedTable *st;
+} TestNode;
+
+/* Serve one connection to a TestNode until it's closed */
+void *serve_test_node(void *arg) {
+  TestNode *node = arg;
+  int fd = accept(node->listener, NULL, NULL);
+  assert(fd != -1);
+  Conn *conn = create_conn(fd);
+  uint8_t buf[4096];
+  ssize_t n;
+  Message msg;
+  while ((n = recv(fd, buf, sizeof buf, 0)) > 0) {
+    uint8_t *pos = buf;
+    while (pos < buf + n || conn_has_msg(conn))
+      if (conn_next_msg(conn, &pos, buf + n, &msg)) {
+        conn_handle_shared_msg(conn, &msg, node->st);
+        free_message_views(&msg);
+      }
+    assert(conn_flush(conn) == 0);
+  }
+  free_conn(conn);
+  close(fd);
+  return NULL;
+}
+
+/* Each key is sent to the server owning it, and batches are split
+   between them and merged back in order */
+void test_cluster_requests(void) {
+  TestNode nodes[CLUSTER_TEST_NODES];
+  char addr_bufs[CLUSTER_TEST_NODES][32];
+  char *addrs[CLUSTER_TEST_NODES];
+  for (int i = 0; i < CLUSTER_TEST_NODES; i++) {
+    struct sockaddr_in addr;
+    nodes[i].listener = listen_loopback(&addr);
+    nodes[i].st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+    assert(pthread_create(&nodes[i].thread, NULL, serve_test_node, &nodes[i]) == 0);
+    snprintf(addr_bufs[i], sizeof addr_bufs[i], "127.0.0.1:%d", ntohs(addr.sin_port));
+    addrs[i] = addr_bufs[i];
+  }
+  Cluster *cluster = create_cluster(addrs, CLUSTER_TEST_NODES);
+  Key keys[BATCH_TEST_KEYS + 1];
+  Val *vals[BATCH_TEST_KEYS + 1];
+  unsigned int owned[CLUSTER_TEST_NODES] = { 0 };
+  bool found;
+  for (uint8_t i = 0; i < BATCH_TEST_KEYS; i++) {
+    init_key(&keys[i], i);
+    Val *val = get_val(i);
+    assert(cluster_put(cluster, &keys[i], val, 0, &found) == 0 && !found);
+    free_val(val);
+    ++owned[cluster_node_index(cluster, &keys[i])];
+  }
+  for (int i = 0; i < CLUSTER_TEST_NODES; i++) {
+    unsigned int items = 0;
+    for (unsigned int s = 0; s < TEST_SHARDS; s++)
+      items += nodes[i].st->shards[s].ht->item_count;
+    assert(items == owned[i]);
+  }
+
+  assert(cluster_delete(cluster, &keys[TEST_KEY], &found) == 0 && found);
+  init_key(&keys[BATCH_TEST_KEYS], BATCH_TEST_KEYS);
+  assert(cluster_mget(cluster, BATCH_TEST_KEYS + 1, keys, vals) == 0);
+  for (uint8_t i = 0; i <= BATCH_TEST_KEYS; i++) {
+    if (i == TEST_KEY || i == BATCH_TEST_KEYS) {
+      assert(vals[i] == NULL);
+    } else {
+      Val *val = get_val(i);
+      assert(cmp_vals(vals[i], val));
+      free_val(val);
+      free_val(vals[i]);
+    }
+  }
+  assert(cluster_get(cluster, &keys[0], &vals[0]) == 0 && vals[0]->val[0] == 0);
+  free_val(vals[0]);
+
+  free_cluster(cluster);
+  for (int i = 0; i < CLUSTER_TEST_NODES; i++) {
+    pthread_join(nodes[i].thread, NULL);
+    close(nodes[i].listener);
+  }
+  for (uint8_t i = 0; i <= BATCH_TEST_KEYS; i++)
+    free(keys[i].key);
+}
+
+/*********************/
+/* client_pool tests */
+/*********************/
+
+#define POOL_TEST_CONNS 2
+#define POOL_TEST_KEYS 2000
+
+/* What a test callback was passed */
+typedef struct PoolResult {
+  bool called;
+  bool failed;
+  MessageType type;
+  bool flag;
+  int val;                      /* Single-byte value, or -1 for none */
+  int err;
+} PoolResult;
+
+void record_pool_result(Message *resp, void *arg) {
+  PoolResult *result = arg;
+  assert(!result->called);
+  result->called = true;
+  result->failed = !resp;
+  result->err = errno;
+  if (!resp)
+    return;
+  result->type = resp->type;
+  result->val = -1;
+  if (resp->type == GET_RESP && resp->message.get_resp.val)
+    result->val = resp->message.get_resp.val->val[0];
+  else if (resp->type == PUT_RESP)
+    result->flag = resp->message.put_resp.is_update;
+  else if (resp->type == DELETE_RESP)
+    result->flag = resp->message.delete_resp.deleted;
+}
+
+/* Thousands of requests may be in flight at once over a few
+   connections, each answered through its own callback */
+void test_client_pool(void) {
+  struct sockaddr_in addr;
+  int listener = listen_loopback(&addr);
+  ShardedTable *st = create_sharded_table(TEST_SHARDS, ENGINE_CHAINED, TEST_HT_SIZE, 0);
+  TestNode servers[POOL_TEST_CONNS];
+  for (int i = 0; i < POOL_TEST_CONNS; i++) {
+    servers[i].listener = listener;
+    servers[i].st = st;
+    assert(pthread_create(&servers[i].thread, NULL, serve_test_node, &servers[i]) == 0);
+  }
+  char port[8];
+  snprintf(port, sizeof port, "%d", ntohs(addr.sin_port));
+  ClientPool *pool = create_client_pool("127.0.0.1", port, POOL_TEST_CONNS);
+  assert(pool != NULL);
+
+  PoolResult *results = calloc(POOL_TEST_KEYS, sizeof(PoolResult));
+  Key key;
+  Val *val = get_val(TEST_VAL);
+  for (uint32_t i = 0; i < POOL_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    assert(client_pool_put(pool, &key, val, 0, record_pool_result, &results[i]) == 0);
+    free(key.key);
+  }
+  assert(pool->in_flight == POOL_TEST_KEYS);
+  assert(client_pool_wait(pool) == 0);
+  for (uint32_t i = 0; i < POOL_TEST_KEYS; i++)
+    assert(results[i].called && !results[i].failed && results[i].type == PUT_RESP
+           && !results[i].flag);
+
+  memset(results, 0, POOL_TEST_KEYS * sizeof(PoolResult));
+  for (uint32_t i = 0; i < POOL_TEST_KEYS; i++) {
+    init_int_key(&key, i % 2 ? i : i + POOL_TEST_KEYS);
+    assert(client_pool_get(pool, &key, record_pool_result, &results[i]) == 0);
+    free(key.key);
+  }
+  assert(client_pool_wait(pool) == 0);
+  for (uint32_t i = 0; i < POOL_TEST_KEYS; i++)
+    assert(results[i].called && results[i].type == GET_RESP
+           && results[i].val == (i % 2 ? TEST_VAL : -1));
+
+  /* Driven by the caller's own poll() */
+  PoolResult deleted = { 0 };
+  init_int_key(&key, 1);
+  assert(client_pool_delete(pool, &key, record_pool_result, &deleted) == 0);
+  free(key.key);
+  struct pollfd pfds[POOL_TEST_CONNS];
+  while (!deleted.called) {
+    unsigned int n = client_pool_pollfds(pool, pfds);
+    assert(n == POOL_TEST_CONNS);
+    assert(poll(pfds, n, 1000) > 0);
+    for (unsigned int i = 0; i < n; i++)
+      client_pool_handle(pool, i, pfds[i].revents);
+  }
+  assert(deleted.type == DELETE_RESP && deleted.flag);
+
+  /* Requests outstanding when the pool is freed fail */
+  memset(results, 0, sizeof(PoolResult));
+  init_int_key(&key, 3);
+  assert(client_pool_get(pool, &key, record_pool_result, &results[0]) == 0);
+  free(key.key);
+  free_client_pool(pool);
+  assert(results[0].called && results[0].failed && results[0].err == ECONNABORTED);
+  for (int i = 0; i < POOL_TEST_CONNS; i++)
+    pthread_join(servers[i].thread, NULL);
+  close(listener);
+  free_val(val);
+  free(results);
+}
+
+/****************************/
+/* mapped sharded_table tests */
+/****************************/
+
+void close_mapped_sharded_table(ShardedTable *st) {
+  for (unsigned int i = 0; i < st->shard_count; i++)
+    close_mapped_hash_table(st->shards[i].ht);
+  free(st->shards);
+  free(st);
+}
+
+/* Sharded tables are reopened with the seed they were filled with,
+   and can't be dumped or replicated by a fork */
+void test_mapped_sharded(void) {
+  char path[64];
+  mkdir(MAPPED_TEST_DIR, 0755);
+  hash_set_seed(1);
+  ShardedTable *st = create_mapped_sharded_table(MAPPED_TEST_DIR, TEST_SHARDS, TEST_HT_SIZE, 0);
+  assert(st != NULL && sharded_table_is_mapped(st));
+  Key key;
+  Val *val = get_val(TEST_VAL);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    hash_table_put(sharded_table_shard(st, &key)->ht, &key, val);
+    free(key.key);
+  }
+  assert(fork_snapshot(st, SNAPSHOT_TEST_PATH) == -1 && errno == ENOTSUP);
+  assert(create_aof(AOF_TEST_PATH, st, 1, 1, 0) == NULL && errno == ENOTSUP);
+  assert(create_primary(st, -1, 1) == NULL && errno == ENOTSUP);
+  close_mapped_sharded_table(st);
+
+  hash_set_seed(2);
+  st = create_mapped_sharded_table(MAPPED_TEST_DIR, TEST_SHARDS, TEST_HT_SIZE, 0);
+  assert(hash_seed == 1);
+  for (uint32_t i = 0; i < RESIZE_TEST_KEYS; i++) {
+    init_int_key(&key, i);
+    assert(cmp_vals(hash_table_get(sharded_table_shard(st, &key)->ht, &key), val));
+    free(key.key);
+  }
+  close_mapped_sharded_table(st);
+  hash_set_seed(0);
+  for (unsigned int i = 0; i < TEST_SHARDS; i++) {
+    snprintf(path, sizeof path, MAPPED_TEST_DIR "/shard-%u.map", i);
+    unlink(path);
+  }
+  rmdir(MAPPED_TEST_DIR);
+}
+
 /********/
 /* Main */
 /********/
@@ -267,14 +2644,98 @@ int main(void) {
   register_test(&test_ht_put_conflict);
   register_test(&test_ht_delete_not_present);
   register_test(&test_ht_delete);
+  register_test(&test_ht_ttl_lazy);
+  register_test(&test_ht_ttl_reap);
+  register_test(&test_ht_ttl_clock_jump);
+  register_test(&test_ht_ttl_clock_back);
+  register_test(&test_ht_mem_limit);
+  register_test(&test_ht_evict_unreferenced);
+  register_test(&test_ht_mem_limit_shift);
+  register_test(&test_ht_put_resize_val);
+  register_test(&test_ht_grow);
+  register_test(&test_ht_shrink);
+  register_test(&test_ht_resize_interleaved);
+  register_test(&test_ht_reserve);
+  register_test(&test_ht_free);
+  register_test(&test_open_init);
+  register_test(&test_open_put_delete);
+  register_test(&test_open_ttl_lazy);
+  register_test(&test_open_ttl_reap);
+  register_test(&test_open_mem_limit);
+  register_test(&test_open_evict_unreferenced);
+  register_test(&test_open_mem_limit_shift);
+  register_test(&test_open_put_resize_val);
+  register_test(&test_open_grow);
+  register_test(&test_open_shrink);
+  register_test(&test_open_resize_interleaved);
+  register_test(&test_open_reserve);
+  register_test(&test_open_free);
+  register_test(&test_mapped_ttl_lazy);
+  register_test(&test_mapped_ttl_reap);
+  register_test(&test_mapped_mem_limit);
+  register_test(&test_mapped_mem_limit_shift);
+  register_test(&test_mapped_evict_unreferenced);
+  register_test(&test_mapped_put_resize_val);
+  register_test(&test_mapped_grow);
+  register_test(&test_mapped_shrink);
+  register_test(&test_mapped_resize_interleaved);
+  register_test(&test_mapped_reserve);
+  register_test(&test_mapped_reopen);
+  register_test(&test_mapped_full);
+  register_test(&test_mapped_reset);
+  register_test(&test_hash_bytes);
+  register_test(&test_hash_seed_crafted);
+  register_test(&test_hash_seed);
+  register_test(&test_hash_spread);
+  register_test(&test_slab_classes);
+  register_test(&test_slab_reuse);
+  register_test(&test_slab_release);
+  register_test(&test_slab_reclaim_page);
+  register_test(&test_ht_slab_accounting);
+  register_test(&test_ht_ref_val);
   register_test(&test_msg_serialise_get);
   register_test(&test_msg_serialise_put);
   register_test(&test_msg_serialise_get_resp);
   register_test(&test_msg_serialise_get_resp_null);
+  register_test(&test_msg_serialise_mget);
+  register_test(&test_msg_serialise_mput);
+  register_test(&test_msg_serialise_batch_resps);
+  register_test(&test_msg_serialise_delete);
+  register_test(&test_msg_serialise_mdelete);
+  register_test(&test_msg_serialise_snapshot);
+  register_test(&test_msg_parse_request);
+  register_test(&test_msg_parse_batch_request);
+  register_test(&test_msg_parse_response);
   register_test(&test_conn_handle_get);
   register_test(&test_conn_handle_get_unknown);
   register_test(&test_conn_handle_put);
   register_test(&test_conn_handle_put_update);
+  register_test(&test_conn_queue_msg);
+  register_test(&test_conn_flush_pipelined);
+  register_test(&test_conn_send_partial);
+  register_test(&test_conn_share_val);
+  register_test(&test_conn_handle_delete);
+  register_test(&test_conn_handle_batch);
+  register_test(&test_conn_mget_too_large);
+  register_test(&test_conn_msg_pool);
+  register_test(&test_conn_next_msg_split);
+  register_test(&test_conn_msg_too_large);
+  register_test(&test_shard_spread);
+  register_test(&test_shard_handle_msg);
+  register_test(&test_shard_handle_batch);
+  register_test(&test_shard_concurrent);
+  register_test(&test_snapshot_round_trip);
+  register_test(&test_snapshot_fork);
+  register_test(&test_snapshot_errors);
+  register_test(&test_aof_replay);
+  register_test(&test_aof_rewrite);
+  register_test(&test_aof_stop);
+  register_test(&test_aof_errors);
+  register_test(&test_repl_sync);
+  register_test(&test_cluster_ring);
+  register_test(&test_cluster_requests);
+  register_test(&test_client_pool);
+  register_test(&test_mapped_sharded);
   run_tests();
   return 0;
 }